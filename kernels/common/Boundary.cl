@@ -0,0 +1,90 @@
+/// Sums over the static boundary particles (Akinci et al. 2012), shared by fluid_sim.cl and dfsph.cl.
+/// The boundary particles are sorted into their own, static, copy of the grid with their positions in xyz
+/// and their volumes in w. Requires common/Fluid.cl, common/Grid.cl and common/Kernels.cl.
+///
+/// Optional pre-processor define, see fluid_sim.cl
+/// LOOSE_GRID_SKIN         // Particles may have left the bin they were sorted into, but the boundary grid is exact
+
+#ifdef LOOSE_GRID_SKIN
+#define BOUNDARY_BIN_ID_3D(position, binID3D)   convert_int3(getPositionBinID_3D(position))
+#else
+#define BOUNDARY_BIN_ID_3D(position, binID3D)   (binID3D)
+#endif
+
+/**
+ * Sums the poly6 kernel over the boundary particles around a position, weighted by their volumes.
+ * @param particleBinID3D The bin the particle was sorted into
+ */
+inline float boundary_volume_sum(const Fluid fluid,
+                                 const float3 position,
+                                 const int3 particleBinID3D,
+                                 __global const float4 *boundaryParticles,
+                                 __global const uint *boundaryBinStartIDs,
+                                 __global const uint *boundaryBinCounts) {
+    float sum = 0.0f;
+    const int3 binID3D = BOUNDARY_BIN_ID_3D(position, particleBinID3D);
+
+    int x, y, z;
+    for (int dx = -1; dx < 2; ++dx) {
+        x = binID3D.x + dx;
+        if (x+1 != clamp(x+1, 1, binCountX)) continue;
+        for (int dy = -1; dy < 2; ++dy) {
+            y = binID3D.y + dy;
+            if (y+1 != clamp(y+1, 1, binCountY)) continue;
+            for (int dz = -1; dz < 2; ++dz) {
+                z = binID3D.z + dz;
+                if (z+1 != clamp(z+1, 1, binCountZ)) continue;
+
+                const uint nBinID = x + binCountX * y + binCountX * binCountY * z;
+                const uint nBinStartID = boundaryBinStartIDs[nBinID];
+                const uint nBinCount = boundaryBinCounts[nBinID];
+
+                for (uint bID = nBinStartID; bID < (nBinStartID + nBinCount); ++bID) {
+                    const float4 boundaryParticle = boundaryParticles[bID];
+                    sum = sum + boundaryParticle.w * Wpoly6(position - boundaryParticle.xyz, FLUID(kernelRadius));
+                }
+            }
+        }
+    }
+
+    return sum;
+}
+
+/**
+ * Sums the gradient of the spiky kernel over the boundary particles around a position, weighted by their volumes.
+ * @param particleBinID3D The bin the particle was sorted into
+ */
+inline float3 boundary_gradient_sum(const Fluid fluid,
+                                    const float3 position,
+                                    const int3 particleBinID3D,
+                                    __global const float4 *boundaryParticles,
+                                    __global const uint *boundaryBinStartIDs,
+                                    __global const uint *boundaryBinCounts) {
+    float3 sum = ZERO3F;
+    const int3 binID3D = BOUNDARY_BIN_ID_3D(position, particleBinID3D);
+
+    int x, y, z;
+    for (int dx = -1; dx < 2; ++dx) {
+        x = binID3D.x + dx;
+        if (x+1 != clamp(x+1, 1, binCountX)) continue;
+        for (int dy = -1; dy < 2; ++dy) {
+            y = binID3D.y + dy;
+            if (y+1 != clamp(y+1, 1, binCountY)) continue;
+            for (int dz = -1; dz < 2; ++dz) {
+                z = binID3D.z + dz;
+                if (z+1 != clamp(z+1, 1, binCountZ)) continue;
+
+                const uint nBinID = x + binCountX * y + binCountX * binCountY * z;
+                const uint nBinStartID = boundaryBinStartIDs[nBinID];
+                const uint nBinCount = boundaryBinCounts[nBinID];
+
+                for (uint bID = nBinStartID; bID < (nBinStartID + nBinCount); ++bID) {
+                    const float4 boundaryParticle = boundaryParticles[bID];
+                    sum += boundaryParticle.w * grad_Wspiky(position - boundaryParticle.xyz, FLUID(kernelRadius));
+                }
+            }
+        }
+    }
+
+    return sum;
+}
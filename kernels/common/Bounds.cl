@@ -1,4 +1,6 @@
+/// The simulation bounds, matching pbf::Bounds on the host
+
 typedef struct def_Bounds {
     float3 dimensions;
     float3 halfDimensions;
-} Bounds;
\ No newline at end of file
+} Bounds;
@@ -0,0 +1,8 @@
+/// Constants and the work-item index shared by the kernel files.
+/// A file that indexes its particles differently (see fluid_sim.cl) redefines ID after including this.
+
+#define ID get_global_id(0)
+#define ZERO3F float3(0.0f, 0.0f, 0.0f)
+#define DIFF float3(0.015f, 0.015f, 0.015f)
+#define EPSILON 0.0001f
+#define PI 3.1415926535f
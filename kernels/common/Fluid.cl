@@ -1,3 +1,11 @@
+/// The fluid parameters, matching pbf::Fluid on the host, and access to them.
+///
+/// Optional pre-processor defines that bake the fluid parameters into the program (see GetDefinesCL(const Fluid&)).
+/// When FLUID_SPECIALIZED is defined, the Fluid kernel arguments are ignored in favour of the following constants:
+/// FLUID_[param]                   // Every field of Fluid except numSubSteps
+/// FLUID_POLY6_COEFF               // 315 / (64 * pi * h^9)
+/// FLUID_GRAD_SPIKY_COEFF          // -45 / (pi * h^6)
+
 typedef struct def_Fluid {
     float kernelRadius;
     uint numSubSteps;
@@ -8,4 +16,17 @@ typedef struct def_Fluid {
     float delta_q;
     uint n;
     float c;
+    float k_vc;
+
+    float kBoundsDensity;
 } Fluid;
+
+#ifdef FLUID_SPECIALIZED
+#define FLUID(param)                FLUID_##param
+#define POLY6_COEFF(h)              FLUID_POLY6_COEFF
+#define GRAD_SPIKY_COEFF(h)         FLUID_GRAD_SPIKY_COEFF
+#else
+#define FLUID(param)                (fluid.param)
+#define POLY6_COEFF(h)              (315.0f / (64.0f * PI * pown((h), 9)))
+#define GRAD_SPIKY_COEFF(h)         (-45.0f / (PI * pown((h), 6)))
+#endif
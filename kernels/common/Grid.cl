@@ -1,12 +1,72 @@
-typedef struct def_Grid {
-    float3 halfDimensions;
+/// Indexing of the uniform grid that the particles are sorted into.
+///
+/// Pre-processor defines that specify grid parameters
+/// halfDims[Z,Y,Z]         // The dimensions/2 of the grid
+/// binSize                 // The side-length of a bin
+/// binCount[Z,Y,Z]         // The number of bins in each dimension
+/// binCount                // The total number of bins in the grid
 
-    // The side-length of a bin
-    float binSize;
+/**
+ * Computes the 1D-index into the linearized uniform grid arrays from a 3D-index.
+ * @param binID_3D The 3D-index
+ * @return The 1D-index
+ */
+inline uint getBinID(const uint3 binID_3D) {
+    return binID_3D.x + binCountX * binID_3D.y + binCountX * binCountY * binID_3D.z;
+}
 
-    // The number of bins in each dimension
-    uint3 binCount3D;
+/**
+ * Computes the 3D-indices into the uniform grid from a 1D-index.
+ * from http://stackoverflow.com/questions/14845084/how-do-i-convert-a-1d-index-into-a-3d-index?noredirect=1&lq=1
+ * @param binID The 1D-index
+ * @return The 3D index
+ */
+inline uint3 getBinID_3D(const uint binID) {
+    uint3 binID3D;
+    binID3D.z = binID / (binCountX * binCountY);
+    binID3D.y = (binID - binID3D.z * binCountX * binCountY) / binCountX;
+    binID3D.x = binID - binCountX * (binID3D.y + binCountY * binID3D.z);
+    return binID3D;
+}
 
-    // The total number of bins in the grid
-    uint binCount;
-} Bounds;
+/**
+ * Calculates the 3D-index of the bin of a position, clamped to the grid. ("hashing")
+ * @param position The position
+ * @return The 3D-index
+ */
+inline uint3 getPositionBinID_3D(const float3 position) {
+    const float3 tmp = (position + float3(halfDimsX, halfDimsY, halfDimsZ)) / binSize;
+    return convert_uint3(clamp(convert_int3(floor(tmp)), int3(0, 0, 0), int3(binCountX-1, binCountY-1, binCountZ-1)));
+}
+
+/**
+ * Calculates the 1D-index of the bin of a position, clamped to the grid.
+ */
+inline uint getPositionBinID(const float3 position) {
+    return getBinID(getPositionBinID_3D(position));
+}
+
+/// The active region is the box of bins that contains all live particles, stored as six uints: the 3D-index of
+/// its first bin followed by that of its last bin. It is empty while the first index exceeds the last.
+
+/**
+ * Grows the active region to contain a bin. Most particles lie inside already, so the region is only read.
+ */
+inline void growActiveRegion(__global volatile uint *activeRegion, const uint3 binID_3D) {
+    if (binID_3D.x < activeRegion[0]) atomic_min(&activeRegion[0], binID_3D.x);
+    if (binID_3D.y < activeRegion[1]) atomic_min(&activeRegion[1], binID_3D.y);
+    if (binID_3D.z < activeRegion[2]) atomic_min(&activeRegion[2], binID_3D.z);
+    if (binID_3D.x > activeRegion[3]) atomic_max(&activeRegion[3], binID_3D.x);
+    if (binID_3D.y > activeRegion[4]) atomic_max(&activeRegion[4], binID_3D.y);
+    if (binID_3D.z > activeRegion[5]) atomic_max(&activeRegion[5], binID_3D.z);
+}
+
+/**
+ * Computes the 1D-index into the grid arrays of the i-th bin of a region. The bins of a region are in the same
+ * order as in the grid.
+ * @param regionMin The 3D-index of the first bin of the region
+ * @param regionSize The number of bins of the region in each dimension
+ */
+inline uint getRegionBinID(const uint i, const uint3 regionMin, const uint3 regionSize) {
+    return getBinID(regionMin + uint3(i % regionSize.x, (i / regionSize.x) % regionSize.y, i / (regionSize.x * regionSize.y)));
+}
@@ -1,33 +1,55 @@
+/// The SPH smoothing kernels, see common/Fluid.cl for the coefficients
+
+//#define USE_FAST_SQRT
+
+/**
+ * Computes the square root of x__. Can be defined to compute a "fast" square root.
+ * @param x__ The input value
+ * @return Its square root
+ */
+inline float sqroot(float x__) {
+#ifdef USE_FAST_SQRT
+    return half_sqrt(x__);
+#else
+    return sqrt(x__);
+#endif
+}
+
 inline float euclidean_distance2(const float3 r) {
     return r.x * r.x + r.y * r.y + r.z * r.z;
 }
 
 inline float euclidean_distance(const float3 r) {
-    return sqrt(r.x * r.x + r.y * r.y + r.z * r.z);
+    return sqroot(r.x * r.x + r.y * r.y + r.z * r.z);
 }
 
+/**
+ * Evaluates the poly6 SPH-kernel at the given coordinate.
+ * @param r The vector from the origin of the kernel
+ * @param h The kernel radius
+ * @return The value of the kernel
+ */
 inline float Wpoly6(const float3 r, const float h) {
     const float tmp = h * h - euclidean_distance2(r);
     if (tmp < EPSILON) {
         return 0.0f;
     }
 
-    return (315.0f / (64.0f * PI * pow(h, 9))) * pow((tmp), 3);
+    return POLY6_COEFF(h) * tmp * tmp * tmp;
 }
 
+/**
+ * Evaluates the gradient of the spiky SPH-kernel at the given coordinate.
+ * @param r The vector from the origin of the kernel
+ * @param h The kernel radius
+ * @return The gradient of the kernel
+ */
 inline float3 grad_Wspiky(const float3 r, const float h) {
     const float radius2 = euclidean_distance2(r);
-    if (radius2 >= h * h) {
-        return float3(0.0f, 0.0f, 0.0f);
-    }
-    if (radius2 <= EPSILON) {
-        return float3(0.0f, 0.0f, 0.0f);
+    if (radius2 >= h * h || radius2 <= EPSILON) {
+        return ZERO3F;
     }
 
-    const float radius = sqrt(radius2);
-    const float kernel_constant = -(15 / (PI * pow(h, 6))) * 3 * pow(h - radius, 2) / radius;
-
-    return float3(kernel_constant * r.x,
-                  kernel_constant * r.y,
-                  kernel_constant * r.z);
+    const float radius = sqroot(radius2);
+    return (GRAD_SPIKY_COEFF(h) * (h - radius) * (h - radius) / radius) * r;
 }
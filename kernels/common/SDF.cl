@@ -0,0 +1,54 @@
+/// Sampling of the signed distance field of the static obstacles, see sdf.cl.
+///
+/// Pre-processor defines, in addition to the grid defines (see common/Grid.cl)
+/// SDF_CELLS_PER_BIN       // The number of SDF cells along each side of a bin
+
+#define SDF_CELL_SIZE   (binSize / SDF_CELLS_PER_BIN)
+#define SDF_NODES_X     (binCountX * SDF_CELLS_PER_BIN + 1)
+#define SDF_NODES_Y     (binCountY * SDF_CELLS_PER_BIN + 1)
+#define SDF_NODES_Z     (binCountZ * SDF_CELLS_PER_BIN + 1)
+
+/// The distance that particles are kept from the surfaces of obstacles
+#define SDF_CONTACT_DISTANCE 0.015f
+
+/**
+ * Trilinearly interpolates a field stored at the SDF nodes, clamping positions outside the lattice.
+ */
+inline float sample_sdf_field(__global const float *field, const float3 position) {
+    const float3 maxCoords = float3(SDF_NODES_X - 1, SDF_NODES_Y - 1, SDF_NODES_Z - 1);
+    const float3 coords = clamp((position + float3(halfDimsX, halfDimsY, halfDimsZ)) / SDF_CELL_SIZE,
+                                ZERO3F, maxCoords);
+    const int3 i = min(convert_int3(floor(coords)), convert_int3(maxCoords) - 1);
+    const float3 t = coords - convert_float3(i);
+
+    const uint nodeID = i.x + SDF_NODES_X * i.y + SDF_NODES_X * SDF_NODES_Y * i.z;
+    const uint dy = SDF_NODES_X;
+    const uint dz = SDF_NODES_X * SDF_NODES_Y;
+
+    const float c00 = mix(field[nodeID], field[nodeID + 1], t.x);
+    const float c10 = mix(field[nodeID + dy], field[nodeID + dy + 1], t.x);
+    const float c01 = mix(field[nodeID + dz], field[nodeID + dz + 1], t.x);
+    const float c11 = mix(field[nodeID + dy + dz], field[nodeID + dy + dz + 1], t.x);
+    return mix(mix(c00, c10, t.y), mix(c01, c11, t.y), t.z);
+}
+
+/**
+ * Moves a position that is closer than SDF_CONTACT_DISTANCE to an obstacle out along the SDF gradient.
+ */
+inline float3 project_out_of_sdf(__global const float *sdf, const float3 position) {
+    const float distance = sample_sdf_field(sdf, position);
+    if (distance >= SDF_CONTACT_DISTANCE) {
+        return position;
+    }
+
+    const float e = 0.5f * SDF_CELL_SIZE;
+    const float3 gradient = float3(sample_sdf_field(sdf, position + float3(e, 0.0f, 0.0f)) - sample_sdf_field(sdf, position - float3(e, 0.0f, 0.0f)),
+                                   sample_sdf_field(sdf, position + float3(0.0f, e, 0.0f)) - sample_sdf_field(sdf, position - float3(0.0f, e, 0.0f)),
+                                   sample_sdf_field(sdf, position + float3(0.0f, 0.0f, e)) - sample_sdf_field(sdf, position - float3(0.0f, 0.0f, e)));
+    const float gradientLength = length(gradient);
+    if (gradientLength < EPSILON) {
+        return position;
+    }
+
+    return position + ((SDF_CONTACT_DISTANCE - distance) / gradientLength) * gradient;
+}
@@ -1,3 +1,5 @@
+/// The rigid solids coupled to the fluid, matching the layouts in src/simulation/SolidObject.hpp
+
 #define STYPE_PLANE 0
 #define STYPE_SPHERE 1
 #define STYPE_BOX 2
@@ -8,22 +10,25 @@ typedef struct def_Plane {
 } Plane;
 
 typedef struct def_Sphere {
-    float mass;
-    float radius;
-
     float3 position;
     float3 velocity;
     float3 impulses;
-} Sphere;
 
-typedef struct def_Box {
     float mass;
-    float3 halfDimensions;
+    float radius;
+} Sphere;
 
+typedef struct def_Box {
     float3 position;
     float3 velocity;
     float3 impulses;
     float3 torques;
+
+    float3 halfDimensions;
+    float4 orientation;
+    float3 angularVelocity;
+
+    float mass;
 } Box;
 
 typedef struct def_SolidObject {
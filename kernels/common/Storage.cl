@@ -0,0 +1,23 @@
+/// Access to the particle attributes whose storage format is selected at build time.
+///
+/// Optional pre-processor define
+/// HALF_STORAGE                    // Velocities, densities and curls are stored as half4/half, loaded and
+///                                 // stored through vload_half/vstore_half while all arithmetic stays in float
+
+#ifdef HALF_STORAGE
+#define STORAGE_FLOAT3                  half
+#define STORAGE_FLOAT                   half
+#define LOAD_FLOAT3(buffer, i)          (vload_half4((i), (buffer)).xyz)
+#define STORE_FLOAT3(buffer, i, value)  vstore_half4(float4((value), 0.0f), (i), (buffer))
+#define COPY_FLOAT3(dst, j, src, i)     vstore_half4(vload_half4((i), (src)), (j), (dst))
+#define LOAD_FLOAT(buffer, i)           vload_half((i), (buffer))
+#define STORE_FLOAT(buffer, i, value)   vstore_half((value), (i), (buffer))
+#else
+#define STORAGE_FLOAT3                  float3
+#define STORAGE_FLOAT                   float
+#define LOAD_FLOAT3(buffer, i)          ((buffer)[i])
+#define STORE_FLOAT3(buffer, i, value)  ((buffer)[i] = (value))
+#define COPY_FLOAT3(dst, j, src, i)     ((dst)[j] = (src)[i])
+#define LOAD_FLOAT(buffer, i)           ((buffer)[i])
+#define STORE_FLOAT(buffer, i, value)   ((buffer)[i] = (value))
+#endif
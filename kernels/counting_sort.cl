@@ -1,41 +1,48 @@
 #pragma OPENCL EXTENSION cl_khr_global_int32_base_atomics : enable
+#pragma OPENCL EXTENSION cl_khr_global_int32_extended_atomics : enable
 
-#define ID get_global_id(0)
-/// Pre-processor defines that specify grid parameters
-/// halfDims[Z,Y,Z]         // The dimensions/2 of the grid
-/// binSize                 // The side-length of a bin
-/// binCount[Z,Y,Z]         // The number of bins in each dimension
-/// binCount                // The total number of bins in the grid
+/// Pre-processor defines that specify grid parameters, see common/Grid.cl
+/// halfDims[Z,Y,Z], binSize, binCount[Z,Y,Z], binCount
+///
+/// The particles are sorted either by counting (insert_particles, compute_bin_start_ID and reindex_particles)
+/// or by a radix sort of (binID, particleIndex) pairs, whose kernels replace the first two (compute_particle_keys,
+/// radix_sort.cl, find_bin_ranges and compute_in_bin_ids).
+///
+/// With the active region (see common/Grid.cl), the counting sort clears and scans only the bins around the
+/// particles: clear_region_bin_counts and compute_region_bin_start_ID replace the fill of the whole grid and
+/// compute_bin_start_ID. All other bins keep a count of zero, but their starts are left undefined.
+///
+/// Optional storage define, see common/Storage.cl
+/// HALF_STORAGE            // Velocities are stored as half4
 
-/**
- * Calculates a corresponding 3D-index in the uniform grid based on a position. ("hashing")
- * @param position The position
- * @return The 3D-index
- */
-inline uint3 getBinID_3D(const float3 position) {
-    float3 tmp = (position + float3(halfDimsX, halfDimsY, halfDimsZ)) / binSize;
-    uint3 indices = convert_uint3(floor(tmp));
-    return clamp(indices, uint3(0, 0, 0), uint3(binCountX-1, binCountY-1, binCountZ-1));
-}
-
-/**
- * Computes the 1D-index into the linearized uniform grid arrays from a 3D-index.
- * @param binID_3D The 3D-index
- * @return The 1D-index
- */
-inline uint getBinID(const uint3 binID_3D) {
-    return binID_3D.x + binCountX * binID_3D.y + binCountX * binCountY * binID_3D.z;
-}
+#include "common/Definitions.cl"
+#include "common/Storage.cl"
+#include "common/Grid.cl"
 
 /**
  * Inserts a particle in the grid and increments corresponding counters.
+ * Dead particles (negative age, see sinks.cl) are inserted in an extra bin with index binCount, so that
+ * the sort moves them behind all live particles and the extra bin's start is the live particle count.
+ * Live particles also grow the active region, which must have been emptied.
  */
 __kernel void insert_particles(__global const float3    *predictedPositions,
                                __global volatile uint   *particleBinID,
                                __global volatile uint   *particleInBinID,
-                               __global volatile uint   *binCounts) {
+                               __global volatile uint   *binCounts,
+                               __global const float     *ages,
+                               __global volatile uint   *activeRegion,
+                               const uint               numItems) {
+    if (get_global_id(0) >= numItems) {
+        return;
+    }
+
     // Compute the 1D bin index of this particle
-    const uint binID = getBinID(getBinID_3D(predictedPositions[ID]));
+    const bool dead = ages[ID] < 0.0f;
+    const uint3 binID3D = getPositionBinID_3D(predictedPositions[ID]);
+    const uint binID = dead ? binCount : getBinID(binID3D);
+    if (!dead) {
+        growActiveRegion(activeRegion, binID3D);
+    }
 
     // Store the bin index in the particle data
     particleBinID[ID] = binID;
@@ -47,12 +54,118 @@ __kernel void insert_particles(__global const float3    *predictedPositions,
     particleInBinID[ID] = atomic_inc(&binCounts[binID]);
 }
 
+/**
+ * Radix sort path: computes the bin of a particle like insert_particles, but without counting, as the
+ * key of a (binID, particleIndex) pair to be sorted by radix_sort.cl.
+ */
+__kernel void compute_particle_keys(__global const float3   *predictedPositions,    // 0
+                                    __global uint           *particleBinID,         // 1
+                                    __global uint           *keys,                  // 2
+                                    __global uint           *values,                // 3
+                                    __global const float    *ages,                  // 4
+                                    const uint              numItems) {             // 5
+    if (get_global_id(0) >= numItems) {
+        return;
+    }
+
+    const uint binID = ages[ID] < 0.0f ? binCount : getPositionBinID(predictedPositions[ID]);
+
+    particleBinID[ID] = binID;
+    keys[ID] = binID;
+    values[ID] = ID;
+}
+
+/**
+ * Radix sort path: finds the range of a bin in the sorted keys by binary search. Run over binCount + 1
+ * bins, so that the starts are the same as those of compute_bin_start_ID, including those of empty bins.
+ */
+__kernel void find_bin_ranges(__global const uint   *sortedKeys,    // 0
+                              const uint            numKeys,        // 1
+                              __global uint         *binStartID,    // 2
+                              __global uint         *binCounts,     // 3
+                              const uint            numItems) {     // 4
+    if (get_global_id(0) >= numItems) {
+        return;
+    }
+
+    // the first sorted key >= ID and >= ID + 1, respectively
+    uint begin = 0;
+    uint end = numKeys;
+    while (begin < end) {
+        const uint middle = (begin + end) / 2;
+        if (sortedKeys[middle] < ID) begin = middle + 1; else end = middle;
+    }
+    const uint start = begin;
+
+    end = numKeys;
+    while (begin < end) {
+        const uint middle = (begin + end) / 2;
+        if (sortedKeys[middle] <= ID) begin = middle + 1; else end = middle;
+    }
+
+    binStartID[ID] = start;
+    binCounts[ID] = begin - start;
+}
+
+/**
+ * Radix sort path: stores the rank of each particle within its bin, which is where the stable sort put it,
+ * so that reindex_particles moves the particles exactly as after insert_particles.
+ */
+__kernel void compute_in_bin_ids(__global const uint    *sortedKeys,        // 0
+                                 __global const uint    *sortedValues,      // 1
+                                 __global const uint    *binStartID,        // 2
+                                 __global uint          *particleInBinID,   // 3
+                                 const uint             numItems) {         // 4
+    if (get_global_id(0) >= numItems) {
+        return;
+    }
+
+    particleInBinID[sortedValues[ID]] = ID - binStartID[sortedKeys[ID]];
+}
+
+/**
+ * Counts the particles whose position left the bin they were last sorted into, and flags any particle
+ * that is further than maxDrift outside of it. Run at the end of a frame, so that the incremental sort
+ * of the next frame can decide whether to keep the order of the last sort without waiting for it.
+ * @param counters [0] The number of particles that changed bins, [1] set to 1 if one drifted too far
+ */
+__kernel void count_moved_particles(__global const float3   *predictedPositions,    // 0
+                                    __global const uint     *particleBinIDs,        // 1
+                                    __global volatile uint  *counters,              // 2
+                                    const float             maxDrift,               // 3
+                                    const uint              numItems) {             // 4
+    if (get_global_id(0) >= numItems) {
+        return;
+    }
+
+    const float3 position = predictedPositions[ID];
+    const uint binID = particleBinIDs[ID];
+    if (getPositionBinID(position) == binID) {
+        return;
+    }
+
+    atomic_inc(&counters[0]);
+
+    // distance from the position to the box of the bin
+    const uint3 id3 = (uint3)(binID % binCountX, (binID / binCountX) % binCountY, binID / (binCountX * binCountY));
+    const float3 binMin = binSize * convert_float3(id3) - float3(halfDimsX, halfDimsY, halfDimsZ);
+    const float3 d = fmax(fmax(binMin - position, position - (binMin + binSize)), float3(0.0f, 0.0f, 0.0f));
+    if (dot(d, d) > maxDrift * maxDrift) {
+        counters[1] = 1;
+    }
+}
+
 /**
  * Calculates the starting index into the new particle array for a
  * bin, using prefix sum of bin counts.
  */
 __kernel void compute_bin_start_ID(__global const uint  *binCounts,
-                                   __global uint        *binStartID) {
+                                   __global uint        *binStartID,
+                                   const uint           numItems) {
+    if (get_global_id(0) >= numItems) {
+        return;
+    }
+
     uint count = 0;
     for (uint prior_id = 0; prior_id < ID; ++prior_id) {
         // Increment this bin's starting index with the count of a previous bin
@@ -62,6 +175,50 @@ __kernel void compute_bin_start_ID(__global const uint  *binCounts,
     binStartID[ID] = count;
 }
 
+/**
+ * Active region: resets the counts of the bins of the region of the previous sort, the only ones besides the
+ * extra bin that can be non-zero. Run over the bins of that region, which the host read back.
+ */
+__kernel void clear_region_bin_counts(__global uint     *binCounts,     // 0
+                                      const uint3       regionMin,      // 1
+                                      const uint3       regionSize,     // 2
+                                      const uint        numItems) {     // 3
+    if (get_global_id(0) >= numItems) {
+        return;
+    }
+
+    binCounts[getRegionBinID(ID, regionMin, regionSize)] = 0;
+}
+
+/**
+ * Active region: compute_bin_start_ID over the bins of the active region only, as all other bins are empty.
+ * The work-item after the last bin of the region writes the start of the extra bin. Run over binCount + 1
+ * items since the region is only known on the device; the items beyond the region return immediately.
+ */
+__kernel void compute_region_bin_start_ID(__global const uint   *binCounts,     // 0
+                                          __global uint         *binStartID,    // 1
+                                          __global const uint   *activeRegion,  // 2
+                                          const uint            numItems) {     // 3
+    if (get_global_id(0) >= numItems) {
+        return;
+    }
+
+    const uint3 regionMin = uint3(activeRegion[0], activeRegion[1], activeRegion[2]);
+    const uint3 regionMax = uint3(activeRegion[3], activeRegion[4], activeRegion[5]);
+    const uint3 regionSize = regionMax + 1 - regionMin;
+    const uint regionBinCount = regionMin.x <= regionMax.x ? regionSize.x * regionSize.y * regionSize.z : 0;
+    if (ID > regionBinCount) {
+        return;
+    }
+
+    uint count = 0;
+    for (uint prior_id = 0; prior_id < ID; ++prior_id) {
+        count = count + binCounts[getRegionBinID(prior_id, regionMin, regionSize)];
+    }
+
+    binStartID[ID < regionBinCount ? getRegionBinID(ID, regionMin, regionSize) : binCount] = count;
+}
+
 /**
  * Copy the particle state of an unsorted particle to its new, sorted, index in
  * the new particle state arrays.
@@ -71,13 +228,28 @@ __kernel void reindex_particles(__global const uint     *particleInBinID,
 
                                 __global const float3   *previousPositionsOld,  // 2
                                 __global const float3   *predictedPositionsOld, // 3
-                                __global const float3   *velocitiesOld,         // 4
+                                __global const STORAGE_FLOAT3 *velocitiesOld,   // 4
                                 __global const uint     *particleBinIDsOld,     // 5
 
                                 __global float3         *previousPositionsNew,  // 6
                                 __global float3         *predictedPositionsNew, // 7
-                                __global float3         *velocitiesNew,         // 8
-                                __global uint           *particleBinIDsNew) {   // 9
+                                __global STORAGE_FLOAT3 *velocitiesNew,         // 8
+                                __global uint           *particleBinIDsNew,     // 9
+
+                                __global const float    *lambdasOld,            // 10
+                                __global float          *lambdasNew,            // 11
+
+                                __global const float    *agesOld,               // 12
+                                __global float          *agesNew,               // 13
+
+                                __global const uint     *particleIDsOld,        // 14
+                                __global uint           *particleIDsNew,        // 15
+
+                                const uint              permuteVelocities,      // 16
+                                const uint              numItems) {             // 17
+    if (get_global_id(0) >= numItems) {
+        return;
+    }
 
     // Compute the new index
     const uint idNew = binStartID[particleBinIDsOld[ID]] + particleInBinID[ID];
@@ -85,6 +257,41 @@ __kernel void reindex_particles(__global const uint     *particleInBinID,
     // Copy particle state to new index
     previousPositionsNew[idNew] = previousPositionsOld[ID];
     predictedPositionsNew[idNew] = predictedPositionsOld[ID];
-    velocitiesNew[idNew] = velocitiesOld[ID];
+    if (permuteVelocities) {
+        COPY_FLOAT3(velocitiesNew, idNew, velocitiesOld, ID);
+    }
     particleBinIDsNew[idNew] = particleBinIDsOld[ID];
+    lambdasNew[idNew] = lambdasOld[ID];
+    agesNew[idNew] = agesOld[ID];
+    particleIDsNew[idNew] = particleIDsOld[ID];
+}
+
+/**
+ * Writes the current index of every particle at its persistent ID, the inverse of the permutation that the
+ * sorts applied. Only valid while the IDs are exactly 0 to numParticles - 1, i.e. none were lost to sinks.
+ */
+__kernel void invert_particle_ids(__global const uint   *particleIDs,       // 0
+                                  __global uint         *particleIndices,   // 1
+                                  const uint            numItems) {         // 2
+    if (get_global_id(0) >= numItems) {
+        return;
+    }
+
+    particleIndices[particleIDs[ID]] = ID;
+}
+
+/**
+ * Pairs the persistent ID of every particle with its current index, for radix_sort.cl to order the indices by
+ * ID when the IDs have gaps.
+ */
+__kernel void compute_id_keys(__global const uint   *particleIDs,   // 0
+                              __global uint         *keys,          // 1
+                              __global uint         *values,        // 2
+                              const uint            numItems) {     // 3
+    if (get_global_id(0) >= numItems) {
+        return;
+    }
+
+    keys[ID] = particleIDs[ID];
+    values[ID] = ID;
 }
@@ -0,0 +1,48 @@
+/// A short, self-contained PBF-like workload for comparing OpenCL devices at startup (see --device auto).
+/// The particles lie on a jittered cubic lattice with a spacing of half the kernel radius, so the neighbours
+/// of a particle are the particles in the 5x5x5 lattice cells around it, found by index like calc_densities
+/// finds them through the neighbouring bins.
+///
+/// Pre-processor defines that specify the workload
+/// LATTICE_SIZE            // The number of particles along each side of the lattice
+/// KERNEL_RADIUS           // The SPH kernel radius h
+
+#define ID get_global_id(0)
+
+#define POLY6_COEFFICIENT (315.0f / (64.0f * M_PI_F * pown(KERNEL_RADIUS, 9)))
+
+/**
+ * Calculates the density of a particle as the sum of Wpoly6 over its lattice neighbours.
+ */
+__kernel void benchmark_densities(__global const float4 *positions,    // 0
+                                  __global float        *densities,    // 1
+                                  const uint            numItems) {    // 2
+    if (get_global_id(0) >= numItems) {
+        return;
+    }
+
+    const int3 cell = (int3)(ID % LATTICE_SIZE, (ID / LATTICE_SIZE) % LATTICE_SIZE, ID / (LATTICE_SIZE * LATTICE_SIZE));
+    const float3 position = positions[ID].xyz;
+    const float h2 = KERNEL_RADIUS * KERNEL_RADIUS;
+
+    float density = 0.0f;
+    for (int dz = -2; dz <= 2; ++dz) {
+        for (int dy = -2; dy <= 2; ++dy) {
+            for (int dx = -2; dx <= 2; ++dx) {
+                const int3 n = cell + (int3)(dx, dy, dz);
+                if (any(n < 0) || any(n >= LATTICE_SIZE)) {
+                    continue;
+                }
+
+                const float3 r = position - positions[n.x + LATTICE_SIZE * n.y + LATTICE_SIZE * LATTICE_SIZE * n.z].xyz;
+                const float r2 = dot(r, r);
+                if (r2 < h2) {
+                    const float diff = h2 - r2;
+                    density += diff * diff * diff;
+                }
+            }
+        }
+    }
+
+    densities[ID] = POLY6_COEFFICIENT * density;
+}
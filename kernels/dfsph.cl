@@ -0,0 +1,255 @@
+/// Divergence-free SPH (Bender & Koschier), as an alternative to the PBF solver in fluid_sim.cl.
+/// Uses the same counting-sort grid and is built with the same defines as fluid_sim.cl.
+///
+/// Pre-processor defines that specify grid parameters, see common/Grid.cl
+/// halfDims[Z,Y,Z], binSize, binCount[Z,Y,Z], binCount
+///
+/// Optional fluid defines, see common/Fluid.cl
+/// FLUID_SPECIALIZED, FLUID_[param], FLUID_GRAD_SPIKY_COEFF
+///
+/// Optional storage define, see common/Storage.cl
+/// HALF_STORAGE
+///
+/// Optional obstacle defines, see fluid_sim.cl and common/SDF.cl
+/// SDF_OBSTACLES, SDF_CELLS_PER_BIN
+///
+/// Optional boundary define, see fluid_sim.cl and common/Boundary.cl
+/// BOUNDARY_PARTICLES      // The boundary particles add to the factors and corrections with zero velocity,
+///                         // mass ρ0 V_b, and the pressure of the fluid particle they are next to
+
+#include "common/Definitions.cl"
+#include "common/Storage.cl"
+#include "common/Fluid.cl"
+#include "common/Bounds.cl"
+#include "common/Grid.cl"
+#include "common/SDF.cl"
+#include "common/Kernels.cl"
+#include "common/Boundary.cl"
+
+/**
+ * Calculates the DFSPH factor α_i = ρ_i / (|Σ_j ∇W_ij|² + Σ_j |∇W_ij|²) of a particle (unit mass),
+ * shared by the divergence and density solves. Boundary particles only add to the first sum, since they
+ * don't move.
+ */
+__kernel void dfsph_calc_factors(         const Fluid   fluid,          // 0
+                                 __global const float3  *positions,     // 1
+                                 __global const uint    *binIDs,        // 2
+                                 __global const uint    *binStartIDs,   // 3
+                                 __global const uint    *binCounts,     // 4
+                                 __global const STORAGE_FLOAT *densities, // 5
+                                 __global float         *factors,       // 6
+                                 __global const float4  *boundaryParticles,     // 7
+                                 __global const uint    *boundaryBinStartIDs,   // 8
+                                 __global const uint    *boundaryBinCounts,     // 9
+                                          const uint    numItems) {     // 10
+    if (get_global_id(0) >= numItems) {
+        return;
+    }
+
+    const float3 position = positions[ID];
+    const int3 binID3D = convert_int3(getBinID_3D(binIDs[ID]));
+
+    float3 sumOfGradients = ZERO3F;
+    float sumOfSquaredGradients = 0.0f;
+
+    int x, y, z;
+    for (int dx = -1; dx < 2; ++dx) {
+        x = binID3D.x + dx;
+        if (x+1 != clamp(x+1, 1, binCountX)) continue;
+        for (int dy = -1; dy < 2; ++dy) {
+            y = binID3D.y + dy;
+            if (y+1 != clamp(y+1, 1, binCountY)) continue;
+            for (int dz = -1; dz < 2; ++dz) {
+                z = binID3D.z + dz;
+                if (z+1 != clamp(z+1, 1, binCountZ)) continue;
+
+                const uint nBinID = x + binCountX * y + binCountX * binCountY * z;
+                const uint nBinStartID = binStartIDs[nBinID];
+                const uint nBinCount = binCounts[nBinID];
+
+                for (uint pID = nBinStartID; pID < (nBinStartID + nBinCount); ++pID) {
+                    const float3 grad = grad_Wspiky(position - positions[pID], FLUID(kernelRadius));
+                    sumOfGradients += grad;
+                    sumOfSquaredGradients += dot(grad, grad);
+                }
+            }
+        }
+    }
+
+#ifdef BOUNDARY_PARTICLES
+    sumOfGradients += FLUID(restDensity) *
+                      boundary_gradient_sum(fluid, position, binID3D, boundaryParticles, boundaryBinStartIDs, boundaryBinCounts);
+#endif
+
+    const float denominator = dot(sumOfGradients, sumOfGradients) + sumOfSquaredGradients;
+    factors[ID] = denominator > EPSILON ? LOAD_FLOAT(densities, ID) / denominator : 0.0f;
+}
+
+/**
+ * Calculates the stiffness κ_i of a particle from the density change rate Dρ_i/Dt = Σ_j (v_i - v_j)·∇W_ij,
+ * where boundary particles have zero velocity.
+ * Divergence solve (densitySolve == 0): κ_i = max(Dρ_i/Dt, 0) α_i / dt
+ * Density solve    (densitySolve != 0): κ_i = max(ρ_i + dt Dρ_i/Dt - ρ0, 0) α_i / dt²
+ * Only compression is corrected in both cases.
+ */
+__kernel void dfsph_calc_kappas(         const Fluid   fluid,           // 0
+                                __global const float3  *positions,      // 1
+                                __global const uint    *binIDs,         // 2
+                                __global const uint    *binStartIDs,    // 3
+                                __global const uint    *binCounts,      // 4
+                                __global const STORAGE_FLOAT3 *velocities, // 5
+                                __global const STORAGE_FLOAT  *densities,  // 6
+                                __global const float   *factors,        // 7
+                                __global float         *kappas,         // 8
+                                         const float   dt,              // 9
+                                         const uint    densitySolve,    // 10
+                                __global const float4  *boundaryParticles,     // 11
+                                __global const uint    *boundaryBinStartIDs,   // 12
+                                __global const uint    *boundaryBinCounts,     // 13
+                                         const uint    numItems) {      // 14
+    if (get_global_id(0) >= numItems) {
+        return;
+    }
+
+    const float3 position = positions[ID];
+    const float3 velocity = LOAD_FLOAT3(velocities, ID);
+    const int3 binID3D = convert_int3(getBinID_3D(binIDs[ID]));
+
+    float densityChangeRate = 0.0f;
+
+    int x, y, z;
+    for (int dx = -1; dx < 2; ++dx) {
+        x = binID3D.x + dx;
+        if (x+1 != clamp(x+1, 1, binCountX)) continue;
+        for (int dy = -1; dy < 2; ++dy) {
+            y = binID3D.y + dy;
+            if (y+1 != clamp(y+1, 1, binCountY)) continue;
+            for (int dz = -1; dz < 2; ++dz) {
+                z = binID3D.z + dz;
+                if (z+1 != clamp(z+1, 1, binCountZ)) continue;
+
+                const uint nBinID = x + binCountX * y + binCountX * binCountY * z;
+                const uint nBinStartID = binStartIDs[nBinID];
+                const uint nBinCount = binCounts[nBinID];
+
+                for (uint pID = nBinStartID; pID < (nBinStartID + nBinCount); ++pID) {
+                    densityChangeRate += dot(velocity - LOAD_FLOAT3(velocities, pID),
+                                             grad_Wspiky(position - positions[pID], FLUID(kernelRadius)));
+                }
+            }
+        }
+    }
+
+#ifdef BOUNDARY_PARTICLES
+    densityChangeRate += FLUID(restDensity) *
+                         dot(velocity, boundary_gradient_sum(fluid, position, binID3D,
+                                                             boundaryParticles, boundaryBinStartIDs, boundaryBinCounts));
+#endif
+
+    if (densitySolve) {
+        const float predictedDensity = LOAD_FLOAT(densities, ID) + dt * densityChangeRate;
+        kappas[ID] = max(predictedDensity - FLUID(restDensity), 0.0f) * factors[ID] / (dt * dt);
+    } else {
+        kappas[ID] = max(densityChangeRate, 0.0f) * factors[ID] / dt;
+    }
+}
+
+/**
+ * Applies the pressure-based velocity correction v_i -= dt Σ_j (κ_i/ρ_i + κ_j/ρ_j) ∇W_ij. Boundary particles
+ * push back with the particle's own κ_i/ρ_i only.
+ * Only the particle's own velocity is written, so the update can be done in place.
+ */
+__kernel void dfsph_correct_velocities(         const Fluid   fluid,        // 0
+                                       __global const float3  *positions,   // 1
+                                       __global const uint    *binIDs,      // 2
+                                       __global const uint    *binStartIDs, // 3
+                                       __global const uint    *binCounts,   // 4
+                                       __global const STORAGE_FLOAT *densities, // 5
+                                       __global const float   *kappas,      // 6
+                                       __global STORAGE_FLOAT3 *velocities, // 7
+                                                const float   dt,           // 8
+                                       __global const float4  *boundaryParticles,     // 9
+                                       __global const uint    *boundaryBinStartIDs,   // 10
+                                       __global const uint    *boundaryBinCounts,     // 11
+                                                const uint    numItems) {   // 12
+    if (get_global_id(0) >= numItems) {
+        return;
+    }
+
+    const float3 position = positions[ID];
+    const float kappaOverDensity = kappas[ID] / max(LOAD_FLOAT(densities, ID), EPSILON);
+    const int3 binID3D = convert_int3(getBinID_3D(binIDs[ID]));
+
+    float3 deltaVelocity = ZERO3F;
+
+    int x, y, z;
+    for (int dx = -1; dx < 2; ++dx) {
+        x = binID3D.x + dx;
+        if (x+1 != clamp(x+1, 1, binCountX)) continue;
+        for (int dy = -1; dy < 2; ++dy) {
+            y = binID3D.y + dy;
+            if (y+1 != clamp(y+1, 1, binCountY)) continue;
+            for (int dz = -1; dz < 2; ++dz) {
+                z = binID3D.z + dz;
+                if (z+1 != clamp(z+1, 1, binCountZ)) continue;
+
+                const uint nBinID = x + binCountX * y + binCountX * binCountY * z;
+                const uint nBinStartID = binStartIDs[nBinID];
+                const uint nBinCount = binCounts[nBinID];
+
+                for (uint pID = nBinStartID; pID < (nBinStartID + nBinCount); ++pID) {
+                    const float coefficient = kappaOverDensity + kappas[pID] / max(LOAD_FLOAT(densities, pID), EPSILON);
+                    deltaVelocity += coefficient * grad_Wspiky(position - positions[pID], FLUID(kernelRadius));
+                }
+            }
+        }
+    }
+
+#ifdef BOUNDARY_PARTICLES
+    deltaVelocity += kappaOverDensity * FLUID(restDensity) *
+                     boundary_gradient_sum(fluid, position, binID3D, boundaryParticles, boundaryBinStartIDs, boundaryBinCounts);
+#endif
+
+    STORE_FLOAT3(velocities, ID, LOAD_FLOAT3(velocities, ID) - dt * deltaVelocity);
+}
+
+/**
+ * Applies gravity, the only non-pressure force that isn't handled by the XSPH/vorticity pass.
+ */
+__kernel void dfsph_apply_gravity(__global STORAGE_FLOAT3 *velocities,  // 0
+                                  const float             dt,           // 1
+                                  const uint              numItems) {   // 2
+    if (get_global_id(0) >= numItems) {
+        return;
+    }
+
+    float3 velocity = LOAD_FLOAT3(velocities, ID);
+    velocity.y = velocity.y - dt * 9.82f;
+    STORE_FLOAT3(velocities, ID, velocity);
+}
+
+/**
+ * Advects a particle with its corrected velocity and clips it to the bounds and obstacles. The velocity
+ * is recomputed from the clipped displacement so that it doesn't keep pushing into the walls.
+ */
+__kernel void dfsph_integrate(         const Bounds  bounds,       // 0
+                              __global float3        *positions,   // 1
+                              __global STORAGE_FLOAT3 *velocities, // 2
+                                       const float   dt,           // 3
+                              __global const float   *sdf,         // 4
+                                       const uint    numItems) {   // 5
+    if (get_global_id(0) >= numItems) {
+        return;
+    }
+
+    const float3 position = positions[ID];
+    float3 newPosition = clamp(position + dt * LOAD_FLOAT3(velocities, ID),
+                               -bounds.halfDimensions + DIFF,
+                               bounds.halfDimensions - DIFF);
+#ifdef SDF_OBSTACLES
+    newPosition = project_out_of_sdf(sdf, newPosition);
+#endif
+
+    positions[ID] = newPosition;
+    STORE_FLOAT3(velocities, ID, (newPosition - position) / dt);
+}
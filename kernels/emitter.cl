@@ -0,0 +1,90 @@
+/// Generates new particles on the device, appending them after the existing ones.
+///
+/// Optional storage define, see common/Storage.cl
+/// HALF_STORAGE
+
+#include "common/Definitions.cl"
+#include "common/Storage.cl"
+
+#define EMITTER_DISC 0
+#define EMITTER_BOX 1
+#define EMITTER_SPHERE 2
+
+/// The R3 low-discrepancy sequence (Roberts), which covers the unit cube evenly without any state
+#define R3_ALPHA float3(0.8191725134f, 0.6710436067f, 0.5497004779f)
+
+typedef struct def_Emitter {
+    float3 position;
+    float3 direction;
+    float radius;
+    float speed;
+    float rate;
+    uint type;
+} Emitter;
+
+/**
+ * Maps a point in the unit cube to a point inside the emitter's shape, relative to its position.
+ * Disc emitters spread their particles along the direction by the distance they move in one frame.
+ */
+float3 map_to_emitter(const Emitter emitter, const float3 u, const float dt);
+
+/**
+ * Emits one particle per work-item into the slot returned by an atomic counter, which holds the
+ * particle count before the first emitter of a frame. Particles beyond maxParticles are dropped.
+ * @param sequenceOffset The number of particles emitted before, continuing the low-discrepancy sequence
+ * @param firstID The persistent ID of the first particle of this emitter in this frame
+ */
+__kernel void emit_particles(const Emitter           emitter,           // 0
+                             __global float3         *positions,        // 1
+                             __global STORAGE_FLOAT3 *velocities,       // 2
+                             __global volatile uint  *particleCounter,  // 3
+                             const uint              maxParticles,      // 4
+                             const uint              sequenceOffset,    // 5
+                             const float             dt,                // 6
+                             __global float          *ages,             // 7
+                             __global uint           *particleIDs,      // 8
+                             const uint              firstID,           // 9
+                             const uint              numItems) {        // 10
+    if (get_global_id(0) >= numItems) {
+        return;
+    }
+
+    const uint slot = atomic_inc(particleCounter);
+    if (slot >= maxParticles) {
+        return;
+    }
+
+    float3 unused;
+    const float3 u = fract(0.5f + convert_float(sequenceOffset + ID) * R3_ALPHA, &unused);
+
+    positions[slot] = emitter.position + map_to_emitter(emitter, u, dt);
+    STORE_FLOAT3(velocities, slot, emitter.speed * emitter.direction);
+    ages[slot] = 0.0f;
+    particleIDs[slot] = firstID + ID;
+}
+
+inline float3 map_to_emitter(const Emitter emitter, const float3 u, const float dt) {
+    switch (emitter.type) {
+        case EMITTER_DISC: {
+            // orthonormal basis of the disc's plane
+            const float3 helper = fabs(emitter.direction.x) < 0.9f ? (float3)(1.0f, 0.0f, 0.0f) : (float3)(0.0f, 1.0f, 0.0f);
+            const float3 tangent = normalize(cross(emitter.direction, helper));
+            const float3 bitangent = cross(emitter.direction, tangent);
+
+            const float r = emitter.radius * sqrt(u.x);
+            const float theta = 2.0f * PI * u.y;
+            return r * (cos(theta) * tangent + sin(theta) * bitangent)
+                   + (u.z * emitter.speed * dt) * emitter.direction;
+        }
+        case EMITTER_BOX:
+            return emitter.radius * (2.0f * u - 1.0f);
+        case EMITTER_SPHERE:
+        default: {
+            const float r = emitter.radius * cbrt(u.x);
+            const float cosTheta = 1.0f - 2.0f * u.y;
+            const float sinTheta = sqrt(max(1.0f - cosTheta * cosTheta, 0.0f));
+            const float phi = 2.0f * PI * u.z;
+            return r * (float3)(sinTheta * cos(phi), sinTheta * sin(phi), cosTheta);
+        }
+    }
+}
@@ -4,98 +4,135 @@
 /// binCount[Z,Y,Z]         // The number of bins in each dimension
 /// binCount                // The total number of bins in the grid
 /// NO_EDGE_CLAMP
+///
+/// Optional pre-processor defines that bake the fluid parameters into the program
+/// (see GetDefinesCL(const Fluid&)). When FLUID_SPECIALIZED is defined, the Fluid
+/// kernel arguments are ignored in favour of the following constants:
+/// FLUID_[param]                   // Every field of Fluid except numSubSteps
+/// FLUID_POLY6_COEFF               // 315 / (64 * pi * h^9)
+/// FLUID_GRAD_SPIKY_COEFF          // -45 / (pi * h^6)
+/// FLUID_ONE_OVER_REST_DENSITY     // 1 / restDensity
+/// FLUID_ONE_OVER_WPOLY6_DELTA_Q   // 1 / Wpoly6(delta_q)
+///
+/// Optional pre-processor define for the storage format of velocities, densities and curls
+/// HALF_STORAGE                    // Stored as half4/half, loaded and stored through vload_half/vstore_half
+///                                 // while all arithmetic stays in float
+///
+/// Optional pre-processor defines for static obstacles given as a signed distance field (see sdf.cl)
+/// SDF_OBSTACLES                   // Obstacles are present, so the SDF arguments are used
+/// SDF_CELLS_PER_BIN               // The number of SDF cells along each side of a bin
+///
+/// Optional pre-processor define for static boundary particles (Akinci et al. 2012)
+/// BOUNDARY_PARTICLES              // Boundary particles replace the analytic wall and SDF densities. They
+///                                 // are sorted into their own, static, copy of the grid with their
+///                                 // positions in xyz and their volumes in w
+///
+/// Optional pre-processor define for skipping particles at rest (see sleeping_bins.cl)
+/// SLEEPING_BINS                   // The kernels are run over the active particle list, whose entries are
+///                                 // the sorted particle indices, rather than over all particles. Its first
+///                                 // entry is its length, so the launch covers all particles
+///
+/// Optional pre-processor defines for the loose grid of the incremental sort
+/// LOOSE_GRID_SKIN                 // Particles may be up to this distance outside of the bin they were last
+///                                 // sorted into. Neighbours are then gathered from all bins within
+///                                 // kernelRadius + LOOSE_GRID_SKIN, i.e. from up to 5x5x5 bins
+
+#include "common/Definitions.cl"
+#include "common/Storage.cl"
+#include "common/Fluid.cl"
+#include "common/Bounds.cl"
+#include "common/Grid.cl"
+#include "common/SDF.cl"
+#include "common/Kernels.cl"
+#include "common/Boundary.cl"
 
-//#define USE_FAST_SQRT
 #define ONE_OVER_SQRT_OF_3 0.577350f
-#define ZERO3F float3(0.0f, 0.0f, 0.0f)
-#define DIFF float3(0.015f, 0.015f, 0.015f)
-#define EPSILON 0.0001f
-#define PI 3.1415926535f
-#define ID get_global_id(0)
+#ifdef SLEEPING_BINS
+#undef ID
+#define ID activeIDs[1 + get_global_id(0)]
+#define NUM_ITEMS(numItems) min(numItems, activeIDs[0])
+#else
+#define NUM_ITEMS(numItems) (numItems)
+#endif
 
 #define MAX_DELTA_PI float3(0.1f, 0.1f, 0.1f)
 
-typedef struct def_Fluid {
-    float kernelRadius;
-    uint numSubSteps;
-    float restDensity;
-    float deltaTime;
-    float epsilon;
-    float k;
-    float delta_q;
-    uint n;
-    float c;
-    float k_vc;
-
-    float kBoundsDensity;
-} Fluid;
-
-typedef struct def_Bounds {
-    float3 dimensions;
-    float3 halfDimensions;
-} Bounds;
-
+/// With a loose grid, particles may have left the bin they were sorted into, so more bins are searched
+#ifdef LOOSE_GRID_SKIN
+#define MAX_NEIGHBOURING_BINS   (5 * 5 * 5)
+#else
+#define MAX_NEIGHBOURING_BINS   (3 * 3 * 3)
+#endif
 
-/**
- * Computes the 3D-indices into the uniform grid from a 1D-index.
- * @param binID The 1D-index
- * @return The 3D index
- */
-uint3 getBinID_3D(uint binID);
+#ifdef FLUID_SPECIALIZED
+#define ONE_OVER_REST_DENSITY       FLUID_ONE_OVER_REST_DENSITY
+#define ONE_OVER_WPOLY6_DELTA_Q     FLUID_ONE_OVER_WPOLY6_DELTA_Q
+#else
+#define ONE_OVER_REST_DENSITY       (1.0f / fluid.restDensity)
+#define ONE_OVER_WPOLY6_DELTA_Q     one_over_wpoly6_delta_q(fluid)
+#endif
 
 /**
- * Computes the 1D-index into the linearized uniform grid arrays from a 3D-index.
- * @param binID_3D The 3D-index
- * @return The 1D-index
+ * Calculates 1 / Wpoly6(delta_q) for the artificial pressure, or 0 (no artificial pressure) if delta_q is so
+ * close to the kernel radius that Wpoly6(delta_q) vanishes. Matches FLUID_ONE_OVER_WPOLY6_DELTA_Q.
  */
-uint getBinID(const uint3 binID_3D);
+inline float one_over_wpoly6_delta_q(const Fluid fluid) {
+    const float wdq = Wpoly6(ONE_OVER_SQRT_OF_3 * float3(fluid.delta_q, fluid.delta_q, fluid.delta_q), fluid.kernelRadius);
+    return wdq > 0.0f ? 1.0f / wdq : 0.0f;
+}
 
-/**
- * Computes the squared norm of a 3-component vector.
- * @param r The vector
- * @return The squared norm
- */
-float euclidean_distance2(const float3 r);
 
 /**
- * Computes the norm of a 3-component vector.
- * @param r The vector
- * @return The norm
+ * Calculates the cross product between vectors u_ and v_ as (u x v). Needed since OpenCL's
+ * built-in cross function always returns the wrong results, at least when usingIntel's
+ * OpenCL SDK.
+ * @param u_ The first vector
+ * @param v_ The second vector
+ * @return The cross product
  */
-float euclidean_distance(const float3 r);
+float3 cross_(float3 u_, float3 v_);
 
 /**
- * Evaluates the poly6 SPH-kernel at the given coordinate.
- * @param r The vector from the origin of the kernel.
- * @param h The kernel radius
- * @return The value of the kernel
+ * Computes the colour of a bin for the graph-coloured Gauss-Seidel solver, such that no two bins of the same
+ * colour are among each other's 26 neighbours. colourCount == 1 is plain Jacobi.
+ * @param binID_3D The 3D-index of the bin
+ * @param colourCount 1, 8 (parity per axis) or 27 (index modulo 3 per axis)
+ * @return The colour, in [0, colourCount)
  */
-float Wpoly6(const float3 r, const float h);
+uint getBinColour(const uint3 binID_3D, const uint colourCount);
 
 /**
- * Evaluates the gradient of the spiky SPH-kernel at the given coordinate.
- * @param The vector from the origin of the kernel.
- * @param h The kernel radius
- * @return The gradient of the kernel
+ * Collects the bins that may hold neighbours of a particle: the 27 bins around its own bin, or with a loose
+ * grid, every bin within kernelRadius + LOOSE_GRID_SKIN of its position.
+ * @param position The position of the particle
+ * @param binID3D The bin the particle was last sorted into
+ * @param neighbouringBinIDs Receives the 1D-indices of the bins, MAX_NEIGHBOURING_BINS at most
+ * @return The number of bins
  */
-float3 grad_Wspiky(const float3 r, const float h);
+uint gather_neighbouring_bins(const Fluid fluid, const float3 position, const int3 binID3D, uint *neighbouringBinIDs);
 
 /**
- * Calculates the cross product between vectors u_ and v_ as (u x v). Needed since OpenCL's
- * built-in cross function always returns the wrong results, at least when usingIntel's
- * OpenCL SDK.
- * @param u_ The first vector
- * @param v_ The second vector
- * @return The cross product
+ * Calculates the (unclamped) position correction of a particle from its own and its neighbours' λ.
  */
-float3 cross_(float3 u_, float3 v_);
+float3 calc_delta_pi(const Fluid            fluid,
+                     __global const float3  *positions,
+                     __global const uint    *binIDs,
+                     __global const uint    *binStartIDs,
+                     __global const uint    *binCounts,
+                     __global const float   *lambdas,
+                     __global const float4  *boundaryParticles,
+                     __global const uint    *boundaryBinStartIDs,
+                     __global const uint    *boundaryBinCounts,
+                     __global const uint    *activeIDs);
 
 /**
- * Computes the square root of x__. Can be defined to compute a "fast" square root.
- * @param x__ The input value
- * @return Its square root
+ * Computes x__ to the power of n__ by repeated multiplication. Fully unrolled by the
+ * compiler when n__ is a compile-time constant.
+ * @param x__ The base
+ * @param n__ The (non-negative) exponent
+ * @return x__^n__
  */
-float sqroot(float x__);
+float ipow(float x__, uint n__);
 
 /**
  * Calculates the density contribution from a planar wall using the volume of a hemisphere.
@@ -114,7 +151,16 @@ __kernel void calc_densities(         const Fluid   fluid,          // 0
                              __global const uint    *binIDs,        // 3
                              __global const uint    *binStartIDs,   // 4
                              __global const uint    *binCounts,     // 5
-                             __global float         *densities) {   // 6
+                             __global STORAGE_FLOAT *densities,     // 6
+                             __global const float   *boundaryVolumes,   // 7
+                             __global const float4  *boundaryParticles,     // 8
+                             __global const uint    *boundaryBinStartIDs,   // 9
+                             __global const uint    *boundaryBinCounts,     // 10
+                             __global const uint    *activeIDs,             // 11
+                                      const uint    numItems) {             // 12
+    if (get_global_id(0) >= NUM_ITEMS(numItems)) {
+        return;
+    }
 
     float density = 0.0f;
     const float3 position = positions[ID];
@@ -125,34 +171,12 @@ __kernel void calc_densities(         const Fluid   fluid,          // 0
 
 /// Gather neighbours
 
-    uint neighbouringBinIDs[3 * 3 * 3];
-    uint neighbouringBinCount = 0;
+    uint neighbouringBinIDs[MAX_NEIGHBOURING_BINS];
+    const uint neighbouringBinCount = gather_neighbouring_bins(fluid, position, binID3D, neighbouringBinIDs);
 
-    uint nBinID;
     uint nBinStartID;
     uint nBinCount;
 
-    int x, y, z;
-    for (int dx = -1; dx < 2; ++dx) {
-        x = binID3D.x + dx;
-        if (x+1 == clamp(x+1, 1, binCountX)) {
-            for (int dy = -1; dy < 2; ++dy) {
-                y = binID3D.y + dy;
-                if (y+1 == clamp(y+1, 1, binCountY)) {
-                    for (int dz = -1; dz < 2; ++dz) {
-                        z = binID3D.z + dz;
-                        if  (z+1 == clamp(z+1, 1, binCountZ)) {
-                            nBinID = x + binCountX * y + binCountX * binCountY * z;
-                            //printf("%d + %d * %d + %d * %d * %d = %d\n", x, binCountX, y, binCountX, binCountY, z, nBinID);
-                            neighbouringBinIDs[neighbouringBinCount] = nBinID;
-                            ++neighbouringBinCount;
-                        }
-                    }
-                }
-            }
-        }
-    }
-
 
 /// for all neighbours: calculate density contribution
 
@@ -163,45 +187,67 @@ __kernel void calc_densities(         const Fluid   fluid,          // 0
         nBinCount = binCounts[nBinID];
 
         for (uint pID = nBinStartID; pID < (nBinStartID + nBinCount); ++pID) {
-            density = density + Wpoly6(positions[pID] - position, fluid.kernelRadius);
+            density = density + Wpoly6(positions[pID] - position, FLUID(kernelRadius));
         }
 
     }
 
     /// Add boundary density contributions
 
+#ifdef BOUNDARY_PARTICLES
+    density = density + FLUID(restDensity) *
+                        boundary_volume_sum(fluid, position, binID3D, boundaryParticles, boundaryBinStartIDs, boundaryBinCounts);
+    STORE_FLOAT(densities, ID, density);
+#else
     float b_density = 0.0f;
     // x-left
-    b_density = b_density + calc_bound_density_contribution(position.x + bounds.halfDimensions.x, fluid.kernelRadius);
+    b_density = b_density + calc_bound_density_contribution(position.x + bounds.halfDimensions.x, FLUID(kernelRadius));
     // x-right
-    b_density = b_density + calc_bound_density_contribution(bounds.halfDimensions.x - position.x, fluid.kernelRadius);
+    b_density = b_density + calc_bound_density_contribution(bounds.halfDimensions.x - position.x, FLUID(kernelRadius));
     // y-down
-    b_density = b_density + calc_bound_density_contribution(position.y + bounds.halfDimensions.y, fluid.kernelRadius);
+    b_density = b_density + calc_bound_density_contribution(position.y + bounds.halfDimensions.y, FLUID(kernelRadius));
     // y-up
-    b_density = b_density + calc_bound_density_contribution(bounds.halfDimensions.y - position.y, fluid.kernelRadius);
+    b_density = b_density + calc_bound_density_contribution(bounds.halfDimensions.y - position.y, FLUID(kernelRadius));
     // z-near
-    b_density = b_density + calc_bound_density_contribution(position.z + bounds.halfDimensions.z, fluid.kernelRadius);
+    b_density = b_density + calc_bound_density_contribution(position.z + bounds.halfDimensions.z, FLUID(kernelRadius));
     // z-far
-    b_density = b_density + calc_bound_density_contribution(bounds.halfDimensions.z - position.z, fluid.kernelRadius);
+    b_density = b_density + calc_bound_density_contribution(bounds.halfDimensions.z - position.z, FLUID(kernelRadius));
+
 
+#ifdef SDF_OBSTACLES
+    // obstacles, as if they were filled with fluid at rest
+    density = density + FLUID(restDensity) * sample_sdf_field(boundaryVolumes, position);
+#endif
 
-    densities[ID] = density + fluid.kBoundsDensity * b_density;
+    STORE_FLOAT(densities, ID, density + FLUID(kBoundsDensity) * b_density);
+#endif
 }
 
 /**
  * Calculates the lambda value (i.e. magnitude of position correction along jacobian) for a particle.
+ * If warmStartBlend > 0, the result is blended with the lambda already stored for the particle
+ * (i.e. the previous frame's value, carried through the counting sort).
  */
 __kernel void calc_lambdas(const Fluid            fluid,          // 0
                            __global const float3  *positions,     // 1
                            __global const uint    *binIDs,        // 2
                            __global const uint    *binStartIDs,   // 3
                            __global const uint    *binCounts,     // 4
-                           __global const float   *densities,     // 5
-                           __global float         *lambdas) {     // 6
+                           __global const STORAGE_FLOAT *densities, // 5
+                           __global float         *lambdas,       // 6
+                           const float            warmStartBlend,     // 7
+                           __global const float4  *boundaryParticles,     // 8
+                           __global const uint    *boundaryBinStartIDs,   // 9
+                           __global const uint    *boundaryBinCounts,     // 10
+                           __global const uint    *activeIDs,             // 11
+                           const uint             numItems) {             // 12
+    if (get_global_id(0) >= NUM_ITEMS(numItems)) {
+        return;
+    }
 
     const float3 position = positions[ID];
-    const float density = densities[ID];
-    const float Ci = density / fluid.restDensity - 1;
+    const float density = LOAD_FLOAT(densities, ID);
+    const float Ci = density * ONE_OVER_REST_DENSITY - 1;
 
     const uint binID = binIDs[ID];
     const int3 binID3D = convert_int3(getBinID_3D(binID));
@@ -209,33 +255,12 @@ __kernel void calc_lambdas(const Fluid            fluid,          // 0
 
     /// Gather all neighbours
 
-    uint neighbouringBinIDs[3 * 3 * 3];
-    uint neighbouringBinCount = 0;
+    uint neighbouringBinIDs[MAX_NEIGHBOURING_BINS];
+    const uint neighbouringBinCount = gather_neighbouring_bins(fluid, position, binID3D, neighbouringBinIDs);
 
-    uint nBinID;
     uint nBinStartID;
     uint nBinCount;
 
-    int x, y, z;
-    for (int dx = -1; dx < 2; ++dx) {
-        x = binID3D.x + dx;
-        if (x+1 == clamp(x+1, 1, binCountX)) {
-            for (int dy = -1; dy < 2; ++dy) {
-                y = binID3D.y + dy;
-                if (y+1 == clamp(y+1, 1, binCountY)) {
-                    for (int dz = -1; dz < 2; ++dz) {
-                        z = binID3D.z + dz;
-                        if  (z+1 == clamp(z+1, 1, binCountZ)) {
-                            nBinID = x + binCountX * y + binCountX * binCountY * z;
-                            neighbouringBinIDs[neighbouringBinCount] = nBinID;
-                            ++neighbouringBinCount;
-                        }
-                    }
-                }
-            }
-        }
-    }
-
 
     /// Calculate gradient^2 of Ci for all neighbours
 
@@ -259,7 +284,7 @@ __kernel void calc_lambdas(const Fluid            fluid,          // 0
 
         for (uint pID = nBinStartID; pID < (nBinStartID + nBinCount); ++pID) {
             k_position = positions[pID];
-            tmp_grad = grad_Wspiky(position - k_position, fluid.kernelRadius);
+            tmp_grad = grad_Wspiky(position - k_position, FLUID(kernelRadius));
             grad_ki += tmp_grad;
 
             if (pID != ID) {
@@ -272,6 +297,12 @@ __kernel void calc_lambdas(const Fluid            fluid,          // 0
         }
     }
 
+#ifdef BOUNDARY_PARTICLES
+    // static boundary particles only contribute to the gradient with respect to the particle itself
+    grad_ki += FLUID(restDensity) *
+               boundary_gradient_sum(fluid, position, binID3D, boundaryParticles, boundaryBinStartIDs, boundaryBinCounts);
+#endif
+
     sumOfSquaredGradients = sumOfSquaredGradients +
                                 grad_ki.x * grad_ki.x +
                                 grad_ki.y * grad_ki.y +
@@ -280,12 +311,18 @@ __kernel void calc_lambdas(const Fluid            fluid,          // 0
 
     /// Compute lambda_i as (-Ci)/(sum(gradient^2 of Ci) + eps)
 
-    const float lambda = - Ci / ((sumOfSquaredGradients / pow(fluid.restDensity, 2)) + fluid.epsilon);
-    lambdas[ID] = lambda;
+    const float lambda = - Ci / (sumOfSquaredGradients * ONE_OVER_REST_DENSITY * ONE_OVER_REST_DENSITY + FLUID(epsilon));
+
+    if (warmStartBlend > 0.0f) {
+        lambdas[ID] = mix(lambda, lambdas[ID], warmStartBlend);
+    } else {
+        lambdas[ID] = lambda;
+    }
 }
 
 /**
- * Calculates the position correction for a particle.
+ * Calculates the position correction for a particle and applies it, clipped to the bounds and obstacles
+ * like apply_delta_pi_coloured.
  */
 __kernel void calc_delta_pi_and_update(const Fluid            fluid,          // 0
                                        const Bounds           bounds,         // 1
@@ -293,53 +330,143 @@ __kernel void calc_delta_pi_and_update(const Fluid            fluid,          //
                                        __global const uint    *binIDs,        // 3
                                        __global const uint    *binStartIDs,   // 4
                                        __global const uint    *binCounts,     // 5
-                                       __global const float   *densities,     // 6
-                                       __global const float   *lambdas) {     // 7
+                                       __global const STORAGE_FLOAT *densities, // 6
+                                       __global const float   *lambdas,      // 7
+                                       __global const float4  *boundaryParticles,     // 8
+                                       __global const uint    *boundaryBinStartIDs,   // 9
+                                       __global const uint    *boundaryBinCounts,     // 10
+                                       __global const uint    *activeIDs,             // 11
+                                       __global const float   *sdf,                   // 12
+                                       const uint             numItems) {             // 13
+    if (get_global_id(0) >= NUM_ITEMS(numItems)) {
+        return;
+    }
+
+    const float3 delta_pi = calc_delta_pi(fluid, positions, binIDs, binStartIDs, binCounts, lambdas,
+                                          boundaryParticles, boundaryBinStartIDs, boundaryBinCounts, activeIDs);
+
+    // clamp the position correction to be within reasonable limits
+    float3 position = clamp(positions[ID] + clamp(delta_pi, - MAX_DELTA_PI, MAX_DELTA_PI),
+                            -bounds.halfDimensions + DIFF,
+                            bounds.halfDimensions - DIFF);
+#ifdef SDF_OBSTACLES
+    position = project_out_of_sdf(sdf, position);
+#endif
+    positions[ID] = position;
+}
+
+/**
+ * Gauss-Seidel variant of calc_delta_pi_and_update: calculates the (clamped) position correction
+ * for the particles in bins of the given colour only. The corrections are written to a separate
+ * buffer, so that particles sharing a bin don't read each other's half-updated positions, and are
+ * applied by apply_delta_pi_coloured.
+ */
+__kernel void calc_delta_pi_coloured(const Fluid            fluid,          // 0
+                                     __global const float3  *positions,     // 1
+                                     __global const uint    *binIDs,        // 2
+                                     __global const uint    *binStartIDs,   // 3
+                                     __global const uint    *binCounts,     // 4
+                                     __global const float   *lambdas,       // 5
+                                     __global float3        *deltas,        // 6
+                                     const uint             colourCount,    // 7
+                                     const uint             colour,         // 8
+                                     __global const float4  *boundaryParticles,     // 9
+                                     __global const uint    *boundaryBinStartIDs,   // 10
+                                     __global const uint    *boundaryBinCounts,     // 11
+                                     __global const uint    *activeIDs,             // 12
+                                     const uint             numItems) {             // 13
+    if (get_global_id(0) >= NUM_ITEMS(numItems)) {
+        return;
+    }
+
+    if (getBinColour(getBinID_3D(binIDs[ID]), colourCount) != colour) {
+        return;
+    }
+
+    const float3 delta_pi = calc_delta_pi(fluid, positions, binIDs, binStartIDs, binCounts, lambdas,
+                                          boundaryParticles, boundaryBinStartIDs, boundaryBinCounts, activeIDs);
+    deltas[ID] = clamp(delta_pi, - MAX_DELTA_PI, MAX_DELTA_PI);
+}
+
+/**
+ * Applies the position corrections computed by calc_delta_pi_coloured to the particles of the
+ * given colour and clips them to the bounds and obstacles, so that the following colours see the result.
+ */
+__kernel void apply_delta_pi_coloured(const Bounds           bounds,        // 0
+                                      __global const uint    *binIDs,       // 1
+                                      __global const float3  *deltas,       // 2
+                                      __global float3        *positions,    // 3
+                                      const uint             colourCount,   // 4
+                                      const uint             colour,        // 5
+                                      __global const float   *sdf,          // 6
+                                      __global const uint    *activeIDs,    // 7
+                                      const uint             numItems) {    // 8
+    if (get_global_id(0) >= NUM_ITEMS(numItems)) {
+        return;
+    }
+
+    if (getBinColour(getBinID_3D(binIDs[ID]), colourCount) != colour) {
+        return;
+    }
+
+    float3 position = clamp(positions[ID] + deltas[ID],
+                            -bounds.halfDimensions + DIFF,
+                            bounds.halfDimensions - DIFF);
+#ifdef SDF_OBSTACLES
+    position = project_out_of_sdf(sdf, position);
+#endif
+    positions[ID] = position;
+}
+
+/**
+ * The first of the two neighbour passes after solving: calculates the curl of a particle and applies XSPH
+ * viscosity smoothing, writing the smoothed velocity to velocitiesOut. With velocitiesFromPositions set
+ * (PBF), the velocities of the particle and its neighbours are computed inline as (x*_i - x_i) / dt from
+ * the predicted and previous positions, instead of being read from velocities.
+ */
+__kernel void calc_curls_and_viscXSPH(const Fluid            fluid,                  // 0
+                                      __global const uint    *binIDs,                // 1
+                                      __global const uint    *binStartIDs,           // 2
+                                      __global const uint    *binCounts,             // 3
+                                      __global const float3  *positions,             // 4
+                                      __global const STORAGE_FLOAT  *densities,      // 5
+                                      __global const STORAGE_FLOAT3 *velocities,     // 6
+                                      __global const float3  *previousPositions,     // 7
+                                      const uint             velocitiesFromPositions,    // 8
+                                      __global STORAGE_FLOAT3 *curls,                // 9
+                                      __global STORAGE_FLOAT3 *velocitiesOut,        // 10
+                                      __global const uint    *activeIDs,             // 11
+                                      const uint             numItems) {             // 12
+    if (get_global_id(0) >= NUM_ITEMS(numItems)) {
+        return;
+    }
+
+    const float oneOverDt = 1.0f / FLUID(deltaTime);
+#define VELOCITY(i) (velocitiesFromPositions ? oneOverDt * (positions[i] - previousPositions[i]) \
+                                             : LOAD_FLOAT3(velocities, i))
 
     const float3 position = positions[ID];
-    const float density = densities[ID];
-    const float lambda = lambdas[ID];
+    const float3 velocity = VELOCITY(ID);
 
     const uint binID = binIDs[ID];
     const int3 binID3D = convert_int3(getBinID_3D(binID));
 
 
     /// Gather all neighbours
+    uint neighbouringBinIDs[MAX_NEIGHBOURING_BINS];
+    const uint neighbouringBinCount = gather_neighbouring_bins(fluid, position, binID3D, neighbouringBinIDs);
 
-    uint neighbouringBinIDs[3 * 3 * 3];
-    uint neighbouringBinCount = 0;
-
-    uint nBinID;
     uint nBinStartID;
     uint nBinCount;
 
-    float3 delta_pi = ZERO3F;
 
-    int x, y, z;
-    for (int dx = -1; dx < 2; ++dx) {
-        x = binID3D.x + dx;
-        if (x+1 == clamp(x+1, 1, binCountX)) {
-            for (int dy = -1; dy < 2; ++dy) {
-                y = binID3D.y + dy;
-                if (y+1 == clamp(y+1, 1, binCountY)) {
-                    for (int dz = -1; dz < 2; ++dz) {
-                        z = binID3D.z + dz;
-                        if  (z+1 == clamp(z+1, 1, binCountZ)) {
-                            nBinID = x + binCountX * y + binCountX * binCountY * z;
-                            neighbouringBinIDs[neighbouringBinCount] = nBinID;
-                            ++neighbouringBinCount;
-                        }
-                    }
-                }
-            }
-        }
-    }
+    /// for each neighbour:
+    /// 1. calculate curl contribution
+    /// 2. accumulate XSPH viscosity smoothing
 
+    float3 curl = ZERO3F;
+    float3 sumWeightedNeighbourVelocities = ZERO3F;
 
-    /// for each neighbour: smooth out lambda values and calculate tensile instability term
-
-    float3 k_position = ZERO3F;
-    float s_corr = 0.0f;
     for (uint i = 0; i < neighbouringBinCount; ++i) {
         uint nBinID = neighbouringBinIDs[i];
 
@@ -347,83 +474,59 @@ __kernel void calc_delta_pi_and_update(const Fluid            fluid,          //
         nBinCount = binCounts[nBinID];
 
         for (uint pID = nBinStartID; pID < (nBinStartID + nBinCount); ++pID) {
-            k_position = positions[pID];
-            s_corr = - fluid.k * pow(Wpoly6(position - k_position, fluid.kernelRadius) /
-                    Wpoly6(float3(ONE_OVER_SQRT_OF_3 * fluid.delta_q,
-                                  ONE_OVER_SQRT_OF_3 * fluid.delta_q,
-                                  ONE_OVER_SQRT_OF_3 * fluid.delta_q),
-                           fluid.kernelRadius), fluid.n);
-            delta_pi = delta_pi + (lambda + lambdas[pID] + s_corr) * grad_Wspiky(position - k_position, fluid.kernelRadius);
+            const float3 r = position - positions[pID];
+            const float3 u = VELOCITY(pID) - velocity;
+
+            // for vorticity
+            curl += cross_(u, grad_Wspiky(r, FLUID(kernelRadius)));
+
+            // for viscosity
+            sumWeightedNeighbourVelocities -= (1 / max(LOAD_FLOAT(densities, pID), 100.0f)) * u * Wpoly6(r, FLUID(kernelRadius));
         }
     }
+#undef VELOCITY
 
-    delta_pi = delta_pi / fluid.restDensity;
-
-    // clamp the position correction to be within reasonable limits
-    positions[ID] = position + clamp(delta_pi, - MAX_DELTA_PI, MAX_DELTA_PI);
+    STORE_FLOAT3(curls, ID, curl);
+    STORE_FLOAT3(velocitiesOut, ID, velocity + FLUID(c) * sumWeightedNeighbourVelocities);
 }
 
 /**
- * Calculates the velocity of a particle as (x_i+1 - x_i) / dt
+ * The second neighbour pass after solving: applies vorticity confinement to the smoothed velocities of
+ * calc_curls_and_viscXSPH, in place since only the particle's own velocity is read.
  */
-__kernel void recalc_velocities(__global const float3 *previousPositions,
-                                __global const float3 *currentPositions,
-                                __global float3       *velocities,
-                                const float           oneOverDt) {
-    velocities[ID] = oneOverDt * (currentPositions[ID] - previousPositions[ID]);
-}
+__kernel void apply_vorticity(const Fluid            fluid,             // 0
+                              __global const uint    *binIDs,           // 1
+                              __global const uint    *binStartIDs,      // 2
+                              __global const uint    *binCounts,        // 3
+                              __global const float3  *positions,        // 4
+                              __global const STORAGE_FLOAT  *densities,     // 5
+                              __global const STORAGE_FLOAT3 *curls,         // 6
+                              __global STORAGE_FLOAT3       *velocities,    // 7
+                              __global const uint           *activeIDs,     // 8
+                              const uint                    numItems) {     // 9
+    if (get_global_id(0) >= NUM_ITEMS(numItems)) {
+        return;
+    }
 
-/**
- * Calculates the curl of a particle.
- */
-__kernel void calc_curls(const Fluid            fluid,          // 0
-                         __global const uint    *binIDs,        // 1
-                         __global const uint    *binStartIDs,   // 2
-                         __global const uint    *binCounts,     // 3
-                         __global const float3  *positions,     // 4
-                         __global const float3  *velocities,    // 5
-                         __global float3        *curls) {       // 6
-    const float3 position = positions[ID];
-    const float3 velocity = velocities[ID];
+    const float3 position   = positions[ID];
+    const float3 curl       = LOAD_FLOAT3(curls, ID);
 
     const uint binID = binIDs[ID];
     const int3 binID3D = convert_int3(getBinID_3D(binID));
 
 
     /// Gather all neighbours
-    uint neighbouringBinIDs[3 * 3 * 3];
-    uint neighbouringBinCount = 0;
 
-    uint nBinID;
+    uint neighbouringBinIDs[MAX_NEIGHBOURING_BINS];
+    const uint neighbouringBinCount = gather_neighbouring_bins(fluid, position, binID3D, neighbouringBinIDs);
+
     uint nBinStartID;
     uint nBinCount;
 
-    int x, y, z;
-    for (int dx = -1; dx < 2; ++dx) {
-        x = binID3D.x + dx;
-        if (x+1 == clamp(x+1, 1, binCountX)) {
-            for (int dy = -1; dy < 2; ++dy) {
-                y = binID3D.y + dy;
-                if (y+1 == clamp(y+1, 1, binCountY)) {
-                    for (int dz = -1; dz < 2; ++dz) {
-                        z = binID3D.z + dz;
-                        if  (z+1 == clamp(z+1, 1, binCountZ)) {
-                            nBinID = x + binCountX * y + binCountX * binCountY * z;
-                            neighbouringBinIDs[neighbouringBinCount] = nBinID;
-                            ++neighbouringBinCount;
-                        }
-                    }
-                }
-            }
-        }
-    }
-
 
-    /// for each neighbour: calculate curl contribution
+    /// for each neighbour: accumulate the gradient of the curl magnitudes
 
-    float3 curl = ZERO3F;
-    float3 u = ZERO3F;
-    float3 v = ZERO3F;
+    float3 n = ZERO3F; //ŋ
 
     for (uint i = 0; i < neighbouringBinCount; ++i) {
         uint nBinID = neighbouringBinIDs[i];
@@ -432,46 +535,55 @@ __kernel void calc_curls(const Fluid            fluid,          // 0
         nBinCount = binCounts[nBinID];
 
         for (uint pID = nBinStartID; pID < (nBinStartID + nBinCount); ++pID) {
-            u = velocities[pID] - velocity;
-            v = grad_Wspiky(position - positions[pID], fluid.kernelRadius);
-            curl += cross_(u, v);
+            const float oneOverDensity = 1 / max(LOAD_FLOAT(densities, pID), 100.0f);
+            n += oneOverDensity * euclidean_distance(LOAD_FLOAT3(curls, pID)) * grad_Wspiky(position - positions[pID], FLUID(kernelRadius));
         }
     }
 
-    curls[ID] = curl;
-}
-
-/**
- * Applies vorticity confinement and viscosity smoothing to a particle.
- */
-__kernel void apply_vort_and_viscXSPH(const Fluid            fluid,             // 0
-                                      __global const uint    *binIDs,           // 1
-                                      __global const uint    *binStartIDs,      // 2
-                                      __global const uint    *binCounts,        // 3
-                                      __global const float3  *positions,        // 4
-                                      __global const float   *densities,        // 5
-                                      __global const float3  *curls,            // 6
-                                      __global const float3  *velocitiesIn,     // 7
-                                      __global float3        *velocitiesOut) {  // 8
-
-    const float3 position   = positions[ID];
-    const float3 velocity   = velocitiesIn[ID];
-    const float density     = densities[ID];
-    const float3 curl       = curls[ID];
+    float3 n_hat = ZERO3F;
+    if (euclidean_distance2(n) > EPSILON) {
+        n_hat = n / length(n);
+    }
 
-    const uint binID = binIDs[ID];
-    const int3 binID3D = convert_int3(getBinID_3D(binID));
+    float4 f_vc = FLUID(k_vc) * cross(float4(n_hat.x, n_hat.y, n_hat.z, 0.0f),
+                                            float4(curl.x,  curl.y,  curl.z, 0.0f));
 
+    STORE_FLOAT3(velocities, ID, LOAD_FLOAT3(velocities, ID)
+                                 + FLUID(k_vc) * FLUID(deltaTime) * float3(f_vc.x, f_vc.y, f_vc.z));
+}
 
-    /// Gather all neighbours
+inline uint getBinColour(const uint3 id3, const uint colourCount) {
+    switch (colourCount) {
+        case 8:
+            return (id3.x & 1) + 2 * (id3.y & 1) + 4 * (id3.z & 1);
+        case 27:
+            return (id3.x % 3) + 3 * (id3.y % 3) + 9 * (id3.z % 3);
+        default:
+            return 0;
+    }
+}
 
-    uint neighbouringBinIDs[3 * 3 * 3];
+inline uint gather_neighbouring_bins(const Fluid fluid, const float3 position, const int3 binID3D, uint *neighbouringBinIDs) {
     uint neighbouringBinCount = 0;
 
-    uint nBinID;
-    uint nBinStartID;
-    uint nBinCount;
-
+#ifdef LOOSE_GRID_SKIN
+    const float range = FLUID(kernelRadius) + LOOSE_GRID_SKIN;
+    const float3 gridMin = -float3(halfDimsX, halfDimsY, halfDimsZ);
+
+    for (int z = max(binID3D.z - 2, 0); z < min(binID3D.z + 3, binCountZ); ++z) {
+        for (int y = max(binID3D.y - 2, 0); y < min(binID3D.y + 3, binCountY); ++y) {
+            for (int x = max(binID3D.x - 2, 0); x < min(binID3D.x + 3, binCountX); ++x) {
+                // distance from the position to the bin's box
+                const float3 binMin = gridMin + binSize * convert_float3((int3)(x, y, z));
+                const float3 d = fmax(fmax(binMin - position, position - (binMin + binSize)), ZERO3F);
+                if (dot(d, d) < range * range) {
+                    neighbouringBinIDs[neighbouringBinCount] = x + binCountX * y + binCountX * binCountY * z;
+                    ++neighbouringBinCount;
+                }
+            }
+        }
+    }
+#else
     int x, y, z;
     for (int dx = -1; dx < 2; ++dx) {
         x = binID3D.x + dx;
@@ -482,8 +594,7 @@ __kernel void apply_vort_and_viscXSPH(const Fluid            fluid,
                     for (int dz = -1; dz < 2; ++dz) {
                         z = binID3D.z + dz;
                         if  (z+1 == clamp(z+1, 1, binCountZ)) {
-                            nBinID = x + binCountX * y + binCountX * binCountY * z;
-                            neighbouringBinIDs[neighbouringBinCount] = nBinID;
+                            neighbouringBinIDs[neighbouringBinCount] = x + binCountX * y + binCountX * binCountY * z;
                             ++neighbouringBinCount;
                         }
                     }
@@ -491,106 +602,73 @@ __kernel void apply_vort_and_viscXSPH(const Fluid            fluid,
             }
         }
     }
+#endif
 
+    return neighbouringBinCount;
+}
 
-    /// for each particle:
-    /// 1. Apply Vorticity confinement contribution
-    /// 2. Apply XSPH viscosity smoothing
-
-    float3 n = ZERO3F; //ŋ
-    float3 sumWeightedNeighbourVelocities = ZERO3F;
-
-    for (uint i = 0; i < neighbouringBinCount; ++i) {
-        uint nBinID = neighbouringBinIDs[i];
-
-        nBinStartID = binStartIDs[nBinID];
-        nBinCount = binCounts[nBinID];
+inline float3 calc_delta_pi(const Fluid            fluid,
+                            __global const float3  *positions,
+                            __global const uint    *binIDs,
+                            __global const uint    *binStartIDs,
+                            __global const uint    *binCounts,
+                            __global const float   *lambdas,
+                            __global const float4  *boundaryParticles,
+                            __global const uint    *boundaryBinStartIDs,
+                            __global const uint    *boundaryBinCounts,
+                            __global const uint    *activeIDs) {
 
-        for (uint pID = nBinStartID; pID < (nBinStartID + nBinCount); ++pID) {
-            // for vorticity
-            n += (1 / (max(densities[pID], 100.0f))) * euclidean_distance(curls[pID]) * grad_Wspiky(position - positions[pID], fluid.kernelRadius);
-
-            // for viscosity
-            sumWeightedNeighbourVelocities += (1 / max(densities[pID], 100.0f)) *
-                (velocity - velocitiesIn[pID]) * Wpoly6(position - positions[pID], fluid.kernelRadius);
-        }
-    }
+    const float3 position = positions[ID];
+    const float lambda = lambdas[ID];
 
-    float3 n_hat = ZERO3F;
-    if (euclidean_distance2(n) > EPSILON) {
-        n_hat = n / length(n);
-    }
+    const uint binID = binIDs[ID];
+    const int3 binID3D = convert_int3(getBinID_3D(binID));
 
-    float4 f_vc = fluid.k_vc * cross(float4(n_hat.x, n_hat.y, n_hat.z, 0.0f),
-                                            float4(curl.x,  curl.y,  curl.z, 0.0f));
 
-    velocitiesOut[ID] = velocity
-                        + fluid.c * sumWeightedNeighbourVelocities
-                        + fluid.k_vc * fluid.deltaTime * float3(f_vc.x, f_vc.y, f_vc.z);
-}
+    /// Gather all neighbours
 
-/**
- * Overwrites the actual particle position with a PBF-corrected (predicted) position.
- */
-__kernel void set_positions_from_predictions(__global const float3 *predictedPositions,
-                                             __global float3       *positions) {
-    positions[ID] = predictedPositions[ID];
-}
+    uint neighbouringBinIDs[MAX_NEIGHBOURING_BINS];
+    const uint neighbouringBinCount = gather_neighbouring_bins(fluid, position, binID3D, neighbouringBinIDs);
 
-/// from http://stackoverflow.com/questions/14845084/how-do-i-convert-a-1d-index-into-a-3d-index?noredirect=1&lq=1
-inline uint3 getBinID_3D(uint binID) {
-    uint3 binID3D;
-    binID3D.z = binID / (binCountX * binCountY);
-    binID3D.y = (binID - binID3D.z * binCountX * binCountY) / binCountX;
-    binID3D.x = binID - binCountX * (binID3D.y + binCountY * binID3D.z);
-    return binID3D;
-}
+    uint nBinStartID;
+    uint nBinCount;
 
-inline uint getBinID(const uint3 id3) {
-    const uint binID = id3.x + binCountX * id3.y + binCountX * binCountY * id3.z;
-    return binID;
-}
+    float3 delta_pi = ZERO3F;
 
-inline float euclidean_distance2(const float3 r) {
-    return r.x * r.x + r.y * r.y + r.z * r.z;
-}
 
-inline float euclidean_distance(const float3 r) {
-    return sqroot(r.x * r.x + r.y * r.y + r.z * r.z);
-}
+    /// for each neighbour: smooth out lambda values and calculate tensile instability term
 
-inline float Wpoly6(const float3 r, const float h) {
-    const float tmp = h * h - euclidean_distance2(r);
-    if (tmp < EPSILON) {
-        return 0.0f;
-    }
+    float3 k_position = ZERO3F;
+    float s_corr = 0.0f;
+    const float oneOverWdq = ONE_OVER_WPOLY6_DELTA_Q;
+    for (uint i = 0; i < neighbouringBinCount; ++i) {
+        uint nBinID = neighbouringBinIDs[i];
 
-    return (315.0f / (64.0f * PI * pow(h, 9))) * pow((tmp), 3);
-}
+        nBinStartID = binStartIDs[nBinID];
+        nBinCount = binCounts[nBinID];
 
-inline float3 grad_Wspiky(const float3 r, const float h) {
-    const float radius2 = euclidean_distance2(r);
-    if (radius2 >= h * h) {
-        return ZERO3F;
-    }
-    if (radius2 <= EPSILON) {
-        return ZERO3F;
+        for (uint pID = nBinStartID; pID < (nBinStartID + nBinCount); ++pID) {
+            k_position = positions[pID];
+            s_corr = - FLUID(k) * ipow(Wpoly6(position - k_position, FLUID(kernelRadius)) * oneOverWdq, FLUID(n));
+            delta_pi = delta_pi + (lambda + lambdas[pID] + s_corr) * grad_Wspiky(position - k_position, FLUID(kernelRadius));
+        }
     }
 
-    const float radius = sqroot(radius2);
-    const float kernel_constant = - (15 / (PI * pow(h, 6))) * 3 * pow(h - radius, 2) / radius;
+#ifdef BOUNDARY_PARTICLES
+    // boundary particles have a mass of restDensity * volume and mirror the particle's own lambda
+    delta_pi = delta_pi + FLUID(restDensity) * lambda *
+                          boundary_gradient_sum(fluid, position, binID3D, boundaryParticles, boundaryBinStartIDs, boundaryBinCounts);
+#endif
 
-    return (float3)(kernel_constant * r.x,
-                    kernel_constant * r.y,
-                    kernel_constant * r.z);
+    return delta_pi * ONE_OVER_REST_DENSITY;
 }
 
-inline float sqroot(float x__) {
-#ifdef USE_FAST_SQRT
-    return half_sqrt(x__);
-#else
-    return sqrt(x__);
-#endif
+inline float ipow(float x__, uint n__) {
+    float result = 1.0f;
+    for (uint i = 0; i < n__; ++i) {
+        result = result * x__;
+    }
+    return result;
 }
 
 inline float3 cross_(float3 u_, float3 v_) {
@@ -610,5 +688,5 @@ inline float calc_bound_density_contribution(float dx_, float kernelRadius_) {
         return (2 * PI / 3);
     }
 
-    return (2 * PI / 3) * pow(kernelRadius_ - dx_, 2) * (kernelRadius_ + dx_);
-}
\ No newline at end of file
+    return (2 * PI / 3) * (kernelRadius_ - dx_) * (kernelRadius_ - dx_) * (kernelRadius_ + dx_);
+}
@@ -0,0 +1,97 @@
+/// Fills the volumes of a generated fluid setup with particles on the device, so that large setups don't
+/// have to be read from files and uploaded.
+
+#include "common/Definitions.cl"
+
+#define FLUID_VOLUME_BOX 0
+#define FLUID_VOLUME_SPHERE 1
+#define FLUID_VOLUME_CYLINDER 2
+
+typedef struct def_FluidVolume {
+    float3 position;
+    float3 halfDimensions;
+    uint type;
+} FluidVolume;
+
+/**
+ * Returns true if the position lies inside the volume.
+ */
+bool inside_fluid_volume(const FluidVolume volume, const float3 position);
+
+/**
+ * Hashes an integer to a float in [0, 1) (Wang hash), for jitter that needs no state.
+ */
+float hash_to_unit(uint x);
+
+/**
+ * Visits one node of a lattice with the given spacing, which spans the bounding box of the volumes, and
+ * appends a particle at it if the node lies inside any of the volumes. The particle is displaced from the
+ * node by up to jitter times the spacing along each axis. Particles beyond maxParticles are dropped, but
+ * still counted by particleCounter.
+ * @param latticeOrigin The position of the first node
+ * @param latticeSize The number of nodes along each axis
+ */
+__kernel void fill_fluid_volumes(__global const FluidVolume *volumes,          // 0
+                                 const uint                 numVolumes,        // 1
+                                 const float3               latticeOrigin,     // 2
+                                 const uint3                latticeSize,       // 3
+                                 const float                spacing,           // 4
+                                 const float                jitter,            // 5
+                                 __global float3            *positions,        // 6
+                                 __global uint              *particleIDs,      // 7
+                                 __global volatile uint     *particleCounter,  // 8
+                                 const uint                 maxParticles,      // 9
+                                 const uint                 numItems) {        // 10
+    if (get_global_id(0) >= numItems) {
+        return;
+    }
+
+    const uint3 node = (uint3)(ID % latticeSize.x,
+                               (ID / latticeSize.x) % latticeSize.y,
+                               ID / (latticeSize.x * latticeSize.y));
+    float3 position = latticeOrigin + spacing * convert_float3(node);
+
+    bool inside = false;
+    for (uint i = 0; i < numVolumes && !inside; ++i) {
+        inside = inside_fluid_volume(volumes[i], position);
+    }
+    if (!inside) {
+        return;
+    }
+
+    const uint slot = atomic_inc(particleCounter);
+    if (slot >= maxParticles) {
+        return;
+    }
+
+    if (jitter > 0.0f) {
+        const float3 u = (float3)(hash_to_unit(3 * ID), hash_to_unit(3 * ID + 1), hash_to_unit(3 * ID + 2));
+        position += (jitter * spacing) * (2.0f * u - 1.0f);
+    }
+
+    positions[slot] = position;
+    particleIDs[slot] = slot;
+}
+
+inline bool inside_fluid_volume(const FluidVolume volume, const float3 position) {
+    const float3 r = position - volume.position;
+    switch (volume.type) {
+        case FLUID_VOLUME_BOX:
+            return all(fabs(r) <= volume.halfDimensions);
+        case FLUID_VOLUME_SPHERE:
+            return dot(r, r) <= volume.halfDimensions.x * volume.halfDimensions.x;
+        case FLUID_VOLUME_CYLINDER:
+        default:
+            return fabs(r.y) <= volume.halfDimensions.y
+                   && r.x * r.x + r.z * r.z <= volume.halfDimensions.x * volume.halfDimensions.x;
+    }
+}
+
+inline float hash_to_unit(uint x) {
+    x = (x ^ 61u) ^ (x >> 16);
+    x *= 9u;
+    x = x ^ (x >> 4);
+    x *= 0x27d4eb2du;
+    x = x ^ (x >> 15);
+    return convert_float(x >> 8) * (1.0f / 16777216.0f);
+}
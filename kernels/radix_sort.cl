@@ -0,0 +1,133 @@
+/// Least-significant-digit radix sort of (key, value) pairs of unsigned integers, RADIX_BITS bits per pass.
+/// Every work-group sorts a contiguous block of RADIX_GROUP_SIZE * RADIX_KEYS_PER_ITEM keys, and every
+/// work-item a contiguous run of RADIX_KEYS_PER_ITEM keys within it, so that the scatter is stable:
+/// 1. radix_histogram counts the digits of each block in local memory
+/// 2. radix_scan turns the histograms, stored digit-major, into the global offset of each digit and block
+/// 3. radix_scatter moves the pairs of each block to their offsets, in order within each digit
+///
+/// Pre-processor defines that specify the sort parameters
+/// RADIX_BITS              // The number of key bits sorted per pass
+/// RADIX_GROUP_SIZE        // The local work size of all three kernels
+/// RADIX_KEYS_PER_ITEM     // The number of keys of each work-item
+
+#define RADIX (1 << RADIX_BITS)
+#define RADIX_BLOCK_SIZE (RADIX_GROUP_SIZE * RADIX_KEYS_PER_ITEM)
+
+#define LID get_local_id(0)
+#define GROUP_ID get_group_id(0)
+#define NUM_GROUPS get_num_groups(0)
+
+#define DIGIT(key, shift) (((key) >> (shift)) & (RADIX - 1))
+
+/**
+ * Counts the digits of the keys of one block with local atomics, writing the count of digit d of block b
+ * to histograms[d * numBlocks + b].
+ */
+__kernel void radix_histogram(__global const uint   *keys,          // 0
+                              const uint            numKeys,        // 1
+                              const uint            shift,          // 2
+                              __global uint         *histograms) {  // 3
+    __local uint histogram[RADIX];
+    for (uint d = LID; d < RADIX; d += RADIX_GROUP_SIZE) {
+        histogram[d] = 0;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    const uint begin = GROUP_ID * RADIX_BLOCK_SIZE + LID * RADIX_KEYS_PER_ITEM;
+    const uint end = min(begin + RADIX_KEYS_PER_ITEM, numKeys);
+    for (uint i = begin; i < end; ++i) {
+        atomic_inc(&histogram[DIGIT(keys[i], shift)]);
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (uint d = LID; d < RADIX; d += RADIX_GROUP_SIZE) {
+        histograms[d * NUM_GROUPS + GROUP_ID] = histogram[d];
+    }
+}
+
+/**
+ * Replaces the histograms by their exclusive prefix sum. Run as a single work-group, in which every
+ * work-item scans a contiguous chunk after the chunk totals were scanned in local memory.
+ */
+__kernel void radix_scan(__global uint  *histograms,    // 0
+                         const uint     size) {         // 1
+    __local uint chunkOffsets[RADIX_GROUP_SIZE];
+
+    const uint chunkSize = (size + RADIX_GROUP_SIZE - 1) / RADIX_GROUP_SIZE;
+    const uint begin = min(LID * chunkSize, size);
+    const uint end = min(begin + chunkSize, size);
+
+    uint sum = 0;
+    for (uint i = begin; i < end; ++i) {
+        sum += histograms[i];
+    }
+    chunkOffsets[LID] = sum;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if (LID == 0) {
+        uint offset = 0;
+        for (uint i = 0; i < RADIX_GROUP_SIZE; ++i) {
+            const uint count = chunkOffsets[i];
+            chunkOffsets[i] = offset;
+            offset += count;
+        }
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    uint offset = chunkOffsets[LID];
+    for (uint i = begin; i < end; ++i) {
+        const uint count = histograms[i];
+        histograms[i] = offset;
+        offset += count;
+    }
+}
+
+/**
+ * Moves the pairs of one block to their sorted positions for the current digit. The offset of each
+ * work-item within its block's digit ranges is the exclusive scan of the work-items' digit counts, which
+ * the first RADIX work-items compute in local memory, one digit each.
+ */
+__kernel void radix_scatter(__global const uint *keysIn,            // 0
+                            __global const uint *valuesIn,          // 1
+                            __global uint       *keysOut,           // 2
+                            __global uint       *valuesOut,         // 3
+                            const uint          numKeys,            // 4
+                            const uint          shift,              // 5
+                            __global const uint *scannedHistograms) {   // 6
+    __local uint itemOffsets[RADIX * RADIX_GROUP_SIZE];
+
+    const uint begin = GROUP_ID * RADIX_BLOCK_SIZE + LID * RADIX_KEYS_PER_ITEM;
+    const uint end = min(begin + RADIX_KEYS_PER_ITEM, numKeys);
+
+    uint offsets[RADIX];
+    for (uint d = 0; d < RADIX; ++d) {
+        offsets[d] = 0;
+    }
+    for (uint i = begin; i < end; ++i) {
+        ++offsets[DIGIT(keysIn[i], shift)];
+    }
+    for (uint d = 0; d < RADIX; ++d) {
+        itemOffsets[d * RADIX_GROUP_SIZE + LID] = offsets[d];
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (uint d = LID; d < RADIX; d += RADIX_GROUP_SIZE) {
+        uint offset = scannedHistograms[d * NUM_GROUPS + GROUP_ID];
+        for (uint item = 0; item < RADIX_GROUP_SIZE; ++item) {
+            const uint count = itemOffsets[d * RADIX_GROUP_SIZE + item];
+            itemOffsets[d * RADIX_GROUP_SIZE + item] = offset;
+            offset += count;
+        }
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (uint d = 0; d < RADIX; ++d) {
+        offsets[d] = itemOffsets[d * RADIX_GROUP_SIZE + LID];
+    }
+    for (uint i = begin; i < end; ++i) {
+        const uint key = keysIn[i];
+        const uint target = offsets[DIGIT(key, shift)]++;
+        keysOut[target] = key;
+        valuesOut[target] = valuesIn[i];
+    }
+}
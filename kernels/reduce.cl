@@ -0,0 +1,153 @@
+/// Parallel reductions (sum, min, max) over buffers of float, float3 and uint, see util::DeviceReduction.
+/// A reduction takes two passes of the same kernel:
+/// 1. Every work-item folds a strided sequence of elements in registers, so that the loads of all work-items
+///    are coalesced and the array is streamed through once, and every work-group combines its work-items in a
+///    local-memory tree into one partial result
+/// 2. A single work-group reduces the partial results of the first pass
+///
+/// Pre-processor defines that specify the reduction parameters
+/// REDUCE_GROUP_SIZE       // The local work size of all kernels, a power of two
+///
+/// Optional storage define, see common/Storage.cl
+/// HALF_STORAGE
+
+#include "common/Definitions.cl"
+#include "common/Storage.cl"
+
+#define LID get_local_id(0)
+
+/// The operations, matching util::DeviceReduction::Op
+#define REDUCE_SUM 0
+#define REDUCE_MIN 1
+#define REDUCE_MAX 2
+
+/// Applies an operation to a pair of floats, float3s or uints
+#define REDUCE_APPLY(op, a, b) ((op) == REDUCE_SUM ? (a) + (b) : (op) == REDUCE_MIN ? min((a), (b)) : max((a), (b)))
+
+/**
+ * The value that leaves any element unchanged under the operation, for floats.
+ */
+inline float reduce_identity_float(const uint op) {
+    return op == REDUCE_SUM ? 0.0f : op == REDUCE_MIN ? INFINITY : -INFINITY;
+}
+
+/**
+ * The value that leaves any element unchanged under the operation, for uints.
+ */
+inline uint reduce_identity_uint(const uint op) {
+    return op == REDUCE_SUM ? 0 : op == REDUCE_MIN ? UINT_MAX : 0;
+}
+
+/**
+ * Combines the values of all work-items of a work-group in a tree. The result is valid in work-item 0.
+ */
+inline float reduce_group_float(__local float *scratch, const float value, const uint op) {
+    scratch[LID] = value;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    for (uint stride = REDUCE_GROUP_SIZE / 2; stride > 0; stride >>= 1) {
+        if (LID < stride) {
+            scratch[LID] = REDUCE_APPLY(op, scratch[LID], scratch[LID + stride]);
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+    return scratch[0];
+}
+
+/**
+ * Reduces count floats to one per work-group, written to output[get_group_id(0)].
+ */
+__kernel void reduce_float(__global const float *input,     // 0
+                           const uint           count,      // 1
+                           const uint           op,         // 2
+                           __global float       *output) {  // 3
+    __local float scratch[REDUCE_GROUP_SIZE];
+
+    float value = reduce_identity_float(op);
+    for (uint i = get_global_id(0); i < count; i += get_global_size(0)) {
+        value = REDUCE_APPLY(op, value, input[i]);
+    }
+
+    value = reduce_group_float(scratch, value, op);
+    if (LID == 0) {
+        output[get_group_id(0)] = value;
+    }
+}
+
+/**
+ * Reduces count float3s component-wise to one per work-group, written to output[get_group_id(0)].
+ */
+__kernel void reduce_float3(__global const float3   *input,     // 0
+                            const uint              count,      // 1
+                            const uint              op,         // 2
+                            __global float3         *output) {  // 3
+    __local float3 scratch[REDUCE_GROUP_SIZE];
+
+    const float identity = reduce_identity_float(op);
+    float3 value = float3(identity, identity, identity);
+    for (uint i = get_global_id(0); i < count; i += get_global_size(0)) {
+        value = REDUCE_APPLY(op, value, input[i]);
+    }
+
+    scratch[LID] = value;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    for (uint stride = REDUCE_GROUP_SIZE / 2; stride > 0; stride >>= 1) {
+        if (LID < stride) {
+            scratch[LID] = REDUCE_APPLY(op, scratch[LID], scratch[LID + stride]);
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    if (LID == 0) {
+        output[get_group_id(0)] = scratch[0];
+    }
+}
+
+/**
+ * Reduces count uints to one per work-group, written to output[get_group_id(0)]. Sums wrap around at 2^32.
+ */
+__kernel void reduce_uint(__global const uint   *input,     // 0
+                          const uint            count,      // 1
+                          const uint            op,         // 2
+                          __global uint         *output) {  // 3
+    __local uint scratch[REDUCE_GROUP_SIZE];
+
+    uint value = reduce_identity_uint(op);
+    for (uint i = get_global_id(0); i < count; i += get_global_size(0)) {
+        value = REDUCE_APPLY(op, value, input[i]);
+    }
+
+    scratch[LID] = value;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    for (uint stride = REDUCE_GROUP_SIZE / 2; stride > 0; stride >>= 1) {
+        if (LID < stride) {
+            scratch[LID] = REDUCE_APPLY(op, scratch[LID], scratch[LID + stride]);
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    if (LID == 0) {
+        output[get_group_id(0)] = scratch[0];
+    }
+}
+
+/**
+ * The first pass of summing the density errors max(ρ/ρ0 - 1, 0) of count particles, each scaled by scale,
+ * to one partial sum per work-group. reduce_float sums the partial sums in the second pass.
+ */
+__kernel void sum_density_errors(__global const STORAGE_FLOAT   *densities,             // 0
+                                 const uint                     count,                  // 1
+                                 const float                    oneOverRestDensity,     // 2
+                                 const float                    scale,                  // 3
+                                 __global float                 *output) {              // 4
+    __local float scratch[REDUCE_GROUP_SIZE];
+
+    float value = 0.0f;
+    for (uint i = get_global_id(0); i < count; i += get_global_size(0)) {
+        value += max(LOAD_FLOAT(densities, i) * oneOverRestDensity - 1.0f, 0.0f);
+    }
+
+    value = reduce_group_float(scratch, scale * value, REDUCE_SUM);
+    if (LID == 0) {
+        output[get_group_id(0)] = value;
+    }
+}
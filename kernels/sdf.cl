@@ -0,0 +1,154 @@
+/// Signed distance field (SDF) of the static obstacles inside the bounds and the boundary volume field
+/// derived from it. Both are sampled at the nodes of a lattice that spans the grid with SDF_CELLS_PER_BIN
+/// cells per bin, and are built once per obstacle rather than every frame.
+///
+/// Pre-processor defines that specify grid parameters, see common/Grid.cl
+/// halfDims[Z,Y,Z], binSize, binCount[Z,Y,Z], binCount
+///
+/// Pre-processor defines that specify the SDF lattice, see common/SDF.cl
+/// SDF_CELLS_PER_BIN
+
+#include "common/Definitions.cl"
+#include "common/Fluid.cl"
+#include "common/SDF.cl"
+#include "common/Kernels.cl"
+
+/// Not axis-aligned, so that rays don't pass exactly through the edges and vertices of box-like meshes
+#define PARITY_RAY_DIRECTION normalize(float3(1.0f, 0.0137f, 0.0291f))
+
+/// The number of samples per kernel radius when integrating the boundary volumes
+#define BOUNDARY_SAMPLES_PER_RADIUS 4
+
+/**
+ * Computes the world-space position of an SDF node from its 1D-index.
+ */
+float3 getNodePosition(uint nodeID);
+
+/**
+ * Computes the distance from a point to a triangle (see Ericson, Real-Time Collision Detection, 5.1.5).
+ */
+float point_triangle_distance(const float3 p, const float3 a, const float3 b, const float3 c);
+
+/**
+ * Returns true if the ray from the origin along the direction hits the triangle (Möller-Trumbore).
+ */
+bool ray_hits_triangle(const float3 origin, const float3 direction, const float3 a, const float3 b, const float3 c);
+
+/**
+ * Computes the signed distance from an SDF node to the closest triangle of a closed mesh, negative inside.
+ * Inside/outside is decided by the parity of the number of triangles hit by a ray from the node.
+ */
+__kernel void build_sdf(__global const float3 *triangles,      // 0 (three vertices per triangle)
+                        const uint            numTriangles,    // 1
+                        __global float        *sdf) {          // 2
+    const float3 position = getNodePosition(ID);
+
+    float distance = MAXFLOAT;
+    uint numHits = 0;
+
+    for (uint i = 0; i < numTriangles; ++i) {
+        const float3 a = triangles[3 * i];
+        const float3 b = triangles[3 * i + 1];
+        const float3 c = triangles[3 * i + 2];
+
+        distance = min(distance, point_triangle_distance(position, a, b, c));
+        if (ray_hits_triangle(position, PARITY_RAY_DIRECTION, a, b, c)) {
+            ++numHits;
+        }
+    }
+
+    sdf[ID] = (numHits % 2 == 1) ? -distance : distance;
+}
+
+/**
+ * Integrates the poly6 kernel over the obstacles around an SDF node, i.e. the fraction of a particle's
+ * rest density that the boundary supplies there. Samples are weighted by a smoothed occupancy of the
+ * obstacle so that the field varies continuously with the distance to the surface.
+ */
+__kernel void compute_boundary_volumes(__global const float *sdf,               // 0
+                                       __global float       *boundaryVolumes,   // 1
+                                       const float          kernelRadius) {     // 2
+    const float3 position = getNodePosition(ID);
+    const float spacing = kernelRadius / BOUNDARY_SAMPLES_PER_RADIUS;
+    const float sampleVolume = spacing * spacing * spacing;
+
+    float volume = 0.0f;
+    for (int dx = -BOUNDARY_SAMPLES_PER_RADIUS; dx <= BOUNDARY_SAMPLES_PER_RADIUS; ++dx) {
+        for (int dy = -BOUNDARY_SAMPLES_PER_RADIUS; dy <= BOUNDARY_SAMPLES_PER_RADIUS; ++dy) {
+            for (int dz = -BOUNDARY_SAMPLES_PER_RADIUS; dz <= BOUNDARY_SAMPLES_PER_RADIUS; ++dz) {
+                const float3 offset = spacing * convert_float3((int3)(dx, dy, dz));
+                const float weight = Wpoly6(offset, kernelRadius);
+                if (weight == 0.0f) continue;
+
+                const float occupancy = clamp(0.5f - sample_sdf_field(sdf, position + offset) / spacing, 0.0f, 1.0f);
+                volume = volume + occupancy * weight * sampleVolume;
+            }
+        }
+    }
+
+    boundaryVolumes[ID] = volume;
+}
+
+inline float3 getNodePosition(uint nodeID) {
+    const uint z = nodeID / (SDF_NODES_X * SDF_NODES_Y);
+    const uint y = (nodeID - z * SDF_NODES_X * SDF_NODES_Y) / SDF_NODES_X;
+    const uint x = nodeID - SDF_NODES_X * (y + SDF_NODES_Y * z);
+    return SDF_CELL_SIZE * convert_float3((uint3)(x, y, z)) - float3(halfDimsX, halfDimsY, halfDimsZ);
+}
+
+inline float point_triangle_distance(const float3 p, const float3 a, const float3 b, const float3 c) {
+    const float3 ab = b - a;
+    const float3 ac = c - a;
+    const float3 ap = p - a;
+
+    const float d1 = dot(ab, ap);
+    const float d2 = dot(ac, ap);
+    if (d1 <= 0.0f && d2 <= 0.0f) return length(ap);
+
+    const float3 bp = p - b;
+    const float d3 = dot(ab, bp);
+    const float d4 = dot(ac, bp);
+    if (d3 >= 0.0f && d4 <= d3) return length(bp);
+
+    const float vc = d1 * d4 - d3 * d2;
+    if (vc <= 0.0f && d1 >= 0.0f && d3 <= 0.0f) {
+        return length(ap - (d1 / (d1 - d3)) * ab);
+    }
+
+    const float3 cp = p - c;
+    const float d5 = dot(ab, cp);
+    const float d6 = dot(ac, cp);
+    if (d6 >= 0.0f && d5 <= d6) return length(cp);
+
+    const float vb = d5 * d2 - d1 * d6;
+    if (vb <= 0.0f && d2 >= 0.0f && d6 <= 0.0f) {
+        return length(ap - (d2 / (d2 - d6)) * ac);
+    }
+
+    const float va = d3 * d6 - d5 * d4;
+    if (va <= 0.0f && (d4 - d3) >= 0.0f && (d5 - d6) >= 0.0f) {
+        return length(bp - ((d4 - d3) / ((d4 - d3) + (d5 - d6))) * (c - b));
+    }
+
+    const float denominator = 1.0f / (va + vb + vc);
+    return length(ap - (vb * denominator) * ab - (vc * denominator) * ac);
+}
+
+inline bool ray_hits_triangle(const float3 origin, const float3 direction, const float3 a, const float3 b, const float3 c) {
+    const float3 ab = b - a;
+    const float3 ac = c - a;
+    const float3 pvec = cross(direction, ac);
+    const float determinant = dot(ab, pvec);
+    if (fabs(determinant) < 1e-12f) return false;
+
+    const float inverseDeterminant = 1.0f / determinant;
+    const float3 tvec = origin - a;
+    const float u = dot(tvec, pvec) * inverseDeterminant;
+    if (u < 0.0f || u > 1.0f) return false;
+
+    const float3 qvec = cross(tvec, ab);
+    const float v = dot(direction, qvec) * inverseDeterminant;
+    if (v < 0.0f || u + v > 1.0f) return false;
+
+    return dot(ac, qvec) * inverseDeterminant > 0.0f;
+}
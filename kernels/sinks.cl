@@ -0,0 +1,41 @@
+/// Ages the particles and marks the ones that should be deleted as dead, by giving them a negative age.
+/// The counting sort then moves dead particles into an extra bin after the grid, which compacts the live
+/// particles to the front of the arrays (see insert_particles in counting_sort.cl).
+
+#include "common/Definitions.cl"
+
+#define DEAD_AGE -1.0f
+
+typedef struct def_Sink {
+    float3 position;
+    float3 halfDimensions;
+} Sink;
+
+/**
+ * Advances the age of a particle and marks it dead if it is older than maxAge, or inside a sink.
+ * @param maxAge The lifetime of a particle in seconds, or 0 for no limit
+ */
+__kernel void age_and_kill_particles(__global const float3  *positions,    // 0
+                                     __global float         *ages,         // 1
+                                     __global const Sink    *sinks,        // 2
+                                     const uint             numSinks,      // 3
+                                     const float            maxAge,        // 4
+                                     const float            dt,            // 5
+                                     const uint             numItems) {    // 6
+    if (get_global_id(0) >= numItems) {
+        return;
+    }
+
+    const float age = ages[ID];
+    if (age < 0.0f) {
+        return;
+    }
+
+    const float3 position = positions[ID];
+    bool dead = maxAge > 0.0f && age + dt > maxAge;
+    for (uint i = 0; i < numSinks && !dead; ++i) {
+        dead = all(isless(fabs(position - sinks[i].position), sinks[i].halfDimensions));
+    }
+
+    ages[ID] = dead ? DEAD_AGE : age + dt;
+}
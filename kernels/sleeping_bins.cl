@@ -0,0 +1,120 @@
+/// Tracks the activity of the grid bins, so that the PBF solver can skip the particles in quiescent regions.
+/// A bin is active in a frame if one of its particles moved more than a threshold or is compressed beyond a
+/// threshold, and falls asleep after it stayed inactive for a number of frames. Particles are only solved
+/// if one of the 27 bins around them is awake; the others are frozen in place and act as static neighbours.
+///
+/// Pre-processor defines that specify grid parameters, see common/Grid.cl
+/// halfDims[Z,Y,Z], binSize, binCount[Z,Y,Z], binCount
+///
+/// Optional storage define, see common/Storage.cl
+/// HALF_STORAGE
+
+#include "common/Definitions.cl"
+#include "common/Storage.cl"
+#include "common/Grid.cl"
+
+/**
+ * Records the current frame as the last active frame of the bin of every particle that moved more than
+ * maxDisplacement in the last frame, or is compressed by more than maxCompression.
+ * Runs before the particles are predicted and sorted, on the state left by the previous frame.
+ */
+__kernel void mark_active_bins(__global const float3         *positions,         // 0
+                               __global const STORAGE_FLOAT3 *velocities,        // 1
+                               __global const STORAGE_FLOAT  *densities,         // 2
+                               __global uint                 *binLastActiveFrames,   // 3
+                               const uint                    frame,              // 4
+                               const float                   dt,                 // 5
+                               const float                   oneOverRestDensity, // 6
+                               const float                   maxDisplacement,    // 7
+                               const float                   maxCompression,     // 8
+                               const uint                    numItems) {         // 9
+    if (get_global_id(0) >= numItems) {
+        return;
+    }
+
+    const float displacement = dt * length(LOAD_FLOAT3(velocities, ID));
+    const float compression = LOAD_FLOAT(densities, ID) * oneOverRestDensity - 1.0f;
+
+    if (displacement > maxDisplacement || compression > maxCompression) {
+        binLastActiveFrames[getPositionBinID(positions[ID])] = frame;
+    }
+}
+
+/**
+ * Counts the particles of a bin if one of the 27 bins around it (including itself) was active within the
+ * last sleepDelay frames, and zero otherwise. Run over binCount + 1 bins, where the extra one holds the
+ * dead particles and is never awake, so that compute_bin_start_ID turns the counts into the offsets of the
+ * bins in the active particle list and its total.
+ */
+__kernel void count_awake_bins(__global const uint  *binCounts,             // 0
+                               __global const uint  *binLastActiveFrames,   // 1
+                               __global uint        *awakeBinCounts,        // 2
+                               const uint           frame,                  // 3
+                               const uint           sleepDelay,             // 4
+                               const uint           numItems) {             // 5
+    if (get_global_id(0) >= numItems) {
+        return;
+    }
+
+    if (ID >= binCount) {
+        awakeBinCounts[ID] = 0;
+        return;
+    }
+
+    const int binID = ID;
+    const int3 binID3D = (int3)(binID % binCountX, (binID / binCountX) % binCountY, binID / (binCountX * binCountY));
+
+    bool awake = false;
+    for (int dx = -1; dx < 2; ++dx) {
+        for (int dy = -1; dy < 2; ++dy) {
+            for (int dz = -1; dz < 2; ++dz) {
+                const int3 n = binID3D + (int3)(dx, dy, dz);
+                if (all(n >= 0) && n.x < binCountX && n.y < binCountY && n.z < binCountZ) {
+                    awake |= frame - binLastActiveFrames[n.x + binCountX * n.y + binCountX * binCountY * n.z] <= sleepDelay;
+                }
+            }
+        }
+    }
+
+    awakeBinCounts[ID] = awake ? binCounts[ID] : 0;
+}
+
+/**
+ * Writes the sorted index of every particle in an awake bin to the active particle list, preserving the
+ * sorted order. The list starts with its length, which the host copies in from the end of activeBinStartIDs. Particles in sleeping bins are frozen instead: their prediction is reset to their position
+ * and their velocities and curls are zeroed, and their density is set to the rest density, so that they
+ * neither move nor wake their bin up by themselves.
+ */
+__kernel void compact_active_particles(__global const uint    *binIDs,              // 0
+                                       __global const uint    *binStartIDs,         // 1
+                                       __global const uint    *awakeBinCounts,      // 2
+                                       __global const uint    *activeBinStartIDs,   // 3
+                                       __global uint          *activeIDs,           // 4
+                                       __global const float3  *positions,           // 5
+                                       __global float3        *predictedPositions,  // 6
+                                       __global STORAGE_FLOAT3 *velocities,         // 7
+                                       __global STORAGE_FLOAT3 *velocitiesOut,      // 8
+                                       __global STORAGE_FLOAT3 *curls,              // 9
+                                       __global STORAGE_FLOAT  *densities,          // 10
+                                       const float            restDensity,          // 11
+                                       const uint             numItems) {           // 12
+    if (get_global_id(0) >= numItems) {
+        return;
+    }
+
+    const uint binID = binIDs[ID];
+    if (binID >= binCount) {
+        return;
+    }
+
+    if (awakeBinCounts[binID] > 0) {
+        activeIDs[1 + activeBinStartIDs[binID] + ID - binStartIDs[binID]] = ID;
+        return;
+    }
+
+    predictedPositions[ID] = positions[ID];
+    STORE_FLOAT3(velocities, ID, ZERO3F);
+    STORE_FLOAT3(velocitiesOut, ID, ZERO3F);
+    STORE_FLOAT3(curls, ID, ZERO3F);
+    STORE_FLOAT(densities, ID, restDensity);
+}
@@ -0,0 +1,372 @@
+#pragma OPENCL EXTENSION cl_khr_global_int32_base_atomics : enable
+
+/// Two-way coupling between the fluid particles and rigid spheres and boxes.
+///
+/// Pre-processor defines that specify grid parameters, see common/Grid.cl
+/// halfDims[Z,Y,Z], binSize, binCount[Z,Y,Z], binCount
+///
+/// Optional storage define, see common/Storage.cl
+/// HALF_STORAGE
+///
+/// Per frame:
+/// 1. count_solids_in_bins, compute_bin_start_ID (counting_sort.cl) and insert_solids_in_bins
+///    build per-bin lists of the solids whose (inflated) bounding boxes overlap the bin.
+/// 2. After each solver iteration, collide_particles_with_solids projects particles out of the
+///    solids in their bin and records the impulse, which reduce_solid_impulses sums per solid.
+/// 3. integrate_solids applies the accumulated impulses and gravity to the solids.
+
+#include "common/Definitions.cl"
+#include "common/Storage.cl"
+#include "common/Bounds.cl"
+#include "common/Grid.cl"
+#include "common/SolidObject.cl"
+
+#define GRAVITY float3(0.0f, -9.82f, 0.0f)
+
+#define NO_SOLID 0xFFFFFFFF
+#define SOLID_RESTITUTION 0.3f
+#define SOLID_ANGULAR_DAMPING 0.98f
+
+/**
+ * Rotates a vector by a unit quaternion (x, y, z, w).
+ */
+float3 rotate(const float4 q, const float3 v);
+
+/**
+ * Rotates a vector by the inverse of a unit quaternion (x, y, z, w).
+ */
+float3 rotate_inverse(const float4 q, const float3 v);
+
+/**
+ * Computes the half-dimensions of the axis-aligned bounding box of a solid.
+ */
+float3 getSolidExtent(__global const SolidObject *solid);
+
+/**
+ * Counts, for every bin, the solids whose bounding box (inflated by the particle radius) overlaps the bin.
+ */
+__kernel void count_solids_in_bins(__global const SolidObject   *solids,            // 0
+                                   __global volatile uint       *binSolidCounts,    // 1
+                                   const float                  particleRadius,     // 2
+                                   const uint                   numItems) {         // 3
+    if (get_global_id(0) >= numItems) {
+        return;
+    }
+
+    __global const SolidObject *solid = &solids[ID];
+    if (solid->type == STYPE_PLANE) {
+        return;
+    }
+
+    const float3 position = solid->type == STYPE_SPHERE ? solid->data.sphere.position : solid->data.box.position;
+    const float3 extent = getSolidExtent(solid) + particleRadius;
+    const int3 minBin = convert_int3(getPositionBinID_3D(position - extent));
+    const int3 maxBin = convert_int3(getPositionBinID_3D(position + extent));
+
+    for (int z = minBin.z; z <= maxBin.z; ++z) {
+        for (int y = minBin.y; y <= maxBin.y; ++y) {
+            for (int x = minBin.x; x <= maxBin.x; ++x) {
+                atomic_inc(&binSolidCounts[getBinID(uint3(x, y, z))]);
+            }
+        }
+    }
+}
+
+/**
+ * Writes the ID of a solid into the lists of all bins its bounding box overlaps. Entries beyond
+ * maxEntries are dropped (the bin counts still include them, so readers must check the index).
+ */
+__kernel void insert_solids_in_bins(__global const SolidObject  *solids,            // 0
+                                    __global const uint         *binSolidStartIDs,  // 1
+                                    __global volatile uint      *binSolidCursors,   // 2
+                                    __global uint               *binSolidIDs,       // 3
+                                    const uint                  maxEntries,         // 4
+                                    const float                 particleRadius,     // 5
+                                    const uint                  numItems) {         // 6
+    if (get_global_id(0) >= numItems) {
+        return;
+    }
+
+    __global const SolidObject *solid = &solids[ID];
+    if (solid->type == STYPE_PLANE) {
+        return;
+    }
+
+    const float3 position = solid->type == STYPE_SPHERE ? solid->data.sphere.position : solid->data.box.position;
+    const float3 extent = getSolidExtent(solid) + particleRadius;
+    const int3 minBin = convert_int3(getPositionBinID_3D(position - extent));
+    const int3 maxBin = convert_int3(getPositionBinID_3D(position + extent));
+
+    for (int z = minBin.z; z <= maxBin.z; ++z) {
+        for (int y = minBin.y; y <= maxBin.y; ++y) {
+            for (int x = minBin.x; x <= maxBin.x; ++x) {
+                const uint binID = getBinID(uint3(x, y, z));
+                const uint entry = binSolidStartIDs[binID] + atomic_inc(&binSolidCursors[binID]);
+                if (entry < maxEntries) {
+                    binSolidIDs[entry] = ID;
+                }
+            }
+        }
+    }
+}
+
+/**
+ * Projects a particle out of the solids listed in its bin and records the impulse (and torque) of the
+ * deepest contact, to be summed per solid by reduce_solid_impulses.
+ * @param velocityScale 1/dt to change the velocity by the projection as well, for solvers that integrate the
+ *                      velocities before the positions (DFSPH). 0 when the velocities are later derived from
+ *                      the positions (PBF), which includes the projection already
+ */
+__kernel void collide_particles_with_solids(__global float3             *positions,         // 0
+                                            __global const uint         *binSolidStartIDs,  // 1
+                                            __global const uint         *binSolidCounts,    // 2
+                                            __global const uint         *binSolidIDs,       // 3
+                                            const uint                  maxEntries,         // 4
+                                            __global const SolidObject  *solids,            // 5
+                                            __global uint               *contactSolidIDs,   // 6
+                                            __global float3             *contactImpulses,   // 7
+                                            __global float3             *contactTorques,    // 8
+                                            const float                 particleRadius,     // 9
+                                            const float                 particleMassOverDt, // 10
+                                            __global STORAGE_FLOAT3     *velocities,        // 11
+                                            const float                 velocityScale,      // 12
+                                            const uint                  numItems) {         // 13
+    if (get_global_id(0) >= numItems) {
+        return;
+    }
+
+    float3 position = positions[ID];
+
+    const uint binID = getPositionBinID(position);
+    const uint binSolidStartID = binSolidStartIDs[binID];
+    const uint binSolidEndID = min(binSolidStartID + binSolidCounts[binID], maxEntries);
+
+    uint contactSolidID = NO_SOLID;
+    float3 contactImpulse = ZERO3F;
+    float3 contactTorque = ZERO3F;
+    float deepestCorrection = 0.0f;
+
+    for (uint entry = binSolidStartID; entry < binSolidEndID; ++entry) {
+        const uint solidID = binSolidIDs[entry];
+        __global const SolidObject *solid = &solids[solidID];
+
+        float3 center;
+        float3 correction = ZERO3F;
+
+        if (solid->type == STYPE_SPHERE) {
+            center = solid->data.sphere.position;
+
+            const float3 r = position - center;
+            const float distance = length(r);
+            const float minDistance = solid->data.sphere.radius + particleRadius;
+            if (distance < minDistance) {
+                const float3 normal = distance > EPSILON ? r / distance : float3(0.0f, 1.0f, 0.0f);
+                correction = (minDistance - distance) * normal;
+            }
+        } else if (solid->type == STYPE_BOX) {
+            center = solid->data.box.position;
+
+            const float4 q = solid->data.box.orientation;
+            const float3 local = rotate_inverse(q, position - center);
+            const float3 penetration = (solid->data.box.halfDimensions + particleRadius) - fabs(local);
+
+            if (all(penetration > 0.0f)) {
+                /// Push out along the axis of least penetration
+                float3 localCorrection = ZERO3F;
+                if (penetration.x <= penetration.y && penetration.x <= penetration.z) {
+                    localCorrection.x = copysign(penetration.x, local.x);
+                } else if (penetration.y <= penetration.z) {
+                    localCorrection.y = copysign(penetration.y, local.y);
+                } else {
+                    localCorrection.z = copysign(penetration.z, local.z);
+                }
+                correction = rotate(q, localCorrection);
+            }
+        } else {
+            continue;
+        }
+
+        const float magnitude = length(correction);
+        if (magnitude <= 0.0f) {
+            continue;
+        }
+
+        position += correction;
+
+        if (magnitude > deepestCorrection) {
+            /// The solid receives the opposite of the particle's change in momentum
+            deepestCorrection = magnitude;
+            contactSolidID = solidID;
+            contactImpulse = - particleMassOverDt * correction;
+            contactTorque = cross(position - center, contactImpulse);
+        }
+    }
+
+    if (velocityScale > 0.0f && contactSolidID != NO_SOLID) {
+        STORE_FLOAT3(velocities, ID, LOAD_FLOAT3(velocities, ID) + velocityScale * (position - positions[ID]));
+    }
+
+    positions[ID] = position;
+    contactSolidIDs[ID] = contactSolidID;
+    contactImpulses[ID] = contactImpulse;
+    contactTorques[ID] = contactTorque;
+}
+
+/**
+ * Sums the contact impulses and torques of the particles near a solid into the solid, using one
+ * work-group per solid. Only the particles in the bins around the solid are visited.
+ */
+__kernel void reduce_solid_impulses(__global SolidObject    *solids,            // 0
+                                    __global const uint     *binStartIDs,       // 1
+                                    __global const uint     *binCounts,         // 2
+                                    __global const uint     *contactSolidIDs,   // 3
+                                    __global const float3   *contactImpulses,   // 4
+                                    __global const float3   *contactTorques,    // 5
+                                    __local float3          *localImpulses,     // 6
+                                    __local float3          *localTorques,      // 7
+                                    const float             particleRadius) {   // 8
+    const uint solidID = get_group_id(0);
+    const uint localID = get_local_id(0);
+    const uint localSize = get_local_size(0);
+
+    __global SolidObject *solid = &solids[solidID];
+    if (solid->type == STYPE_PLANE) {
+        return;
+    }
+
+    /// Particles were binned at the start of the frame, so look one bin further than the solid reaches
+    const float3 position = solid->type == STYPE_SPHERE ? solid->data.sphere.position : solid->data.box.position;
+    const float3 extent = getSolidExtent(solid) + particleRadius + binSize;
+    const int3 minBin = convert_int3(getPositionBinID_3D(position - extent));
+    const int3 maxBin = convert_int3(getPositionBinID_3D(position + extent));
+
+    float3 impulse = ZERO3F;
+    float3 torque = ZERO3F;
+
+    for (int z = minBin.z; z <= maxBin.z; ++z) {
+        for (int y = minBin.y; y <= maxBin.y; ++y) {
+            for (int x = minBin.x; x <= maxBin.x; ++x) {
+                const uint binID = getBinID(uint3(x, y, z));
+                const uint binStartID = binStartIDs[binID];
+                const uint binEndID = binStartID + binCounts[binID];
+
+                for (uint pID = binStartID + localID; pID < binEndID; pID += localSize) {
+                    if (contactSolidIDs[pID] == solidID) {
+                        impulse += contactImpulses[pID];
+                        torque += contactTorques[pID];
+                    }
+                }
+            }
+        }
+    }
+
+    localImpulses[localID] = impulse;
+    localTorques[localID] = torque;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    /// Tree reduction (the work-group size is a power of two)
+    for (uint stride = localSize / 2; stride > 0; stride /= 2) {
+        if (localID < stride) {
+            localImpulses[localID] += localImpulses[localID + stride];
+            localTorques[localID] += localTorques[localID + stride];
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    if (localID == 0) {
+        if (solid->type == STYPE_SPHERE) {
+            solid->data.sphere.impulses += localImpulses[0];
+        } else {
+            solid->data.box.impulses += localImpulses[0];
+            solid->data.box.torques += localTorques[0];
+        }
+    }
+}
+
+/**
+ * Applies the accumulated impulses (and torques), gravity and collisions with the bounds to a solid,
+ * advances it by one timestep and clears its accumulators.
+ */
+__kernel void integrate_solids(const Bounds           bounds,     // 0
+                               __global SolidObject   *solids,    // 1
+                               const float            dt,         // 2
+                               const uint             numItems) { // 3
+    if (get_global_id(0) >= numItems) {
+        return;
+    }
+
+    __global SolidObject *solid = &solids[ID];
+
+    float3 position;
+    float3 velocity;
+    float3 extent = getSolidExtent(solid);
+
+    if (solid->type == STYPE_SPHERE) {
+        __global Sphere *sphere = &solid->data.sphere;
+        velocity = sphere->velocity + sphere->impulses / sphere->mass + dt * GRAVITY;
+        position = sphere->position + dt * velocity;
+        sphere->impulses = ZERO3F;
+    } else if (solid->type == STYPE_BOX) {
+        __global Box *box = &solid->data.box;
+        velocity = box->velocity + box->impulses / box->mass + dt * GRAVITY;
+        position = box->position + dt * velocity;
+
+        /// Angular impulse through the inverse inertia tensor, in the box's frame
+        const float3 h2 = box->halfDimensions * box->halfDimensions;
+        const float3 inertia = (box->mass / 3.0f) * float3(h2.y + h2.z, h2.x + h2.z, h2.x + h2.y);
+        const float4 q = box->orientation;
+        const float3 angularVelocity = SOLID_ANGULAR_DAMPING * (box->angularVelocity
+                                       + rotate(q, rotate_inverse(q, box->torques) / inertia));
+
+        /// q' = q + dt/2 * (ω, 0) q
+        const float4 w = float4(angularVelocity, 0.0f);
+        const float4 dq = float4(w.w * q.xyz + q.w * w.xyz + cross(w.xyz, q.xyz),
+                                 w.w * q.w - dot(w.xyz, q.xyz));
+        box->orientation = normalize(q + 0.5f * dt * dq);
+        box->angularVelocity = angularVelocity;
+
+        box->impulses = ZERO3F;
+        box->torques = ZERO3F;
+        extent = getSolidExtent(solid);
+    } else {
+        return;
+    }
+
+    /// Bounce off the bounds
+    const float3 minPosition = -bounds.halfDimensions + DIFF + extent;
+    const float3 maxPosition = bounds.halfDimensions - DIFF - extent;
+    const int3 outside = isless(position, minPosition) || isgreater(position, maxPosition);
+    velocity = select(velocity, -SOLID_RESTITUTION * velocity, outside);
+    position = clamp(position, minPosition, maxPosition);
+
+    if (solid->type == STYPE_SPHERE) {
+        solid->data.sphere.position = position;
+        solid->data.sphere.velocity = velocity;
+    } else {
+        solid->data.box.position = position;
+        solid->data.box.velocity = velocity;
+    }
+}
+
+inline float3 rotate(const float4 q, const float3 v) {
+    const float3 t = 2.0f * cross(q.xyz, v);
+    return v + q.w * t + cross(q.xyz, t);
+}
+
+inline float3 rotate_inverse(const float4 q, const float3 v) {
+    return rotate(float4(-q.xyz, q.w), v);
+}
+
+inline float3 getSolidExtent(__global const SolidObject *solid) {
+    if (solid->type == STYPE_SPHERE) {
+        const float r = solid->data.sphere.radius;
+        return float3(r, r, r);
+    }
+
+    /// The extent of a rotated box is the sum of its rotated half-axes
+    const float4 q = solid->data.box.orientation;
+    const float3 h = solid->data.box.halfDimensions;
+    return fabs(rotate(q, float3(h.x, 0.0f, 0.0f)))
+           + fabs(rotate(q, float3(0.0f, h.y, 0.0f)))
+           + fabs(rotate(q, float3(0.0f, 0.0f, h.z)));
+}
@@ -0,0 +1,13 @@
+#pragma OPENCL EXTENSION cl_khr_global_int32_base_atomics : enable
+
+/// The sort, time step and solver kernels linked into a single program, so that they are built once and
+/// share the common/ functions instead of each program carrying its own copy. It is built with the union of
+/// the defines of the included files.
+///
+/// fluid_sim.cl comes last, since it redefines ID to index the active particle list under SLEEPING_BINS.
+
+#include "counting_sort.cl"
+#include "sleeping_bins.cl"
+#include "timestep.cl"
+#include "dfsph.cl"
+#include "fluid_sim.cl"
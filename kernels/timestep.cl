@@ -1,11 +1,77 @@
-#define ID get_global_id(0)
+#pragma OPENCL EXTENSION cl_khr_global_int32_base_atomics : enable
+#pragma OPENCL EXTENSION cl_khr_global_int32_extended_atomics : enable
 
-__kernel void timestep(__global const float3 *positions,          // 0
-                       __global float3       *predictedPositions, // 1
-                       __global const float3 *velocities,         // 2
-                       const float           dt) {                // 3
-    float3 velocity = velocities[ID];
+/// Starts a PBF frame in a single pass over the particles: applies gravity, predicts the positions, clips them
+/// to the bounds and obstacles and, when the counting sort follows directly, inserts them in the grid.
+///
+/// Pre-processor defines that specify grid parameters, see common/Grid.cl
+/// halfDims[Z,Y,Z], binSize, binCount[Z,Y,Z], binCount
+///
+/// Optional obstacle defines, see fluid_sim.cl and common/SDF.cl
+/// SDF_OBSTACLES, SDF_CELLS_PER_BIN
+///
+/// Optional storage define, see common/Storage.cl
+/// HALF_STORAGE
+
+#include "common/Definitions.cl"
+#include "common/Storage.cl"
+#include "common/Bounds.cl"
+#include "common/Grid.cl"
+#include "common/SDF.cl"
+
+/**
+ * Predicts the position of a particle after applying gravity, clips it to the bounds and pushes it out of
+ * any obstacles. If insert is set, the particle is also inserted in the grid like insert_particles, so that
+ * the counting sort continues with compute_bin_start_ID; the bin counts must have been reset to zero and
+ * the active region emptied.
+ * @param ages The particle ages, negative for dead particles (see sinks.cl)
+ * @param keptPositions Receives the positions if keepPositions is set, so that the prediction can be done
+ *                      in place when the incremental sort keeps the buffers of the last frame
+ */
+__kernel void predict_and_insert(__global const float3         *positions,          // 0
+                                 __global float3               *predictedPositions, // 1
+                                 __global const STORAGE_FLOAT3 *velocities,         // 2
+                                 const float                   dt,                  // 3
+                                 const Bounds                  bounds,              // 4
+                                 __global const float          *sdf,                // 5
+                                 const uint                    insert,              // 6
+                                 __global uint                 *particleBinID,      // 7
+                                 __global uint                 *particleInBinID,    // 8
+                                 __global volatile uint        *binCounts,          // 9
+                                 __global const float          *ages,               // 10
+                                 __global volatile uint        *activeRegion,       // 11
+                                 __global float3               *keptPositions,      // 12
+                                 const uint                    keepPositions,       // 13
+                                 const uint                    numItems) {          // 14
+    if (get_global_id(0) >= numItems) {
+        return;
+    }
+
+    const float3 previousPosition = positions[ID];
+    if (keepPositions) {
+        keptPositions[ID] = previousPosition;
+    }
+
+    float3 velocity = LOAD_FLOAT3(velocities, ID);
     velocity.y = velocity.y - dt * 9.82f;
 
-    predictedPositions[ID] = positions[ID] + dt * velocity;
-}
\ No newline at end of file
+    // Clamp the xyz-coordinates to the bounds seperately
+    float3 position = clamp(previousPosition + dt * velocity,
+                            -bounds.halfDimensions + DIFF,
+                            bounds.halfDimensions - DIFF);
+#ifdef SDF_OBSTACLES
+    position = project_out_of_sdf(sdf, position);
+#endif
+    predictedPositions[ID] = position;
+
+    if (insert) {
+        const bool dead = ages[ID] < 0.0f;
+        const uint3 binID3D = getPositionBinID_3D(position);
+        const uint binID = dead ? binCount : getBinID(binID3D);
+        if (!dead) {
+            growActiveRegion(activeRegion, binID3D);
+        }
+        particleBinID[ID] = binID;
+        particleInBinID[ID] = atomic_inc(&binCounts[binID]);
+    }
+}
@@ -13,6 +13,16 @@
 #include "util/paths.hpp"
 #include <fstream>
 #include <iomanip>
+#include <thread>
+#include <random>
+#include <cmath>
+#include "util/cl_util.hpp"
+
+#ifdef _WIN32
+#include <cstdlib>
+#else
+#include <unistd.h>
+#endif
 
 #ifdef TARGET_OS_MAC
 #include <CGLCurrent.h>
@@ -21,6 +31,8 @@
 namespace clgl {
     std::map<std::string, Application::SceneCreator> Application::SceneCreators;
 
+    const std::string Application::DEVICE_CACHE_FILE = "device_selection.txt";
+
     Application::Application(int argc, char *argv[]) {
         // Read command line arguments
         std::vector<std::string> args;
@@ -56,7 +68,26 @@ namespace clgl {
             desiredDeviceIndex = std::stoi(*(++iter));
         }
 
-        if (!trySelectPlatform(desiredPlatformIndex) || !trySelectDevice(desiredDeviceIndex)) {
+        iter = std::find(args.begin(), args.end(), "--device");
+        const bool selectFastestDevice = iter != args.end() && ++iter != args.end() && *iter == "auto";
+
+        if (selectFastestDevice) {
+            if (!trySelectFastestDevice()) {
+                return false;
+            }
+        } else if (!trySelectPlatform(desiredPlatformIndex) || !trySelectDevice(desiredDeviceIndex)) {
+            return false;
+        }
+
+        cl_uint desiredSubDeviceCount = 0;
+        iter = std::find(args.begin(), args.end(), "-subdevices");
+        if (iter != args.end()) {
+            desiredSubDeviceCount = static_cast<cl_uint>(std::stoul(*(++iter)));
+        }
+
+        const bool partitionByNUMA = std::find(args.begin(), args.end(), "-numa") != args.end();
+        if ((desiredSubDeviceCount > 0 || partitionByNUMA) &&
+            !tryCreateSubDevices(desiredSubDeviceCount, partitionByNUMA)) {
             return false;
         }
 
@@ -88,11 +119,18 @@ namespace clgl {
         gcl_gl_set_sharegroup(shareGroup);
 #endif
 
-        mContext = OCL_CHECK(cl::Context({mDevice}, properties, NULL, NULL, CL_ERROR));
+        std::vector<cl::Device> contextDevices = {mDevice};
+        contextDevices.insert(contextDevices.end(), mSubDevices.begin(), mSubDevices.end());
+        mContext = OCL_CHECK(cl::Context(contextDevices, properties, NULL, NULL, CL_ERROR));
 
         //create queue to which we will push commands for the device.
         mQueue = OCL_CHECK(cl::CommandQueue(mContext, mDevice, 0, CL_ERROR));
 
+        for (cl::Device &subDevice : mSubDevices) {
+            cl::CommandQueue queue = OCL_CHECK(cl::CommandQueue(mContext, subDevice, 0, CL_ERROR));
+            mSubDeviceQueues.push_back(queue);
+        }
+
         return true;
     }
 
@@ -185,6 +223,249 @@ namespace clgl {
         return true;
     }
 
+    bool Application::trySelectFastestDevice() {
+        std::vector<cl::Platform> allPlatforms;
+        OCL_CALL(cl::Platform::get(&allPlatforms));
+
+        std::vector<cl::Platform> platforms;
+        std::vector<cl::Device> devices;
+        for (cl::Platform &platform : allPlatforms) {
+            std::vector<cl::Device> platformDevices;
+            if (platform.getDevices(CL_DEVICE_TYPE_ALL, &platformDevices) != CL_SUCCESS) {
+                continue;
+            }
+            for (cl::Device &device : platformDevices) {
+                platforms.push_back(platform);
+                devices.push_back(device);
+            }
+        }
+        if (devices.empty()) {
+            std::cerr << "No OpenCL devices found. Check your OpenCL installation." << std::endl;
+            return false;
+        }
+
+        /// Reuse the choice of an earlier start on this host if that device is still there
+        const std::string host = GetHostName();
+        std::string cachedDeviceKey;
+        std::ifstream ifs(OUTPUTPATH(DEVICE_CACHE_FILE).c_str());
+        std::string cacheHost, cacheDeviceKey;
+        while (ifs >> cacheHost >> cacheDeviceKey) {
+            if (cacheHost == host) {
+                cachedDeviceKey = cacheDeviceKey;
+            }
+        }
+        ifs.close();
+
+        for (uint i = 0; i < devices.size(); ++i) {
+            if (!cachedDeviceKey.empty() && util::TunedValues::GetDeviceKey(devices[i]) == cachedDeviceKey) {
+                std::cout << "Selected " << devices[i].getInfo<CL_DEVICE_NAME>() << " (cached in "
+                          << DEVICE_CACHE_FILE << ")" << std::endl;
+                mPlatform = platforms[i];
+                mDevice = devices[i];
+                return true;
+            }
+        }
+
+        /// Devices other than CPUs are measured concurrently, CPU devices one at a time afterwards, since they
+        /// would compete with each other and with the threads driving the other devices
+        std::vector<double> throughputs(devices.size(), 0.0);
+        std::vector<std::thread> threads;
+        for (uint i = 0; i < devices.size(); ++i) {
+            if (!(devices[i].getInfo<CL_DEVICE_TYPE>() & CL_DEVICE_TYPE_CPU)) {
+                threads.push_back(std::thread([&throughputs, &devices, i]() {
+                    throughputs[i] = MeasureDeviceThroughput(devices[i]);
+                }));
+            }
+        }
+        for (std::thread &thread : threads) {
+            thread.join();
+        }
+        for (uint i = 0; i < devices.size(); ++i) {
+            if (devices[i].getInfo<CL_DEVICE_TYPE>() & CL_DEVICE_TYPE_CPU) {
+                throughputs[i] = MeasureDeviceThroughput(devices[i]);
+            }
+        }
+
+        std::cout << "Device benchmark (density step, million particles per second):" << std::endl;
+        uint best = 0;
+        for (uint i = 0; i < devices.size(); ++i) {
+            std::cout << std::setw(10) << throughputs[i] / 1e6 << "  "
+                      << platforms[i].getInfo<CL_PLATFORM_NAME>() << ", " << devices[i].getInfo<CL_DEVICE_NAME>()
+                      << (throughputs[i] > 0.0 ? "" : " (failed)") << std::endl;
+            if (throughputs[i] > throughputs[best]) {
+                best = i;
+            }
+        }
+
+        if (throughputs[best] <= 0.0) {
+            std::cerr << "No OpenCL device could run the device benchmark." << std::endl;
+            return false;
+        }
+
+        mPlatform = platforms[best];
+        mDevice = devices[best];
+        std::cout << "Selected " << mDevice.getInfo<CL_DEVICE_NAME>() << std::endl;
+
+        /// Rewrite the cache with this host's new entry, keeping the other hosts' entries
+        std::vector<std::string> otherHosts;
+        ifs.open(OUTPUTPATH(DEVICE_CACHE_FILE).c_str());
+        std::string line;
+        while (std::getline(ifs, line)) {
+            if (!line.empty() && line.compare(0, host.size() + 1, host + " ") != 0) {
+                otherHosts.push_back(line);
+            }
+        }
+        ifs.close();
+
+        std::ofstream ofs(OUTPUTPATH(DEVICE_CACHE_FILE).c_str());
+        if (ofs.is_open()) {
+            for (const std::string &other : otherHosts) {
+                ofs << other << std::endl;
+            }
+            ofs << host << " " << util::TunedValues::GetDeviceKey(mDevice) << std::endl;
+        }
+        ofs.close();
+
+        return true;
+    }
+
+    double Application::MeasureDeviceThroughput(cl::Device device) {
+        const float KERNEL_RADIUS = 0.1f;
+        const uint MAX_LATTICE_SIZE = 128;
+        /// A step has to take this long before it is timed
+        const double MIN_STEP_TIME = 0.02;
+        const uint NUM_TIMED_STEPS = 5;
+
+        cl_int error = CL_SUCCESS;
+        cl::Context context(std::vector<cl::Device>(1, device), NULL, NULL, NULL, &error);
+        if (error != CL_SUCCESS) {
+            return 0.0;
+        }
+        cl::CommandQueue queue(context, device, 0, &error);
+        if (error != CL_SUCCESS) {
+            return 0.0;
+        }
+
+        std::mt19937 random(device.getInfo<CL_DEVICE_VENDOR_ID>());
+        std::uniform_real_distribution<float> jitter(-0.1f * KERNEL_RADIUS, 0.1f * KERNEL_RADIUS);
+
+        double throughput = 0.0;
+        for (uint latticeSize = 16; latticeSize <= MAX_LATTICE_SIZE; latticeSize *= 2) {
+            const uint numParticles = latticeSize * latticeSize * latticeSize;
+            if (2 * sizeof(cl_float4) * numParticles > device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>()) {
+                break;
+            }
+
+            const std::string defines = "#define LATTICE_SIZE " + std::to_string(latticeSize) + "\n"
+                                        + "#define KERNEL_RADIUS " + util::ToCLFloat(KERNEL_RADIUS) + "\n";
+            std::unique_ptr<cl::Program> program = util::LoadCLProgram("device_benchmark.cl", context, device,
+                                                                       defines);
+            if (!program) {
+                return 0.0;
+            }
+            cl::Kernel kernel(*program, "benchmark_densities", &error);
+            if (error != CL_SUCCESS) {
+                return 0.0;
+            }
+
+            std::vector<cl_float4> positions(numParticles);
+            for (uint id = 0; id < numParticles; ++id) {
+                const uint x = id % latticeSize, y = (id / latticeSize) % latticeSize;
+                const uint z = id / (latticeSize * latticeSize);
+                positions[id] = {0.5f * KERNEL_RADIUS * x + jitter(random),
+                                 0.5f * KERNEL_RADIUS * y + jitter(random),
+                                 0.5f * KERNEL_RADIUS * z + jitter(random), 0.0f};
+            }
+
+            cl::Buffer positionsCL(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                                   sizeof(cl_float4) * numParticles, &positions[0], &error);
+            cl::Buffer densitiesCL(context, CL_MEM_WRITE_ONLY, sizeof(cl_float) * numParticles, NULL, &error);
+            if (error != CL_SUCCESS) {
+                return 0.0;
+            }
+            kernel.setArg(0, positionsCL);
+            kernel.setArg(1, densitiesCL);
+            kernel.setArg(2, numParticles);
+
+            /// Untimed warm-up, which also uploads the positions
+            if (queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(numParticles)) != CL_SUCCESS ||
+                queue.finish() != CL_SUCCESS) {
+                return 0.0;
+            }
+
+            const double begin = glfwGetTime();
+            for (uint step = 0; step < NUM_TIMED_STEPS; ++step) {
+                queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(numParticles));
+            }
+            if (queue.finish() != CL_SUCCESS) {
+                return 0.0;
+            }
+            const double stepTime = (glfwGetTime() - begin) / NUM_TIMED_STEPS;
+
+            throughput = numParticles / stepTime;
+            if (stepTime >= MIN_STEP_TIME) {
+                break;
+            }
+        }
+
+        return throughput;
+    }
+
+    std::string Application::GetHostName() {
+        std::string host = "localhost";
+#ifdef _WIN32
+        const char *computerName = std::getenv("COMPUTERNAME");
+        if (computerName) {
+            host = computerName;
+        }
+#else
+        char name[256];
+        if (gethostname(name, sizeof(name)) == 0) {
+            name[sizeof(name) - 1] = '\0';
+            host = name;
+        }
+#endif
+        for (char &c : host) {
+            if (std::isspace(static_cast<unsigned char>(c))) {
+                c = '_';
+            }
+        }
+        return host;
+    }
+
+    bool Application::tryCreateSubDevices(cl_uint numSubDevices, bool partitionByNUMA) {
+        const cl_uint computeUnits = mDevice.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>();
+        if (!partitionByNUMA && (numSubDevices < 2 || numSubDevices > computeUnits)) {
+            std::cerr << "Invalid sub-device count, the device has " << computeUnits << " compute units." << std::endl;
+            return false;
+        }
+
+        cl_device_partition_property properties[3] = {0, 0, 0};
+        if (partitionByNUMA) {
+            properties[0] = CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN;
+            properties[1] = CL_DEVICE_AFFINITY_DOMAIN_NUMA;
+        } else {
+            properties[0] = CL_DEVICE_PARTITION_EQUALLY;
+            properties[1] = computeUnits / numSubDevices;
+        }
+
+        const cl_int error = mDevice.createSubDevices(properties, &mSubDevices);
+        if (error != CL_SUCCESS || mSubDevices.empty()) {
+            std::cerr << "Could not partition " << mDevice.getInfo<CL_DEVICE_NAME>() << " into sub-devices." << std::endl;
+            mSubDevices.clear();
+            return false;
+        }
+
+        /// Equal partitions may leave a remainder of compute units in an extra sub-device
+        if (!partitionByNUMA && mSubDevices.size() > static_cast<size_t>(numSubDevices)) {
+            mSubDevices.resize(numSubDevices);
+        }
+
+        std::cout << "Created " << mSubDevices.size() << " sub-devices with "
+                  << mSubDevices[0].getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() << " compute units each." << std::endl;
+        return true;
+    }
+
     void Application::createConfigGUI() {
         using namespace nanogui;
         Window *window = new Window(mScreen.get(), "General Controls");
@@ -242,6 +523,7 @@ namespace clgl {
         auto sceneCreator = SceneCreators[formattedName];
 
         mScene = std::move(sceneCreator(mContext, mDevice, mQueue));
+        mScene->setSubDeviceQueues(mSubDeviceQueues);
         mScene->addGUI(mScreen.get());
         mScene->setIsKeyDownFunctor([=](int glfwKey) {
             return glfwGetKey(this->mScreen->glfwWindow(), glfwKey) == GLFW_PRESS;
@@ -41,6 +41,33 @@ namespace clgl {
 
         bool trySelectDevice(int commandLineDeviceIndex = -1);
 
+        /**
+         * Selects the device with the highest throughput in a short calibrated density step, see
+         * MeasureDeviceThroughput. The choice is cached per host in DEVICE_CACHE_FILE and reused while that
+         * device is still available, so the benchmark only runs on the first start.
+         * @return False if no device could run the benchmark
+         */
+        bool trySelectFastestDevice();
+
+        /**
+         * Runs the density step of device_benchmark.cl on its own context, doubling the particle count until a
+         * step takes long enough to time reliably.
+         * @return Particles per second, or 0 if the device could not build or run the kernel
+         */
+        static double MeasureDeviceThroughput(cl::Device device);
+
+        /// Identifies this machine in DEVICE_CACHE_FILE
+        static std::string GetHostName();
+
+        static const std::string DEVICE_CACHE_FILE;
+
+        /**
+         * Partitions the selected device into sub-devices, either one per NUMA node or
+         * numSubDevices equally large ones.
+         * @return False if the device could not be partitioned as requested
+         */
+        bool tryCreateSubDevices(cl_uint numSubDevices, bool partitionByNUMA);
+
         void createConfigGUI();
 
         void loadScene(std::string formattedName);
@@ -53,6 +80,11 @@ namespace clgl {
 
         cl::CommandQueue mQueue;
 
+        /// Partitions of mDevice (if requested), sharing mContext, and one queue for each
+        std::vector<cl::Device> mSubDevices;
+
+        std::vector<cl::CommandQueue> mSubDeviceQueues;
+
         static std::map<std::string, SceneCreator> SceneCreators;
 
         /// The "thing" that is "happening" in the app...
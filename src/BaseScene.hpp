@@ -2,6 +2,7 @@
 
 #include <memory>
 #include <functional>
+#include <vector>
 
 #include <CL/cl.hpp>
 #include <nanogui/nanogui.h>
@@ -51,6 +52,14 @@ namespace clgl {
             mIsKeyDownFunctor = isKeyDownFunctor;
         }
 
+        /**
+         * Provides queues to sub-devices of mDevice (sharing mContext) that the scene may distribute work over.
+         * @param queues One queue per sub-device, empty if the device wasn't partitioned
+         */
+        inline void setSubDeviceQueues(const std::vector<cl::CommandQueue> &queues) {
+            mSubDeviceQueues = queues;
+        }
+
         //////////////
         /// EVENTS ///
         //////////////
@@ -74,6 +83,8 @@ namespace clgl {
 
         cl::CommandQueue &mQueue;
 
+        std::vector<cl::CommandQueue> mSubDeviceQueues;
+
     private:
         std::function<bool(int)> mIsKeyDownFunctor;
     };
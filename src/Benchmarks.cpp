@@ -0,0 +1,522 @@
+#include "Benchmarks.hpp"
+#include "ParticleSimulationScene.hpp"
+
+#include <glm/ext.hpp>
+#include "util/paths.hpp"
+#include "util/OCL_CALL.hpp"
+
+#include <algorithm>
+#include <map>
+
+namespace pbf {
+    Benchmarks::FrameStats Benchmarks::runFrames(uint numFrames, bool continuing) {
+        ParticleSimulationScene &s = mScene;
+        if (!continuing) {
+            s.reset();
+        }
+
+        FrameStats stats = {0.0, 0.0, 0.0, 0.0, 0.0, 0.0};
+        uint framesReachingTolerance = 0;
+        s.mNumSorts = 0;
+        s.mNumSkippedSorts = 0;
+
+        for (uint frame = 0; frame < numFrames; ++frame) {
+            const double timeBegin = glfwGetTime();
+            s.update();
+            stats.msPerFrame += 1000 * (glfwGetTime() - timeBegin);
+            stats.activeFraction += static_cast<double>(s.mNumActiveParticles) / std::max(s.mNumParticles, 1u);
+
+            const std::vector<float> &errors = s.mSolverStats.densityErrors;
+            if (errors.empty()) {
+                continue;
+            }
+
+            stats.finalDensityError += errors.back();
+            for (uint iteration = 0; iteration < errors.size(); ++iteration) {
+                if (errors[iteration] <= s.mConvergenceTolerance) {
+                    stats.iterationsToTolerance += iteration;
+                    ++framesReachingTolerance;
+                    break;
+                }
+            }
+        }
+
+        stats.msPerFrame /= numFrames;
+        stats.finalDensityError /= numFrames;
+        stats.activeFraction /= numFrames;
+        stats.skippedSortFraction = static_cast<double>(s.mNumSkippedSorts) / numFrames;
+        stats.fractionReachedTolerance = static_cast<double>(framesReachingTolerance) / numFrames;
+        if (framesReachingTolerance > 0) {
+            stats.iterationsToTolerance /= framesReachingTolerance;
+        }
+
+        return stats;
+    }
+
+    Benchmarks::FrameStats Benchmarks::runTimedFrames(uint numFrames) {
+        ParticleSimulationScene &s = mScene;
+        const bool measureConvergence = s.mMeasureConvergence;
+
+        /// Time without the blocking density read-backs, then measure the error in a second run
+        s.mMeasureConvergence = false;
+        const double msPerFrame = runFrames(numFrames).msPerFrame;
+        s.mMeasureConvergence = true;
+        FrameStats stats = runFrames(numFrames);
+        stats.msPerFrame = msPerFrame;
+
+        s.mMeasureConvergence = measureConvergence;
+        return stats;
+    }
+
+    double Benchmarks::timeRepetitions(uint numRepetitions, const std::function<void()> &work) {
+        double time = 0.0;
+        for (uint repetition = 0; repetition < numRepetitions; ++repetition) {
+            const double timeBegin = glfwGetTime();
+            work();
+            OCL_CALL(mScene.mQueue.finish());
+            time += glfwGetTime() - timeBegin;
+        }
+        return time / numRepetitions;
+    }
+
+    BenchmarkTable Benchmarks::runWarmStart() {
+        ParticleSimulationScene &s = mScene;
+        const float originalBlend = s.mWarmStartBlend;
+        const float blend = originalBlend > 0.0f ? originalBlend : 0.5f;
+
+        BenchmarkTable table;
+        table.description = "Warm-started λ: " + s.mCurrentFluidSetup + ", " + BenchmarkTable::Cell(NUM_FRAMES)
+                            + " frames, " + BenchmarkTable::Cell(s.mFluidCL->numSubSteps) + " sub-steps, tolerance "
+                            + BenchmarkTable::Cell(s.mConvergenceTolerance);
+        table.header = {"blend", "ms/frame", "final error", "iters to tol", "frames at tol"};
+
+        s.mMeasureConvergence = true;
+        for (float b : {0.0f, blend}) {
+            s.mWarmStartBlend = b;
+            const FrameStats r = runFrames(NUM_FRAMES);
+            table.rows.push_back({BenchmarkTable::Cell(b), BenchmarkTable::Cell(r.msPerFrame),
+                                  BenchmarkTable::Cell(r.finalDensityError), BenchmarkTable::Cell(r.iterationsToTolerance),
+                                  BenchmarkTable::Percent(r.fractionReachedTolerance)});
+        }
+        s.mMeasureConvergence = false;
+
+        s.mWarmStartBlend = originalBlend;
+        s.reset();
+        return table;
+    }
+
+    BenchmarkTable Benchmarks::runColouring() {
+        typedef ParticleSimulationScene::SolverColouring SolverColouring;
+        ParticleSimulationScene &s = mScene;
+        const SolverColouring originalColouring = s.mSolverColouring;
+        const uint originalSubSteps = s.mFluidCL->numSubSteps;
+        const char *names[] = {"Jacobi", "8-colour GS", "27-colour GS"};
+
+        BenchmarkTable table;
+        table.description = "Solver colouring: " + s.mCurrentFluidSetup + ", " + BenchmarkTable::Cell(NUM_FRAMES) + " frames";
+        table.header = {"solver", "sub-steps", "ms/frame", "final error"};
+
+        for (SolverColouring colouring : {SolverColouring::Jacobi, SolverColouring::Parity8, SolverColouring::Colours27}) {
+            s.mSolverColouring = colouring;
+
+            for (uint subSteps : {1, 2, 4, 8}) {
+                s.mFluidCL->numSubSteps = subSteps;
+
+                const FrameStats r = runTimedFrames(NUM_FRAMES);
+                table.rows.push_back({names[static_cast<int>(colouring)], BenchmarkTable::Cell(subSteps),
+                                      BenchmarkTable::Cell(r.msPerFrame), BenchmarkTable::Cell(r.finalDensityError)});
+            }
+        }
+
+        s.mSolverColouring = originalColouring;
+        s.mFluidCL->numSubSteps = originalSubSteps;
+        s.reset();
+        return table;
+    }
+
+    BenchmarkTable Benchmarks::runSolverType() {
+        typedef ParticleSimulationScene::SolverType SolverType;
+        ParticleSimulationScene &s = mScene;
+        const SolverType originalSolverType = s.mSolverType;
+        const float originalDeltaTime = s.mFluidCL->deltaTime;
+
+        BenchmarkTable table;
+        table.description = "PBF vs. DFSPH: " + s.mCurrentFluidSetup + ", " + BenchmarkTable::Cell(NUM_FRAMES)
+                            + " frames, " + BenchmarkTable::Cell(s.mFluidCL->numSubSteps) + " iterations";
+        table.header = {"solver", "dt", "ms/frame", "ms/sim. second", "final error"};
+
+        /// PBF at the configured timestep, DFSPH at increasingly larger ones
+        std::vector<std::pair<SolverType, float>> configurations = {{SolverType::PBF, 1.0f}};
+        for (float scale : {1.0f, 2.0f, 3.0f, 4.0f, 5.0f}) {
+            configurations.push_back({SolverType::DFSPH, scale});
+        }
+
+        for (const auto &configuration : configurations) {
+            s.mSolverType = configuration.first;
+            s.mFluidCL->deltaTime = configuration.second * originalDeltaTime;
+
+            const FrameStats r = runTimedFrames(NUM_FRAMES);
+            table.rows.push_back({s.mSolverType == SolverType::PBF ? "PBF" : "DFSPH",
+                                  BenchmarkTable::Cell(s.mFluidCL->deltaTime), BenchmarkTable::Cell(r.msPerFrame),
+                                  BenchmarkTable::Cell(r.msPerFrame / s.mFluidCL->deltaTime),
+                                  BenchmarkTable::Cell(r.finalDensityError)});
+        }
+
+        s.mSolverType = originalSolverType;
+        s.mFluidCL->deltaTime = originalDeltaTime;
+        s.reset();
+        return table;
+    }
+
+    BenchmarkTable Benchmarks::runHalfStorage() {
+        ParticleSimulationScene &s = mScene;
+        const bool originalHalfStorage = s.mHalfStorage;
+        const std::string originalFluidSetup = s.mCurrentFluidSetup;
+
+        BenchmarkTable table;
+        table.description = "Half storage: " + BenchmarkTable::Cell(NUM_FRAMES) + " frames, "
+                            + BenchmarkTable::Cell(s.mFluidCL->numSubSteps) + " sub-steps";
+        table.header = {"setup", "storage", "bytes/part.", "ms/frame", "final error", "vs. fp32"};
+
+        for (const char *setup : {"dam-break.txt", "large-dam-break.txt", "cube-drop.txt"}) {
+            s.mCurrentFluidSetup = RESPATH("fluidSetups/") + setup;
+
+            double fullPrecisionError = 0.0;
+            for (bool halfStorage : {false, true}) {
+                s.setHalfStorage(halfStorage);
+
+                const FrameStats r = runTimedFrames(NUM_FRAMES);
+                if (!halfStorage) {
+                    fullPrecisionError = r.finalDensityError;
+                }
+
+                table.rows.push_back({setup, halfStorage ? "fp16" : "fp32", BenchmarkTable::Cell(s.getBytesPerParticle()),
+                                      BenchmarkTable::Cell(r.msPerFrame), BenchmarkTable::Cell(r.finalDensityError),
+                                      BenchmarkTable::Cell(r.finalDensityError - fullPrecisionError)});
+            }
+        }
+
+        s.mCurrentFluidSetup = originalFluidSetup;
+        s.setHalfStorage(originalHalfStorage);
+        return table;
+    }
+
+    BenchmarkTable Benchmarks::runSlabScaling() {
+        ParticleSimulationScene &s = mScene;
+        const uint originalNumSlabs = s.mNumSlabs;
+
+        BenchmarkTable table;
+        table.description = "Slab scaling: " + s.mCurrentFluidSetup + ", " + BenchmarkTable::Cell(NUM_FRAMES)
+                            + " frames, " + BenchmarkTable::Cell(s.mSubDeviceQueues.size()) + " sub-devices";
+        table.header = {"slabs", "ms/frame", "speedup", "efficiency"};
+
+        /// Strong scaling relative to a single sub-device; 0 slabs is the undivided device for reference
+        double msPerFrameOneSlab = 0.0;
+        for (uint numSlabs = 0; numSlabs <= s.mSubDeviceQueues.size(); ++numSlabs) {
+            s.mNumSlabs = numSlabs;
+
+            const double msPerFrame = runFrames(NUM_FRAMES).msPerFrame;
+            if (numSlabs == 1) {
+                msPerFrameOneSlab = msPerFrame;
+            }
+
+            std::vector<std::string> row = {BenchmarkTable::Cell(numSlabs), BenchmarkTable::Cell(msPerFrame), "", ""};
+            if (numSlabs > 0) {
+                const double speedup = msPerFrameOneSlab / msPerFrame;
+                row[2] = BenchmarkTable::Cell(speedup);
+                row[3] = BenchmarkTable::Percent(speedup / numSlabs);
+            }
+            table.rows.push_back(row);
+        }
+
+        s.mNumSlabs = originalNumSlabs;
+        s.reset();
+        return table;
+    }
+
+    BenchmarkTable Benchmarks::runSettling(const std::string &name, bool &option) {
+        ParticleSimulationScene &s = mScene;
+        const bool originalOption = option;
+
+        BenchmarkTable table;
+        table.description = "Settling: " + s.mCurrentFluidSetup + ", " + BenchmarkTable::Cell(4 * NUM_FRAMES)
+                            + " frames, timed over the first and last " + BenchmarkTable::Cell(NUM_FRAMES);
+        table.header = {name, "ms/fr. first", "ms/fr. last", "active", "sorts skipped", "final error"};
+
+        for (bool enabled : {false, true}) {
+            option = enabled;
+
+            /// The first frames include the splash, the last ones the (nearly) settled fluid
+            const double msPerFrameFirst = runFrames(NUM_FRAMES).msPerFrame;
+            runFrames(2 * NUM_FRAMES, true);
+            const FrameStats last = runFrames(NUM_FRAMES, true);
+
+            s.calcDensities();
+            const float finalDensityError = s.measureDensityError();
+
+            table.rows.push_back({enabled ? "on" : "off", BenchmarkTable::Cell(msPerFrameFirst),
+                                  BenchmarkTable::Cell(last.msPerFrame), BenchmarkTable::Percent(last.activeFraction),
+                                  BenchmarkTable::Percent(last.skippedSortFraction),
+                                  BenchmarkTable::Cell(finalDensityError)});
+        }
+
+        option = originalOption;
+        s.reset();
+        return table;
+    }
+
+    BenchmarkTable Benchmarks::runSort() {
+        OCL_ERROR;
+        ParticleSimulationScene &s = mScene;
+        const uint numRepetitions = 10;
+        const uint binCount = s.mGridCL->binCount;
+        uint numBits = 1;
+        while ((1u << numBits) <= binCount) {
+            ++numBits;
+        }
+
+        BenchmarkTable table;
+        table.description = "Sort throughput: " + BenchmarkTable::Cell(binCount) + " bins, "
+                            + BenchmarkTable::Cell(numRepetitions) + " repetitions, uniformly distributed particles";
+        table.header = {"keys", "counting Mk/s", "radix Mk/s"};
+
+        const cl_ulong maxAllocationSize = s.mDevice.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>();
+        uint crossover = 0;
+
+        for (uint numKeys : {10000u, 30000u, 100000u, 300000u, 1000000u, 5000000u, 20000000u}) {
+            if (sizeof(cl_float4) * numKeys > maxAllocationSize) {
+                table.rows.push_back({BenchmarkTable::Cell(numKeys), "too large", "too large"});
+                continue;
+            }
+
+            /// The counting sort's insert and scan kernels, against the radix sort path producing the same bin
+            /// table and in-bin ranks (the reindexing that follows either is the same)
+            const glm::vec3 halfDims(s.mGridCL->halfDimensions.s[0], s.mGridCL->halfDimensions.s[1], s.mGridCL->halfDimensions.s[2]);
+            std::vector<glm::vec4> positions(numKeys);
+            for (glm::vec4 &position : positions) {
+                position = glm::vec4(glm::linearRand(-halfDims, halfDims), 0.0f);
+            }
+
+            cl::Buffer positionsCL, agesCL, binIDsCL, inBinIDsCL, keysCL[2], valuesCL[2], histogramsCL;
+            OCL_CHECK(positionsCL = cl::Buffer(s.mContext, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(cl_float4) * numKeys, positions.data(), CL_ERROR));
+            OCL_CHECK(agesCL = cl::Buffer(s.mContext, CL_MEM_READ_WRITE, sizeof(cl_float) * numKeys, (void*)0, CL_ERROR));
+            OCL_CHECK(binIDsCL = cl::Buffer(s.mContext, CL_MEM_READ_WRITE, sizeof(cl_uint) * numKeys, (void*)0, CL_ERROR));
+            OCL_CHECK(inBinIDsCL = cl::Buffer(s.mContext, CL_MEM_READ_WRITE, sizeof(cl_uint) * numKeys, (void*)0, CL_ERROR));
+            for (uint i = 0; i < 2; ++i) {
+                OCL_CHECK(keysCL[i] = cl::Buffer(s.mContext, CL_MEM_READ_WRITE, sizeof(cl_uint) * numKeys, (void*)0, CL_ERROR));
+                OCL_CHECK(valuesCL[i] = cl::Buffer(s.mContext, CL_MEM_READ_WRITE, sizeof(cl_uint) * numKeys, (void*)0, CL_ERROR));
+            }
+            OCL_CHECK(histogramsCL = cl::Buffer(s.mContext, CL_MEM_READ_WRITE, sizeof(cl_uint) * ParticleSimulationScene::GetRadixHistogramSize(numKeys), (void*)0, CL_ERROR));
+            OCL_CALL(s.mQueue.enqueueFillBuffer<cl_float>(agesCL, 0.0f, 0, sizeof(cl_float) * numKeys));
+            OCL_CALL(s.mQueue.finish());
+
+            const double countingTime = timeRepetitions(numRepetitions, [&]() {
+                OCL_CALL(s.mQueue.enqueueFillBuffer<cl_uint>(*s.mBinCountCL, 0, 0, sizeof(cl_uint) * (binCount + 1)));
+                OCL_CALL(s.mSortInsertParticles->setArg(0, positionsCL));
+                OCL_CALL(s.mSortInsertParticles->setArg(1, binIDsCL));
+                OCL_CALL(s.mSortInsertParticles->setArg(2, inBinIDsCL));
+                OCL_CALL(s.mSortInsertParticles->setArg(3, *s.mBinCountCL));
+                OCL_CALL(s.mSortInsertParticles->setArg(4, agesCL));
+                OCL_CALL(s.mSortInsertParticles->setArg(5, *s.mActiveRegionCL));
+                s.enqueueKernel(*s.mSortInsertParticles, numKeys);
+                OCL_CALL(s.mSortComputeBinStartID->setArg(0, *s.mBinCountCL));
+                OCL_CALL(s.mSortComputeBinStartID->setArg(1, *s.mBinStartIDCL));
+                s.enqueueKernel(*s.mSortComputeBinStartID, binCount + 1);
+            });
+
+            const double radixTime = timeRepetitions(numRepetitions, [&]() {
+                OCL_CALL(s.mSortComputeParticleKeys->setArg(0, positionsCL));
+                OCL_CALL(s.mSortComputeParticleKeys->setArg(1, binIDsCL));
+                OCL_CALL(s.mSortComputeParticleKeys->setArg(2, keysCL[0]));
+                OCL_CALL(s.mSortComputeParticleKeys->setArg(3, valuesCL[0]));
+                OCL_CALL(s.mSortComputeParticleKeys->setArg(4, agesCL));
+                s.enqueueKernel(*s.mSortComputeParticleKeys, numKeys);
+                s.radixSort(keysCL[0], valuesCL[0], keysCL[1], valuesCL[1], histogramsCL, numKeys, numBits);
+                OCL_CALL(s.mSortFindBinRanges->setArg(0, keysCL[0]));
+                OCL_CALL(s.mSortFindBinRanges->setArg(1, numKeys));
+                OCL_CALL(s.mSortFindBinRanges->setArg(2, *s.mBinStartIDCL));
+                OCL_CALL(s.mSortFindBinRanges->setArg(3, *s.mBinCountCL));
+                s.enqueueKernel(*s.mSortFindBinRanges, binCount + 1);
+                OCL_CALL(s.mSortComputeInBinIDs->setArg(0, keysCL[0]));
+                OCL_CALL(s.mSortComputeInBinIDs->setArg(1, valuesCL[0]));
+                OCL_CALL(s.mSortComputeInBinIDs->setArg(2, *s.mBinStartIDCL));
+                OCL_CALL(s.mSortComputeInBinIDs->setArg(3, inBinIDsCL));
+                s.enqueueKernel(*s.mSortComputeInBinIDs, numKeys);
+            });
+
+            const double countingRate = 1e-6 * numKeys / countingTime;
+            const double radixRate = 1e-6 * numKeys / radixTime;
+            table.rows.push_back({BenchmarkTable::Cell(numKeys), BenchmarkTable::Cell(countingRate),
+                                  BenchmarkTable::Cell(radixRate)});
+
+            if (crossover == 0 && radixRate > countingRate) {
+                crossover = numKeys;
+            }
+        }
+
+        if (crossover > 0) {
+            s.mRadixSortThreshold = crossover;
+            s.mSortTuning.set("radix_sort_threshold", crossover);
+            s.mSortTuning.save(OUTPUTPATH(ParticleSimulationScene::SORT_TUNING_FILE));
+            table.note = "Auto sorts with the radix sort from " + BenchmarkTable::Cell(crossover)
+                         + " particles on, saved to " + ParticleSimulationScene::SORT_TUNING_FILE;
+        }
+
+        /// The grid buffers were overwritten
+        s.reset();
+        return table;
+    }
+
+    BenchmarkTable Benchmarks::runPhases() {
+        typedef ParticleSimulationScene::SolverType SolverType;
+        ParticleSimulationScene &s = mScene;
+        const SolverType originalSolverType = s.mSolverType;
+
+        BenchmarkTable table;
+        table.description = "Frame phases: " + s.mCurrentFluidSetup + ", " + BenchmarkTable::Cell(NUM_FRAMES)
+                            + " frames, the queue is finished after every phase";
+        table.header = {"solver", "phase", "ms/frame"};
+
+        for (SolverType solverType : {SolverType::PBF, SolverType::DFSPH}) {
+            s.mSolverType = solverType;
+            const char *solverName = solverType == SolverType::PBF ? "PBF" : "DFSPH";
+
+            s.reset();
+
+            s.mPhaseTimes.clear();
+            s.mTimePhases = true;
+            runFrames(NUM_FRAMES, true);
+            s.mTimePhases = false;
+
+            double msPerFrame = 0.0;
+            for (const auto &phase : s.mPhaseTimes) {
+                const double ms = 1000 * phase.second / NUM_FRAMES;
+                table.rows.push_back({solverName, phase.first, BenchmarkTable::Cell(ms)});
+                msPerFrame += ms;
+            }
+            table.rows.push_back({solverName, "total", BenchmarkTable::Cell(msPerFrame)});
+        }
+
+        s.mSolverType = originalSolverType;
+        s.reset();
+        return table;
+    }
+
+    BenchmarkTable Benchmarks::runReduction() {
+        OCL_ERROR;
+        ParticleSimulationScene &s = mScene;
+        const uint numRepetitions = 10;
+        const char *TYPE_NAMES[] = {"float", "float3", "uint"};
+        const size_t TYPE_SIZES[] = {sizeof(cl_float), sizeof(cl_float3), sizeof(cl_uint)};
+
+        BenchmarkTable table;
+        table.description = "Reductions: " + BenchmarkTable::Cell(numRepetitions) + " repetitions of summing ones, "
+                            + "against a buffer copy of the same size (counting the bytes read and written)";
+        table.header = {"elements", "type", "ms", "GB/s", "copy GB/s", "sum"};
+
+        const cl_ulong maxAllocationSize = s.mDevice.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>();
+
+        for (cl_uint count : {1u << 20, 1u << 22, 1u << 24, 1u << 26}) {
+            for (uint type = 0; type < 3; ++type) {
+                const size_t numBytes = TYPE_SIZES[type] * count;
+                if (numBytes > maxAllocationSize) {
+                    table.rows.push_back({BenchmarkTable::Cell(count), TYPE_NAMES[type], "too large", "", "", ""});
+                    continue;
+                }
+
+                cl::Buffer inputCL, copyCL;
+                OCL_CHECK(inputCL = cl::Buffer(s.mContext, CL_MEM_READ_WRITE, numBytes, (void*)0, CL_ERROR));
+                OCL_CHECK(copyCL = cl::Buffer(s.mContext, CL_MEM_READ_WRITE, numBytes, (void*)0, CL_ERROR));
+                if (type == 2) {
+                    OCL_CALL(s.mQueue.enqueueFillBuffer<cl_uint>(inputCL, 1, 0, numBytes));
+                } else {
+                    OCL_CALL(s.mQueue.enqueueFillBuffer<cl_float>(inputCL, 1.0f, 0, numBytes));
+                }
+                OCL_CALL(s.mQueue.finish());
+
+                /// Sums of up to 2^26 ones are exact in floats, so every component must equal count
+                bool correct = true;
+                const double reductionTime = timeRepetitions(numRepetitions, [&]() {
+                    if (type == 0) {
+                        cl_float sum;
+                        OCL_CALL(s.mReduction->reduce(s.mQueue, util::DeviceReduction::Op::Sum, inputCL, count, &sum).wait());
+                        correct = correct && sum == count;
+                    } else if (type == 1) {
+                        cl_float3 sum;
+                        OCL_CALL(s.mReduction->reduce(s.mQueue, util::DeviceReduction::Op::Sum, inputCL, count, &sum).wait());
+                        correct = correct && sum.s[0] == count && sum.s[1] == count && sum.s[2] == count;
+                    } else {
+                        cl_uint sum;
+                        OCL_CALL(s.mReduction->reduce(s.mQueue, util::DeviceReduction::Op::Sum, inputCL, count, &sum).wait());
+                        correct = correct && sum == count;
+                    }
+                });
+
+                const double copyTime = timeRepetitions(numRepetitions, [&]() {
+                    OCL_CALL(s.mQueue.enqueueCopyBuffer(inputCL, copyCL, 0, 0, numBytes));
+                });
+
+                table.rows.push_back({BenchmarkTable::Cell(count), TYPE_NAMES[type],
+                                      BenchmarkTable::Cell(1000 * reductionTime),
+                                      BenchmarkTable::Cell(1e-9 * numBytes / reductionTime),
+                                      BenchmarkTable::Cell(2e-9 * numBytes / copyTime),
+                                      correct ? "ok" : "WRONG"});
+            }
+        }
+
+        return table;
+    }
+
+    BenchmarkTable Benchmarks::runWorkGroupTuning() {
+        ParticleSimulationScene &s = mScene;
+        /// 0 lets the implementation choose, which is also what every kernel falls back to without tuning
+        const size_t CANDIDATES[] = {0, 32, 64, 128, 256, 512};
+        const size_t maxLocalSize = s.mDevice.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>();
+
+        BenchmarkTable table;
+        table.description = "Work-group sizes: " + s.mCurrentFluidSetup + ", " + BenchmarkTable::Cell(NUM_FRAMES)
+                            + " frames per size, the queue is finished after every kernel";
+        table.header = {"kernel", "default ms", "size", "ms"};
+
+        std::map<std::string, std::pair<size_t, double>> best;
+        std::map<std::string, double> defaultTimes;
+        s.mTuningWorkGroups = true;
+        for (size_t localSize : CANDIDATES) {
+            if (localSize > maxLocalSize) {
+                continue;
+            }
+
+            s.mTuningLocalSize = localSize;
+            s.reset();
+            s.mKernelTimes.clear();
+            runFrames(NUM_FRAMES, true);
+
+            for (const auto &kernel : s.mKernelTimes) {
+                auto iter = best.find(kernel.first);
+                if (iter == best.end() || kernel.second < iter->second.second) {
+                    best[kernel.first] = std::make_pair(localSize, kernel.second);
+                }
+                if (localSize == 0) {
+                    defaultTimes[kernel.first] = kernel.second;
+                }
+            }
+        }
+        s.mTuningWorkGroups = false;
+
+        s.mWorkGroupSizes.clear();
+        s.mKernelLaunchInfo.clear();
+        for (const auto &kernel : best) {
+            s.mWorkGroupSizes.set(kernel.first, kernel.second.first);
+            table.rows.push_back({kernel.first, BenchmarkTable::Cell(1000 * defaultTimes[kernel.first] / NUM_FRAMES),
+                                  BenchmarkTable::Cell(kernel.second.first),
+                                  BenchmarkTable::Cell(1000 * kernel.second.second / NUM_FRAMES)});
+        }
+
+        s.mWorkGroupSizes.save(OUTPUTPATH(ParticleSimulationScene::WORK_GROUP_SIZES_FILE));
+        table.note = "Saved to " + ParticleSimulationScene::WORK_GROUP_SIZES_FILE;
+        s.reset();
+        return table;
+    }
+
+    const uint Benchmarks::NUM_FRAMES = 300;
+}
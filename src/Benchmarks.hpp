@@ -0,0 +1,99 @@
+#pragma once
+
+#include <functional>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <CL/cl.hpp>
+
+namespace pbf {
+    class ParticleSimulationScene;
+
+    /// @brief The results of a benchmark as a table of formatted cells, shown in the GUI
+    struct BenchmarkTable {
+        /// What was measured and how, e.g. the fluid setup and the number of frames
+        std::string description;
+        std::vector<std::string> header;
+        std::vector<std::vector<std::string>> rows;
+        /// A closing remark, such as the tuned values that were saved
+        std::string note;
+
+        template<typename T>
+        static std::string Cell(const T &value) {
+            std::ostringstream ss;
+            ss << value;
+            return ss.str();
+        }
+
+        static std::string Percent(double fraction) {
+            return Cell(100 * fraction) + "%";
+        }
+    };
+
+    /// @brief The benchmarks and the work-group size tuning of a ParticleSimulationScene. Each runs on the
+    /// scene's current setup, restores the options it changes and returns its results rather than printing them
+    class Benchmarks {
+    public:
+        explicit Benchmarks(ParticleSimulationScene &scene) : mScene(scene) {}
+
+        /// Compares iterations-to-tolerance with and without warm-started λ
+        BenchmarkTable runWarmStart();
+
+        /// Compares density error against frame time for the Jacobi and Gauss-Seidel solvers
+        BenchmarkTable runColouring();
+
+        /// Compares PBF against DFSPH at larger timesteps (cost per simulated second and density error)
+        BenchmarkTable runSolverType();
+
+        /// Compares half against full precision storage on all fluid setups (memory, frame time, error)
+        BenchmarkTable runHalfStorage();
+
+        /// Strong scaling of the frame time over 1, 2, ... sub-devices
+        BenchmarkTable runSlabScaling();
+
+        /// Frame time, active particle fraction and skipped sorts with and without an option while the fluid settles
+        BenchmarkTable runSettling(const std::string &name, bool &option);
+
+        /// Sort throughput of the counting and the radix sort path for 10k to 20M keys. The smallest count at
+        /// which the radix sort wins becomes the scene's radix sort threshold, saved for this device
+        BenchmarkTable runSort();
+
+        /// Time per frame spent in each phase of both solvers
+        BenchmarkTable runPhases();
+
+        /// Throughput of the float, float3 and uint reductions for 1M to 64M elements against that of a buffer copy
+        BenchmarkTable runReduction();
+
+        /// Times every kernel launched through enqueueKernel with each candidate local size on the current
+        /// setup, keeps the fastest per kernel and saves them for this device
+        BenchmarkTable runWorkGroupTuning();
+
+    private:
+        /// Averages over the frames of a run
+        struct FrameStats {
+            double msPerFrame;
+            double finalDensityError;
+            /// Average over the frames that reached the tolerance within numSubSteps iterations
+            double iterationsToTolerance;
+            double fractionReachedTolerance;
+            /// Fractions of the particles that were awake and of the frames that skipped the sort
+            double activeFraction;
+            double skippedSortFraction;
+        };
+
+        /// The timing helper of all frame-based benchmarks: resets the current fluid setup unless continuing,
+        /// then simulates numFrames frames while collecting statistics
+        FrameStats runFrames(uint numFrames, bool continuing = false);
+
+        /// Like runFrames, but times a run without density read-backs and measures errors in a second run
+        FrameStats runTimedFrames(uint numFrames);
+
+        /// The average time in seconds of enqueueing work and finishing the queue, over numRepetitions
+        double timeRepetitions(uint numRepetitions, const std::function<void()> &work);
+
+        ParticleSimulationScene &mScene;
+
+        static const uint NUM_FRAMES;
+    };
+}
@@ -1,5 +1,6 @@
 #include <OpenCL/opencl.h>
 #include "ParticleSimulationScene.hpp"
+#include "Benchmarks.hpp"
 
 #include <glm/ext.hpp>
 #include "util/paths.hpp"
@@ -11,6 +12,10 @@
 #include "geometry/Primitives.hpp"
 
 #include <iomanip>
+#include <algorithm>
+#include <numeric>
+#include <set>
+#include <cstring>
 
 #define FIRST_BUFFER 0
 #define SECOND_BUFFER 1
@@ -54,6 +59,46 @@ namespace pbf {
         mGridCL->binCount = 16 * 20 * 20;
 
         mFluidCL = pbf::Fluid::GetDefault();
+        mSpecializeFluid = false;
+        mUseHalfStorage = false;
+        mNumSlabs = 0;
+        mSlabBinStartIDsPending = false;
+        mSolidDensity = 500.0f;
+        mObstacleType = ObstacleType::None;
+        mBuiltObstacleType = ObstacleType::None;
+        mBoundaryKernelRadius = mFluidCL->kernelRadius;
+        mUseBoundaryParticles = false;
+        mBoundaryParticles = false;
+        mNumBoundaryParticles = 0;
+        mHalfStorage = false;
+        mUseSingleSolverProgram = false;
+        mSingleSolverProgram = false;
+        mWarmStartBlend = 0.0f;
+        mSolverType = SolverType::PBF;
+        mSolverColouring = SolverColouring::Jacobi;
+        mSortMethod = SortMethod::Auto;
+        mTimePhases = false;
+        mPhaseBeginTime = 0.0;
+        mScreen = nullptr;
+        mBenchmarkWindow = nullptr;
+        /// The crossover measured on an earlier run on this device, else a guess: the contention of the counting
+        /// sort's atomics is worst on GPUs, local memory is emulated on CPUs
+        mSortTuning.setDevice(mDevice);
+        if (mSortTuning.load(OUTPUTPATH(SORT_TUNING_FILE)) && mSortTuning.has("radix_sort_threshold")) {
+            mRadixSortThreshold = static_cast<uint>(mSortTuning.get("radix_sort_threshold"));
+        } else {
+            mRadixSortThreshold = mDevice.getInfo<CL_DEVICE_TYPE>() & CL_DEVICE_TYPE_GPU ? 256 * 1024 : 4 * 1024 * 1024;
+        }
+        mTuningWorkGroups = false;
+        mTuningLocalSize = 0;
+        /// Sizes tuned on an earlier run on this device, else the implementation chooses
+        mWorkGroupSizes.setDevice(mDevice);
+        if (mWorkGroupSizes.load(OUTPUTPATH(WORK_GROUP_SIZES_FILE))) {
+            std::cout << "Loaded tuned work-group sizes from " << WORK_GROUP_SIZES_FILE << std::endl;
+        }
+
+        mMeasureConvergence = false;
+        mConvergenceTolerance = 0.01f;
 
         mSpawnPoint = glm::vec2(0.0f, 0.0f);
         mSpawnPointSphere.mRadius = 0.2f;
@@ -67,6 +112,35 @@ namespace pbf {
         );
         mSpawnPointSphereObject->setPosition(getWorldSpawnPoint());
 
+        mSpawnEmitterType = pbf::Emitter::Type::Disc;
+        mSpawnEmitter = pbf::Emitter(mSpawnEmitterType, getWorldSpawnPoint(), glm::vec3(1.0f, 0.0f, 0.0f),
+                                     0.15f, 2.0f, 6000.0f);
+        mSpawnEmitterCarry = 0.0f;
+        mEmissionSequenceOffset = 0;
+        mGeneratorJitter = 0.0f;
+        mNextParticleID = 0;
+        mMaxParticleAge = 0.0f;
+        mLiveParticleCount = 0;
+        mLiveParticleCountPending = false;
+        mUseSleepingBins = false;
+        mSleepingBins = false;
+        mSleepDisplacement = 0.0005f;
+        mSleepCompression = 0.05f;
+        mSleepFrame = 0;
+        mNumActiveParticles = 0;
+        mUseIncrementalSort = false;
+        mLooseGrid = false;
+        mResortFraction = 0.05f;
+        mNumSortedParticles = 0;
+        mUseActiveRegion = true;
+        mActiveRegionValid = false;
+        mNumSorts = 0;
+        mNumSkippedSorts = 0;
+        mMovedParticleCountersPending = false;
+        mMaxParticles = NUM_MAX_PARTICLES;
+        mNumDroppedParticles = 0;
+        mSkipSort = false;
+
         /// Create lights
         mAmbLight = std::make_shared<clgl::AmbientLight>(glm::vec3(0.3f, 0.3f, 1.0f), 0.2f);
         mDirLight = std::make_shared<clgl::DirectionalLight>(glm::vec3(1.0f, 1.0f, 1.0f), 0.1f);
@@ -84,21 +158,22 @@ namespace pbf {
         mPredictedPositionsGL[FIRST_BUFFER] = make_unique<VertexBuffer>(GL_ARRAY_BUFFER, GL_DYNAMIC_DRAW);
         mPredictedPositionsGL[SECOND_BUFFER] = make_unique<VertexBuffer>(GL_ARRAY_BUFFER, GL_DYNAMIC_DRAW);
 
+        /// Setup the obstacle fields, which are unused until an obstacle is built
+        OCL_ERROR;
+        OCL_CHECK(mSDFCL = make_unique<cl::Buffer>(mContext, CL_MEM_READ_WRITE, sizeof(cl_float) * getNumSDFNodes(), (void*)0, CL_ERROR));
+        OCL_CHECK(mBoundaryVolumeCL = make_unique<cl::Buffer>(mContext, CL_MEM_READ_WRITE, sizeof(cl_float) * getNumSDFNodes(), (void*)0, CL_ERROR));
+        OCL_CHECK(mBoundaryParticlesCL = make_unique<cl::Buffer>(mContext, CL_MEM_READ_ONLY, sizeof(cl_float4), (void*)0, CL_ERROR));
+        OCL_CHECK(mBoundaryBinStartIDCL = make_unique<cl::Buffer>(mContext, CL_MEM_READ_ONLY, sizeof(cl_uint) * mGridCL->binCount, (void*)0, CL_ERROR));
+        OCL_CHECK(mBoundaryBinCountCL = make_unique<cl::Buffer>(mContext, CL_MEM_READ_ONLY, sizeof(cl_uint) * mGridCL->binCount, (void*)0, CL_ERROR));
 
-        /// Create OpenGL vertex array, representing each particle
-        mParticles[FIRST_BUFFER] = make_unique<VertexArray>();
-        mParticles[FIRST_BUFFER]->bind();
-        mParticles[FIRST_BUFFER]->addVertexAttribute(*mPositionsGL[FIRST_BUFFER], 4, GL_FLOAT, GL_FALSE, /*3*sizeof(GLfloat)*/ 0);
-        mParticles[FIRST_BUFFER]->addVertexAttribute(*mVelocitiesGL[FIRST_BUFFER], 4, GL_FLOAT, GL_FALSE, /*3*sizeof(GLfloat)*/ 0);
-        mParticles[FIRST_BUFFER]->addVertexAttribute(*mDensitiesGL, 1, GL_FLOAT, GL_FALSE, /*sizeof(GLfloat)*/ 0);
-        mParticles[FIRST_BUFFER]->unbind();
+        OCL_CHECK(mParticleCounterCL = make_unique<cl::Buffer>(mContext, CL_MEM_READ_WRITE, sizeof(cl_uint), (void*)0, CL_ERROR));
+        OCL_CHECK(mSinksCL = make_unique<cl::Buffer>(mContext, CL_MEM_READ_ONLY, sizeof(pbf::Sink) * NUM_MAX_SINKS, (void*)0, CL_ERROR));
 
-        mParticles[SECOND_BUFFER] = make_unique<VertexArray>();
-        mParticles[SECOND_BUFFER]->bind();
-        mParticles[SECOND_BUFFER]->addVertexAttribute(*mPositionsGL[SECOND_BUFFER], 4, GL_FLOAT, GL_FALSE, /*3*sizeof(GLfloat)*/ 0);
-        mParticles[SECOND_BUFFER]->addVertexAttribute(*mVelocitiesGL[FIRST_BUFFER], 4, GL_FLOAT, GL_FALSE, /*3*sizeof(GLfloat)*/ 0);
-        mParticles[SECOND_BUFFER]->addVertexAttribute(*mDensitiesGL, 1, GL_FLOAT, GL_FALSE, /*sizeof(GLfloat)*/ 0);
-        mParticles[SECOND_BUFFER]->unbind();
+        /// Setup the bin activity buffers, which are unused until sleeping bins are enabled
+        OCL_CHECK(mBinLastActiveFrameCL = make_unique<cl::Buffer>(mContext, CL_MEM_READ_WRITE, sizeof(cl_uint) * mGridCL->binCount, (void*)0, CL_ERROR));
+        OCL_CHECK(mAwakeBinCountCL = make_unique<cl::Buffer>(mContext, CL_MEM_READ_WRITE, sizeof(cl_uint) * (mGridCL->binCount + 1), (void*)0, CL_ERROR));
+        OCL_CHECK(mActiveBinStartIDCL = make_unique<cl::Buffer>(mContext, CL_MEM_READ_WRITE, sizeof(cl_uint) * (mGridCL->binCount + 1), (void*)0, CL_ERROR));
+        OCL_CHECK(mMovedParticleCountersCL = make_unique<cl::Buffer>(mContext, CL_MEM_READ_WRITE, 2 * sizeof(cl_uint), (void*)0, CL_ERROR));
 
         loadKernels();
     }
@@ -110,6 +185,7 @@ namespace pbf {
         mCamera->setClipPlanes(0.01f, 100.f);
 
         using namespace nanogui;
+        mScreen = screen;
         Window *win = new Window(screen, "Scene Controls");
         win->setPosition(Eigen::Vector2i(15, 125));
         win->setLayout(new GroupLayout());
@@ -121,7 +197,7 @@ namespace pbf {
         });
         b = new Button(win, "Reload kernels");
         b->setCallback([this]() {
-            loadKernels();
+            reloadKernels();
         });
 
         /// Fluid scenes
@@ -142,9 +218,120 @@ namespace pbf {
             this->loadFluidSetup(mCurrentFluidSetup);
         });
 
+        /// Generated on the device at the rest spacing, see getGeneratedFluidSetup
+        for (const std::string &name : {"dam-break", "drop", "column"}) {
+            b = new Button(win, "Generated " + name);
+            b->setCallback([this, name]() {
+                mCurrentFluidSetup = GENERATED_SETUP_PREFIX + name;
+                this->loadFluidSetup(mCurrentFluidSetup);
+            });
+        }
+
+        /// Emitters that stay on, copied from the spawn point's emitter
+        new Label(win, "Emitters");
+        b = new Button(win, "Add emitter at spawn point");
+        b->setCallback([this]() {
+            const float offset = mSpawnEmitterType == pbf::Emitter::Type::Disc ? 0.05f : mSpawnEmitter.radius + 0.05f;
+            mEmitters.push_back(pbf::Emitter(mSpawnEmitterType, getWorldSpawnPoint() + glm::vec3(offset, 0.0f, 0.0f),
+                                             glm::vec3(1.0f, 0.0f, 0.0f),
+                                             mSpawnEmitter.radius, mSpawnEmitter.speed, mSpawnEmitter.rate));
+            mEmitterCarries.push_back(0.0f);
+        });
+        b = new Button(win, "Clear emitters");
+        b->setCallback([this]() {
+            mEmitters.clear();
+            mEmitterCarries.clear();
+        });
+
+        /// Sinks delete the particles entering them
+        new Label(win, "Sinks");
+        b = new Button(win, "Add drain");
+        b->setCallback([this]() {
+            if (mSinks.size() >= NUM_MAX_SINKS) {
+                return;
+            }
+
+            /// A drain in the floor next to the wall opposite the spawn point
+            const glm::vec3 halfDims(mBoundsCL->halfDimensions.s[0], mBoundsCL->halfDimensions.s[1], mBoundsCL->halfDimensions.s[2]);
+            mSinks.push_back(pbf::Sink(glm::vec3(halfDims.x - 0.1f, -halfDims.y + 0.05f, 0.0f),
+                                       glm::vec3(0.1f, 0.1f, 0.3f)));
+            uploadSinks();
+        });
+        b = new Button(win, "Clear sinks");
+        b->setCallback([this]() {
+            mSinks.clear();
+        });
+
+        /// Rigid bodies, coupled with the fluid in both directions
+        new Label(win, "Solids");
+        b = new Button(win, "Add 10 spheres");
+        b->setCallback([this]() {
+            addSolids(STYPE_SPHERE, 10);
+        });
+        b = new Button(win, "Add 10 boxes");
+        b->setCallback([this]() {
+            addSolids(STYPE_BOX, 10);
+        });
+        b = new Button(win, "Clear solids");
+        b->setCallback([this]() {
+            clearSolids();
+        });
+
+        /// Benchmarks, whose results are shown in a window of their own
+        new Label(win, "Benchmarks");
+        b = new Button(win, "Warm-started λ");
+        b->setCallback([this]() {
+            showBenchmarkResults(Benchmarks(*this).runWarmStart());
+        });
+        b = new Button(win, "Solver colouring");
+        b->setCallback([this]() {
+            showBenchmarkResults(Benchmarks(*this).runColouring());
+        });
+        b = new Button(win, "PBF vs. DFSPH");
+        b->setCallback([this]() {
+            showBenchmarkResults(Benchmarks(*this).runSolverType());
+        });
+        b = new Button(win, "Half storage");
+        b->setCallback([this]() {
+            showBenchmarkResults(Benchmarks(*this).runHalfStorage());
+        });
+        b = new Button(win, "Sleeping bins");
+        b->setCallback([this]() {
+            showBenchmarkResults(Benchmarks(*this).runSettling("sleeping", mUseSleepingBins));
+        });
+        b = new Button(win, "Incremental sort");
+        b->setCallback([this]() {
+            showBenchmarkResults(Benchmarks(*this).runSettling("incr. sort", mUseIncrementalSort));
+        });
+        b = new Button(win, "Sort throughput");
+        b->setCallback([this]() {
+            showBenchmarkResults(Benchmarks(*this).runSort());
+        });
+        b = new Button(win, "Frame phases");
+        b->setCallback([this]() {
+            showBenchmarkResults(Benchmarks(*this).runPhases());
+        });
+        b = new Button(win, "Reductions");
+        b->setCallback([this]() {
+            showBenchmarkResults(Benchmarks(*this).runReduction());
+        });
+        b = new Button(win, "Work-group sizes");
+        b->setCallback([this]() {
+            showBenchmarkResults(Benchmarks(*this).runWorkGroupTuning());
+        });
+        if (!mSubDeviceQueues.empty()) {
+            b = new Button(win, "Slab scaling");
+            b->setCallback([this]() {
+                showBenchmarkResults(Benchmarks(*this).runSlabScaling());
+            });
+        }
+
         /// FPS Labels
         mLabelAverageFrameTime = new Label(win, "");
         mLabelFPS = new Label(win, "");
+        mLabelActiveParticles = new Label(win, "");
+        mLabelSkippedSorts = new Label(win, "");
+        mLabelParticleCount = new Label(win, "");
         updateTimeLabelsInGUI(0.0);
 
         /// Particles size
@@ -180,18 +367,69 @@ namespace pbf {
         gui->addVariable("c", mFluidCL->c);
         gui->addVariable("k_vc", mFluidCL->k_vc);
         gui->addVariable("kBoundsDensity", mFluidCL->kBoundsDensity);
+        gui->addVariable("Specialise kernels", mSpecializeFluid);
+        gui->addVariable("Half storage", mUseHalfStorage);
+        gui->addVariable("Single program", mUseSingleSolverProgram);
+        gui->addVariable("Solid density", mSolidDensity);
+        gui->addVariable("Obstacle", mObstacleType)
+                ->setItems({"None", "Sphere", "Weir"});
+        gui->addVariable("Boundary particles", mUseBoundaryParticles);
+        gui->addVariable("Generator jitter", mGeneratorJitter)
+                ->setTooltip("Displacement of generated particles from their lattice, as a fraction of the spacing");
+        gui->addVariable("Emitter shape", mSpawnEmitterType)
+                ->setItems({"Disc", "Box", "Sphere"});
+        gui->addVariable("Emitter radius", mSpawnEmitter.radius);
+        gui->addVariable("Emission speed", mSpawnEmitter.speed);
+        gui->addVariable("Emission rate", mSpawnEmitter.rate);
+        gui->addVariable("Particle lifetime", mMaxParticleAge)
+                ->setTooltip("Seconds until a particle is deleted, 0 keeps particles forever");
+        if (!mSubDeviceQueues.empty()) {
+            gui->addVariable("Slabs", mNumSlabs)
+                    ->setTooltip("Number of sub-devices to distribute the solver over, 0 uses the whole device");
+        }
+        gui->addVariable("Warm start λ", mWarmStartBlend);
+        gui->addVariable("Sleeping bins", mUseSleepingBins)
+                ->setTooltip("Skip the PBF solver in regions at rest (not with DFSPH or rigid bodies)");
+        gui->addVariable("Sleep displacement", mSleepDisplacement);
+        gui->addVariable("Sleep compression", mSleepCompression);
+        gui->addVariable("Incremental sort", mUseIncrementalSort)
+                ->setTooltip("Only sort when enough particles changed bins (not with DFSPH or rigid bodies)");
+        gui->addVariable("Re-sort fraction", mResortFraction);
+        gui->addVariable("Sort method", mSortMethod)
+                ->setItems({"Counting", "Radix", "Auto"});
+        gui->addVariable("Radix sort from", mRadixSortThreshold)
+                ->setTooltip("Particle count from which Auto uses the radix sort, measured by the sort benchmark");
+        gui->addVariable("Clip grid to fluid", mUseActiveRegion)
+                ->setTooltip("Clear and scan only the bins around the particles in the counting sort");
+        gui->addVariable("Solver type", mSolverType)
+                ->setItems({"PBF", "DFSPH"});
+        gui->addVariable("Solver", mSolverColouring)
+                ->setItems({"Jacobi", "8-colour GS", "27-colour GS"});
     }
 
     void ParticleSimulationScene::loadFluidSetup(const std::string &path) {
+        const std::vector<pbf::FluidVolume> volumes = getGeneratedFluidSetup(path);
+        if (!volumes.empty()) {
+            generateFluidSetup(volumes);
+            return;
+        }
+
         std::ifstream ifs(path.c_str());
 
-        const unsigned int MAX_PARTICLES = 10000;
-        std::vector<glm::vec4> positions(MAX_PARTICLES);
-        std::vector<glm::vec4> velocities(MAX_PARTICLES);
-        std::vector<float> densities(MAX_PARTICLES);
+        std::vector<glm::vec4> positions(NUM_MAX_PARTICLES);
+        std::vector<glm::vec4> velocities(NUM_MAX_PARTICLES);
+        std::vector<float> densities(NUM_MAX_PARTICLES);
+
+        /// Loaded setups get the default capacity, which leaves room for the emitters
+        mMaxParticles = NUM_MAX_PARTICLES;
+        mNumDroppedParticles = 0;
 
         if (ifs.is_open() && !ifs.eof()) {
             ifs >> mNumParticles;
+            if (mNumParticles > NUM_MAX_PARTICLES) {
+                mNumDroppedParticles = mNumParticles - NUM_MAX_PARTICLES;
+                mNumParticles = NUM_MAX_PARTICLES;
+            }
 
             while (!ifs.eof()) {
                 for (unsigned int id = 0; id < mNumParticles; ++id) {
@@ -207,39 +445,165 @@ namespace pbf {
         initializeParticleStates(std::move(positions), std::move(velocities), std::move(densities));
     }
 
+    std::vector<pbf::FluidVolume> ParticleSimulationScene::getGeneratedFluidSetup(const std::string &name) const {
+        typedef pbf::FluidVolume::Type Type;
+        const glm::vec3 halfDims(mBoundsCL->halfDimensions.s[0], mBoundsCL->halfDimensions.s[1], mBoundsCL->halfDimensions.s[2]);
+
+        if (name == GENERATED_SETUP_PREFIX + "dam-break") {
+            /// A block against the -x wall, filling the bottom half of the container
+            const glm::vec3 blockHalfDims(0.4f * halfDims.x, 0.5f * halfDims.y, halfDims.z);
+            return {pbf::FluidVolume(Type::Box, blockHalfDims - halfDims, blockHalfDims)};
+        }
+        if (name == GENERATED_SETUP_PREFIX + "drop") {
+            /// A sphere above a shallow pool
+            const glm::vec3 poolHalfDims(halfDims.x, 0.15f * halfDims.y, halfDims.z);
+            return {pbf::FluidVolume(Type::Box, glm::vec3(0.0f, poolHalfDims.y - halfDims.y, 0.0f), poolHalfDims),
+                    pbf::FluidVolume(Type::Sphere, glm::vec3(0.0f, 0.4f * halfDims.y, 0.0f), glm::vec3(0.3f * halfDims.x))};
+        }
+        if (name == GENERATED_SETUP_PREFIX + "column") {
+            /// A column of water standing in the middle of the container
+            return {pbf::FluidVolume(Type::Cylinder, glm::vec3(0.0f, -0.2f * halfDims.y, 0.0f),
+                                     glm::vec3(0.35f * halfDims.x, 0.8f * halfDims.y, 0.0f))};
+        }
+        return {};
+    }
+
+    void ParticleSimulationScene::generateFluidSetup(const std::vector<pbf::FluidVolume> &volumes) {
+        OCL_ERROR;
+
+        /// The lattice spans the bounding box of the volumes within the bounds, at the rest spacing of particles of unit mass
+        const float spacing = std::cbrt(1.0f / mFluidCL->restDensity);
+        const glm::vec3 halfDims(mBoundsCL->halfDimensions.s[0], mBoundsCL->halfDimensions.s[1], mBoundsCL->halfDimensions.s[2]);
+        glm::vec3 lower = halfDims;
+        glm::vec3 upper = -halfDims;
+        for (const pbf::FluidVolume &volume : volumes) {
+            const glm::vec3 position(volume.position.s[0], volume.position.s[1], volume.position.s[2]);
+            glm::vec3 extent(volume.halfDimensions.s[0], volume.halfDimensions.s[1], volume.halfDimensions.s[2]);
+            if (volume.type == FLUID_VOLUME_SPHERE) {
+                extent = glm::vec3(extent.x);
+            } else if (volume.type == FLUID_VOLUME_CYLINDER) {
+                extent = glm::vec3(extent.x, extent.y, extent.x);
+            }
+            lower = glm::min(lower, position - extent);
+            upper = glm::max(upper, position + extent);
+        }
+        lower = glm::max(lower, -halfDims);
+        upper = glm::min(upper, halfDims);
+        const glm::uvec3 latticeSize(glm::max(glm::floor((upper - lower) / spacing), glm::vec3(0.0f)));
+        const uint numNodes = latticeSize.x * latticeSize.y * latticeSize.z;
+        const glm::vec3 origin = lower + 0.5f * spacing;
+
+        cl::Buffer volumesCL;
+        OCL_CHECK(volumesCL = cl::Buffer(mContext, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                                         sizeof(pbf::FluidVolume) * volumes.size(), (void*)volumes.data(), CL_ERROR));
+
+        OCL_CALL(mFillFluidVolumes->setArg(0, volumesCL));
+        OCL_CALL(mFillFluidVolumes->setArg(1, static_cast<cl_uint>(volumes.size())));
+        OCL_CALL(mFillFluidVolumes->setArg(2, cl_float3{{origin.x, origin.y, origin.z, 0.0f}}));
+        OCL_CALL(mFillFluidVolumes->setArg(3, cl_uint3{{latticeSize.x, latticeSize.y, latticeSize.z, 0}}));
+        OCL_CALL(mFillFluidVolumes->setArg(4, spacing));
+        OCL_CALL(mFillFluidVolumes->setArg(5, glm::clamp(mGeneratorJitter, 0.0f, 0.5f)));
+        OCL_CALL(mFillFluidVolumes->setArg(8, *mParticleCounterCL));
+
+        /// Count the particles inside the volumes first, writing none of them, and size the buffers to fit them
+        /// within the device's memory
+        cl_uint numParticles = 0;
+        if (numNodes > 0) {
+            OCL_CALL(mQueue.enqueueFillBuffer<cl_uint>(*mParticleCounterCL, 0, 0, sizeof(cl_uint)));
+            OCL_CALL(mFillFluidVolumes->setArg(6, *mParticleCounterCL));
+            OCL_CALL(mFillFluidVolumes->setArg(7, *mParticleCounterCL));
+            OCL_CALL(mFillFluidVolumes->setArg(9, 0u));
+            enqueueKernel(*mFillFluidVolumes, numNodes);
+            OCL_CALL(mQueue.enqueueReadBuffer(*mParticleCounterCL, CL_TRUE, 0, sizeof(cl_uint), &numParticles));
+        }
+        mMaxParticles = std::max(NUM_MAX_PARTICLES, std::min(numParticles, getMaxParticleCapacity()));
+        mNumDroppedParticles = numParticles > mMaxParticles ? numParticles - mMaxParticles : 0;
+
+        /// Allocate the particle buffers without uploading anything, then fill them on the device
+        mNumParticles = 0;
+        initializeParticleStates(std::vector<glm::vec4>(), std::vector<glm::vec4>(), std::vector<float>());
+
+        glFinish();
+        OCL_CALL(mQueue.enqueueAcquireGLObjects(&mMemObjects));
+
+        const size_t positionsSize = sizeof(cl_float4) * mMaxParticles;
+        OCL_CALL(mQueue.enqueueFillBuffer<cl_float>(*mPositionsCL[FIRST_BUFFER], 0.0f, 0, positionsSize));
+        OCL_CALL(mQueue.enqueueFillBuffer<cl_uchar>(*mVelocitiesCL[FIRST_BUFFER], 0, 0, getVelocityStride() * mMaxParticles));
+        OCL_CALL(mQueue.enqueueFillBuffer<cl_uchar>(*mVelocitiesCL[SECOND_BUFFER], 0, 0, getVelocityStride() * mMaxParticles));
+        OCL_CALL(mQueue.enqueueFillBuffer<cl_uchar>(*mDensitiesCL, 0, 0, getDensityStride() * mMaxParticles));
+        OCL_CALL(mQueue.enqueueFillBuffer<cl_uint>(*mParticleCounterCL, 0, 0, sizeof(cl_uint)));
+
+        if (numNodes > 0) {
+            OCL_CALL(mFillFluidVolumes->setArg(6, *mPositionsCL[FIRST_BUFFER]));
+            OCL_CALL(mFillFluidVolumes->setArg(7, *mParticleIDsCL[FIRST_BUFFER]));
+            OCL_CALL(mFillFluidVolumes->setArg(9, mMaxParticles));
+            enqueueKernel(*mFillFluidVolumes, numNodes);
+        }
+
+        /// Every position buffer starts out with the same positions, like a loaded setup
+        OCL_CALL(mQueue.enqueueCopyBuffer(*mPositionsCL[FIRST_BUFFER], *mPositionsCL[SECOND_BUFFER], 0, 0, positionsSize));
+        OCL_CALL(mQueue.enqueueCopyBuffer(*mPositionsCL[FIRST_BUFFER], *mPredictedPositionsCL[FIRST_BUFFER], 0, 0, positionsSize));
+        OCL_CALL(mQueue.enqueueCopyBuffer(*mPositionsCL[FIRST_BUFFER], *mPredictedPositionsCL[SECOND_BUFFER], 0, 0, positionsSize));
+        OCL_CALL(mQueue.enqueueCopyBuffer(*mParticleIDsCL[FIRST_BUFFER], *mParticleIDsCL[SECOND_BUFFER], 0, 0,
+                                          sizeof(cl_uint) * mMaxParticles));
+        OCL_CALL(mQueue.enqueueReleaseGLObjects(&mMemObjects));
+        OCL_CALL(mQueue.finish());
+
+        /// The particles that didn't fit are shown in the GUI
+        mNumParticles = std::min(numParticles, mMaxParticles);
+        mNextParticleID = mNumParticles;
+    }
+
     void ParticleSimulationScene::initializeParticleStates(std::vector<glm::vec4> &&positions,
                                                            std::vector<glm::vec4> &&velocities,
                                                            std::vector<float> &&densities) {
+        /// Velocities and densities are uploaded in the storage format the kernels were built for
+        /// Empty vectors leave the buffers uninitialized, for setups that are generated on the device
+        std::vector<glm::uint64> halfVelocities;
+        std::vector<glm::uint16> halfDensities;
+        const void *positionData = positions.empty() ? nullptr : &positions[0];
+        const void *velocityData = velocities.empty() ? nullptr : &velocities[0];
+        const void *densityData = densities.empty() ? nullptr : &densities[0];
+        if (mHalfStorage && !velocities.empty()) {
+            halfVelocities = util::pack_half4s(velocities);
+            halfDensities = util::pack_halfs(densities);
+            velocityData = &halfVelocities[0];
+            densityData = &halfDensities[0];
+        }
+
         mPositionsGL[FIRST_BUFFER]->bind();
-        mPositionsGL[FIRST_BUFFER]->bufferData(4 * sizeof(float) * NUM_MAX_PARTICLES, &positions[0]);
+        mPositionsGL[FIRST_BUFFER]->bufferData(4 * sizeof(float) * mMaxParticles, positionData);
         mPositionsGL[FIRST_BUFFER]->unbind();
 
         mVelocitiesGL[FIRST_BUFFER]->bind();
-        mVelocitiesGL[FIRST_BUFFER]->bufferData(4 * sizeof(float) * NUM_MAX_PARTICLES, &velocities[0]);
+        mVelocitiesGL[FIRST_BUFFER]->bufferData(getVelocityStride() * mMaxParticles, velocityData);
         mVelocitiesGL[FIRST_BUFFER]->unbind();
 
         mPositionsGL[SECOND_BUFFER]->bind();
-        mPositionsGL[SECOND_BUFFER]->bufferData(4 * sizeof(float) * NUM_MAX_PARTICLES, &positions[0]);
+        mPositionsGL[SECOND_BUFFER]->bufferData(4 * sizeof(float) * mMaxParticles, positionData);
         mPositionsGL[SECOND_BUFFER]->unbind();
 
         mVelocitiesGL[SECOND_BUFFER]->bind();
-        mVelocitiesGL[SECOND_BUFFER]->bufferData(4 * sizeof(float) * NUM_MAX_PARTICLES, &velocities[0]);
+        mVelocitiesGL[SECOND_BUFFER]->bufferData(getVelocityStride() * mMaxParticles, velocityData);
         mVelocitiesGL[SECOND_BUFFER]->unbind();
 
         mPredictedPositionsGL[FIRST_BUFFER]->bind();
-        mPredictedPositionsGL[FIRST_BUFFER]->bufferData(4 * sizeof(float) * NUM_MAX_PARTICLES, &positions[0]);
+        mPredictedPositionsGL[FIRST_BUFFER]->bufferData(4 * sizeof(float) * mMaxParticles, positionData);
         mPredictedPositionsGL[FIRST_BUFFER]->unbind();
 
         mPredictedPositionsGL[SECOND_BUFFER]->bind();
-        mPredictedPositionsGL[SECOND_BUFFER]->bufferData(4 * sizeof(float) * NUM_MAX_PARTICLES, &positions[0]);
+        mPredictedPositionsGL[SECOND_BUFFER]->bufferData(4 * sizeof(float) * mMaxParticles, positionData);
         mPredictedPositionsGL[SECOND_BUFFER]->unbind();
 
         mDensitiesGL->bind();
-        mDensitiesGL->bufferData(sizeof(float) * NUM_MAX_PARTICLES, &densities[0]);
+        mDensitiesGL->bufferData(getDensityStride() * mMaxParticles, densityData);
         mDensitiesGL->unbind();
 
-        /// Create OpenCL references to OpenGL buffers
+        setupParticleVertexArrays();
+
+        /// Create OpenCL references to OpenGL buffers, replacing those of the previous setup
         OCL_ERROR;
+        mMemObjects.clear();
         OCL_CHECK(mPositionsCL[FIRST_BUFFER] = make_unique<BufferGL>(mContext, CL_MEM_READ_WRITE, mPositionsGL[FIRST_BUFFER]->ID(), CL_ERROR));
         mMemObjects.push_back(*mPositionsCL[FIRST_BUFFER]);
         OCL_CHECK(mPositionsCL[SECOND_BUFFER] = make_unique<BufferGL>(mContext, CL_MEM_READ_WRITE, mPositionsGL[SECOND_BUFFER]->ID(), CL_ERROR));
@@ -258,20 +622,74 @@ namespace pbf {
         OCL_CHECK(mDensitiesCL = make_unique<BufferGL>(mContext, CL_MEM_READ_WRITE, mDensitiesGL->ID(), CL_ERROR));
         mMemObjects.push_back(*mDensitiesCL);
 
-        /// Setup CL-only buffers (for the grid)
-        OCL_CHECK(mBinCountCL = make_unique<cl::Buffer>(mContext, CL_MEM_READ_WRITE, sizeof(cl_uint) * mGridCL->binCount, (void*)0, CL_ERROR));
-        OCL_CHECK(mBinStartIDCL = make_unique<cl::Buffer>(mContext, CL_MEM_READ_WRITE, sizeof(cl_uint) * mGridCL->binCount, (void*)0, CL_ERROR));
-        OCL_CHECK(mParticleInBinPosCL = make_unique<cl::Buffer>(mContext, CL_MEM_READ_WRITE, sizeof(cl_uint) * NUM_MAX_PARTICLES, (void*)0, CL_ERROR));
-        OCL_CHECK(mParticleBinIDCL[FIRST_BUFFER] = make_unique<cl::Buffer>(mContext, CL_MEM_READ_WRITE, sizeof(cl_uint) * NUM_MAX_PARTICLES, (void*)0, CL_ERROR));
-        OCL_CHECK(mParticleBinIDCL[SECOND_BUFFER] = make_unique<cl::Buffer>(mContext, CL_MEM_READ_WRITE, sizeof(cl_uint) * NUM_MAX_PARTICLES, (void*)0, CL_ERROR));
-        OCL_CHECK(mParticleLambdasCL = make_unique<cl::Buffer>(mContext, CL_MEM_READ_WRITE, sizeof(cl_float) * NUM_MAX_PARTICLES, (void*)0, CL_ERROR));
-        OCL_CHECK(mParticleCurlsCL = make_unique<cl::Buffer>(mContext, CL_MEM_READ_WRITE, sizeof(cl_float3) * NUM_MAX_PARTICLES, (void*)0, CL_ERROR));
-
-        OCL_CALL(mQueue.enqueueFillBuffer<cl_uint>(*mBinCountCL, 0, 0, sizeof(cl_uint) * mGridCL->binCount));
-        OCL_CALL(mQueue.enqueueFillBuffer<cl_uint>(*mBinStartIDCL, 0, 0, sizeof(cl_uint) * mGridCL->binCount));
-        OCL_CALL(mQueue.enqueueFillBuffer<cl_uint>(*mParticleInBinPosCL, 0, 0, sizeof(cl_uint) * NUM_MAX_PARTICLES));
-        OCL_CALL(mQueue.enqueueFillBuffer<cl_uint>(*mParticleBinIDCL[FIRST_BUFFER], 0, 0, sizeof(cl_uint) * NUM_MAX_PARTICLES));
-        OCL_CALL(mQueue.enqueueFillBuffer<cl_uint>(*mParticleBinIDCL[SECOND_BUFFER], 0, 0, sizeof(cl_uint) * NUM_MAX_PARTICLES));
+        /// Setup CL-only buffers (for the grid, plus an extra bin for dead particles)
+        OCL_CHECK(mBinCountCL = make_unique<cl::Buffer>(mContext, CL_MEM_READ_WRITE, sizeof(cl_uint) * (mGridCL->binCount + 1), (void*)0, CL_ERROR));
+        OCL_CHECK(mBinStartIDCL = make_unique<cl::Buffer>(mContext, CL_MEM_READ_WRITE, sizeof(cl_uint) * (mGridCL->binCount + 1), (void*)0, CL_ERROR));
+        OCL_CHECK(mActiveRegionCL = make_unique<cl::Buffer>(mContext, CL_MEM_READ_WRITE, sizeof(mActiveRegion), (void*)0, CL_ERROR));
+        OCL_CHECK(mParticleInBinPosCL = make_unique<cl::Buffer>(mContext, CL_MEM_READ_WRITE, sizeof(cl_uint) * mMaxParticles, (void*)0, CL_ERROR));
+        OCL_CHECK(mParticleBinIDCL[FIRST_BUFFER] = make_unique<cl::Buffer>(mContext, CL_MEM_READ_WRITE, sizeof(cl_uint) * mMaxParticles, (void*)0, CL_ERROR));
+        OCL_CHECK(mParticleBinIDCL[SECOND_BUFFER] = make_unique<cl::Buffer>(mContext, CL_MEM_READ_WRITE, sizeof(cl_uint) * mMaxParticles, (void*)0, CL_ERROR));
+        OCL_CHECK(mParticleLambdasCL[FIRST_BUFFER] = make_unique<cl::Buffer>(mContext, CL_MEM_READ_WRITE, sizeof(cl_float) * mMaxParticles, (void*)0, CL_ERROR));
+        OCL_CHECK(mParticleLambdasCL[SECOND_BUFFER] = make_unique<cl::Buffer>(mContext, CL_MEM_READ_WRITE, sizeof(cl_float) * mMaxParticles, (void*)0, CL_ERROR));
+        OCL_CHECK(mParticleAgesCL[FIRST_BUFFER] = make_unique<cl::Buffer>(mContext, CL_MEM_READ_WRITE, sizeof(cl_float) * mMaxParticles, (void*)0, CL_ERROR));
+        OCL_CHECK(mParticleAgesCL[SECOND_BUFFER] = make_unique<cl::Buffer>(mContext, CL_MEM_READ_WRITE, sizeof(cl_float) * mMaxParticles, (void*)0, CL_ERROR));
+        OCL_CHECK(mParticleIDsCL[FIRST_BUFFER] = make_unique<cl::Buffer>(mContext, CL_MEM_READ_WRITE, sizeof(cl_uint) * mMaxParticles, (void*)0, CL_ERROR));
+        OCL_CHECK(mParticleIDsCL[SECOND_BUFFER] = make_unique<cl::Buffer>(mContext, CL_MEM_READ_WRITE, sizeof(cl_uint) * mMaxParticles, (void*)0, CL_ERROR));
+        OCL_CHECK(mDFSPHFactorsCL = make_unique<cl::Buffer>(mContext, CL_MEM_READ_WRITE, sizeof(cl_float) * mMaxParticles, (void*)0, CL_ERROR));
+        OCL_CHECK(mDFSPHKappasCL = make_unique<cl::Buffer>(mContext, CL_MEM_READ_WRITE, sizeof(cl_float) * mMaxParticles, (void*)0, CL_ERROR));
+        OCL_CHECK(mDeltaPositionsCL = make_unique<cl::Buffer>(mContext, CL_MEM_READ_WRITE, sizeof(cl_float3) * mMaxParticles, (void*)0, CL_ERROR));
+        OCL_CHECK(mParticleCurlsCL = make_unique<cl::Buffer>(mContext, CL_MEM_READ_WRITE, getVelocityStride() * mMaxParticles, (void*)0, CL_ERROR));
+        OCL_CHECK(mActiveParticleIDsCL = make_unique<cl::Buffer>(mContext, CL_MEM_READ_WRITE, sizeof(cl_uint) * (mMaxParticles + 1), (void*)0, CL_ERROR));
+        setActiveParticleIDsArgs();
+
+        /// Setup the radix sort buffers
+        for (uint i = 0; i < 2; ++i) {
+            OCL_CHECK(mRadixKeysCL[i] = make_unique<cl::Buffer>(mContext, CL_MEM_READ_WRITE, sizeof(cl_uint) * mMaxParticles, (void*)0, CL_ERROR));
+            OCL_CHECK(mRadixValuesCL[i] = make_unique<cl::Buffer>(mContext, CL_MEM_READ_WRITE, sizeof(cl_uint) * mMaxParticles, (void*)0, CL_ERROR));
+        }
+        OCL_CHECK(mRadixHistogramsCL = make_unique<cl::Buffer>(mContext, CL_MEM_READ_WRITE, sizeof(cl_uint) * GetRadixHistogramSize(mMaxParticles), (void*)0, CL_ERROR));
+        OCL_CHECK(mParticleOrderCL = make_unique<cl::Buffer>(mContext, CL_MEM_READ_WRITE, sizeof(cl_uint) * mMaxParticles, (void*)0, CL_ERROR));
+
+        OCL_CALL(mQueue.enqueueFillBuffer<cl_uint>(*mBinCountCL, 0, 0, sizeof(cl_uint) * (mGridCL->binCount + 1)));
+        OCL_CALL(mQueue.enqueueFillBuffer<cl_uint>(*mBinStartIDCL, 0, 0, sizeof(cl_uint) * (mGridCL->binCount + 1)));
+        mActiveRegionValid = false;
+        OCL_CALL(mQueue.enqueueFillBuffer<cl_uint>(*mParticleInBinPosCL, 0, 0, sizeof(cl_uint) * mMaxParticles));
+        OCL_CALL(mQueue.enqueueFillBuffer<cl_uint>(*mParticleBinIDCL[FIRST_BUFFER], 0, 0, sizeof(cl_uint) * mMaxParticles));
+        OCL_CALL(mQueue.enqueueFillBuffer<cl_uint>(*mParticleBinIDCL[SECOND_BUFFER], 0, 0, sizeof(cl_uint) * mMaxParticles));
+        OCL_CALL(mQueue.enqueueFillBuffer<cl_float>(*mParticleLambdasCL[FIRST_BUFFER], 0.0f, 0, sizeof(cl_float) * mMaxParticles));
+        OCL_CALL(mQueue.enqueueFillBuffer<cl_float>(*mParticleLambdasCL[SECOND_BUFFER], 0.0f, 0, sizeof(cl_float) * mMaxParticles));
+        OCL_CALL(mQueue.enqueueFillBuffer<cl_float>(*mParticleAgesCL[FIRST_BUFFER], 0.0f, 0, sizeof(cl_float) * mMaxParticles));
+        OCL_CALL(mQueue.enqueueFillBuffer<cl_float>(*mParticleAgesCL[SECOND_BUFFER], 0.0f, 0, sizeof(cl_float) * mMaxParticles));
+        mLiveParticleCountPending = false;
+        mSlabBinStartIDsPending = false;
+
+        /// The particles are numbered in their initial order
+        std::vector<cl_uint> particleIDs(mNumParticles);
+        std::iota(particleIDs.begin(), particleIDs.end(), 0);
+        if (mNumParticles > 0) {
+            OCL_CALL(mQueue.enqueueWriteBuffer(*mParticleIDsCL[FIRST_BUFFER], CL_TRUE, 0, sizeof(cl_uint) * mNumParticles, particleIDs.data()));
+            OCL_CALL(mQueue.enqueueWriteBuffer(*mParticleIDsCL[SECOND_BUFFER], CL_TRUE, 0, sizeof(cl_uint) * mNumParticles, particleIDs.data()));
+        }
+        mNextParticleID = mNumParticles;
+
+        /// The previous order is meaningless for the new particles
+        mNumSortedParticles = 0;
+        mMovedParticleCountersPending = false;
+
+        /// All bins start awake, and stay so for SLEEP_DELAY_FRAMES
+        OCL_CALL(mQueue.enqueueFillBuffer<cl_uint>(*mBinLastActiveFrameCL, 0, 0, sizeof(cl_uint) * mGridCL->binCount));
+        mSleepFrame = 0;
+
+        /// Setup solid buffers, restarting the solids from where they were added
+        OCL_CHECK(mSolidsCL = make_unique<cl::Buffer>(mContext, CL_MEM_READ_WRITE, sizeof(pbf::SolidObject) * NUM_MAX_SOLIDS, (void*)0, CL_ERROR));
+        OCL_CHECK(mBinSolidCountCL = make_unique<cl::Buffer>(mContext, CL_MEM_READ_WRITE, sizeof(cl_uint) * mGridCL->binCount, (void*)0, CL_ERROR));
+        OCL_CHECK(mBinSolidStartIDCL = make_unique<cl::Buffer>(mContext, CL_MEM_READ_WRITE, sizeof(cl_uint) * mGridCL->binCount, (void*)0, CL_ERROR));
+        OCL_CHECK(mBinSolidCursorCL = make_unique<cl::Buffer>(mContext, CL_MEM_READ_WRITE, sizeof(cl_uint) * mGridCL->binCount, (void*)0, CL_ERROR));
+        OCL_CHECK(mBinSolidIDCL = make_unique<cl::Buffer>(mContext, CL_MEM_READ_WRITE, sizeof(cl_uint) * NUM_MAX_BIN_SOLID_ENTRIES, (void*)0, CL_ERROR));
+        OCL_CHECK(mContactSolidIDCL = make_unique<cl::Buffer>(mContext, CL_MEM_READ_WRITE, sizeof(cl_uint) * mMaxParticles, (void*)0, CL_ERROR));
+        OCL_CHECK(mContactImpulseCL = make_unique<cl::Buffer>(mContext, CL_MEM_READ_WRITE, sizeof(cl_float3) * mMaxParticles, (void*)0, CL_ERROR));
+        OCL_CHECK(mContactTorqueCL = make_unique<cl::Buffer>(mContext, CL_MEM_READ_WRITE, sizeof(cl_float3) * mMaxParticles, (void*)0, CL_ERROR));
+        uploadSolids(0);
 
         /// Set these arguments of the kernel since they don't flip their buffers
         OCL_CALL(mSortInsertParticles->setArg(2, *mParticleInBinPosCL));
@@ -285,6 +703,65 @@ namespace pbf {
         mDirLight->setLightDirection(glm::vec3(-1.0f));
     }
 
+    void ParticleSimulationScene::setupParticleVertexArrays() {
+        const GLenum attributeType = mHalfStorage ? GL_HALF_FLOAT : GL_FLOAT;
+
+        /// Create OpenGL vertex array, representing each particle
+        mParticles[FIRST_BUFFER] = make_unique<VertexArray>();
+        mParticles[FIRST_BUFFER]->bind();
+        mParticles[FIRST_BUFFER]->addVertexAttribute(*mPredictedPositionsGL[FIRST_BUFFER], 4, GL_FLOAT, GL_FALSE, /*3*sizeof(GLfloat)*/ 0);
+        mParticles[FIRST_BUFFER]->addVertexAttribute(*mVelocitiesGL[FIRST_BUFFER], 4, attributeType, GL_FALSE, /*3*sizeof(GLfloat)*/ 0);
+        mParticles[FIRST_BUFFER]->addVertexAttribute(*mDensitiesGL, 1, attributeType, GL_FALSE, /*sizeof(GLfloat)*/ 0);
+        mParticles[FIRST_BUFFER]->unbind();
+
+        mParticles[SECOND_BUFFER] = make_unique<VertexArray>();
+        mParticles[SECOND_BUFFER]->bind();
+        mParticles[SECOND_BUFFER]->addVertexAttribute(*mPredictedPositionsGL[SECOND_BUFFER], 4, GL_FLOAT, GL_FALSE, /*3*sizeof(GLfloat)*/ 0);
+        mParticles[SECOND_BUFFER]->addVertexAttribute(*mVelocitiesGL[FIRST_BUFFER], 4, attributeType, GL_FALSE, /*3*sizeof(GLfloat)*/ 0);
+        mParticles[SECOND_BUFFER]->addVertexAttribute(*mDensitiesGL, 1, attributeType, GL_FALSE, /*sizeof(GLfloat)*/ 0);
+        mParticles[SECOND_BUFFER]->unbind();
+    }
+
+    size_t ParticleSimulationScene::getVelocityStride() const {
+        return mHalfStorage ? 4 * sizeof(cl_half) : sizeof(cl_float4);
+    }
+
+    size_t ParticleSimulationScene::getDensityStride() const {
+        return mHalfStorage ? sizeof(cl_half) : sizeof(cl_float);
+    }
+
+    size_t ParticleSimulationScene::getBytesPerParticle() const {
+        return 2 * sizeof(cl_float4)        // positions
+               + 2 * sizeof(cl_float4)      // predicted positions
+               + 2 * getVelocityStride()    // velocities
+               + getDensityStride()         // densities
+               + getVelocityStride()        // curls
+               + 2 * sizeof(cl_uint)        // bin IDs
+               + sizeof(cl_uint)            // in-bin IDs
+               + 2 * sizeof(cl_float)       // lambdas
+               + 2 * sizeof(cl_float)       // ages
+               + sizeof(cl_float4)          // position corrections
+               + 2 * sizeof(cl_float);      // DFSPH factors and stiffnesses
+    }
+
+    uint ParticleSimulationScene::getMaxParticleCapacity() const {
+        /// A quarter of the memory is left for the grid, the sorts and the other buffers
+        const cl_ulong globalMemorySize = mDevice.getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>();
+        const cl_ulong maxAllocationSize = mDevice.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>();
+        const cl_ulong capacity = std::min<cl_ulong>(3 * globalMemorySize / 4 / getBytesPerParticle(),
+                                                     maxAllocationSize / sizeof(cl_float4));
+        return static_cast<uint>(std::min<cl_ulong>(capacity, CL_UINT_MAX - 1));
+    }
+
+    void ParticleSimulationScene::setHalfStorage(bool halfStorage) {
+        mUseHalfStorage = halfStorage;
+        mHalfStorage = halfStorage;
+
+        /// Both the kernels and the particle buffers depend on the storage format
+        loadKernels();
+        reset();
+    }
+
     void ParticleSimulationScene::reset() {
         mCurrentBufferID = 0;
         loadFluidSetup(mCurrentFluidSetup);
@@ -302,7 +779,6 @@ namespace pbf {
         if (isKeyDown(GLFW_KEY_UP)) mSpawnPoint.y += 0.018f;
         if (isKeyDown(GLFW_KEY_DOWN)) mSpawnPoint.y -= 0.018f;
         mSpawnPointSphereObject->setPosition(glm::vec3(getWorldSpawnPoint().x, -getWorldSpawnPoint().y, getWorldSpawnPoint().z));
-        if (isKeyDown(GLFW_KEY_SPACE)) spawnParticles();
 
         /// Rotate camera with keys
         glm::vec3 eulerAngles = mCameraRotator->getEulerAngles();
@@ -313,6 +789,64 @@ namespace pbf {
         eulerAngles.x = clamp(eulerAngles.x, - CL_M_PI_F / 2, CL_M_PI_F / 2);
         mCameraRotator->setEulerAngles(eulerAngles);
 
+        /// Rebuild the fluid kernels if their baked parameters went stale (e.g. edited in the GUI). The defines
+        /// are only generated again once a parameter changed
+        if (mSpecializeFluid != mDefinedFluidSpecialized || std::memcmp(&mDefinedFluid, mFluidCL.get(), sizeof(pbf::Fluid)) != 0) {
+            const std::string fluidDefines = mSpecializeFluid ? GetDefinesCL(*mFluidCL) : "";
+            mDefinedFluid = *mFluidCL;
+            mDefinedFluidSpecialized = mSpecializeFluid;
+            if (fluidDefines != mFluidDefines) {
+                loadFluidSimKernels();
+            }
+        }
+
+        if (mUseHalfStorage != mHalfStorage) {
+            setHalfStorage(mUseHalfStorage);
+        }
+
+        if (mUseSingleSolverProgram != mSingleSolverProgram) {
+            mSingleSolverProgram = mUseSingleSolverProgram;
+            loadKernels();
+        }
+
+        /// Rebuild the static boundaries if they were changed in the GUI, or if the kernel radius that their
+        /// volumes depend on changed
+        const bool obstacleChanged = mObstacleType != mBuiltObstacleType;
+        if (obstacleChanged || mUseBoundaryParticles != mBoundaryParticles) {
+            if (obstacleChanged) {
+                buildObstacle();
+            }
+            mBoundaryParticles = mUseBoundaryParticles;
+            if (mBoundaryParticles) {
+                buildBoundaryParticles();
+            }
+
+            /// Which boundary terms are evaluated is baked into the kernels
+            loadKernels();
+        } else if (mFluidCL->kernelRadius != mBoundaryKernelRadius) {
+            if (mBuiltObstacleType != ObstacleType::None) {
+                computeBoundaryVolumes();
+            }
+            if (mBoundaryParticles) {
+                buildBoundaryParticles();
+            }
+        }
+        mBoundaryKernelRadius = mFluidCL->kernelRadius;
+
+        const bool sleepingBins = mUseSleepingBins && mSolverType == SolverType::PBF && mSolids.empty();
+        const bool looseGrid = mUseIncrementalSort && mSolverType == SolverType::PBF && mSolids.empty();
+        if (sleepingBins != mSleepingBins || looseGrid != mLooseGrid) {
+            mSleepingBins = sleepingBins;
+            mLooseGrid = looseGrid;
+            loadFluidSimKernels();
+        }
+
+        /// The previous frame has finished, including the read-back of the live particle count
+        if (mLiveParticleCountPending) {
+            mNumParticles = mLiveParticleCount;
+            mLiveParticleCountPending = false;
+        }
+
         double timeBegin = glfwGetTime();
         if (mFramesSinceLastUpdate == 0) {
             mTimeOfLastUpdate = timeBegin;
@@ -320,68 +854,149 @@ namespace pbf {
 
         ++mFramesSinceLastUpdate;
 
-        unsigned int previousBufferID = mCurrentBufferID;
-        //unsigned int previousBufferID = 0;
-        mCurrentBufferID = 1 - mCurrentBufferID;
+        const unsigned int previousBufferID = mCurrentBufferID;
 
+        /// The slab queues run kernels on the shared buffers too, so they hold them for the frame as well
+        const uint numSlabs = getNumSlabs();
         cl::Event event;
         OCL_CALL(mQueue.enqueueAcquireGLObjects(&mMemObjects));
+        for (uint slab = 0; slab < numSlabs; ++slab) {
+            OCL_CALL(mSubDeviceQueues[slab].enqueueAcquireGLObjects(&mMemObjects));
+        }
+        beginPhases();
 
-        ///////////////////////////////////////////////////
-        /// Apply external forces and predict positions ///
-        ///////////////////////////////////////////////////
+        emitParticles(previousBufferID);
+        endPhase("emit");
 
-        OCL_CALL(mTimestepKernel->setArg(0, *mPositionsCL[previousBufferID]));
-        OCL_CALL(mTimestepKernel->setArg(1, *mPredictedPositionsCL[previousBufferID]));
-        OCL_CALL(mTimestepKernel->setArg(2, *mVelocitiesCL[FIRST_BUFFER]));
-        OCL_CALL(mTimestepKernel->setArg(3, mFluidCL->deltaTime));
-        OCL_CALL(mQueue.enqueueNDRangeKernel(*mTimestepKernel, cl::NullRange,
-                                             cl::NDRange(mNumParticles, 1), cl::NullRange));
+        /// The sort moves the particles into the other buffer set, unless it keeps the order of the last one
+        mSkipSort = canSkipSort();
+        if (!mSkipSort) {
+            mCurrentBufferID = 1 - mCurrentBufferID;
+        }
 
-        OCL_CALL(mClipToBoundsKernel->setArg(0, *mPredictedPositionsCL[previousBufferID]));
-        OCL_CALL(mClipToBoundsKernel->setArg(1, sizeof(pbf::Bounds), mBoundsCL.get()));
-        OCL_CALL(mQueue.enqueueNDRangeKernel(*mClipToBoundsKernel, cl::NullRange,
-                                             cl::NDRange(mNumParticles, 1), cl::NullRange));
+        mSolverStats.densityErrors.clear();
+        mNumActiveParticles = mNumParticles;
 
-        /////////////////////
-        /// Counting sort ///
-        /////////////////////
+        if (!mSolids.empty()) {
+            insertSolidsInGrid();
+            endPhase("solids");
+        }
 
-        /// Reset bin counts to zero
-        OCL_CALL(mQueue.enqueueFillBuffer<cl_uint>(*mBinCountCL, 0, 0, sizeof(cl_uint) * mGridCL->binCount));
+        switch (mSolverType) {
+            case SolverType::PBF:
+                stepPBF(previousBufferID);
+                break;
+            case SolverType::DFSPH:
+                stepDFSPH(previousBufferID);
+                break;
+        }
 
-        // Insert particles based on their predicted positions
-        OCL_CALL(mSortInsertParticles->setArg(0, *mPredictedPositionsCL[previousBufferID]));
-        OCL_CALL(mSortInsertParticles->setArg(1, *mParticleBinIDCL[previousBufferID]));
-        OCL_CALL(mSortInsertParticles->setArg(2, *mParticleInBinPosCL));
-        OCL_CALL(mSortInsertParticles->setArg(3, *mBinCountCL));
-        OCL_CALL(mQueue.enqueueNDRangeKernel(*mSortInsertParticles, cl::NullRange,
-                                             cl::NDRange(mNumParticles, 1), cl::NullRange));
+        if (!mSolids.empty()) {
+            integrateSolids();
+            endPhase("solids");
+        }
 
-        OCL_CALL(mSortComputeBinStartID->setArg(0, *mBinCountCL));
-        OCL_CALL(mSortComputeBinStartID->setArg(1, *mBinStartIDCL));
-        OCL_CALL(mQueue.enqueueNDRangeKernel(*mSortComputeBinStartID, cl::NullRange,
-                                             cl::NDRange(mGridCL->binCount, 1), cl::NullRange));
+        if (mLooseGrid && !isKillingParticles()) {
+            countMovedParticles();
+        }
 
-        OCL_CALL(mSortReindexParticles->setArg(0, *mParticleInBinPosCL));
-        OCL_CALL(mSortReindexParticles->setArg(1, *mBinStartIDCL));
-        OCL_CALL(mSortReindexParticles->setArg(2, *mPositionsCL[previousBufferID]));
-        OCL_CALL(mSortReindexParticles->setArg(3, *mPredictedPositionsCL[previousBufferID]));
-        OCL_CALL(mSortReindexParticles->setArg(4, *mVelocitiesCL[FIRST_BUFFER]));
-        OCL_CALL(mSortReindexParticles->setArg(5, *mParticleBinIDCL[previousBufferID]));
-        OCL_CALL(mSortReindexParticles->setArg(6, *mPositionsCL[mCurrentBufferID]));
-        OCL_CALL(mSortReindexParticles->setArg(7, *mPredictedPositionsCL[mCurrentBufferID]));
-        OCL_CALL(mSortReindexParticles->setArg(8, *mVelocitiesCL[SECOND_BUFFER]));
-        OCL_CALL(mSortReindexParticles->setArg(9, *mParticleBinIDCL[mCurrentBufferID]));
-        OCL_CALL(mQueue.enqueueNDRangeKernel(*mSortReindexParticles, cl::NullRange,
-                                             cl::NDRange(mNumParticles, 1), cl::NullRange));
+        std::vector<cl::Event> slabEvents(numSlabs);
+        for (uint slab = 0; slab < numSlabs; ++slab) {
+            OCL_CALL(mSubDeviceQueues[slab].enqueueReleaseGLObjects(&mMemObjects, NULL, &slabEvents[slab]));
+            OCL_CALL(mSubDeviceQueues[slab].flush());
+        }
+        OCL_CALL(mQueue.enqueueReleaseGLObjects(&mMemObjects, NULL, &event));
+        OCL_CALL(event.wait());
+        for (cl::Event &slabEvent : slabEvents) {
+            OCL_CALL(slabEvent.wait());
+        }
+
+        if (!mPendingDensityErrors.empty()) {
+            OCL_CALL(mPendingDensityErrorsEvent.wait());
+            mSolverStats.densityErrors.assign(mPendingDensityErrors.begin(), mPendingDensityErrors.end());
+            mPendingDensityErrors.clear();
+        }
+
+        if (!mSolids.empty()) {
+            updateSolidMeshes();
+        }
+
+        double timeEnd = glfwGetTime();
+        while (mSimulationTimes.size() > NUM_AVG_SIM_TIMES) {
+            mSimulationTimes.pop_back();
+        }
+        mSimulationTimes.push_front(timeEnd - timeBegin);
+
+        // update GUI twice each second
+        if (timeEnd - mTimeOfLastUpdate > 2.0f) {
+            updateTimeLabelsInGUI(timeEnd - mTimeOfLastUpdate);
+            mFramesSinceLastUpdate = 0;
+        }
+    }
+
+    uint ParticleSimulationScene::GetColourCount(SolverColouring colouring) {
+        switch (colouring) {
+            case SolverColouring::Parity8:
+                return 8;
+            case SolverColouring::Colours27:
+                return 27;
+            default:
+                return 1;
+        }
+    }
+
+    void ParticleSimulationScene::stepPBF(uint previousBufferID) {
+        /// The positions left by the previous frame are its predictions, so predict into its free positions buffer.
+        /// If the sort is skipped, they are predicted in place and kept in the positions buffer instead
+        const cl::Buffer &positions = *mPredictedPositionsCL[previousBufferID];
+        const cl::Buffer &predictedPositions = mSkipSort ? positions : *mPositionsCL[previousBufferID];
+
+        /// The bin activity is measured on the velocities and densities left by the previous frame
+        if (mSleepingBins) {
+            markActiveBins(positions);
+        }
+
+        ///////////////////////////////////////////////////
+        /// Apply external forces and predict positions ///
+        ///////////////////////////////////////////////////
+
+        /// Also insert the particles into the grid in the same pass, unless the sort needs the predictions first
+        const bool insert = canInsertWhilePredicting();
+        if (insert) {
+            clearBinCounts();
+        }
+
+        OCL_CALL(mPredictAndInsert->setArg(0, positions));
+        OCL_CALL(mPredictAndInsert->setArg(1, predictedPositions));
+        OCL_CALL(mPredictAndInsert->setArg(2, *mVelocitiesCL[FIRST_BUFFER]));
+        OCL_CALL(mPredictAndInsert->setArg(3, mFluidCL->deltaTime));
+        OCL_CALL(mPredictAndInsert->setArg(4, sizeof(pbf::Bounds), mBoundsCL.get()));
+        OCL_CALL(mPredictAndInsert->setArg(5, *mSDFCL));
+        OCL_CALL(mPredictAndInsert->setArg(6, static_cast<cl_uint>(insert ? 1 : 0)));
+        OCL_CALL(mPredictAndInsert->setArg(7, *mParticleBinIDCL[previousBufferID]));
+        OCL_CALL(mPredictAndInsert->setArg(8, *mParticleInBinPosCL));
+        OCL_CALL(mPredictAndInsert->setArg(9, *mBinCountCL));
+        OCL_CALL(mPredictAndInsert->setArg(10, *mParticleAgesCL[previousBufferID]));
+        OCL_CALL(mPredictAndInsert->setArg(11, *mActiveRegionCL));
+        OCL_CALL(mPredictAndInsert->setArg(12, *mPositionsCL[mCurrentBufferID]));
+        OCL_CALL(mPredictAndInsert->setArg(13, static_cast<cl_uint>(mSkipSort ? 1 : 0)));
+        enqueueKernel(*mPredictAndInsert, mNumParticles);
+        endPhase("predict");
+
+        /// The velocities were used up by the prediction and are recomputed from the positions
+        sortParticles(previousBufferID, positions, predictedPositions, false, insert);
+        endPhase("sort");
 
         //////////////////////////////////
         /// Apply position corrections ///
         //////////////////////////////////
 
         /// Reset densities to zero
-        OCL_CALL(mQueue.enqueueFillBuffer<cl_uint>(*mDensitiesCL, 0, 0, sizeof(cl_float) * mNumParticles));
+        OCL_CALL(mQueue.enqueueFillBuffer<cl_uchar>(*mDensitiesCL, 0, 0, getDensityStride() * mNumParticles));
+
+        if (mSleepingBins) {
+            compactActiveParticles();
+        }
 
         for (unsigned int i = 0; i < mFluidCL->numSubSteps; ++i) {
             ////////////////////
@@ -389,26 +1004,25 @@ namespace pbf {
             ////////////////////
 
             /// Calculate densities
-            OCL_CALL(mCalcDensities->setArg(0, sizeof(pbf::Fluid), mFluidCL.get()));
-            OCL_CALL(mCalcDensities->setArg(1, sizeof(pbf::Bounds), mBoundsCL.get()));
-            OCL_CALL(mCalcDensities->setArg(2, *mPredictedPositionsCL[mCurrentBufferID]));
-            OCL_CALL(mCalcDensities->setArg(3, *mParticleBinIDCL[mCurrentBufferID]));
-            OCL_CALL(mCalcDensities->setArg(4, *mBinStartIDCL));
-            OCL_CALL(mCalcDensities->setArg(5, *mBinCountCL));
-            OCL_CALL(mCalcDensities->setArg(6, *mDensitiesCL));
-            OCL_CALL(mQueue.enqueueNDRangeKernel(*mCalcDensities, cl::NullRange,
-                                                 cl::NDRange(mNumParticles, 1), cl::NullRange));
-
-            /// Calculate λi
+            calcDensities();
+
+            if (mMeasureConvergence) {
+                recordDensityError();
+            }
+
+            /// Calculate λi, warm-started from the previous frame in the first iteration
             OCL_CALL(mCalcLambdas->setArg(0, sizeof(pbf::Fluid), mFluidCL.get()));
             OCL_CALL(mCalcLambdas->setArg(1, *mPredictedPositionsCL[mCurrentBufferID]));
             OCL_CALL(mCalcLambdas->setArg(2, *mParticleBinIDCL[mCurrentBufferID]));
             OCL_CALL(mCalcLambdas->setArg(3, *mBinStartIDCL));
             OCL_CALL(mCalcLambdas->setArg(4, *mBinCountCL));
             OCL_CALL(mCalcLambdas->setArg(5, *mDensitiesCL));
-            OCL_CALL(mCalcLambdas->setArg(6, *mParticleLambdasCL));
-            OCL_CALL(mQueue.enqueueNDRangeKernel(*mCalcLambdas, cl::NullRange,
-                                                 cl::NDRange(mNumParticles, 1), cl::NullRange));
+            OCL_CALL(mCalcLambdas->setArg(6, *mParticleLambdasCL[mCurrentBufferID]));
+            OCL_CALL(mCalcLambdas->setArg(7, i == 0 ? mWarmStartBlend : 0.0f));
+            OCL_CALL(mCalcLambdas->setArg(8, *mBoundaryParticlesCL));
+            OCL_CALL(mCalcLambdas->setArg(9, *mBoundaryBinStartIDCL));
+            OCL_CALL(mCalcLambdas->setArg(10, *mBoundaryBinCountCL));
+            enqueueActive(*mCalcLambdas);
 
 
             ////////////////////////////////////////////////
@@ -416,155 +1030,1042 @@ namespace pbf {
             /// perform collision detection and response ///
             ////////////////////////////////////////////////
 
-            /// calculate ∆pi and update x*i
-            OCL_CALL(mCalcDeltaPositionAndDoUpdate->setArg(0, sizeof(pbf::Fluid), mFluidCL.get()));
-            OCL_CALL(mCalcDeltaPositionAndDoUpdate->setArg(1, sizeof(pbf::Bounds), mFluidCL.get()));
-            OCL_CALL(mCalcDeltaPositionAndDoUpdate->setArg(2, *mPredictedPositionsCL[mCurrentBufferID]));
-            OCL_CALL(mCalcDeltaPositionAndDoUpdate->setArg(3, *mParticleBinIDCL[mCurrentBufferID]));
-            OCL_CALL(mCalcDeltaPositionAndDoUpdate->setArg(4, *mBinStartIDCL));
-            OCL_CALL(mCalcDeltaPositionAndDoUpdate->setArg(5, *mBinCountCL));
-            OCL_CALL(mCalcDeltaPositionAndDoUpdate->setArg(6, *mDensitiesCL));
-            OCL_CALL(mCalcDeltaPositionAndDoUpdate->setArg(7, *mParticleLambdasCL));
-            OCL_CALL(mQueue.enqueueNDRangeKernel(*mCalcDeltaPositionAndDoUpdate, cl::NullRange,
-                                                 cl::NDRange(mNumParticles, 1), cl::NullRange));
-
-            OCL_CALL(mClipToBoundsKernel->setArg(0, *mPredictedPositionsCL[mCurrentBufferID]));
-            OCL_CALL(mClipToBoundsKernel->setArg(1, sizeof(pbf::Bounds), mBoundsCL.get()));
-            OCL_CALL(mQueue.enqueueNDRangeKernel(*mClipToBoundsKernel, cl::NullRange,
-                                                 cl::NDRange(mNumParticles, 1), cl::NullRange));
+            const uint colourCount = GetColourCount(mSolverColouring);
+            if (colourCount == 1) {
+                /// calculate ∆pi and update x*i, clipped to the bounds and obstacles
+                OCL_CALL(mCalcDeltaPositionAndDoUpdate->setArg(0, sizeof(pbf::Fluid), mFluidCL.get()));
+                OCL_CALL(mCalcDeltaPositionAndDoUpdate->setArg(1, sizeof(pbf::Bounds), mBoundsCL.get()));
+                OCL_CALL(mCalcDeltaPositionAndDoUpdate->setArg(2, *mPredictedPositionsCL[mCurrentBufferID]));
+                OCL_CALL(mCalcDeltaPositionAndDoUpdate->setArg(3, *mParticleBinIDCL[mCurrentBufferID]));
+                OCL_CALL(mCalcDeltaPositionAndDoUpdate->setArg(4, *mBinStartIDCL));
+                OCL_CALL(mCalcDeltaPositionAndDoUpdate->setArg(5, *mBinCountCL));
+                OCL_CALL(mCalcDeltaPositionAndDoUpdate->setArg(6, *mDensitiesCL));
+                OCL_CALL(mCalcDeltaPositionAndDoUpdate->setArg(7, *mParticleLambdasCL[mCurrentBufferID]));
+                OCL_CALL(mCalcDeltaPositionAndDoUpdate->setArg(8, *mBoundaryParticlesCL));
+                OCL_CALL(mCalcDeltaPositionAndDoUpdate->setArg(9, *mBoundaryBinStartIDCL));
+                OCL_CALL(mCalcDeltaPositionAndDoUpdate->setArg(10, *mBoundaryBinCountCL));
+                OCL_CALL(mCalcDeltaPositionAndDoUpdate->setArg(12, *mSDFCL));
+                enqueueActive(*mCalcDeltaPositionAndDoUpdate);
+            } else {
+                /// Gauss-Seidel: update x*i one bin colour at a time, so later colours see the corrected positions
+                for (uint colour = 0; colour < colourCount; ++colour) {
+                    OCL_CALL(mCalcDeltaPositionColoured->setArg(0, sizeof(pbf::Fluid), mFluidCL.get()));
+                    OCL_CALL(mCalcDeltaPositionColoured->setArg(1, *mPredictedPositionsCL[mCurrentBufferID]));
+                    OCL_CALL(mCalcDeltaPositionColoured->setArg(2, *mParticleBinIDCL[mCurrentBufferID]));
+                    OCL_CALL(mCalcDeltaPositionColoured->setArg(3, *mBinStartIDCL));
+                    OCL_CALL(mCalcDeltaPositionColoured->setArg(4, *mBinCountCL));
+                    OCL_CALL(mCalcDeltaPositionColoured->setArg(5, *mParticleLambdasCL[mCurrentBufferID]));
+                    OCL_CALL(mCalcDeltaPositionColoured->setArg(6, *mDeltaPositionsCL));
+                    OCL_CALL(mCalcDeltaPositionColoured->setArg(7, colourCount));
+                    OCL_CALL(mCalcDeltaPositionColoured->setArg(8, colour));
+                    OCL_CALL(mCalcDeltaPositionColoured->setArg(9, *mBoundaryParticlesCL));
+                    OCL_CALL(mCalcDeltaPositionColoured->setArg(10, *mBoundaryBinStartIDCL));
+                    OCL_CALL(mCalcDeltaPositionColoured->setArg(11, *mBoundaryBinCountCL));
+                    enqueueActive(*mCalcDeltaPositionColoured);
+
+                    OCL_CALL(mApplyDeltaPositionColoured->setArg(0, sizeof(pbf::Bounds), mBoundsCL.get()));
+                    OCL_CALL(mApplyDeltaPositionColoured->setArg(1, *mParticleBinIDCL[mCurrentBufferID]));
+                    OCL_CALL(mApplyDeltaPositionColoured->setArg(2, *mDeltaPositionsCL));
+                    OCL_CALL(mApplyDeltaPositionColoured->setArg(3, *mPredictedPositionsCL[mCurrentBufferID]));
+                    OCL_CALL(mApplyDeltaPositionColoured->setArg(4, colourCount));
+                    OCL_CALL(mApplyDeltaPositionColoured->setArg(5, colour));
+                    OCL_CALL(mApplyDeltaPositionColoured->setArg(6, *mSDFCL));
+                    enqueueActive(*mApplyDeltaPositionColoured);
+                }
+            }
+
+            if (!mSolids.empty()) {
+                collideWithSolids();
+            }
 
             ////////////////////////////////////////
             /// update position x∗i ⇐ x∗i + ∆pi ///
             ////////////////////////////////////////
         }
 
+        /// Evaluate the density error left after the final iteration
+        if (mMeasureConvergence) {
+            calcDensities();
+            recordDensityError();
+        }
+        endPhase("solve");
+
         //////////////////////////////////////////////////////
         /// update velocity vi ⇐ (1/∆t)(x∗i − xi)         ///
         /// apply vorticity confinement and XSPH viscosity ///
-        /// update position xi ⇐ x∗i                      ///
+        /// x∗i becomes xi for the next frame              ///
         //////////////////////////////////////////////////////
 
-        OCL_CALL(mRecalcVelocities->setArg(0, *mPositionsCL[mCurrentBufferID]));
-        OCL_CALL(mRecalcVelocities->setArg(1, *mPredictedPositionsCL[mCurrentBufferID]));
-        OCL_CALL(mRecalcVelocities->setArg(2, *mVelocitiesCL[SECOND_BUFFER]));
-        OCL_CALL(mRecalcVelocities->setArg(3, 1.0f / mFluidCL->deltaTime));
-        OCL_CALL(mQueue.enqueueNDRangeKernel(*mRecalcVelocities, cl::NullRange,
-                                             cl::NDRange(mNumParticles, 1), cl::NullRange));
-
-        OCL_CALL(mCalcCurls->setArg(0, sizeof(pbf::Fluid), mFluidCL.get()));
-        OCL_CALL(mCalcCurls->setArg(1, *mParticleBinIDCL[mCurrentBufferID]));
-        OCL_CALL(mCalcCurls->setArg(2, *mBinStartIDCL));
-        OCL_CALL(mCalcCurls->setArg(3, *mBinCountCL));
-        OCL_CALL(mCalcCurls->setArg(4, *mPredictedPositionsCL[mCurrentBufferID]));
-        OCL_CALL(mCalcCurls->setArg(5, *mVelocitiesCL[SECOND_BUFFER]));
-        OCL_CALL(mCalcCurls->setArg(6, *mParticleCurlsCL));
-        OCL_CALL(mQueue.enqueueNDRangeKernel(*mCalcCurls, cl::NullRange,
-                                             cl::NDRange(mNumParticles, 1), cl::NullRange));
-
-        OCL_CALL(mApplyVortAndViscXSPH->setArg(0, sizeof(pbf::Fluid), mFluidCL.get()));
-        OCL_CALL(mApplyVortAndViscXSPH->setArg(1, *mParticleBinIDCL[mCurrentBufferID]));
-        OCL_CALL(mApplyVortAndViscXSPH->setArg(2, *mBinStartIDCL));
-        OCL_CALL(mApplyVortAndViscXSPH->setArg(3, *mBinCountCL));
-        OCL_CALL(mApplyVortAndViscXSPH->setArg(4, *mPredictedPositionsCL[mCurrentBufferID]));
-        OCL_CALL(mApplyVortAndViscXSPH->setArg(5, *mDensitiesCL));
-        OCL_CALL(mApplyVortAndViscXSPH->setArg(6, *mParticleCurlsCL));
-        OCL_CALL(mApplyVortAndViscXSPH->setArg(7, *mVelocitiesCL[SECOND_BUFFER]));
-        OCL_CALL(mApplyVortAndViscXSPH->setArg(8, *mVelocitiesCL[FIRST_BUFFER]));
-        OCL_CALL(mQueue.enqueueNDRangeKernel(*mApplyVortAndViscXSPH, cl::NullRange,
-                                             cl::NDRange(mNumParticles, 1), cl::NullRange));
-
-        OCL_CALL(mSetPositionsFromPredictions->setArg(0, *mPredictedPositionsCL[mCurrentBufferID]));
-        OCL_CALL(mSetPositionsFromPredictions->setArg(1, *mPositionsCL[mCurrentBufferID]));
-        OCL_CALL(mQueue.enqueueNDRangeKernel(*mSetPositionsFromPredictions, cl::NullRange,
-                                             cl::NDRange(mNumParticles, 1), cl::NullRange));
+        /// The velocities are computed inline from the positions by the first neighbour pass
+        applyVorticityAndViscosity(true);
+        endPhase("velocities");
+    }
 
-        OCL_CALL(mQueue.enqueueReleaseGLObjects(&mMemObjects, NULL, &event));
-        OCL_CALL(event.wait());
+    void ParticleSimulationScene::stepDFSPH(uint previousBufferID) {
+        /// The predicted positions are the positions at the end of a frame, so sort on them directly
+        const cl::Buffer &positions = *mPredictedPositionsCL[previousBufferID];
+        sortParticles(previousBufferID, positions, positions, true);
+        endPhase("sort");
 
-        double timeEnd = glfwGetTime();
-        while (mSimulationTimes.size() > NUM_AVG_SIM_TIMES) {
-            mSimulationTimes.pop_back();
-        }
-        mSimulationTimes.push_front(timeEnd - timeBegin);
+        /// Compute densities and factors α_i
+        calcDensities();
 
-        // update GUI twice each second
-        if (timeEnd - mTimeOfLastUpdate > 2.0f) {
-            updateTimeLabelsInGUI(timeEnd - mTimeOfLastUpdate);
-            mFramesSinceLastUpdate = 0;
+        if (mMeasureConvergence) {
+            recordDensityError();
         }
-    }
 
-    void ParticleSimulationScene::render() {
-        OGL_CALL(glEnable(GL_DEPTH_TEST));
-        OGL_CALL(glEnable(GL_CULL_FACE));
-        OGL_CALL(glCullFace(GL_BACK));
-        //OGL_CALL(glDisable(GL_PROGRAM_POINT_SIZE));
+        OCL_CALL(mDFSPHCalcFactors->setArg(0, sizeof(pbf::Fluid), mFluidCL.get()));
+        OCL_CALL(mDFSPHCalcFactors->setArg(1, *mPredictedPositionsCL[mCurrentBufferID]));
+        OCL_CALL(mDFSPHCalcFactors->setArg(2, *mParticleBinIDCL[mCurrentBufferID]));
+        OCL_CALL(mDFSPHCalcFactors->setArg(3, *mBinStartIDCL));
+        OCL_CALL(mDFSPHCalcFactors->setArg(4, *mBinCountCL));
+        OCL_CALL(mDFSPHCalcFactors->setArg(5, *mDensitiesCL));
+        OCL_CALL(mDFSPHCalcFactors->setArg(6, *mDFSPHFactorsCL));
+        OCL_CALL(mDFSPHCalcFactors->setArg(7, *mBoundaryParticlesCL));
+        OCL_CALL(mDFSPHCalcFactors->setArg(8, *mBoundaryBinStartIDCL));
+        OCL_CALL(mDFSPHCalcFactors->setArg(9, *mBoundaryBinCountCL));
+        enqueueSlabs(*mDFSPHCalcFactors);
+
+        /// Make the (sorted) velocity field divergence-free
+        for (unsigned int i = 0; i < mFluidCL->numSubSteps; ++i) {
+            correctDFSPHVelocities(*mVelocitiesCL[SECOND_BUFFER], false);
+        }
+        endPhase("solve");
 
-        const glm::mat4 V = glm::inverse(mCamera->getTransform());
-        const glm::mat4 VP = mCamera->getPerspectiveTransform() * V;
+        /// Non-pressure forces: vorticity confinement and XSPH viscosity (into the first buffer), then gravity
+        applyVorticityAndViscosity(false);
 
-        mParticlesShader->use();
-        mParticlesShader->uniform("MV", V);
-        mParticlesShader->uniform("MVP", VP);
-        mParticlesShader->uniform("pointRadius", mParticleRadius);
-        mParticlesShader->uniform("pointScale",
-                                  mCamera->getScreenDimensions().y / tanf(mCamera->getFieldOfViewY() * CL_M_PI_F / 360));
+        OCL_CALL(mDFSPHApplyGravity->setArg(0, *mVelocitiesCL[FIRST_BUFFER]));
+        OCL_CALL(mDFSPHApplyGravity->setArg(1, mFluidCL->deltaTime));
+        enqueueSlabs(*mDFSPHApplyGravity);
+        endPhase("velocities");
 
-        mPointLight->setUniformsInShader(mParticlesShader, "pointLight");
-        mAmbLight->setUniformsInShader(mParticlesShader, "ambLight");
+        /// Correct the predicted density error
+        for (unsigned int i = 0; i < mFluidCL->numSubSteps; ++i) {
+            correctDFSPHVelocities(*mVelocitiesCL[FIRST_BUFFER], true);
+        }
 
-        mParticles[mCurrentBufferID]->bind();
-        OGL_CALL(glPointSize(mParticleRadius));
-        OGL_CALL(glDrawArrays(GL_POINTS, 0, (GLsizei) mNumParticles));
-        mParticles[mCurrentBufferID]->unbind();
+        /// Advect and clip to the bounds
+        OCL_CALL(mDFSPHIntegrate->setArg(0, sizeof(pbf::Bounds), mBoundsCL.get()));
+        OCL_CALL(mDFSPHIntegrate->setArg(1, *mPredictedPositionsCL[mCurrentBufferID]));
+        OCL_CALL(mDFSPHIntegrate->setArg(2, *mVelocitiesCL[FIRST_BUFFER]));
+        OCL_CALL(mDFSPHIntegrate->setArg(3, mFluidCL->deltaTime));
+        OCL_CALL(mDFSPHIntegrate->setArg(4, *mSDFCL));
+        enqueueSlabs(*mDFSPHIntegrate);
+
+        /// The velocities were integrated already, so they take the projection out of the solids too
+        if (!mSolids.empty()) {
+            collideWithSolids(true);
+        }
 
-        // Cull front faces to only render box insides
-        OGL_CALL(glCullFace(GL_FRONT));
-        mAmbLight->setUniformsInShader(mBoxShader, "ambLight.");
-        mDirLight->setUniformsInShader(mBoxShader, "dirLight.");
-        mPointLight->setUniformsInShader(mBoxShader, "pointLight.");
+        if (mMeasureConvergence) {
+            calcDensities();
+            recordDensityError();
+        }
+        endPhase("solve");
+    }
 
-        mBoundingBox->render(VP);
-        mSpawnPointSphereObject->render(VP);
+    void ParticleSimulationScene::correctDFSPHVelocities(const cl::Buffer &velocities, bool densitySolve) {
+        OCL_CALL(mDFSPHCalcKappas->setArg(0, sizeof(pbf::Fluid), mFluidCL.get()));
+        OCL_CALL(mDFSPHCalcKappas->setArg(1, *mPredictedPositionsCL[mCurrentBufferID]));
+        OCL_CALL(mDFSPHCalcKappas->setArg(2, *mParticleBinIDCL[mCurrentBufferID]));
+        OCL_CALL(mDFSPHCalcKappas->setArg(3, *mBinStartIDCL));
+        OCL_CALL(mDFSPHCalcKappas->setArg(4, *mBinCountCL));
+        OCL_CALL(mDFSPHCalcKappas->setArg(5, velocities));
+        OCL_CALL(mDFSPHCalcKappas->setArg(6, *mDensitiesCL));
+        OCL_CALL(mDFSPHCalcKappas->setArg(7, *mDFSPHFactorsCL));
+        OCL_CALL(mDFSPHCalcKappas->setArg(8, *mDFSPHKappasCL));
+        OCL_CALL(mDFSPHCalcKappas->setArg(9, mFluidCL->deltaTime));
+        OCL_CALL(mDFSPHCalcKappas->setArg(10, static_cast<cl_uint>(densitySolve ? 1 : 0)));
+        OCL_CALL(mDFSPHCalcKappas->setArg(11, *mBoundaryParticlesCL));
+        OCL_CALL(mDFSPHCalcKappas->setArg(12, *mBoundaryBinStartIDCL));
+        OCL_CALL(mDFSPHCalcKappas->setArg(13, *mBoundaryBinCountCL));
+        enqueueSlabs(*mDFSPHCalcKappas);
+
+        OCL_CALL(mDFSPHCorrectVelocities->setArg(0, sizeof(pbf::Fluid), mFluidCL.get()));
+        OCL_CALL(mDFSPHCorrectVelocities->setArg(1, *mPredictedPositionsCL[mCurrentBufferID]));
+        OCL_CALL(mDFSPHCorrectVelocities->setArg(2, *mParticleBinIDCL[mCurrentBufferID]));
+        OCL_CALL(mDFSPHCorrectVelocities->setArg(3, *mBinStartIDCL));
+        OCL_CALL(mDFSPHCorrectVelocities->setArg(4, *mBinCountCL));
+        OCL_CALL(mDFSPHCorrectVelocities->setArg(5, *mDensitiesCL));
+        OCL_CALL(mDFSPHCorrectVelocities->setArg(6, *mDFSPHKappasCL));
+        OCL_CALL(mDFSPHCorrectVelocities->setArg(7, velocities));
+        OCL_CALL(mDFSPHCorrectVelocities->setArg(8, mFluidCL->deltaTime));
+        OCL_CALL(mDFSPHCorrectVelocities->setArg(9, *mBoundaryParticlesCL));
+        OCL_CALL(mDFSPHCorrectVelocities->setArg(10, *mBoundaryBinStartIDCL));
+        OCL_CALL(mDFSPHCorrectVelocities->setArg(11, *mBoundaryBinCountCL));
+        enqueueSlabs(*mDFSPHCorrectVelocities);
     }
 
-    void ParticleSimulationScene::spawnParticles() {
-        const float delta = 0.05f * 6400 / mFluidCL->restDensity;
-        const float radius = 4 * delta;
+    bool ParticleSimulationScene::isKillingParticles() const {
+        return !mSinks.empty() || mMaxParticleAge > 0.0f;
+    }
 
-        const float initialVelocity = delta / mFluidCL->deltaTime;
-        const glm::vec3 spawnPoint = getWorldSpawnPoint();
+    bool ParticleSimulationScene::canInsertWhilePredicting() const {
+        return !useRadixSort() && !mLooseGrid && !isKillingParticles();
+    }
 
-        std::vector<glm::vec4> newPositions;
+    void ParticleSimulationScene::sortParticles(uint previousBufferID, const cl::Buffer &positions,
+                                                const cl::Buffer &predictedPositions, bool permuteVelocities,
+                                                bool particlesInserted) {
+        /////////////////////
+        /// Counting sort ///
+        /////////////////////
 
-        glm::vec3 position;
-        for (int z = -4; z <= 4; ++z) {
-            for (int y = -4; y <= 4; ++y) {
-                position.x = spawnPoint.x + delta;
-                position.y = spawnPoint.y + delta * y;
-                position.z = spawnPoint.z + delta * z;
-
-                if (powf(position.y - spawnPoint.y, 2) + powf(position.z - spawnPoint.z, 2) < powf(radius, 2)) {
-                    newPositions.push_back(glm::vec4(position, 1.0f));
-                }
+        /// Incremental sort: keep the order of the last sort. The particle state stays in the buffer set of the
+        /// last frame (see update), and the loose grid finds the neighbours of the particles that left their bins
+        if (mSkipSort) {
+            /// The solver reads the sorted velocities from the second buffer
+            if (permuteVelocities) {
+                OCL_CALL(mQueue.enqueueCopyBuffer(*mVelocitiesCL[FIRST_BUFFER], *mVelocitiesCL[SECOND_BUFFER],
+                                                  0, 0, getVelocityStride() * mNumParticles));
             }
+            ++mNumSkippedSorts;
+            return;
         }
+        ++mNumSorts;
+        mNumSortedParticles = mNumParticles;
 
-        const uint nNewParticles = std::min(static_cast<uint>(newPositions.size()) + mNumParticles, NUM_MAX_PARTICLES) - mNumParticles;
+        const bool killing = isKillingParticles();
 
-        std::vector<glm::vec4> newVelocities(nNewParticles);
-        std::fill(newVelocities.begin(), newVelocities.end(), glm::vec4(initialVelocity, 0.0f, 0.0f, 0.0f));
+        if (killing) {
+            killParticles(previousBufferID, predictedPositions);
+        }
 
-        /// Push to OpenGL buffer
-        mPositionsGL[mCurrentBufferID]->bind();
-        mPositionsGL[mCurrentBufferID]->bufferSubData(mNumParticles * sizeof(glm::vec4), nNewParticles * sizeof(glm::vec4), newPositions.data());
-        mPositionsGL[mCurrentBufferID]->unbind();
-        mVelocitiesGL[FIRST_BUFFER]->bind();
-        mVelocitiesGL[FIRST_BUFFER]->bufferSubData(mNumParticles * sizeof(glm::vec4), nNewParticles * sizeof(glm::vec4), newVelocities.data());
-        mVelocitiesGL[FIRST_BUFFER]->unbind();
+        if (useRadixSort()) {
+            binParticlesRadix(previousBufferID, predictedPositions);
+
+            /// find_bin_ranges wrote every bin, but the active region wasn't grown
+            mActiveRegionValid = false;
+        } else {
+            if (!particlesInserted) {
+                /// Reset bin counts to zero
+                clearBinCounts();
+
+                // Insert particles based on their predicted positions, dead ones in the extra bin
+                OCL_CALL(mSortInsertParticles->setArg(0, predictedPositions));
+                OCL_CALL(mSortInsertParticles->setArg(1, *mParticleBinIDCL[previousBufferID]));
+                OCL_CALL(mSortInsertParticles->setArg(2, *mParticleInBinPosCL));
+                OCL_CALL(mSortInsertParticles->setArg(3, *mBinCountCL));
+                OCL_CALL(mSortInsertParticles->setArg(4, *mParticleAgesCL[previousBufferID]));
+                OCL_CALL(mSortInsertParticles->setArg(5, *mActiveRegionCL));
+                enqueueKernel(*mSortInsertParticles, mNumParticles);
+            }
 
-        mNumParticles += nNewParticles;
-    }
+            if (mUseActiveRegion) {
+                OCL_CALL(mSortComputeRegionBinStartID->setArg(0, *mBinCountCL));
+                OCL_CALL(mSortComputeRegionBinStartID->setArg(1, *mBinStartIDCL));
+                OCL_CALL(mSortComputeRegionBinStartID->setArg(2, *mActiveRegionCL));
+                enqueueKernel(*mSortComputeRegionBinStartID, mGridCL->binCount + 1);
+
+                /// The next frame clears the bins of this region, once the update has waited for the queue
+                OCL_CALL(mQueue.enqueueReadBuffer(*mActiveRegionCL, CL_FALSE, 0, sizeof(mActiveRegion), mActiveRegion));
+                mActiveRegionValid = true;
+            } else {
+                OCL_CALL(mSortComputeBinStartID->setArg(0, *mBinCountCL));
+                OCL_CALL(mSortComputeBinStartID->setArg(1, *mBinStartIDCL));
+                enqueueKernel(*mSortComputeBinStartID, mGridCL->binCount + 1);
+                mActiveRegionValid = false;
+            }
+        }
+
+        /// The start of the extra bin is the live particle count, which the next frame picks up
+        if (killing) {
+            OCL_CALL(mQueue.enqueueReadBuffer(*mBinStartIDCL, CL_FALSE, sizeof(cl_uint) * mGridCL->binCount,
+                                              sizeof(cl_uint), &mLiveParticleCount));
+            mLiveParticleCountPending = true;
+        }
+
+        OCL_CALL(mSortReindexParticles->setArg(0, *mParticleInBinPosCL));
+        OCL_CALL(mSortReindexParticles->setArg(1, *mBinStartIDCL));
+        OCL_CALL(mSortReindexParticles->setArg(2, positions));
+        OCL_CALL(mSortReindexParticles->setArg(3, predictedPositions));
+        OCL_CALL(mSortReindexParticles->setArg(4, *mVelocitiesCL[FIRST_BUFFER]));
+        OCL_CALL(mSortReindexParticles->setArg(5, *mParticleBinIDCL[previousBufferID]));
+        OCL_CALL(mSortReindexParticles->setArg(6, *mPositionsCL[mCurrentBufferID]));
+        OCL_CALL(mSortReindexParticles->setArg(7, *mPredictedPositionsCL[mCurrentBufferID]));
+        OCL_CALL(mSortReindexParticles->setArg(8, *mVelocitiesCL[SECOND_BUFFER]));
+        OCL_CALL(mSortReindexParticles->setArg(9, *mParticleBinIDCL[mCurrentBufferID]));
+        OCL_CALL(mSortReindexParticles->setArg(10, *mParticleLambdasCL[previousBufferID]));
+        OCL_CALL(mSortReindexParticles->setArg(11, *mParticleLambdasCL[mCurrentBufferID]));
+        OCL_CALL(mSortReindexParticles->setArg(12, *mParticleAgesCL[previousBufferID]));
+        OCL_CALL(mSortReindexParticles->setArg(13, *mParticleAgesCL[mCurrentBufferID]));
+        OCL_CALL(mSortReindexParticles->setArg(14, *mParticleIDsCL[previousBufferID]));
+        OCL_CALL(mSortReindexParticles->setArg(15, *mParticleIDsCL[mCurrentBufferID]));
+        OCL_CALL(mSortReindexParticles->setArg(16, static_cast<cl_uint>(permuteVelocities ? 1 : 0)));
+        enqueueKernel(*mSortReindexParticles, mNumParticles);
+
+        updateSlabs();
+    }
+
+    void ParticleSimulationScene::clearBinCounts() {
+        if (mUseActiveRegion && mActiveRegionValid) {
+            /// Only the bins of the last region and the extra bin for dead particles can have been counted
+            OCL_CALL(mQueue.enqueueFillBuffer<cl_uint>(*mBinCountCL, 0, sizeof(cl_uint) * mGridCL->binCount, sizeof(cl_uint)));
+            if (mActiveRegion[0] <= mActiveRegion[3]) {
+                const cl_uint3 regionSize = {{mActiveRegion[3] + 1 - mActiveRegion[0], mActiveRegion[4] + 1 - mActiveRegion[1],
+                                              mActiveRegion[5] + 1 - mActiveRegion[2], 0}};
+                OCL_CALL(mSortClearRegionBinCounts->setArg(0, *mBinCountCL));
+                OCL_CALL(mSortClearRegionBinCounts->setArg(1, cl_uint3{{mActiveRegion[0], mActiveRegion[1], mActiveRegion[2], 0}}));
+                OCL_CALL(mSortClearRegionBinCounts->setArg(2, regionSize));
+                enqueueKernel(*mSortClearRegionBinCounts, regionSize.s[0] * regionSize.s[1] * regionSize.s[2]);
+            }
+        } else {
+            OCL_CALL(mQueue.enqueueFillBuffer<cl_uint>(*mBinCountCL, 0, 0, sizeof(cl_uint) * (mGridCL->binCount + 1)));
+        }
+
+        /// An empty region: the first bin beyond any last bin
+        OCL_CALL(mQueue.enqueueFillBuffer<cl_uint>(*mActiveRegionCL, CL_UINT_MAX, 0, 3 * sizeof(cl_uint)));
+        OCL_CALL(mQueue.enqueueFillBuffer<cl_uint>(*mActiveRegionCL, 0, 3 * sizeof(cl_uint), 3 * sizeof(cl_uint)));
+    }
+
+    bool ParticleSimulationScene::useRadixSort() const {
+        switch (mSortMethod) {
+            case SortMethod::Radix:
+                return true;
+            case SortMethod::Auto:
+                return mNumParticles >= mRadixSortThreshold;
+            default:
+                return false;
+        }
+    }
+
+    void ParticleSimulationScene::binParticlesRadix(uint previousBufferID, const cl::Buffer &predictedPositions) {
+        OCL_CALL(mSortComputeParticleKeys->setArg(0, predictedPositions));
+        OCL_CALL(mSortComputeParticleKeys->setArg(1, *mParticleBinIDCL[previousBufferID]));
+        OCL_CALL(mSortComputeParticleKeys->setArg(2, *mRadixKeysCL[0]));
+        OCL_CALL(mSortComputeParticleKeys->setArg(3, *mRadixValuesCL[0]));
+        OCL_CALL(mSortComputeParticleKeys->setArg(4, *mParticleAgesCL[previousBufferID]));
+        enqueueKernel(*mSortComputeParticleKeys, mNumParticles);
+
+        /// Only the bits of the largest key, the extra bin for dead particles, are sorted
+        uint numBits = 1;
+        while ((1u << numBits) <= mGridCL->binCount) {
+            ++numBits;
+        }
+        radixSort(*mRadixKeysCL[0], *mRadixValuesCL[0], *mRadixKeysCL[1], *mRadixValuesCL[1],
+                  *mRadixHistogramsCL, mNumParticles, numBits);
+
+        OCL_CALL(mSortFindBinRanges->setArg(0, *mRadixKeysCL[0]));
+        OCL_CALL(mSortFindBinRanges->setArg(1, mNumParticles));
+        OCL_CALL(mSortFindBinRanges->setArg(2, *mBinStartIDCL));
+        OCL_CALL(mSortFindBinRanges->setArg(3, *mBinCountCL));
+        enqueueKernel(*mSortFindBinRanges, mGridCL->binCount + 1);
+
+        OCL_CALL(mSortComputeInBinIDs->setArg(0, *mRadixKeysCL[0]));
+        OCL_CALL(mSortComputeInBinIDs->setArg(1, *mRadixValuesCL[0]));
+        OCL_CALL(mSortComputeInBinIDs->setArg(2, *mBinStartIDCL));
+        OCL_CALL(mSortComputeInBinIDs->setArg(3, *mParticleInBinPosCL));
+        enqueueKernel(*mSortComputeInBinIDs, mNumParticles);
+    }
+
+    void ParticleSimulationScene::radixSort(cl::Buffer &keys, cl::Buffer &values, cl::Buffer &keysTemp,
+                                            cl::Buffer &valuesTemp, cl::Buffer &histograms, uint numKeys,
+                                            uint numBits) {
+        const uint blockSize = RADIX_SORT_GROUP_SIZE * RADIX_SORT_KEYS_PER_ITEM;
+        const uint numBlocks = (numKeys + blockSize - 1) / blockSize;
+        const cl_uint histogramSize = (1u << RADIX_SORT_BITS) * numBlocks;
+
+        uint numPasses = (numBits + RADIX_SORT_BITS - 1) / RADIX_SORT_BITS;
+        numPasses += numPasses % 2;
+
+        cl::Buffer *keysIn = &keys, *valuesIn = &values, *keysOut = &keysTemp, *valuesOut = &valuesTemp;
+        for (uint pass = 0; pass < numPasses; ++pass) {
+            const cl_uint shift = pass * RADIX_SORT_BITS;
+
+            OCL_CALL(mRadixHistogram->setArg(0, *keysIn));
+            OCL_CALL(mRadixHistogram->setArg(1, numKeys));
+            OCL_CALL(mRadixHistogram->setArg(2, shift));
+            OCL_CALL(mRadixHistogram->setArg(3, histograms));
+            OCL_CALL(mQueue.enqueueNDRangeKernel(*mRadixHistogram, cl::NullRange,
+                                                 cl::NDRange(numBlocks * RADIX_SORT_GROUP_SIZE),
+                                                 cl::NDRange(RADIX_SORT_GROUP_SIZE)));
+
+            OCL_CALL(mRadixScan->setArg(0, histograms));
+            OCL_CALL(mRadixScan->setArg(1, histogramSize));
+            OCL_CALL(mQueue.enqueueNDRangeKernel(*mRadixScan, cl::NullRange,
+                                                 cl::NDRange(RADIX_SORT_GROUP_SIZE),
+                                                 cl::NDRange(RADIX_SORT_GROUP_SIZE)));
+
+            OCL_CALL(mRadixScatter->setArg(0, *keysIn));
+            OCL_CALL(mRadixScatter->setArg(1, *valuesIn));
+            OCL_CALL(mRadixScatter->setArg(2, *keysOut));
+            OCL_CALL(mRadixScatter->setArg(3, *valuesOut));
+            OCL_CALL(mRadixScatter->setArg(4, numKeys));
+            OCL_CALL(mRadixScatter->setArg(5, shift));
+            OCL_CALL(mRadixScatter->setArg(6, histograms));
+            OCL_CALL(mQueue.enqueueNDRangeKernel(*mRadixScatter, cl::NullRange,
+                                                 cl::NDRange(numBlocks * RADIX_SORT_GROUP_SIZE),
+                                                 cl::NDRange(RADIX_SORT_GROUP_SIZE)));
+
+            std::swap(keysIn, keysOut);
+            std::swap(valuesIn, valuesOut);
+        }
+    }
+
+    uint ParticleSimulationScene::computeParticleOrder() {
+        /// Particles killed in the last frame are still at the end until the next update drops them
+        const uint numParticles = mLiveParticleCountPending ? mLiveParticleCount : mNumParticles;
+        if (numParticles == 0) {
+            return 0;
+        }
+
+        if (mNextParticleID == numParticles) {
+            /// No IDs were lost, so they are a permutation of the indices
+            OCL_CALL(mInvertParticleIDs->setArg(0, getParticleIDs()));
+            OCL_CALL(mInvertParticleIDs->setArg(1, *mParticleOrderCL));
+            enqueueKernel(*mInvertParticleIDs, numParticles);
+        } else {
+            OCL_CALL(mComputeIDKeys->setArg(0, getParticleIDs()));
+            OCL_CALL(mComputeIDKeys->setArg(1, *mRadixKeysCL[0]));
+            OCL_CALL(mComputeIDKeys->setArg(2, *mParticleOrderCL));
+            enqueueKernel(*mComputeIDKeys, numParticles);
+
+            uint numBits = 1;
+            while (numBits < 32 && (1u << numBits) < mNextParticleID) {
+                ++numBits;
+            }
+            radixSort(*mRadixKeysCL[0], *mParticleOrderCL, *mRadixKeysCL[1], *mRadixValuesCL[1],
+                      *mRadixHistogramsCL, numParticles, numBits);
+        }
+
+        return numParticles;
+    }
+
+    const cl::Buffer &ParticleSimulationScene::getParticleOrder() const {
+        return *mParticleOrderCL;
+    }
+
+    const cl::Buffer &ParticleSimulationScene::getParticleIDs() const {
+        return *mParticleIDsCL[mCurrentBufferID];
+    }
+
+    size_t ParticleSimulationScene::GetRadixHistogramSize(uint numKeys) {
+        const uint blockSize = RADIX_SORT_GROUP_SIZE * RADIX_SORT_KEYS_PER_ITEM;
+        return (size_t(1) << RADIX_SORT_BITS) * ((numKeys + blockSize - 1) / blockSize);
+    }
+
+    bool ParticleSimulationScene::canSkipSort() {
+        if (!mMovedParticleCountersPending) {
+            return false;
+        }
+        mMovedParticleCountersPending = false;
+
+        /// Sort if a particle may leave the loose grid within this frame, or enough changed bins that the
+        /// wider neighbour search costs more than sorting. Emitting or deleting particles always sorts
+        return mLooseGrid && !isKillingParticles() && mNumParticles == mNumSortedParticles
+               && mMovedParticleCounters[1] == 0 && mMovedParticleCounters[0] <= mResortFraction * mNumParticles;
+    }
+
+    void ParticleSimulationScene::countMovedParticles() {
+        OCL_CALL(mQueue.enqueueFillBuffer<cl_uint>(*mMovedParticleCountersCL, 0, 0, 2 * sizeof(cl_uint)));
+
+        OCL_CALL(mSortCountMovedParticles->setArg(0, *mPredictedPositionsCL[mCurrentBufferID]));
+        OCL_CALL(mSortCountMovedParticles->setArg(1, *mParticleBinIDCL[mCurrentBufferID]));
+        OCL_CALL(mSortCountMovedParticles->setArg(2, *mMovedParticleCountersCL));
+        OCL_CALL(mSortCountMovedParticles->setArg(3, 0.5f * LOOSE_GRID_SKIN));
+        enqueueKernel(*mSortCountMovedParticles, mNumParticles);
+
+        OCL_CALL(mQueue.enqueueReadBuffer(*mMovedParticleCountersCL, CL_FALSE, 0, sizeof(mMovedParticleCounters),
+                                          mMovedParticleCounters));
+        mMovedParticleCountersPending = true;
+    }
+
+    uint ParticleSimulationScene::getNumSlabs() const {
+        return std::min(mNumSlabs, static_cast<uint>(mSubDeviceQueues.size()));
+    }
+
+    void ParticleSimulationScene::updateSlabs() {
+        const uint numSlabs = getNumSlabs();
+        if (numSlabs == 0) {
+            mSlabBinStartIDsPending = false;
+            return;
+        }
+
+        mSlabStartIDs.assign(numSlabs + 1, mNumParticles);
+        mSlabStartIDs[0] = 0;
+
+        if (mSlabBinStartIDsPending) {
+            /// Slabs are whole layers of bins along z, which are contiguous ranges of the sorted particles
+            const std::vector<cl_uint> &binStartIDs = mSlabBinStartIDs;
+            const cl_uint *region = mSlabActiveRegion;
+            const uint binsPerLayer = mGridCL->binCount3D.s[0] * mGridCL->binCount3D.s[1];
+            const uint numLayers = mGridCL->binCount3D.s[2];
+
+            /// Clipped to the active region, only the starts of its bins are defined, and the layers outside it are empty
+            auto getLayerStartID = [&](uint layer) -> uint {
+                if (!mSlabActiveRegionValid) {
+                    return binStartIDs[layer * binsPerLayer];
+                }
+                if (layer < region[2]) {
+                    return 0;
+                }
+                if (layer > region[5]) {
+                    return mNumParticles;
+                }
+                return binStartIDs[region[0] + mGridCL->binCount3D.s[0] * region[1] + layer * binsPerLayer];
+            };
+
+            /// Balance the particle counts: each slab starts at the first layer beyond its share of the particles.
+            /// The starts are those of the previous sort, so they are clamped to the current particle count
+            uint layer = 0;
+            for (uint slab = 1; slab < numSlabs; ++slab) {
+                const uint target = slab * mNumParticles / numSlabs;
+                while (layer < numLayers && getLayerStartID(layer) < target) {
+                    ++layer;
+                }
+                mSlabStartIDs[slab] = std::min(layer < numLayers ? getLayerStartID(layer) : mNumParticles, mNumParticles);
+            }
+        } else {
+            /// No previous sort to balance by, so split the particles evenly (the slabs need not align with layers)
+            for (uint slab = 1; slab < numSlabs; ++slab) {
+                mSlabStartIDs[slab] = slab * mNumParticles / numSlabs;
+            }
+        }
+
+        /// Read back the bin starts of this sort for the next frame, which finds them complete after the update
+        /// waited for the queue, instead of stalling the pipeline here
+        mSlabBinStartIDs.resize(mGridCL->binCount);
+        OCL_CALL(mQueue.enqueueReadBuffer(*mBinStartIDCL, CL_FALSE, 0, sizeof(cl_uint) * mGridCL->binCount, mSlabBinStartIDs.data()));
+        OCL_CALL(mQueue.enqueueReadBuffer(*mActiveRegionCL, CL_FALSE, 0, sizeof(mSlabActiveRegion), mSlabActiveRegion));
+        mSlabActiveRegionValid = mActiveRegionValid;
+        mSlabBinStartIDsPending = true;
+    }
+
+    void ParticleSimulationScene::enqueueSlabs(cl::Kernel &kernel) {
+        const uint numSlabs = getNumSlabs();
+        if (numSlabs == 0) {
+            enqueueKernel(kernel, mNumParticles);
+            return;
+        }
+
+        /// Fork: the slabs start once everything enqueued on the main queue so far has completed
+        std::vector<cl::Event> ready(1);
+        OCL_CALL(mQueue.enqueueMarkerWithWaitList(NULL, &ready[0]));
+        OCL_CALL(mQueue.flush());
+
+        std::vector<cl::Event> done(numSlabs);
+        for (uint slab = 0; slab < numSlabs; ++slab) {
+            cl::CommandQueue &queue = mSubDeviceQueues[slab];
+            const uint begin = mSlabStartIDs[slab];
+            const uint end = mSlabStartIDs[slab + 1];
+
+            if (begin < end) {
+                enqueueKernel(queue, kernel, begin, end - begin, &ready, &done[slab]);
+            } else {
+                OCL_CALL(queue.enqueueMarkerWithWaitList(&ready, &done[slab]));
+            }
+            OCL_CALL(queue.flush());
+        }
+
+        /// Join: the next stage waits for all slabs, i.e. sees the updated halo particles of neighbouring slabs
+        OCL_CALL(mQueue.enqueueBarrierWithWaitList(&done));
+    }
+
+    void ParticleSimulationScene::enqueueActive(cl::Kernel &kernel) {
+        if (!mSleepingBins) {
+            enqueueSlabs(kernel);
+            return;
+        }
+
+        /// The active particle list is ordered by bins, but not split into slabs. Its length is only known on the
+        /// device, so the launch covers all particles and the work-items beyond it return immediately
+        enqueueKernel(kernel, mNumParticles);
+    }
+
+    void ParticleSimulationScene::enqueueKernel(cl::CommandQueue &queue, cl::Kernel &kernel, uint offset, uint count,
+                                                const std::vector<cl::Event> *events, cl::Event *event) {
+        const KernelLaunchInfo &info = getKernelLaunchInfo(queue, kernel);
+
+        /// Sizes beyond what the kernel supports on the queue's device (e.g. for its register use, or on a
+        /// sub-device) fall back to the default
+        size_t localSize = mTuningWorkGroups ? mTuningLocalSize : info.tunedLocalSize;
+        const bool supported = localSize <= info.maxLocalSize;
+        if (!supported) {
+            localSize = 0;
+        }
+        const size_t globalSize = localSize > 0 ? (count + localSize - 1) / localSize * localSize : count;
+
+        OCL_CALL(kernel.setArg(info.numArgs - 1, offset + count));
+
+        double begin = 0.0;
+        if (mTuningWorkGroups) {
+            OCL_CALL(mQueue.finish());
+            OCL_CALL(queue.finish());
+            begin = glfwGetTime();
+        }
+
+        OCL_CALL(queue.enqueueNDRangeKernel(kernel, offset > 0 ? cl::NDRange(offset) : cl::NullRange,
+                                            cl::NDRange(globalSize),
+                                            localSize > 0 ? cl::NDRange(localSize) : cl::NullRange,
+                                            events, event));
+
+        if (mTuningWorkGroups) {
+            OCL_CALL(queue.finish());
+            if (supported) {
+                mKernelTimes[info.name] += glfwGetTime() - begin;
+            }
+        }
+    }
+
+    void ParticleSimulationScene::enqueueKernel(cl::Kernel &kernel, uint count) {
+        if (count > 0) {
+            enqueueKernel(mQueue, kernel, 0, count);
+        }
+    }
+
+    const ParticleSimulationScene::KernelLaunchInfo &
+    ParticleSimulationScene::getKernelLaunchInfo(cl::CommandQueue &queue, cl::Kernel &kernel) {
+        const auto key = std::make_pair(kernel(), queue());
+        auto iter = mKernelLaunchInfo.find(key);
+        if (iter != mKernelLaunchInfo.end()) {
+            return iter->second;
+        }
+
+        KernelLaunchInfo info;
+        info.name = kernel.getInfo<CL_KERNEL_FUNCTION_NAME>().c_str();
+        info.numArgs = kernel.getInfo<CL_KERNEL_NUM_ARGS>();
+        info.tunedLocalSize = mWorkGroupSizes.get(info.name);
+        info.maxLocalSize = kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(queue.getInfo<CL_QUEUE_DEVICE>());
+        return mKernelLaunchInfo[key] = info;
+    }
+
+    std::string ParticleSimulationScene::getSleepingDefines() const {
+        return mSleepingBins ? "#define SLEEPING_BINS\n" : "";
+    }
+
+    std::string ParticleSimulationScene::getLooseGridDefines() const {
+        return mLooseGrid ? "#define LOOSE_GRID_SKIN " + util::ToCLFloat(LOOSE_GRID_SKIN) + "\n" : "";
+    }
+
+    void ParticleSimulationScene::markActiveBins(const cl::Buffer &positions) {
+        ++mSleepFrame;
+
+        OCL_CALL(mMarkActiveBins->setArg(0, positions));
+        OCL_CALL(mMarkActiveBins->setArg(1, *mVelocitiesCL[FIRST_BUFFER]));
+        OCL_CALL(mMarkActiveBins->setArg(2, *mDensitiesCL));
+        OCL_CALL(mMarkActiveBins->setArg(3, *mBinLastActiveFrameCL));
+        OCL_CALL(mMarkActiveBins->setArg(4, mSleepFrame));
+        OCL_CALL(mMarkActiveBins->setArg(5, mFluidCL->deltaTime));
+        OCL_CALL(mMarkActiveBins->setArg(6, 1.0f / mFluidCL->restDensity));
+        OCL_CALL(mMarkActiveBins->setArg(7, mSleepDisplacement));
+        OCL_CALL(mMarkActiveBins->setArg(8, mSleepCompression));
+        enqueueKernel(*mMarkActiveBins, mNumParticles);
+    }
+
+    void ParticleSimulationScene::compactActiveParticles() {
+        OCL_CALL(mCountAwakeBins->setArg(0, *mBinCountCL));
+        OCL_CALL(mCountAwakeBins->setArg(1, *mBinLastActiveFrameCL));
+        OCL_CALL(mCountAwakeBins->setArg(2, *mAwakeBinCountCL));
+        OCL_CALL(mCountAwakeBins->setArg(3, mSleepFrame));
+        OCL_CALL(mCountAwakeBins->setArg(4, SLEEP_DELAY_FRAMES));
+        enqueueKernel(*mCountAwakeBins, mGridCL->binCount + 1);
+
+        /// The same scan as in the counting sort gives the offsets of the awake bins in the active list
+        OCL_CALL(mSortComputeBinStartID->setArg(0, *mAwakeBinCountCL));
+        OCL_CALL(mSortComputeBinStartID->setArg(1, *mActiveBinStartIDCL));
+        enqueueKernel(*mSortComputeBinStartID, mGridCL->binCount + 1);
+
+        OCL_CALL(mCompactActiveParticles->setArg(0, *mParticleBinIDCL[mCurrentBufferID]));
+        OCL_CALL(mCompactActiveParticles->setArg(1, *mBinStartIDCL));
+        OCL_CALL(mCompactActiveParticles->setArg(2, *mAwakeBinCountCL));
+        OCL_CALL(mCompactActiveParticles->setArg(3, *mActiveBinStartIDCL));
+        OCL_CALL(mCompactActiveParticles->setArg(4, *mActiveParticleIDsCL));
+        OCL_CALL(mCompactActiveParticles->setArg(5, *mPositionsCL[mCurrentBufferID]));
+        OCL_CALL(mCompactActiveParticles->setArg(6, *mPredictedPositionsCL[mCurrentBufferID]));
+        OCL_CALL(mCompactActiveParticles->setArg(7, *mVelocitiesCL[SECOND_BUFFER]));
+        OCL_CALL(mCompactActiveParticles->setArg(8, *mVelocitiesCL[FIRST_BUFFER]));
+        OCL_CALL(mCompactActiveParticles->setArg(9, *mParticleCurlsCL));
+        OCL_CALL(mCompactActiveParticles->setArg(10, *mDensitiesCL));
+        OCL_CALL(mCompactActiveParticles->setArg(11, mFluidCL->restDensity));
+        enqueueKernel(*mCompactActiveParticles, mNumParticles);
+
+        /// The list starts with its length, which the solver kernels check, so the host never waits for it.
+        /// The statistics read it back asynchronously, it is valid once the update has waited for the queue
+        OCL_CALL(mQueue.enqueueCopyBuffer(*mActiveBinStartIDCL, *mActiveParticleIDsCL,
+                                          sizeof(cl_uint) * mGridCL->binCount, 0, sizeof(cl_uint)));
+        OCL_CALL(mQueue.enqueueReadBuffer(*mActiveBinStartIDCL, CL_FALSE, sizeof(cl_uint) * mGridCL->binCount,
+                                          sizeof(cl_uint), &mNumActiveParticles));
+    }
+
+    void ParticleSimulationScene::applyVorticityAndViscosity(bool velocitiesFromPositions) {
+        OCL_CALL(mCalcCurlsAndViscXSPH->setArg(0, sizeof(pbf::Fluid), mFluidCL.get()));
+        OCL_CALL(mCalcCurlsAndViscXSPH->setArg(1, *mParticleBinIDCL[mCurrentBufferID]));
+        OCL_CALL(mCalcCurlsAndViscXSPH->setArg(2, *mBinStartIDCL));
+        OCL_CALL(mCalcCurlsAndViscXSPH->setArg(3, *mBinCountCL));
+        OCL_CALL(mCalcCurlsAndViscXSPH->setArg(4, *mPredictedPositionsCL[mCurrentBufferID]));
+        OCL_CALL(mCalcCurlsAndViscXSPH->setArg(5, *mDensitiesCL));
+        OCL_CALL(mCalcCurlsAndViscXSPH->setArg(6, *mVelocitiesCL[SECOND_BUFFER]));
+        OCL_CALL(mCalcCurlsAndViscXSPH->setArg(7, *mPositionsCL[mCurrentBufferID]));
+        OCL_CALL(mCalcCurlsAndViscXSPH->setArg(8, static_cast<cl_uint>(velocitiesFromPositions ? 1 : 0)));
+        OCL_CALL(mCalcCurlsAndViscXSPH->setArg(9, *mParticleCurlsCL));
+        OCL_CALL(mCalcCurlsAndViscXSPH->setArg(10, *mVelocitiesCL[FIRST_BUFFER]));
+        enqueueActive(*mCalcCurlsAndViscXSPH);
+
+        OCL_CALL(mApplyVorticity->setArg(0, sizeof(pbf::Fluid), mFluidCL.get()));
+        OCL_CALL(mApplyVorticity->setArg(1, *mParticleBinIDCL[mCurrentBufferID]));
+        OCL_CALL(mApplyVorticity->setArg(2, *mBinStartIDCL));
+        OCL_CALL(mApplyVorticity->setArg(3, *mBinCountCL));
+        OCL_CALL(mApplyVorticity->setArg(4, *mPredictedPositionsCL[mCurrentBufferID]));
+        OCL_CALL(mApplyVorticity->setArg(5, *mDensitiesCL));
+        OCL_CALL(mApplyVorticity->setArg(6, *mParticleCurlsCL));
+        OCL_CALL(mApplyVorticity->setArg(7, *mVelocitiesCL[FIRST_BUFFER]));
+        enqueueActive(*mApplyVorticity);
+    }
+
+    void ParticleSimulationScene::calcDensities() {
+        OCL_CALL(mCalcDensities->setArg(0, sizeof(pbf::Fluid), mFluidCL.get()));
+        OCL_CALL(mCalcDensities->setArg(1, sizeof(pbf::Bounds), mBoundsCL.get()));
+        OCL_CALL(mCalcDensities->setArg(2, *mPredictedPositionsCL[mCurrentBufferID]));
+        OCL_CALL(mCalcDensities->setArg(3, *mParticleBinIDCL[mCurrentBufferID]));
+        OCL_CALL(mCalcDensities->setArg(4, *mBinStartIDCL));
+        OCL_CALL(mCalcDensities->setArg(5, *mBinCountCL));
+        OCL_CALL(mCalcDensities->setArg(6, *mDensitiesCL));
+        OCL_CALL(mCalcDensities->setArg(7, *mBoundaryVolumeCL));
+        OCL_CALL(mCalcDensities->setArg(8, *mBoundaryParticlesCL));
+        OCL_CALL(mCalcDensities->setArg(9, *mBoundaryBinStartIDCL));
+        OCL_CALL(mCalcDensities->setArg(10, *mBoundaryBinCountCL));
+        enqueueActive(*mCalcDensities);
+    }
+
+    cl::Event ParticleSimulationScene::enqueueDensityError(cl_float *result) {
+        /// The errors are scaled before they are summed, so that the sum is the average
+        const cl_uint numGroups = mReduction->getNumGroups(mNumParticles);
+        OCL_CALL(mSumDensityErrors->setArg(0, *mDensitiesCL));
+        OCL_CALL(mSumDensityErrors->setArg(1, mNumParticles));
+        OCL_CALL(mSumDensityErrors->setArg(2, 1.0f / mFluidCL->restDensity));
+        OCL_CALL(mSumDensityErrors->setArg(3, 1.0f / std::max(mNumParticles, 1u)));
+        OCL_CALL(mSumDensityErrors->setArg(4, mReduction->getPartials()));
+        OCL_CALL(mQueue.enqueueNDRangeKernel(*mSumDensityErrors, cl::NullRange,
+                                             cl::NDRange(numGroups * mReduction->getGroupSize()),
+                                             cl::NDRange(mReduction->getGroupSize())));
+        return mReduction->reducePartials(mQueue, util::DeviceReduction::Op::Sum, mNumParticles, result);
+    }
+
+    float ParticleSimulationScene::measureDensityError() {
+        cl_float error = 0.0f;
+        OCL_CALL(enqueueDensityError(&error).wait());
+        return error;
+    }
+
+    void ParticleSimulationScene::recordDensityError() {
+        mPendingDensityErrors.push_back(0.0f);
+        mPendingDensityErrorsEvent = enqueueDensityError(&mPendingDensityErrors.back());
+    }
+
+    void ParticleSimulationScene::showBenchmarkResults(const BenchmarkTable &table) {
+        using namespace nanogui;
+        if (mBenchmarkWindow) {
+            mBenchmarkWindow->dispose();
+        }
+
+        mBenchmarkWindow = new Window(mScreen, "Benchmark results");
+        mBenchmarkWindow->setPosition(Eigen::Vector2i(250, 15));
+        mBenchmarkWindow->setLayout(new GroupLayout());
+
+        new Label(mBenchmarkWindow, table.description);
+        Widget *cells = new Widget(mBenchmarkWindow);
+        cells->setLayout(new GridLayout(Orientation::Horizontal, static_cast<int>(table.header.size()),
+                                        Alignment::Maximum, 0, 8));
+        for (const std::string &column : table.header) {
+            new Label(cells, column, "sans-bold");
+        }
+        for (const std::vector<std::string> &row : table.rows) {
+            for (const std::string &cell : row) {
+                new Label(cells, cell);
+            }
+        }
+        if (!table.note.empty()) {
+            new Label(mBenchmarkWindow, table.note);
+        }
+
+        Button *close = new Button(mBenchmarkWindow, "Close");
+        close->setCallback([this]() {
+            mBenchmarkWindow->dispose();
+            mBenchmarkWindow = nullptr;
+        });
+
+        mScreen->performLayout();
+    }
+
+    void ParticleSimulationScene::beginPhases() {
+        if (mTimePhases) {
+            OCL_CALL(mQueue.finish());
+            mPhaseBeginTime = glfwGetTime();
+        }
+    }
+
+    void ParticleSimulationScene::endPhase(const std::string &name) {
+        if (!mTimePhases) {
+            return;
+        }
+
+        OCL_CALL(mQueue.finish());
+        const double time = glfwGetTime();
+
+        auto phase = std::find_if(mPhaseTimes.begin(), mPhaseTimes.end(),
+                                  [&name](const std::pair<std::string, double> &p) { return p.first == name; });
+        if (phase == mPhaseTimes.end()) {
+            mPhaseTimes.emplace_back(name, 0.0);
+            phase = mPhaseTimes.end() - 1;
+        }
+        phase->second += time - mPhaseBeginTime;
+        mPhaseBeginTime = time;
+    }
+
+    void ParticleSimulationScene::addSolids(uint type, uint count) {
+        count = std::min(count, NUM_MAX_SOLIDS - static_cast<uint>(mSolids.size()));
+        if (count == 0) {
+            return;
+        }
+
+        const glm::vec3 halfDims(mBoundsCL->halfDimensions.s[0], mBoundsCL->halfDimensions.s[1], mBoundsCL->halfDimensions.s[2]);
+        const std::vector<glm::vec3> positions = util::generate_uniform_vec3s(count,
+                                                                              -0.8f * halfDims.x, 0.8f * halfDims.x,
+                                                                              0.2f * halfDims.y, 0.8f * halfDims.y,
+                                                                              -0.8f * halfDims.z, 0.8f * halfDims.z);
+        const std::vector<glm::vec3> sizes = util::generate_uniform_vec3s(count, 0.04f, 0.12f, 0.04f, 0.12f, 0.04f, 0.12f);
+
+        const uint firstNewSolid = static_cast<uint>(mSolids.size());
+        for (uint i = 0; i < count; ++i) {
+            if (type == STYPE_SPHERE) {
+                const float radius = sizes[i].x;
+                const float mass = mSolidDensity * 4.0f / 3.0f * CL_M_PI_F * radius * radius * radius;
+                mSolids.push_back(pbf::SolidObject(pbf::Sphere(positions[i], radius, mass)));
+                mSolidMeshes.push_back(std::make_shared<clgl::MeshObject>(
+                        clgl::Primitives::CreateIcosphere(radius, 2), mBoxShader, true));
+            } else {
+                const float mass = mSolidDensity * 8.0f * sizes[i].x * sizes[i].y * sizes[i].z;
+                mSolids.push_back(pbf::SolidObject(pbf::Box(positions[i], sizes[i], mass)));
+                mSolidMeshes.push_back(std::make_shared<clgl::MeshObject>(
+                        clgl::Primitives::CreateBox(sizes[i]), mBoxShader));
+            }
+            mSolidMeshes.back()->setPosition(positions[i]);
+        }
+
+        uploadSolids(firstNewSolid);
+    }
+
+    void ParticleSimulationScene::clearSolids() {
+        mSolids.clear();
+        mSolidMeshes.clear();
+    }
+
+    void ParticleSimulationScene::uploadSolids(uint firstSolid) {
+        if (firstSolid >= mSolids.size()) {
+            return;
+        }
+
+        OCL_CALL(mQueue.enqueueWriteBuffer(*mSolidsCL, CL_TRUE, sizeof(pbf::SolidObject) * firstSolid,
+                                           sizeof(pbf::SolidObject) * (mSolids.size() - firstSolid),
+                                           &mSolids[firstSolid]));
+    }
+
+    float ParticleSimulationScene::getSolidContactRadius() const {
+        /// Half the rest spacing of the particles, of which there are restDensity per unit volume at rest
+        return 0.5f * std::cbrt(1.0f / mFluidCL->restDensity);
+    }
+
+    float ParticleSimulationScene::getParticleMass() const {
+        return WATER_DENSITY / mFluidCL->restDensity;
+    }
+
+    void ParticleSimulationScene::insertSolidsInGrid() {
+        const uint numSolids = static_cast<uint>(mSolids.size());
+
+        OCL_CALL(mQueue.enqueueFillBuffer<cl_uint>(*mBinSolidCountCL, 0, 0, sizeof(cl_uint) * mGridCL->binCount));
+        OCL_CALL(mQueue.enqueueFillBuffer<cl_uint>(*mBinSolidCursorCL, 0, 0, sizeof(cl_uint) * mGridCL->binCount));
+
+        OCL_CALL(mCountSolidsInBins->setArg(0, *mSolidsCL));
+        OCL_CALL(mCountSolidsInBins->setArg(1, *mBinSolidCountCL));
+        OCL_CALL(mCountSolidsInBins->setArg(2, getSolidContactRadius()));
+        enqueueKernel(*mCountSolidsInBins, numSolids);
+
+        OCL_CALL(mSortComputeBinStartID->setArg(0, *mBinSolidCountCL));
+        OCL_CALL(mSortComputeBinStartID->setArg(1, *mBinSolidStartIDCL));
+        enqueueKernel(*mSortComputeBinStartID, mGridCL->binCount);
+
+        OCL_CALL(mInsertSolidsInBins->setArg(0, *mSolidsCL));
+        OCL_CALL(mInsertSolidsInBins->setArg(1, *mBinSolidStartIDCL));
+        OCL_CALL(mInsertSolidsInBins->setArg(2, *mBinSolidCursorCL));
+        OCL_CALL(mInsertSolidsInBins->setArg(3, *mBinSolidIDCL));
+        OCL_CALL(mInsertSolidsInBins->setArg(4, NUM_MAX_BIN_SOLID_ENTRIES));
+        OCL_CALL(mInsertSolidsInBins->setArg(5, getSolidContactRadius()));
+        enqueueKernel(*mInsertSolidsInBins, numSolids);
+    }
+
+    void ParticleSimulationScene::collideWithSolids(bool correctVelocities) {
+        const uint numSolids = static_cast<uint>(mSolids.size());
+
+        OCL_CALL(mCollideWithSolids->setArg(0, *mPredictedPositionsCL[mCurrentBufferID]));
+        OCL_CALL(mCollideWithSolids->setArg(1, *mBinSolidStartIDCL));
+        OCL_CALL(mCollideWithSolids->setArg(2, *mBinSolidCountCL));
+        OCL_CALL(mCollideWithSolids->setArg(3, *mBinSolidIDCL));
+        OCL_CALL(mCollideWithSolids->setArg(4, NUM_MAX_BIN_SOLID_ENTRIES));
+        OCL_CALL(mCollideWithSolids->setArg(5, *mSolidsCL));
+        OCL_CALL(mCollideWithSolids->setArg(6, *mContactSolidIDCL));
+        OCL_CALL(mCollideWithSolids->setArg(7, *mContactImpulseCL));
+        OCL_CALL(mCollideWithSolids->setArg(8, *mContactTorqueCL));
+        OCL_CALL(mCollideWithSolids->setArg(9, getSolidContactRadius()));
+        OCL_CALL(mCollideWithSolids->setArg(10, getParticleMass() / mFluidCL->deltaTime));
+        OCL_CALL(mCollideWithSolids->setArg(11, *mVelocitiesCL[FIRST_BUFFER]));
+        OCL_CALL(mCollideWithSolids->setArg(12, correctVelocities ? 1.0f / mFluidCL->deltaTime : 0.0f));
+        enqueueSlabs(*mCollideWithSolids);
+
+        /// One work-group per solid sums the contacts of the particles around it
+        OCL_CALL(mReduceSolidImpulses->setArg(0, *mSolidsCL));
+        OCL_CALL(mReduceSolidImpulses->setArg(1, *mBinStartIDCL));
+        OCL_CALL(mReduceSolidImpulses->setArg(2, *mBinCountCL));
+        OCL_CALL(mReduceSolidImpulses->setArg(3, *mContactSolidIDCL));
+        OCL_CALL(mReduceSolidImpulses->setArg(4, *mContactImpulseCL));
+        OCL_CALL(mReduceSolidImpulses->setArg(5, *mContactTorqueCL));
+        OCL_CALL(mReduceSolidImpulses->setArg(6, cl::Local(sizeof(cl_float3) * SOLID_REDUCTION_SIZE)));
+        OCL_CALL(mReduceSolidImpulses->setArg(7, cl::Local(sizeof(cl_float3) * SOLID_REDUCTION_SIZE)));
+        OCL_CALL(mReduceSolidImpulses->setArg(8, getSolidContactRadius()));
+        OCL_CALL(mQueue.enqueueNDRangeKernel(*mReduceSolidImpulses, cl::NullRange,
+                                             cl::NDRange(numSolids * SOLID_REDUCTION_SIZE),
+                                             cl::NDRange(SOLID_REDUCTION_SIZE)));
+    }
+
+    void ParticleSimulationScene::integrateSolids() {
+        OCL_CALL(mIntegrateSolids->setArg(0, sizeof(pbf::Bounds), mBoundsCL.get()));
+        OCL_CALL(mIntegrateSolids->setArg(1, *mSolidsCL));
+        OCL_CALL(mIntegrateSolids->setArg(2, mFluidCL->deltaTime));
+        enqueueKernel(*mIntegrateSolids, mSolids.size());
+    }
+
+    void ParticleSimulationScene::updateSolidMeshes() {
+        std::vector<pbf::SolidObject> solids(mSolids.size());
+        OCL_CALL(mQueue.enqueueReadBuffer(*mSolidsCL, CL_TRUE, 0, sizeof(pbf::SolidObject) * solids.size(), solids.data()));
+
+        for (size_t i = 0; i < solids.size(); ++i) {
+            if (solids[i].type == STYPE_SPHERE) {
+                const cl_float3 &p = solids[i].data.sphere.position;
+                mSolidMeshes[i]->setPosition(glm::vec3(p.s[0], p.s[1], p.s[2]));
+            } else if (solids[i].type == STYPE_BOX) {
+                const cl_float3 &p = solids[i].data.box.position;
+                const cl_float4 &q = solids[i].data.box.orientation;
+                mSolidMeshes[i]->setPosition(glm::vec3(p.s[0], p.s[1], p.s[2]));
+                mSolidMeshes[i]->setOrientation(glm::quat(q.s[3], q.s[0], q.s[1], q.s[2]));
+            }
+        }
+    }
+
+    void ParticleSimulationScene::render() {
+        /// Polled here rather than in update, so that a reload also finishes while paused
+        pollKernelReload();
+
+        OGL_CALL(glEnable(GL_DEPTH_TEST));
+        OGL_CALL(glEnable(GL_CULL_FACE));
+        OGL_CALL(glCullFace(GL_BACK));
+        //OGL_CALL(glDisable(GL_PROGRAM_POINT_SIZE));
+
+        const glm::mat4 V = glm::inverse(mCamera->getTransform());
+        const glm::mat4 VP = mCamera->getPerspectiveTransform() * V;
+
+        mParticlesShader->use();
+        mParticlesShader->uniform("MV", V);
+        mParticlesShader->uniform("MVP", VP);
+        mParticlesShader->uniform("pointRadius", mParticleRadius);
+        mParticlesShader->uniform("pointScale",
+                                  mCamera->getScreenDimensions().y / tanf(mCamera->getFieldOfViewY() * CL_M_PI_F / 360));
+
+        mPointLight->setUniformsInShader(mParticlesShader, "pointLight");
+        mAmbLight->setUniformsInShader(mParticlesShader, "ambLight");
+
+        mParticles[mCurrentBufferID]->bind();
+        OGL_CALL(glPointSize(mParticleRadius));
+        OGL_CALL(glDrawArrays(GL_POINTS, 0, (GLsizei) mNumParticles));
+        mParticles[mCurrentBufferID]->unbind();
+
+        // Cull front faces to only render box insides
+        OGL_CALL(glCullFace(GL_FRONT));
+        mAmbLight->setUniformsInShader(mBoxShader, "ambLight.");
+        mDirLight->setUniformsInShader(mBoxShader, "dirLight.");
+        mPointLight->setUniformsInShader(mBoxShader, "pointLight.");
+
+        mBoundingBox->render(VP);
+        mSpawnPointSphereObject->render(VP);
+
+        if (mObstacleObject) {
+            mObstacleObject->render(VP);
+        }
+
+        for (auto &solidMesh : mSolidMeshes) {
+            solidMesh->render(VP);
+        }
+    }
+
+    void ParticleSimulationScene::killParticles(uint previousBufferID, const cl::Buffer &predictedPositions) {
+        OCL_CALL(mAgeAndKillParticles->setArg(0, predictedPositions));
+        OCL_CALL(mAgeAndKillParticles->setArg(1, *mParticleAgesCL[previousBufferID]));
+        OCL_CALL(mAgeAndKillParticles->setArg(2, *mSinksCL));
+        OCL_CALL(mAgeAndKillParticles->setArg(3, static_cast<cl_uint>(mSinks.size())));
+        OCL_CALL(mAgeAndKillParticles->setArg(4, mMaxParticleAge));
+        OCL_CALL(mAgeAndKillParticles->setArg(5, mFluidCL->deltaTime));
+        enqueueKernel(*mAgeAndKillParticles, mNumParticles);
+    }
+
+    void ParticleSimulationScene::uploadSinks() {
+        if (mSinks.empty()) {
+            return;
+        }
+
+        OCL_CALL(mQueue.enqueueWriteBuffer(*mSinksCL, CL_TRUE, 0, sizeof(pbf::Sink) * mSinks.size(), mSinks.data()));
+    }
+
+    void ParticleSimulationScene::emitParticles(uint bufferID) {
+        if (mNumParticles >= mMaxParticles) {
+            return;
+        }
+
+        /// The particles are appended on the device, so start the counter at the current particle count
+        OCL_CALL(mQueue.enqueueFillBuffer<cl_uint>(*mParticleCounterCL, mNumParticles, 0, sizeof(cl_uint)));
+
+        uint numParticles = mNumParticles;
+        if (isKeyDown(GLFW_KEY_SPACE)) {
+            /// Keep the emitter's volume clear of the wall that the spawn point sits on
+            const float offset = mSpawnEmitterType == pbf::Emitter::Type::Disc ? 0.05f : mSpawnEmitter.radius + 0.05f;
+            const glm::vec3 position = getWorldSpawnPoint() + glm::vec3(offset, 0.0f, 0.0f);
+            mSpawnEmitter = pbf::Emitter(mSpawnEmitterType, position, glm::vec3(1.0f, 0.0f, 0.0f),
+                                         mSpawnEmitter.radius, mSpawnEmitter.speed, mSpawnEmitter.rate);
+            numParticles += emitParticles(mSpawnEmitter, mSpawnEmitterCarry, bufferID);
+        }
+
+        for (size_t i = 0; i < mEmitters.size(); ++i) {
+            numParticles += emitParticles(mEmitters[i], mEmitterCarries[i], bufferID);
+        }
+
+        /// Every work-item claims a slot, so the count follows without reading the counter back
+        mNumParticles = std::min(numParticles, mMaxParticles);
+    }
+
+    uint ParticleSimulationScene::emitParticles(pbf::Emitter &emitter, float &carry, uint bufferID) {
+        const float particles = emitter.rate * mFluidCL->deltaTime + carry;
+        const uint numNewParticles = static_cast<uint>(particles);
+        carry = particles - numNewParticles;
+        if (numNewParticles == 0) {
+            return 0;
+        }
+
+        OCL_CALL(mEmitParticles->setArg(0, sizeof(pbf::Emitter), &emitter));
+        OCL_CALL(mEmitParticles->setArg(1, *mPredictedPositionsCL[bufferID]));
+        OCL_CALL(mEmitParticles->setArg(2, *mVelocitiesCL[FIRST_BUFFER]));
+        OCL_CALL(mEmitParticles->setArg(3, *mParticleCounterCL));
+        OCL_CALL(mEmitParticles->setArg(4, mMaxParticles));
+        OCL_CALL(mEmitParticles->setArg(5, mEmissionSequenceOffset));
+        OCL_CALL(mEmitParticles->setArg(6, mFluidCL->deltaTime));
+        OCL_CALL(mEmitParticles->setArg(7, *mParticleAgesCL[bufferID]));
+        OCL_CALL(mEmitParticles->setArg(8, *mParticleIDsCL[bufferID]));
+        OCL_CALL(mEmitParticles->setArg(9, mNextParticleID));
+        enqueueKernel(*mEmitParticles, numNewParticles);
+
+        /// Wrapped well below 2^24, so that the sequence index stays exact as a float
+        mEmissionSequenceOffset = (mEmissionSequenceOffset + numNewParticles) % (1 << 20);
+        /// Particles dropped beyond the maximum use up their IDs as well
+        mNextParticleID += numNewParticles;
+        return numNewParticles;
+    }
 
     glm::vec3 ParticleSimulationScene::getWorldSpawnPoint() {
         return glm::vec3(-mBoundsCL->halfDimensions.s[0],
@@ -665,6 +2166,31 @@ namespace pbf {
         double FPS = mFramesSinceLastUpdate / timeSinceLastUpdate;
         ss << "Average FPS: " << std::setprecision(3) << FPS;
         mLabelFPS->setCaption(ss.str());
+
+        ss.str("");
+
+        ss << "Active particles: " << mNumActiveParticles << "/" << mNumParticles;
+        mLabelActiveParticles->setCaption(ss.str());
+
+        ss.str("");
+
+        const uint numSortCalls = mNumSorts + mNumSkippedSorts;
+        ss << "Sorts skipped: " << std::setprecision(3)
+           << (numSortCalls > 0 ? 100.0 * mNumSkippedSorts / numSortCalls : 0.0) << "%";
+        mLabelSkippedSorts->setCaption(ss.str());
+        mNumSorts = 0;
+        mNumSkippedSorts = 0;
+
+        ss.str("");
+
+        ss << "Particles: " << mNumParticles << "/" << mMaxParticles;
+        if (mNumDroppedParticles > 0) {
+            ss << ", " << mNumDroppedParticles << " dropped";
+        }
+        if (mBoundaryParticles) {
+            ss << ", " << mNumBoundaryParticles << " boundary";
+        }
+        mLabelParticleCount->setCaption(ss.str());
     }
 
     void ParticleSimulationScene::loadShaders() {
@@ -683,34 +2209,415 @@ namespace pbf {
     void ParticleSimulationScene::loadKernels() {
         OCL_ERROR;
 
+        /// The handles of the kernels released below may be reused by new ones
+        mKernelLaunchInfo.clear();
+
+        /// Build everything that isn't cached concurrently, so that the programs below come from the cache
+        mProgramCache.build(getProgramSources(), mContext, mDevice);
+
         /// Setup counting sort kernels
-        mCountingSortProgram = util::LoadCLProgram("counting_sort.cl", mContext, mDevice, GetDefinesCL(*mGridCL));
+        mCountingSortProgram = getProgram("counting_sort.cl");
         OCL_CHECK(mSortInsertParticles = make_unique<Kernel>(*mCountingSortProgram, "insert_particles", CL_ERROR));
         OCL_CHECK(mSortComputeBinStartID = make_unique<Kernel>(*mCountingSortProgram, "compute_bin_start_ID", CL_ERROR));
+        OCL_CHECK(mSortClearRegionBinCounts = make_unique<Kernel>(*mCountingSortProgram, "clear_region_bin_counts", CL_ERROR));
+        OCL_CHECK(mSortComputeRegionBinStartID = make_unique<Kernel>(*mCountingSortProgram, "compute_region_bin_start_ID", CL_ERROR));
+        OCL_CHECK(mSortCountMovedParticles = make_unique<Kernel>(*mCountingSortProgram, "count_moved_particles", CL_ERROR));
+        OCL_CHECK(mSortComputeParticleKeys = make_unique<Kernel>(*mCountingSortProgram, "compute_particle_keys", CL_ERROR));
+        OCL_CHECK(mSortFindBinRanges = make_unique<Kernel>(*mCountingSortProgram, "find_bin_ranges", CL_ERROR));
+        OCL_CHECK(mSortComputeInBinIDs = make_unique<Kernel>(*mCountingSortProgram, "compute_in_bin_ids", CL_ERROR));
+        OCL_CHECK(mInvertParticleIDs = make_unique<Kernel>(*mCountingSortProgram, "invert_particle_ids", CL_ERROR));
+        OCL_CHECK(mComputeIDKeys = make_unique<Kernel>(*mCountingSortProgram, "compute_id_keys", CL_ERROR));
+
+        /// Setup radix sort kernels
+        mRadixSortProgram = getProgram("radix_sort.cl");
+        OCL_CHECK(mRadixHistogram = make_unique<Kernel>(*mRadixSortProgram, "radix_histogram", CL_ERROR));
+        OCL_CHECK(mRadixScan = make_unique<Kernel>(*mRadixSortProgram, "radix_scan", CL_ERROR));
+        OCL_CHECK(mRadixScatter = make_unique<Kernel>(*mRadixSortProgram, "radix_scatter", CL_ERROR));
         OCL_CHECK(mSortReindexParticles = make_unique<Kernel>(*mCountingSortProgram, "reindex_particles", CL_ERROR));
 
+        loadFluidSimKernels();
+
+        loadSolidKernels();
+
+        /// Setup emitter kernel
+        mEmitterProgram = getProgram("emitter.cl");
+        OCL_CHECK(mEmitParticles = make_unique<Kernel>(*mEmitterProgram, "emit_particles", CL_ERROR));
+
+        /// Setup reduction kernels
+        mReduceProgram = getProgram("reduce.cl");
+        mReduction = make_unique<util::DeviceReduction>(mContext, mDevice, *mReduceProgram);
+        OCL_CHECK(mSumDensityErrors = make_unique<Kernel>(*mReduceProgram, "sum_density_errors", CL_ERROR));
+
+        /// Setup fluid setup generator kernel
+        mFluidVolumesProgram = getProgram("fluid_volumes.cl");
+        OCL_CHECK(mFillFluidVolumes = make_unique<Kernel>(*mFluidVolumesProgram, "fill_fluid_volumes", CL_ERROR));
+
+        /// Setup sink kernel
+        mSinksProgram = getProgram("sinks.cl");
+        OCL_CHECK(mAgeAndKillParticles = make_unique<Kernel>(*mSinksProgram, "age_and_kill_particles", CL_ERROR));
+
+        /// Setup sleeping bin kernels
+        mSleepingBinsProgram = getProgram("sleeping_bins.cl");
+        OCL_CHECK(mMarkActiveBins = make_unique<Kernel>(*mSleepingBinsProgram, "mark_active_bins", CL_ERROR));
+        OCL_CHECK(mCountAwakeBins = make_unique<Kernel>(*mSleepingBinsProgram, "count_awake_bins", CL_ERROR));
+        OCL_CHECK(mCompactActiveParticles = make_unique<Kernel>(*mSleepingBinsProgram, "compact_active_particles", CL_ERROR));
+
+        /// Setup the fused predict, clip and insert kernel
+        mTimestepProgram = getProgram("timestep.cl");
+        OCL_CHECK(mPredictAndInsert = make_unique<Kernel>(*mTimestepProgram, "predict_and_insert", CL_ERROR));
+
+        /// Setup obstacle kernels
+        mSDFProgram = getProgram("sdf.cl");
+        OCL_CHECK(mBuildSDF = make_unique<Kernel>(*mSDFProgram, "build_sdf", CL_ERROR));
+        OCL_CHECK(mComputeBoundaryVolumes = make_unique<Kernel>(*mSDFProgram, "compute_boundary_volumes", CL_ERROR));
+    }
+
+    std::vector<util::ProgramCache::Source> ParticleSimulationScene::getProgramSources() const {
+        const std::string gridDefines = GetDefinesCL(*mGridCL);
+        const std::string fluidDefines = mSpecializeFluid ? GetDefinesCL(*mFluidCL) : "";
+        const std::string radixDefines = "#define RADIX_BITS " + std::to_string(RADIX_SORT_BITS) + "\n"
+                                         + "#define RADIX_GROUP_SIZE " + std::to_string(RADIX_SORT_GROUP_SIZE) + "\n"
+                                         + "#define RADIX_KEYS_PER_ITEM " + std::to_string(RADIX_SORT_KEYS_PER_ITEM) + "\n";
+
+        std::vector<util::ProgramCache::Source> sources = {
+            {"counting_sort.cl", gridDefines + getStorageDefines()},
+            {"radix_sort.cl", radixDefines},
+            {"fluid_sim.cl", gridDefines + fluidDefines + getStorageDefines() + getBoundaryDefines()
+                             + getSleepingDefines() + getLooseGridDefines()},
+            {"dfsph.cl", gridDefines + fluidDefines + getStorageDefines() + getBoundaryDefines()},
+            {"solids.cl", gridDefines + getStorageDefines()},
+            {"emitter.cl", getStorageDefines()},
+            {"fluid_volumes.cl", ""},
+            {"reduce.cl", util::DeviceReduction::GetDefinesCL(mDevice) + getStorageDefines()},
+            {"sinks.cl", ""},
+            {"sleeping_bins.cl", gridDefines + getStorageDefines()},
+            {"timestep.cl", gridDefines + getBoundaryDefines() + getStorageDefines()},
+            {"sdf.cl", gridDefines + getBoundaryDefines()}
+        };
+        if (!mSingleSolverProgram) {
+            return sources;
+        }
+
+        /// Replace the files linked into solver.cl by solver.cl, built with the union of their defines
+        std::vector<util::ProgramCache::Source> linkedSources;
+        std::set<std::string> solverDefineLines;
+        std::string solverDefines;
+        for (const util::ProgramCache::Source &source : sources) {
+            if (!IsSolverProgramFile(source.first)) {
+                linkedSources.push_back(source);
+                continue;
+            }
+
+            std::stringstream defines(source.second);
+            std::string line;
+            while (std::getline(defines, line)) {
+                if (solverDefineLines.insert(line).second) {
+                    solverDefines += line + "\n";
+                }
+            }
+        }
+        linkedSources.push_back({SOLVER_PROGRAM_FILE, solverDefines});
+        return linkedSources;
+    }
+
+    util::ProgramCache::Source ParticleSimulationScene::getProgramSource(const std::string &kernelFile) const {
+        const std::string file = mSingleSolverProgram && IsSolverProgramFile(kernelFile) ? SOLVER_PROGRAM_FILE : kernelFile;
+        for (const util::ProgramCache::Source &source : getProgramSources()) {
+            if (source.first == file) {
+                return source;
+            }
+        }
+        return util::ProgramCache::Source(kernelFile, "");
+    }
+
+    bool ParticleSimulationScene::IsSolverProgramFile(const std::string &kernelFile) {
+        return kernelFile == "counting_sort.cl" || kernelFile == "sleeping_bins.cl" || kernelFile == "timestep.cl"
+               || kernelFile == "dfsph.cl" || kernelFile == "fluid_sim.cl";
+    }
+
+    std::shared_ptr<cl::Program> ParticleSimulationScene::getProgram(const std::string &kernelFile) {
+        const util::ProgramCache::Source source = getProgramSource(kernelFile);
+        return mProgramCache.get(source.first, mContext, mDevice, source.second);
+    }
+
+    void ParticleSimulationScene::reloadKernels() {
+        if (mKernelReload.valid()) {
+            std::cout << "Kernels are already being reloaded" << std::endl;
+            return;
+        }
+
+        /// A fresh cache, since the sources may have changed on disk. The handles are copied, so the builds
+        /// don't touch any scene state
+        const std::vector<util::ProgramCache::Source> sources = getProgramSources();
+        cl::Context context = mContext;
+        cl::Device device = mDevice;
+        mKernelReload = std::async(std::launch::async, [sources, context, device]() mutable {
+            std::unique_ptr<util::ProgramCache> programs = make_unique<util::ProgramCache>();
+            if (!programs->build(sources, context, device)) {
+                programs.reset();
+            }
+            return programs;
+        });
+        std::cout << "Reloading kernels in the background" << std::endl;
+    }
+
+    void ParticleSimulationScene::pollKernelReload() {
+        if (!mKernelReload.valid() || mKernelReload.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+            return;
+        }
+
+        std::unique_ptr<util::ProgramCache> programs = mKernelReload.get();
+        if (!programs) {
+            std::cerr << "Reloading kernels failed, keeping the previous kernels" << std::endl;
+            return;
+        }
+
+        /// Programs for a configuration that changed during the reload are built by loadKernels
+        mProgramCache = std::move(*programs);
+        loadKernels();
+        std::cout << "Reloaded kernels" << std::endl;
+    }
+
+    std::string ParticleSimulationScene::getStorageDefines() const {
+        return mHalfStorage ? "#define HALF_STORAGE\n" : "";
+    }
+
+    std::string ParticleSimulationScene::getBoundaryDefines() const {
+        std::string defines = "#define SDF_CELLS_PER_BIN " + std::to_string(SDF_CELLS_PER_BIN) + "\n";
+        if (mBuiltObstacleType != ObstacleType::None) {
+            defines += "#define SDF_OBSTACLES\n";
+        }
+        if (mBoundaryParticles) {
+            defines += "#define BOUNDARY_PARTICLES\n";
+        }
+        return defines;
+    }
+
+    uint ParticleSimulationScene::getNumSDFNodes() const {
+        return (mGridCL->binCount3D.s[0] * SDF_CELLS_PER_BIN + 1)
+               * (mGridCL->binCount3D.s[1] * SDF_CELLS_PER_BIN + 1)
+               * (mGridCL->binCount3D.s[2] * SDF_CELLS_PER_BIN + 1);
+    }
+
+    void ParticleSimulationScene::buildObstacle() {
+        OCL_ERROR;
+
+        const glm::vec3 halfDims(mBoundsCL->halfDimensions.s[0], mBoundsCL->halfDimensions.s[1], mBoundsCL->halfDimensions.s[2]);
+
+        std::shared_ptr<clgl::Mesh> mesh;
+        glm::vec3 position;
+        switch (mObstacleType) {
+            case ObstacleType::None:
+                break;
+            case ObstacleType::Sphere:
+                mesh = clgl::Primitives::CreateIcosphere(0.3f, 3);
+                position = glm::vec3(0.0f, -halfDims.y + 0.25f, 0.0f);
+                break;
+            case ObstacleType::Weir:
+                /// Spans the bounds along z, so that the fluid has to flow over it
+                mesh = clgl::Primitives::CreateBox(glm::vec3(0.08f, 0.25f, halfDims.z + 0.1f));
+                position = glm::vec3(0.0f, -halfDims.y + 0.15f, 0.0f);
+                break;
+        }
+
+        mBuiltObstacleType = mObstacleType;
+        mObstacleObject.reset();
+        mObstacleTriangles.clear();
+
+        if (mesh) {
+            mObstacleTriangles = mesh->getTriangles(position);
+
+            std::vector<cl_float3> triangles;
+            triangles.reserve(mObstacleTriangles.size());
+            for (const glm::vec3 &vertex : mObstacleTriangles) {
+                triangles.push_back({{vertex.x, vertex.y, vertex.z, 0.0f}});
+            }
+
+            cl::Buffer trianglesCL;
+            OCL_CHECK(trianglesCL = cl::Buffer(mContext, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                                               sizeof(cl_float3) * triangles.size(), triangles.data(), CL_ERROR));
+
+            /// The SDF kernels are the same with and without obstacles, so they can be used before the rebuild
+            OCL_CALL(mBuildSDF->setArg(0, trianglesCL));
+            OCL_CALL(mBuildSDF->setArg(1, static_cast<cl_uint>(triangles.size() / 3)));
+            OCL_CALL(mBuildSDF->setArg(2, *mSDFCL));
+            OCL_CALL(mQueue.enqueueNDRangeKernel(*mBuildSDF, cl::NullRange,
+                                                 cl::NDRange(getNumSDFNodes(), 1), cl::NullRange));
+            computeBoundaryVolumes();
+
+            const bool hasIndices = !mesh->mIndices.empty();
+            mObstacleObject = std::make_shared<clgl::MeshObject>(std::move(mesh), mBoxShader, hasIndices);
+            mObstacleObject->setPosition(position);
+        }
+    }
+
+    void ParticleSimulationScene::computeBoundaryVolumes() {
+        OCL_CALL(mComputeBoundaryVolumes->setArg(0, *mSDFCL));
+        OCL_CALL(mComputeBoundaryVolumes->setArg(1, *mBoundaryVolumeCL));
+        OCL_CALL(mComputeBoundaryVolumes->setArg(2, mFluidCL->kernelRadius));
+        OCL_CALL(mQueue.enqueueNDRangeKernel(*mComputeBoundaryVolumes, cl::NullRange,
+                                             cl::NDRange(getNumSDFNodes(), 1), cl::NullRange));
+        OCL_CALL(mQueue.finish());
+    }
+
+    void ParticleSimulationScene::buildBoundaryParticles() {
+        OCL_ERROR;
+
+        const glm::vec3 halfDims(mBoundsCL->halfDimensions.s[0], mBoundsCL->halfDimensions.s[1], mBoundsCL->halfDimensions.s[2]);
+        const glm::ivec3 binCount3D(mGridCL->binCount3D.s[0], mGridCL->binCount3D.s[1], mGridCL->binCount3D.s[2]);
+        const float h = mFluidCL->kernelRadius;
+
+        const auto getBinID3D = [&](const glm::vec3 &position) {
+            return glm::clamp(glm::ivec3(glm::floor((position + halfDims) / mGridCL->binSize)),
+                              glm::ivec3(0), binCount3D - 1);
+        };
+
+        /// Sample the walls and the obstacle at about the rest spacing of the fluid particles
+        std::vector<glm::vec3> triangles = clgl::Primitives::CreateBox(halfDims)->getTriangles();
+        triangles.insert(triangles.end(), mObstacleTriangles.begin(), mObstacleTriangles.end());
+        const std::vector<glm::vec3> samples = util::sample_triangles(triangles, std::cbrt(1.0f / mFluidCL->restDensity));
+
+        /// Counting sort into the grid, on the host since it only happens once
+        std::vector<cl_uint> binIDs(samples.size());
+        std::vector<cl_uint> binCounts(mGridCL->binCount, 0);
+        for (size_t i = 0; i < samples.size(); ++i) {
+            const glm::ivec3 binID3D = getBinID3D(samples[i]);
+            binIDs[i] = binID3D.x + binCount3D.x * (binID3D.y + binCount3D.y * binID3D.z);
+            ++binCounts[binIDs[i]];
+        }
+
+        std::vector<cl_uint> binStartIDs(mGridCL->binCount, 0);
+        for (uint binID = 1; binID < mGridCL->binCount; ++binID) {
+            binStartIDs[binID] = binStartIDs[binID - 1] + binCounts[binID - 1];
+        }
+
+        std::vector<glm::vec4> sorted(samples.size());
+        std::vector<cl_uint> cursors = binStartIDs;
+        for (size_t i = 0; i < samples.size(); ++i) {
+            sorted[cursors[binIDs[i]]++] = glm::vec4(samples[i], 0.0f);
+        }
+
+        /// The volume of a boundary particle is the inverse of the kernel-weighted number of boundary particles
+        /// around it (Akinci et al. 2012), which makes up for uneven sampling, e.g. along shared edges
+        const float poly6Coefficient = 315.0f / (64.0f * CL_M_PI_F * std::pow(h, 9.0f));
+        for (glm::vec4 &particle : sorted) {
+            const glm::ivec3 binID3D = getBinID3D(glm::vec3(particle));
+
+            float sum = 0.0f;
+            for (int z = std::max(binID3D.z - 1, 0); z <= std::min(binID3D.z + 1, binCount3D.z - 1); ++z) {
+                for (int y = std::max(binID3D.y - 1, 0); y <= std::min(binID3D.y + 1, binCount3D.y - 1); ++y) {
+                    for (int x = std::max(binID3D.x - 1, 0); x <= std::min(binID3D.x + 1, binCount3D.x - 1); ++x) {
+                        const uint binID = x + binCount3D.x * (y + binCount3D.y * z);
+                        for (uint j = binStartIDs[binID]; j < binStartIDs[binID] + binCounts[binID]; ++j) {
+                            const glm::vec3 r = glm::vec3(particle) - glm::vec3(sorted[j]);
+                            const float tmp = h * h - glm::dot(r, r);
+                            if (tmp > 0.0f) {
+                                sum += poly6Coefficient * tmp * tmp * tmp;
+                            }
+                        }
+                    }
+                }
+            }
+            particle.w = 1.0f / sum;
+        }
+
+        mNumBoundaryParticles = static_cast<uint>(sorted.size());
+        OCL_CHECK(mBoundaryParticlesCL = make_unique<cl::Buffer>(mContext, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                                                                 sizeof(cl_float4) * sorted.size(), sorted.data(), CL_ERROR));
+        OCL_CALL(mQueue.enqueueWriteBuffer(*mBoundaryBinStartIDCL, CL_TRUE, 0, sizeof(cl_uint) * mGridCL->binCount, binStartIDs.data()));
+        OCL_CALL(mQueue.enqueueWriteBuffer(*mBoundaryBinCountCL, CL_TRUE, 0, sizeof(cl_uint) * mGridCL->binCount, binCounts.data()));
+    }
+
+    void ParticleSimulationScene::loadSolidKernels() {
+        OCL_ERROR;
+
+        mSolidsProgram = getProgram("solids.cl");
+        OCL_CHECK(mCountSolidsInBins = make_unique<Kernel>(*mSolidsProgram, "count_solids_in_bins", CL_ERROR));
+        OCL_CHECK(mInsertSolidsInBins = make_unique<Kernel>(*mSolidsProgram, "insert_solids_in_bins", CL_ERROR));
+        OCL_CHECK(mCollideWithSolids = make_unique<Kernel>(*mSolidsProgram, "collide_particles_with_solids", CL_ERROR));
+        OCL_CHECK(mReduceSolidImpulses = make_unique<Kernel>(*mSolidsProgram, "reduce_solid_impulses", CL_ERROR));
+        OCL_CHECK(mIntegrateSolids = make_unique<Kernel>(*mSolidsProgram, "integrate_solids", CL_ERROR));
+    }
+
+    void ParticleSimulationScene::setActiveParticleIDsArgs() {
+        /// The active particle list is only read with SLEEPING_BINS, but always set
+        OCL_CALL(mCalcDensities->setArg(11, *mActiveParticleIDsCL));
+        OCL_CALL(mCalcLambdas->setArg(11, *mActiveParticleIDsCL));
+        OCL_CALL(mCalcDeltaPositionAndDoUpdate->setArg(11, *mActiveParticleIDsCL));
+        OCL_CALL(mCalcDeltaPositionColoured->setArg(12, *mActiveParticleIDsCL));
+        OCL_CALL(mApplyDeltaPositionColoured->setArg(7, *mActiveParticleIDsCL));
+        OCL_CALL(mCalcCurlsAndViscXSPH->setArg(11, *mActiveParticleIDsCL));
+        OCL_CALL(mApplyVorticity->setArg(8, *mActiveParticleIDsCL));
+    }
+
+    void ParticleSimulationScene::loadFluidSimKernels() {
+        OCL_ERROR;
+
+        /// The handles of the kernels released below may be reused by new ones
+        mKernelLaunchInfo.clear();
+
+        mFluidDefines = mSpecializeFluid ? GetDefinesCL(*mFluidCL) : "";
+        mDefinedFluid = *mFluidCL;
+        mDefinedFluidSpecialized = mSpecializeFluid;
+
+        /// Both programs depend on the fluid defines, so build them together when these change
+        mProgramCache.build({getProgramSource("fluid_sim.cl"), getProgramSource("dfsph.cl")}, mContext, mDevice);
+
         /// Setup position adjustment kernels
-        mPositionAdjustmentProgram = util::LoadCLProgram("fluid_sim.cl", mContext, mDevice, GetDefinesCL(*mGridCL));
+        mPositionAdjustmentProgram = getProgram("fluid_sim.cl");
         OCL_CHECK(mCalcDensities = make_unique<Kernel>(*mPositionAdjustmentProgram, "calc_densities", CL_ERROR));
         OCL_CHECK(mCalcLambdas = make_unique<Kernel>(*mPositionAdjustmentProgram, "calc_lambdas", CL_ERROR));
         OCL_CHECK(mCalcDeltaPositionAndDoUpdate = make_unique<Kernel>(*mPositionAdjustmentProgram, "calc_delta_pi_and_update", CL_ERROR));
-        OCL_CHECK(mRecalcVelocities = make_unique<Kernel>(*mPositionAdjustmentProgram, "recalc_velocities", CL_ERROR));
-        OCL_CHECK(mCalcCurls = make_unique<Kernel>(*mPositionAdjustmentProgram, "calc_curls", CL_ERROR));
-        OCL_CHECK(mApplyVortAndViscXSPH = make_unique<Kernel>(*mPositionAdjustmentProgram, "apply_vort_and_viscXSPH", CL_ERROR));
-        OCL_CHECK(mSetPositionsFromPredictions = make_unique<Kernel>(*mPositionAdjustmentProgram, "set_positions_from_predictions", CL_ERROR));
-
-        /// Setup timestep kernel
-        mTimestepProgram = util::LoadCLProgram("timestep.cl", mContext, mDevice);
-        OCL_CHECK(mTimestepKernel = make_unique<Kernel>(*mTimestepProgram, "timestep", CL_ERROR));
-
-        /// Setup "clip to bounds"-kernel
-        mClipToBoundsProgram = util::LoadCLProgram("clip_to_bounds.cl", mContext, mDevice);
-        OCL_CHECK(mClipToBoundsKernel = make_unique<Kernel>(*mClipToBoundsProgram, "clip_to_bounds", CL_ERROR));
+        OCL_CHECK(mCalcDeltaPositionColoured = make_unique<Kernel>(*mPositionAdjustmentProgram, "calc_delta_pi_coloured", CL_ERROR));
+        OCL_CHECK(mApplyDeltaPositionColoured = make_unique<Kernel>(*mPositionAdjustmentProgram, "apply_delta_pi_coloured", CL_ERROR));
+        OCL_CHECK(mCalcCurlsAndViscXSPH = make_unique<Kernel>(*mPositionAdjustmentProgram, "calc_curls_and_viscXSPH", CL_ERROR));
+        OCL_CHECK(mApplyVorticity = make_unique<Kernel>(*mPositionAdjustmentProgram, "apply_vorticity", CL_ERROR));
+
+        /// The particle buffers don't exist yet when the kernels are first loaded
+        if (mActiveParticleIDsCL) {
+            setActiveParticleIDsArgs();
+        }
 
-        OCL_CALL(mClipToBoundsKernel->setArg(1, sizeof(pbf::Bounds), mBoundsCL.get()));
+        /// Setup DFSPH kernels, built with the same defines
+        mDFSPHProgram = getProgram("dfsph.cl");
+        OCL_CHECK(mDFSPHCalcFactors = make_unique<Kernel>(*mDFSPHProgram, "dfsph_calc_factors", CL_ERROR));
+        OCL_CHECK(mDFSPHCalcKappas = make_unique<Kernel>(*mDFSPHProgram, "dfsph_calc_kappas", CL_ERROR));
+        OCL_CHECK(mDFSPHCorrectVelocities = make_unique<Kernel>(*mDFSPHProgram, "dfsph_correct_velocities", CL_ERROR));
+        OCL_CHECK(mDFSPHApplyGravity = make_unique<Kernel>(*mDFSPHProgram, "dfsph_apply_gravity", CL_ERROR));
+        OCL_CHECK(mDFSPHIntegrate = make_unique<Kernel>(*mDFSPHProgram, "dfsph_integrate", CL_ERROR));
     }
 
     const uint ParticleSimulationScene::NUM_AVG_SIM_TIMES = 10;
 
     const uint ParticleSimulationScene::NUM_MAX_PARTICLES = 10000;
+
+
+    const std::string ParticleSimulationScene::WORK_GROUP_SIZES_FILE = "workgroup_sizes.txt";
+    const std::string ParticleSimulationScene::SORT_TUNING_FILE = "sort_tuning.txt";
+
+    const std::string ParticleSimulationScene::SOLVER_PROGRAM_FILE = "solver.cl";
+
+    const std::string ParticleSimulationScene::GENERATED_SETUP_PREFIX = "generated/";
+
+    const uint ParticleSimulationScene::SDF_CELLS_PER_BIN = 2;
+
+    const uint ParticleSimulationScene::NUM_MAX_SINKS = 16;
+
+    const uint ParticleSimulationScene::SLEEP_DELAY_FRAMES = 30;
+
+    const float ParticleSimulationScene::LOOSE_GRID_SKIN = 0.02f;
+
+    const uint ParticleSimulationScene::RADIX_SORT_BITS = 4;
+
+    const uint ParticleSimulationScene::RADIX_SORT_GROUP_SIZE = 128;
+
+    const uint ParticleSimulationScene::RADIX_SORT_KEYS_PER_ITEM = 16;
+
+    const uint ParticleSimulationScene::NUM_MAX_SOLIDS = 1024;
+
+    const uint ParticleSimulationScene::NUM_MAX_BIN_SOLID_ENTRIES = 64 * 1024;
+
+    const uint ParticleSimulationScene::SOLID_REDUCTION_SIZE = 64;
+
+    const float ParticleSimulationScene::WATER_DENSITY = 1000.0f;
 }
\ No newline at end of file
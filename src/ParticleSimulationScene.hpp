@@ -14,12 +14,23 @@
 #include "simulation/Bounds.hpp"
 #include "simulation/Grid.hpp"
 #include "simulation/Fluid.hpp"
+#include "simulation/SolidObject.hpp"
+#include "simulation/Emitter.hpp"
+#include "simulation/FluidVolume.hpp"
+#include "simulation/Sink.hpp"
+
+#include "util/cl_util.hpp"
+#include "util/DeviceReduction.hpp"
 
 #include "geometry/Sphere.hpp"
 
 #include <deque>
+#include <future>
 
 namespace pbf {
+    class Benchmarks;
+    struct BenchmarkTable;
+
     /// @brief //todo add brief description to FluidScene
     /// @author Benjamin Wiberg
     class ParticleSimulationScene : public clgl::BaseScene {
@@ -42,21 +53,300 @@ namespace pbf {
 
         virtual bool keyboardEvent(int key, int scancode, int action, int modifiers) override;
 
+        /// Fills a buffer with the current index of every live particle in the order of their persistent IDs,
+        /// for exporting or analysing the particles in a stable order on the device. Returns the number of entries
+        uint computeParticleOrder();
+
+        /// The buffer filled by computeParticleOrder
+        const cl::Buffer &getParticleOrder() const;
+
+        /// The persistent particle IDs after the last update, indexed like the particle buffers
+        const cl::Buffer &getParticleIDs() const;
+
     private:
+        /// The benchmarks run on the scene's buffers, kernels and options
+        friend class Benchmarks;
+
+        /// Loads a fluid setup file, or generates the setup if the path names a generated one
         void loadFluidSetup(const std::string &path);
 
+        /// The volumes of a generated fluid setup (see GENERATED_SETUP_PREFIX), none for any other setup
+        std::vector<pbf::FluidVolume> getGeneratedFluidSetup(const std::string &name) const;
+
+        /// Resets the particles to the union of the volumes, filled at the rest spacing on the device
+        void generateFluidSetup(const std::vector<pbf::FluidVolume> &volumes);
+
         void loadShaders();
 
+        /// Creates all kernels, after building the programs that aren't cached yet concurrently
         void loadKernels();
 
+        void loadFluidSimKernels();
+
+        /// Binds the active particle list, which is reallocated with the particle buffers
+        void setActiveParticleIDsArgs();
+
+        void loadSolidKernels();
+
+        /// Every program of the scene with the defines of the current configuration
+        std::vector<util::ProgramCache::Source> getProgramSources() const;
+
+        /// The entry of getProgramSources for a kernel file, which is solver.cl for the files linked into it
+        /// when the single solver program is used
+        util::ProgramCache::Source getProgramSource(const std::string &kernelFile) const;
+
+        /// Whether a kernel file is included by solver.cl
+        static bool IsSolverProgramFile(const std::string &kernelFile);
+
+        static const std::string SOLVER_PROGRAM_FILE;
+
+        /// The program of a kernel file with the current defines, from the cache if it was built before
+        std::shared_ptr<cl::Program> getProgram(const std::string &kernelFile);
+
+        /// Rebuilds all programs from disk on a background thread, see pollKernelReload
+        void reloadKernels();
+
+        /// Swaps in the programs of a finished background reload if all of them built, else keeps the current ones
+        void pollKernelReload();
+
+        /// The pre-processor defines selecting the storage format of velocities, densities and curls
+        std::string getStorageDefines() const;
+
+        /// Switches the storage format, rebuilding the kernels and resetting the particle buffers
+        void setHalfStorage(bool halfStorage);
+
+        /// The pre-processor defines describing the SDF lattice and whether obstacles are present
+        std::string getBoundaryDefines() const;
+
+        /// The number of nodes in the SDF lattice, which spans the grid with SDF_CELLS_PER_BIN cells per bin
+        uint getNumSDFNodes() const;
+
+        /// Byte sizes of a stored velocity (or curl) and density in the current storage format
+        size_t getVelocityStride() const;
+        size_t getDensityStride() const;
+
+        /// The device memory used per particle across all particle buffers
+        size_t getBytesPerParticle() const;
+
+        /// The most particles the device memory holds, given getBytesPerParticle()
+        uint getMaxParticleCapacity() const;
+
+        void setupParticleVertexArrays();
+
+        /// Number of sub-devices in use, i.e. mNumSlabs limited to the available sub-devices
+        uint getNumSlabs() const;
+
+        /// Splits the sorted particles into one slab per sub-device (after the counting sort), balanced by the bin
+        /// starts of the previous sort, and reads back those of this sort without blocking
+        void updateSlabs();
+
+        /// Enqueues a per-particle kernel over all particles, split into slabs over the sub-devices if enabled
+        void enqueueSlabs(cl::Kernel &kernel);
+
+        /// Enqueues a fluid_sim.cl kernel over the active particle list with sleeping bins, else like enqueueSlabs
+        void enqueueActive(cl::Kernel &kernel);
+
+        /// Enqueues count work-items of a kernel from a global offset, with the tuned local size of the kernel if
+        /// the queue's device supports it. The global size is padded to a multiple of the local size, so the
+        /// kernel's last argument is set to offset + count, which its work-items check before doing anything
+        void enqueueKernel(cl::CommandQueue &queue, cl::Kernel &kernel, uint offset, uint count,
+                           const std::vector<cl::Event> *events = NULL, cl::Event *event = NULL);
+
+        /// Enqueues count work-items of a kernel on the main queue, see above
+        void enqueueKernel(cl::Kernel &kernel, uint count);
+
+        /// What enqueueKernel needs of a kernel on the device of a queue, which doesn't change between launches
+        struct KernelLaunchInfo {
+            std::string name;
+            cl_uint numArgs;
+            size_t tunedLocalSize;
+            size_t maxLocalSize;
+        };
+
+        /// Looks up the launch info of a kernel on a queue, querying the kernel on the queue's device on first use
+        const KernelLaunchInfo &getKernelLaunchInfo(cl::CommandQueue &queue, cl::Kernel &kernel);
+
+        /// The pre-processor define that runs the fluid_sim.cl kernels over the active particle list
+        std::string getSleepingDefines() const;
+
+        /// The pre-processor define that makes the fluid_sim.cl kernels search a loose grid
+        std::string getLooseGridDefines() const;
+
+        /// Decides whether the incremental sort can keep the order of the last sort for this frame, from the
+        /// moved particles counted at the end of the previous frame
+        bool canSkipSort();
+
+        /// Counts the particles that left their bins, read back asynchronously for the next frame's canSkipSort
+        void countMovedParticles();
+
+        /// Marks the bins whose particles moved or were compressed in the previous frame as active
+        void markActiveBins(const cl::Buffer &positions);
+
+        /// Lists the sorted particles around awake bins and freezes the others (after the counting sort)
+        void compactActiveParticles();
+
         void initializeParticleStates(std::vector<glm::vec4> && positions,
                                       std::vector<glm::vec4> && velocities,
                                       std::vector<float> && densities);
 
-        void spawnParticles();
+        /// Advances the simulation by one frame with position-based fluids
+        void stepPBF(uint previousBufferID);
+
+        /// Advances the simulation by one frame with divergence-free SPH
+        void stepDFSPH(uint previousBufferID);
+
+        /// Runs one DFSPH divergence (or density) solver iteration on the given velocities
+        void correctDFSPHVelocities(const cl::Buffer &velocities, bool densitySolve);
+
+        /// Sorts the particles into the grid based on their predicted positions, writing to the current buffers.
+        /// The velocities are only permuted when the solver reads them before recomputing them
+        void sortParticles(uint previousBufferID, const cl::Buffer &positions, const cl::Buffer &predictedPositions,
+                           bool permuteVelocities, bool particlesInserted = false);
+
+        /// Whether predict_and_insert can insert the particles in the grid, i.e. the counting sort follows directly
+        bool canInsertWhilePredicting() const;
+
+        /// Whether particles are killed by sinks or their lifetime before they are sorted
+        bool isKillingParticles() const;
+
+        /// Whether the radix sort path is used for the current particle count
+        bool useRadixSort() const;
+
+        /// Fills the bin table and the particles' bins and in-bin ranks with a radix sort instead of counting
+        void binParticlesRadix(uint previousBufferID, const cl::Buffer &predictedPositions);
+
+        /// Sorts numKeys (key, value) pairs by the lowest numBits bits of the keys. An even number of passes is
+        /// made, so that the result ends up in keys and values again
+        void radixSort(cl::Buffer &keys, cl::Buffer &values, cl::Buffer &keysTemp, cl::Buffer &valuesTemp,
+                       cl::Buffer &histograms, uint numKeys, uint numBits);
+
+        /// The number of histogram entries that radixSort needs for numKeys keys
+        static size_t GetRadixHistogramSize(uint numKeys);
+
+        /// Computes curls and applies vorticity confinement and XSPH viscosity (second to first velocity buffer) in two
+        /// neighbour passes. With velocitiesFromPositions, the velocities are computed from the current positions instead
+        void applyVorticityAndViscosity(bool velocitiesFromPositions);
+
+        /// Runs the active emitters, appending their particles to the given position buffer and the first velocity buffer
+        void emitParticles(uint bufferID);
+
+        /// Enqueues one emitter's particles for this frame and returns how many of them fit
+        uint emitParticles(pbf::Emitter &emitter, float &carry, uint bufferID);
 
         glm::vec3 getWorldSpawnPoint();
 
+        /// The emitter at the spawn point, active while SPACE is held
+        pbf::Emitter mSpawnEmitter;
+        pbf::Emitter::Type mSpawnEmitterType;
+        float mSpawnEmitterCarry;
+
+        /// Emitters that are always active, with their fractional particles carried over between frames
+        std::vector<pbf::Emitter> mEmitters;
+        std::vector<float> mEmitterCarries;
+
+        /// The number of particles emitted so far, used to continue the emitters' low-discrepancy sequence
+        uint mEmissionSequenceOffset;
+
+        /// The persistent ID of the next emitted particle. IDs are never reused, so they are exactly the
+        /// particle indices at initialization, and have gaps once particles are killed
+        cl_uint mNextParticleID;
+
+        /// Appending counter for the emitters, holding the particle count
+        std::unique_ptr<cl::Buffer> mParticleCounterCL;
+
+        std::shared_ptr<cl::Program> mEmitterProgram;
+        std::unique_ptr<cl::Kernel> mEmitParticles;
+
+        std::shared_ptr<cl::Program> mFluidVolumesProgram;
+        std::unique_ptr<cl::Kernel> mFillFluidVolumes;
+
+        /// Displacement of the generated particles from their lattice nodes, as a fraction of the spacing
+        float mGeneratorJitter;
+
+        /// Names the fluid setups that are generated rather than loaded from a file
+        static const std::string GENERATED_SETUP_PREFIX;
+
+        /// Ages the particles and marks the ones in sinks, or past their lifetime, dead before they are sorted
+        void killParticles(uint previousBufferID, const cl::Buffer &predictedPositions);
+
+        void uploadSinks();
+
+        std::vector<pbf::Sink> mSinks;
+
+        /// Lifetime of the particles in seconds, 0 for no limit
+        float mMaxParticleAge;
+
+        /// The live particle count, read back asynchronously after the sort compacted the dead particles away.
+        /// Dead particles at the end of the arrays are harmless until it takes effect in the next frame
+        cl_uint mLiveParticleCount;
+        bool mLiveParticleCountPending;
+
+        std::unique_ptr<cl::Buffer> mSinksCL;
+
+        std::shared_ptr<cl::Program> mSinksProgram;
+        std::unique_ptr<cl::Kernel> mAgeAndKillParticles;
+
+        static const uint NUM_MAX_SINKS;
+
+        /// Sleeping bins skip the PBF solver for the particles in regions at rest (requested and built state,
+        /// since the PBF kernels are rebuilt for it and it is unavailable for DFSPH and with rigid bodies)
+        bool mUseSleepingBins;
+        bool mSleepingBins;
+
+        /// A bin stays awake while one of its particles moves further than this per frame...
+        float mSleepDisplacement;
+        /// ...or is compressed by more than this fraction of the rest density
+        float mSleepCompression;
+
+        /// Frames counted for the last-active frames of the bins
+        cl_uint mSleepFrame;
+
+        /// The number of particles in the active particle list of the current frame, read back asynchronously
+        /// for the statistics only
+        cl_uint mNumActiveParticles;
+
+        std::unique_ptr<cl::Buffer> mBinLastActiveFrameCL;
+        std::unique_ptr<cl::Buffer> mAwakeBinCountCL;
+        std::unique_ptr<cl::Buffer> mActiveBinStartIDCL;
+        std::unique_ptr<cl::Buffer> mActiveParticleIDsCL;
+
+        std::shared_ptr<cl::Program> mSleepingBinsProgram;
+        std::unique_ptr<cl::Kernel> mMarkActiveBins;
+        std::unique_ptr<cl::Kernel> mCountAwakeBins;
+        std::unique_ptr<cl::Kernel> mCompactActiveParticles;
+
+        /// The number of frames that a bin has to be inactive before it falls asleep
+        static const uint SLEEP_DELAY_FRAMES;
+
+        /// The incremental sort keeps the order of the last sort while few particles changed bins, searching a
+        /// loose grid in the meantime (requested and built state, PBF without rigid bodies only)
+        bool mUseIncrementalSort;
+        bool mLooseGrid;
+
+        /// The fraction of the particles that may have changed bins before the particles are sorted again
+        float mResortFraction;
+
+        /// The particle count at the last sort, emitting or deleting particles always forces a sort
+        uint mNumSortedParticles;
+
+        /// Sorts performed and skipped since the statistics were last shown
+        uint mNumSorts;
+        uint mNumSkippedSorts;
+
+        std::unique_ptr<cl::Buffer> mMovedParticleCountersCL;
+
+        /// The counts of countMovedParticles, valid in the next frame like mLiveParticleCount
+        cl_uint mMovedParticleCounters[2];
+        bool mMovedParticleCountersPending;
+
+        /// The sort of this frame is skipped, so the particles stay in the buffer set of the last frame
+        bool mSkipSort;
+        std::unique_ptr<cl::Kernel> mSortCountMovedParticles;
+
+        /// How far particles may be outside of their bins in the loose grid. The moved particles are counted at
+        /// the end of a frame, so half of it is left for the prediction and corrections of the next one
+        static const float LOOSE_GRID_SKIN;
+
         bool clickedOnSphere(const clgl::Sphere &sphere, const glm::ivec2 &cursorPosition);
 
         glm::vec2 mSpawnPoint;
@@ -79,6 +369,10 @@ namespace pbf {
 
         unsigned int mNumParticles;
 
+        /// The capacity of the particle buffers, and the particles of the current setup that exceeded it
+        uint mMaxParticles;
+        uint mNumDroppedParticles;
+
         std::string mCurrentFluidSetup;
 
         float mParticleRadius;
@@ -92,18 +386,22 @@ namespace pbf {
         /// OpenGL particle buffers
         /// Double state buffers (pos and vel) are needed for the counting sort algorithm
         std::unique_ptr<bwgl::VertexBuffer> mPositionsGL[2];
-        std::unique_ptr<bwgl::VertexBuffer> mPredictedPositionsGL[2]; // unused in GL
+        std::unique_ptr<bwgl::VertexBuffer> mPredictedPositionsGL[2]; // the rendered positions, see mPositionsCL
         std::unique_ptr<bwgl::VertexBuffer> mVelocitiesGL[2];
         std::unique_ptr<bwgl::VertexBuffer> mDensitiesGL;
         std::unique_ptr<bwgl::VertexArray> mParticles[2];
 
-        /// OpenCL particle buffers
+        /// OpenCL particle buffers. Between frames, the particle positions are the predicted positions of the current
+        /// buffers; the positions are those at the start of the frame. The next frame predicts into the free positions
+        /// buffer and sorts from there, so that the two swap roles instead of the predictions being copied back
         std::unique_ptr<cl::BufferGL> mPositionsCL[2];
         std::unique_ptr<cl::BufferGL> mPredictedPositionsCL[2];
         std::unique_ptr<cl::BufferGL> mVelocitiesCL[2];
         std::unique_ptr<cl::BufferGL> mDensitiesCL;
         std::unique_ptr<cl::Buffer> mParticleBinIDCL[2];
-        std::unique_ptr<cl::Buffer> mParticleLambdasCL;
+        std::unique_ptr<cl::Buffer> mParticleLambdasCL[2];
+        std::unique_ptr<cl::Buffer> mParticleAgesCL[2]; // negative for dead particles
+        std::unique_ptr<cl::Buffer> mParticleIDsCL[2]; // persistent, permuted along with the particle state
 
         /// OpenCL stuff
         std::unique_ptr<pbf::Bounds> mBoundsCL;
@@ -114,30 +412,338 @@ namespace pbf {
         std::unique_ptr<cl::Buffer> mBinStartIDCL;
         std::unique_ptr<cl::Buffer> mParticleInBinPosCL;
         std::unique_ptr<cl::Buffer> mParticleCurlsCL;
+        std::unique_ptr<cl::Buffer> mDeltaPositionsCL;
+        std::unique_ptr<cl::Buffer> mDFSPHFactorsCL;
+        std::unique_ptr<cl::Buffer> mDFSPHKappasCL;
 
         std::vector<cl::Memory> mMemObjects;
 
-        std::unique_ptr<cl::Program> mTimestepProgram;
-        std::unique_ptr<cl::Program> mPositionAdjustmentProgram;
-        std::unique_ptr<cl::Program> mClipToBoundsProgram;
-        std::unique_ptr<cl::Program> mCountingSortProgram;
+        util::ProgramCache mProgramCache;
+
+        /// The programs being rebuilt by reloadKernels, null if any of them failed to build
+        std::future<std::unique_ptr<util::ProgramCache>> mKernelReload;
 
-        std::unique_ptr<cl::Kernel> mTimestepKernel;
+        /// Tuned local work sizes of the per-particle and per-bin kernels, see Benchmarks::runWorkGroupTuning
+        util::TunedValues mWorkGroupSizes;
+
+        /// Launch info per kernel and queue, cleared when the kernels are recreated or mWorkGroupSizes changes
+        std::map<std::pair<cl_kernel, cl_command_queue>, KernelLaunchInfo> mKernelLaunchInfo;
+
+        std::shared_ptr<cl::Program> mTimestepProgram;
+        std::shared_ptr<cl::Program> mPositionAdjustmentProgram;
+        std::shared_ptr<cl::Program> mCountingSortProgram;
+        std::shared_ptr<cl::Program> mRadixSortProgram;
+        std::shared_ptr<cl::Program> mDFSPHProgram;
+
+        /// Bake the fluid parameters into the fluid_sim program as compile-time constants
+        bool mSpecializeFluid;
+
+        /// The fluid defines that the current fluid_sim program was built with (empty if not specialised)
+        std::string mFluidDefines;
+
+        /// The parameters and specialisation that mFluidDefines were last checked against
+        pbf::Fluid mDefinedFluid;
+        bool mDefinedFluidSpecialized;
+
+        /// Store velocities, densities and curls as half (as set in the GUI)
+        bool mUseHalfStorage;
+
+        /// The storage format that the current kernels and particle buffers use
+        bool mHalfStorage;
+
+        /// Build the sort, time step and solver kernels as the single program solver.cl (as set in the GUI)
+        bool mUseSingleSolverProgram;
+
+        /// Whether the current kernels come from solver.cl
+        bool mSingleSolverProgram;
+
+        /// Number of sub-devices to distribute the solver over (0 runs everything on the main queue)
+        uint mNumSlabs;
+
+        /// The first particle (in sorted order) of each slab, followed by mNumParticles
+        std::vector<uint> mSlabStartIDs;
+
+        /// The bin starts and active region of the last sort, read back asynchronously for the next updateSlabs
+        std::vector<cl_uint> mSlabBinStartIDs;
+        cl_uint mSlabActiveRegion[6];
+        bool mSlabActiveRegionValid;
+        bool mSlabBinStartIDsPending;
+
+        /// Predicts and clips the positions, and inserts the particles in the grid if the counting sort follows
+        std::unique_ptr<cl::Kernel> mPredictAndInsert;
 
         std::unique_ptr<cl::Kernel> mSortInsertParticles;
         std::unique_ptr<cl::Kernel> mSortComputeBinStartID;
         std::unique_ptr<cl::Kernel> mSortReindexParticles;
 
+        /// Active region path of the counting sort, replacing the fill of the bin counts and compute_bin_start_ID
+        std::unique_ptr<cl::Kernel> mSortClearRegionBinCounts;
+        std::unique_ptr<cl::Kernel> mSortComputeRegionBinStartID;
+
+        /// Radix sort path, replacing insert_particles and compute_bin_start_ID
+        std::unique_ptr<cl::Kernel> mSortComputeParticleKeys;
+        std::unique_ptr<cl::Kernel> mSortFindBinRanges;
+        std::unique_ptr<cl::Kernel> mSortComputeInBinIDs;
+
+        /// Inverse permutation of the persistent particle IDs
+        std::unique_ptr<cl::Kernel> mInvertParticleIDs;
+        std::unique_ptr<cl::Kernel> mComputeIDKeys;
+        std::unique_ptr<cl::Buffer> mParticleOrderCL;
+        std::unique_ptr<cl::Kernel> mRadixHistogram;
+        std::unique_ptr<cl::Kernel> mRadixScan;
+        std::unique_ptr<cl::Kernel> mRadixScatter;
+
         std::unique_ptr<cl::Kernel> mCalcDensities;
         std::unique_ptr<cl::Kernel> mCalcLambdas;
         std::unique_ptr<cl::Kernel> mCalcDeltaPositionAndDoUpdate;
+        std::unique_ptr<cl::Kernel> mCalcDeltaPositionColoured;
+        std::unique_ptr<cl::Kernel> mApplyDeltaPositionColoured;
+
+        std::unique_ptr<cl::Kernel> mCalcCurlsAndViscXSPH;
+        std::unique_ptr<cl::Kernel> mApplyVorticity;
+
+        std::unique_ptr<cl::Kernel> mDFSPHCalcFactors;
+        std::unique_ptr<cl::Kernel> mDFSPHCalcKappas;
+        std::unique_ptr<cl::Kernel> mDFSPHCorrectVelocities;
+        std::unique_ptr<cl::Kernel> mDFSPHApplyGravity;
+        std::unique_ptr<cl::Kernel> mDFSPHIntegrate;
+
+        /// Blend factor between the freshly computed λ and last frame's λ in the first solver iteration
+        float mWarmStartBlend;
+
+        /// Which solver advances the simulation; both share the grid and the fluid parameters
+        enum class SolverType {
+            PBF = 0,
+            DFSPH
+        };
+
+        SolverType mSolverType;
+
+        /// How bins are coloured for the position updates; Jacobi updates all particles at once
+        enum class SolverColouring {
+            Jacobi = 0,
+            Parity8,
+            Colours27
+        };
+
+        static uint GetColourCount(SolverColouring colouring);
+
+        SolverColouring mSolverColouring;
+
+        /// How the particles are sorted into the grid; Auto picks the radix sort from mRadixSortThreshold particles on
+        enum class SortMethod {
+            Counting = 0,
+            Radix,
+            Auto
+        };
+
+        SortMethod mSortMethod;
+
+        /// The particle count from which the radix sort is faster on this device. Measured by Benchmarks::runSort and
+        /// saved for the device to SORT_TUNING_FILE, else a guess by device type. The particle buffers grow to fit
+        /// generated setups, so it is reached by those larger than NUM_MAX_PARTICLES
+        uint mRadixSortThreshold;
+        util::TunedValues mSortTuning;
+
+        static const std::string SORT_TUNING_FILE;
+
+        /// The counting sort clears and scans only the active region, the box of bins around the particles
+        /// (see common/Grid.cl), so that its cost follows the extent of the fluid rather than that of the grid
+        bool mUseActiveRegion;
+
+        /// The active region of the last counting sort, read back asynchronously for clearing its bins in the
+        /// next frame. Only valid if that sort was clipped to it, otherwise the whole grid is cleared
+        cl_uint mActiveRegion[6];
+        bool mActiveRegionValid;
+
+        std::unique_ptr<cl::Buffer> mActiveRegionCL;
+
+        /// Resets the bin counts of the counting sort to zero and empties the active region
+        void clearBinCounts();
+
+        /// Pairs of (binID, particleIndex) and their temporary copies for the radix sort passes
+        std::unique_ptr<cl::Buffer> mRadixKeysCL[2];
+        std::unique_ptr<cl::Buffer> mRadixValuesCL[2];
+        std::unique_ptr<cl::Buffer> mRadixHistogramsCL;
+
+        static const uint RADIX_SORT_BITS;
+        static const uint RADIX_SORT_GROUP_SIZE;
+        static const uint RADIX_SORT_KEYS_PER_ITEM;
+
+        /// Static obstacles
+
+        enum class ObstacleType {
+            None = 0,
+            Sphere,
+            Weir
+        };
+
+        /// Builds the SDF and boundary volumes of the selected obstacle from its mesh
+        void buildObstacle();
+
+        /// Integrates the boundary volumes from the SDF, which only has to be redone if the kernel radius changes
+        void computeBoundaryVolumes();
+
+        ObstacleType mObstacleType;
+
+        /// The obstacle that the SDF currently describes
+        ObstacleType mBuiltObstacleType;
+
+        /// The kernel radius that the boundary volumes were integrated with
+        float mBoundaryKernelRadius;
+
+        std::shared_ptr<clgl::MeshObject> mObstacleObject;
+
+        /// World-space triangles of the obstacle, three vertices each
+        std::vector<glm::vec3> mObstacleTriangles;
+
+        std::unique_ptr<cl::Buffer> mSDFCL;
+        std::unique_ptr<cl::Buffer> mBoundaryVolumeCL;
+
+        std::shared_ptr<cl::Program> mSDFProgram;
+
+        std::unique_ptr<cl::Kernel> mBuildSDF;
+        std::unique_ptr<cl::Kernel> mComputeBoundaryVolumes;
+
+        static const uint SDF_CELLS_PER_BIN;
+
+        /// Samples boundary particles on the walls and the obstacle, computes their volumes and sorts them into a
+        /// static grid that is uploaded once
+        void buildBoundaryParticles();
+
+        /// Requested in the GUI vs. baked into the current kernels
+        bool mUseBoundaryParticles;
+        bool mBoundaryParticles;
+
+        uint mNumBoundaryParticles;
+
+        /// Positions (xyz) and volumes (w) of the boundary particles, sorted by bin
+        std::unique_ptr<cl::Buffer> mBoundaryParticlesCL;
+        std::unique_ptr<cl::Buffer> mBoundaryBinStartIDCL;
+        std::unique_ptr<cl::Buffer> mBoundaryBinCountCL;
+
+        /// Solids
+
+        /// Adds count spheres or boxes (STYPE_SPHERE/STYPE_BOX) of random sizes; they are kept across resets
+        void addSolids(uint type, uint count);
+
+        void clearSolids();
+
+        /// Uploads the solids from firstSolid onwards in the state they were added in
+        void uploadSolids(uint firstSolid);
+
+        /// The distance that particles are kept from the surfaces of the solids
+        float getSolidContactRadius() const;
+
+        /// The mass of a particle in kg, for the impulses on the solids: the simulation treats the particles as
+        /// unit masses at restDensity particles per unit volume, i.e. each fills 1/restDensity of water
+        float getParticleMass() const;
+
+        /// Broad phase: lists the solids overlapping each bin of the grid
+        void insertSolidsInGrid();
+
+        /// Narrow phase: projects the particles out of the solids and sums their impulses per solid. With
+        /// correctVelocities, the velocities change by the projection over the timestep as well (DFSPH)
+        void collideWithSolids(bool correctVelocities = false);
+
+        /// Applies the summed impulses and gravity to the solids and advances them
+        void integrateSolids();
+
+        /// Reads back the solids and moves their meshes accordingly
+        void updateSolidMeshes();
+
+        /// The solids as they were added (i.e. their initial state)
+        std::vector<pbf::SolidObject> mSolids;
+
+        std::vector<std::shared_ptr<clgl::MeshObject>> mSolidMeshes;
+
+        /// Mass density of new solids, relative to the fluid's WATER_DENSITY
+        float mSolidDensity;
+
+        std::unique_ptr<cl::Buffer> mSolidsCL;
+        std::unique_ptr<cl::Buffer> mBinSolidCountCL;
+        std::unique_ptr<cl::Buffer> mBinSolidStartIDCL;
+        std::unique_ptr<cl::Buffer> mBinSolidCursorCL;
+        std::unique_ptr<cl::Buffer> mBinSolidIDCL;
+        std::unique_ptr<cl::Buffer> mContactSolidIDCL;
+        std::unique_ptr<cl::Buffer> mContactImpulseCL;
+        std::unique_ptr<cl::Buffer> mContactTorqueCL;
+
+        std::shared_ptr<cl::Program> mSolidsProgram;
+
+        std::unique_ptr<cl::Kernel> mCountSolidsInBins;
+        std::unique_ptr<cl::Kernel> mInsertSolidsInBins;
+        std::unique_ptr<cl::Kernel> mCollideWithSolids;
+        std::unique_ptr<cl::Kernel> mReduceSolidImpulses;
+        std::unique_ptr<cl::Kernel> mIntegrateSolids;
+
+        static const uint NUM_MAX_SOLIDS;
+
+        /// Capacity of the per-bin solid lists, summed over all bins
+        static const uint NUM_MAX_BIN_SOLID_ENTRIES;
+
+        /// Work-group size (a power of two) of the per-solid impulse reduction
+        static const uint SOLID_REDUCTION_SIZE;
+
+        /// Mass density of the fluid, relating the unit-mass particles to the masses of the solids
+        static const float WATER_DENSITY;
+
+        /// Benchmarking
+
+        /// Enqueues calc_densities on the current (sorted) predicted positions
+        void calcDensities();
+
+        /// Enqueues the reduction of the densities to the average compression, i.e. max(ρ/ρ0 - 1, 0), which is
+        /// read back into result once the returned event has completed
+        cl::Event enqueueDensityError(cl_float *result);
+
+        /// Computes the average compression and waits for it
+        float measureDensityError();
+
+        /// Appends the average compression to the solver statistics at the end of the frame, without stalling the queue
+        void recordDensityError();
+
+        /// The density errors of the current frame, read back asynchronously (a deque, so that they stay in place)
+        std::deque<cl_float> mPendingDensityErrors;
+        cl::Event mPendingDensityErrorsEvent;
+
+        std::shared_ptr<cl::Program> mReduceProgram;
+        std::unique_ptr<util::DeviceReduction> mReduction;
+        std::unique_ptr<cl::Kernel> mSumDensityErrors;
+
+        /// Solver statistics of the latest frame, collected when mMeasureConvergence is set
+        struct SolverStats {
+            /// Average density error after 0, 1, ..., numSubSteps solver iterations
+            std::vector<float> densityErrors;
+        };
+
+        /// Shows the results of a benchmark in a window, replacing those of the previous one
+        void showBenchmarkResults(const BenchmarkTable &table);
+
+        nanogui::Screen *mScreen;
+        nanogui::Window *mBenchmarkWindow;
+
+        /// While tuning, every kernel runs with mTuningLocalSize and the queue is finished around it
+        bool mTuningWorkGroups;
+        size_t mTuningLocalSize;
+        std::map<std::string, double> mKernelTimes;
+
+        static const std::string WORK_GROUP_SIZES_FILE;
+
+        /// Starts timing the phases of a frame if mTimePhases is set
+        void beginPhases();
+
+        /// Adds the time since the end of the previous phase to the given phase, after waiting for its kernels
+        void endPhase(const std::string &name);
 
-        std::unique_ptr<cl::Kernel> mRecalcVelocities;
-        std::unique_ptr<cl::Kernel> mCalcCurls;
-        std::unique_ptr<cl::Kernel> mApplyVortAndViscXSPH;
-        std::unique_ptr<cl::Kernel> mSetPositionsFromPredictions;
+        /// Per-phase timing, which finishes the queue after every phase
+        bool mTimePhases;
+        double mPhaseBeginTime;
+        std::vector<std::pair<std::string, double>> mPhaseTimes;
 
-        std::unique_ptr<cl::Kernel> mClipToBoundsKernel;
+        bool mMeasureConvergence;
+        float mConvergenceTolerance;
+        SolverStats mSolverStats;
 
         /// FPS
 
@@ -147,6 +753,7 @@ namespace pbf {
 
         static const uint NUM_AVG_SIM_TIMES;
 
+        /// The default particle capacity, generated setups grow the buffers beyond it to fit
         static const uint NUM_MAX_PARTICLES;
 
         double mTimeOfLastUpdate;
@@ -154,5 +761,8 @@ namespace pbf {
 
         nanogui::Label *mLabelFPS;
         nanogui::Label *mLabelAverageFrameTime;
+        nanogui::Label *mLabelActiveParticles;
+        nanogui::Label *mLabelSkippedSorts;
+        nanogui::Label *mLabelParticleCount;
     };
 }
\ No newline at end of file
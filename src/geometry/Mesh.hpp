@@ -13,6 +13,9 @@ namespace clgl {
 
         void flipNormals();
 
+        /// The vertices of each triangle in turn (resolving indices, if any), translated by offset
+        std::vector<glm::vec3> getTriangles(const glm::vec3 &offset = glm::vec3(0.0f)) const;
+
         std::vector<glm::vec4> mPositions;
 
         std::vector<glm::vec4> mNormals;
@@ -42,4 +45,16 @@ namespace clgl {
             normal = - normal;
         });
     }
+
+    inline std::vector<glm::vec3> Mesh::getTriangles(const glm::vec3 &offset) const {
+        const bool hasIndices = !mIndices.empty();
+        const size_t numVertices = hasIndices ? mIndices.size() : mPositions.size();
+
+        std::vector<glm::vec3> triangles;
+        triangles.reserve(numVertices);
+        for (size_t i = 0; i < numVertices; ++i) {
+            triangles.push_back(glm::vec3(mPositions[hasIndices ? mIndices[i] : i]) + offset);
+        }
+        return triangles;
+    }
 }
\ No newline at end of file
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <CL/cl.hpp>
+#include <glm/glm.hpp>
+
+#define EMITTER_DISC 0
+#define EMITTER_BOX 1
+#define EMITTER_SPHERE 2
+
+namespace pbf {
+    /// A source of particles, which are generated on the device by emitter.cl
+    struct Emitter {
+        enum class Type {
+            Disc = EMITTER_DISC,
+            Box = EMITTER_BOX,
+            Sphere = EMITTER_SPHERE
+        };
+
+        Emitter() = default;
+
+        Emitter(Type type, const glm::vec3 &position, const glm::vec3 &direction,
+                float radius, float speed, float rate);
+
+        cl_float3 position;
+        // Unit vector along which the particles are emitted, also the normal of a disc
+        cl_float3 direction;
+        // Radius of a disc or sphere, half the side of a (cube-shaped) box
+        cl_float radius;
+        // Initial speed of the particles
+        cl_float speed;
+        // Particles per second
+        cl_float rate;
+        cl_uint type;
+    };
+
+    inline Emitter::Emitter(Type type, const glm::vec3 &position, const glm::vec3 &direction,
+                            float radius, float speed, float rate)
+            : radius(radius),
+              speed(speed),
+              rate(rate),
+              type(static_cast<cl_uint>(type)) {
+        const glm::vec3 unitDirection = glm::normalize(direction);
+        this->position = {{position.x, position.y, position.z, 0.0f}};
+        this->direction = {{unitDirection.x, unitDirection.y, unitDirection.z, 0.0f}};
+    }
+}
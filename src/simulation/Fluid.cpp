@@ -2,6 +2,7 @@
 
 #include <fstream>
 #include <iomanip>
+#include <cmath>
 
 namespace pbf {
     std::unique_ptr<Fluid> Fluid::GetDefault() {
@@ -68,4 +69,40 @@ namespace pbf {
 
         ofs.close();
     }
+
+    std::string GetDefinesCL(const Fluid &fluid) {
+        using std::to_string;
+        using util::ToCLFloat;
+
+        const double PI = 3.1415926535;
+        const double h = fluid.kernelRadius;
+
+        // Wpoly6 evaluated at the artificial pressure radius delta_q, with the same cut-off as Wpoly6 in
+        // common/Kernels.cl (EPSILON). If it vanishes, its reciprocal is 0, which disables the artificial pressure
+        const double EPSILON = 0.0001;
+        const double hh_minus_dq2 = h * h - fluid.delta_q * fluid.delta_q;
+        const double poly6Coeff = 315.0 / (64.0 * PI * std::pow(h, 9));
+        const double wpoly6DeltaQ = hh_minus_dq2 < EPSILON ? 0.0 : poly6Coeff * hh_minus_dq2 * hh_minus_dq2 * hh_minus_dq2;
+        const double oneOverWpoly6DeltaQ = wpoly6DeltaQ > 0.0 ? 1.0 / wpoly6DeltaQ : 0.0;
+
+        const std::string args[30] = {
+                "FLUID_SPECIALIZED",                "1",
+                "FLUID_kernelRadius",               ToCLFloat(fluid.kernelRadius),
+                "FLUID_restDensity",                ToCLFloat(fluid.restDensity),
+                "FLUID_deltaTime",                  ToCLFloat(fluid.deltaTime),
+                "FLUID_epsilon",                    ToCLFloat(fluid.epsilon),
+                "FLUID_k",                          ToCLFloat(fluid.k),
+                "FLUID_delta_q",                    ToCLFloat(fluid.delta_q),
+                "FLUID_n",                          to_string(fluid.n) + "u",
+                "FLUID_c",                          ToCLFloat(fluid.c),
+                "FLUID_k_vc",                       ToCLFloat(fluid.k_vc),
+                "FLUID_kBoundsDensity",             ToCLFloat(fluid.kBoundsDensity),
+                "FLUID_POLY6_COEFF",                ToCLFloat(static_cast<float>(poly6Coeff)),
+                "FLUID_GRAD_SPIKY_COEFF",           ToCLFloat(static_cast<float>(-45.0 / (PI * std::pow(h, 6)))),
+                "FLUID_ONE_OVER_REST_DENSITY",      ToCLFloat(1.0f / fluid.restDensity),
+                "FLUID_ONE_OVER_WPOLY6_DELTA_Q",    ToCLFloat(static_cast<float>(oneOverWpoly6DeltaQ))
+        };
+
+        return util::ConvertToCLDefines(15, args);
+    }
 }
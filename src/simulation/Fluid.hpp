@@ -3,6 +3,7 @@
 #include <memory>
 #include <CL/cl.hpp>
 #include "util/make_unique.hpp"
+#include "util/cl_util.hpp"
 
 namespace pbf {
     struct Fluid {
@@ -37,4 +38,8 @@ namespace pbf {
 
         cl_float kBoundsDensity;
     };
+
+    /// Bakes the fluid parameters, and the SPH kernel constants derived from them, into
+    /// pre-processor defines. numSubSteps is left out since no kernel reads it.
+    std::string GetDefinesCL(const Fluid &fluid);
 }
\ No newline at end of file
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <CL/cl.hpp>
+#include <glm/glm.hpp>
+
+#define FLUID_VOLUME_BOX 0
+#define FLUID_VOLUME_SPHERE 1
+#define FLUID_VOLUME_CYLINDER 2
+
+namespace pbf {
+    /// A primitive volume that fluid_volumes.cl fills with particles. A generated fluid setup is the union
+    /// of one or more of them
+    struct FluidVolume {
+        enum class Type {
+            Box = FLUID_VOLUME_BOX,
+            Sphere = FLUID_VOLUME_SPHERE,
+            Cylinder = FLUID_VOLUME_CYLINDER
+        };
+
+        FluidVolume() = default;
+
+        FluidVolume(Type type, const glm::vec3 &position, const glm::vec3 &halfDimensions);
+
+        cl_float3 position;
+        // Half the sides of a box, the radius of a sphere in x, or the radius (x) and half the height (y)
+        // of a cylinder standing along y
+        cl_float3 halfDimensions;
+        cl_uint type;
+    };
+
+    inline FluidVolume::FluidVolume(Type type, const glm::vec3 &position, const glm::vec3 &halfDimensions)
+            : type(static_cast<cl_uint>(type)) {
+        this->position = {{position.x, position.y, position.z, 0.0f}};
+        this->halfDimensions = {{halfDimensions.x, halfDimensions.y, halfDimensions.z, 0.0f}};
+    }
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <CL/cl.hpp>
+#include <glm/glm.hpp>
+
+namespace pbf {
+    /// An axis-aligned box that deletes the particles entering it (see sinks.cl)
+    struct Sink {
+        Sink() = default;
+
+        Sink(const glm::vec3 &position, const glm::vec3 &halfDimensions);
+
+        cl_float3 position;
+        cl_float3 halfDimensions;
+    };
+
+    inline Sink::Sink(const glm::vec3 &position, const glm::vec3 &halfDimensions) {
+        this->position = {{position.x, position.y, position.z, 0.0f}};
+        this->halfDimensions = {{halfDimensions.x, halfDimensions.y, halfDimensions.z, 0.0f}};
+    }
+}
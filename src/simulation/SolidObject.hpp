@@ -1,6 +1,7 @@
 #pragma once
 
 #include <glm/glm.hpp>
+#include <glm/gtc/quaternion.hpp>
 #include <CL/cl.hpp>
 
 #define STYPE_PLANE 0
@@ -9,8 +10,12 @@
 
 #define DEFAULT_MASS 1.0f
 
-namespace clgl {
-    struct __attribute__((packed)) Plane {
+/// The layouts match the structs in kernels/common/SolidObject.cl, i.e. every
+/// cl_float3/cl_float4 is 16-byte aligned and the scalars come last.
+namespace pbf {
+    struct Plane {
+        Plane() = default;
+
         Plane(const glm::vec3 &position, const glm::vec3 &normal);
 
         Plane(const cl_float3 &position, const cl_float3 &normal);
@@ -19,34 +24,50 @@ namespace clgl {
         cl_float3 position;
     };
 
-    struct __attribute__((packed)) Sphere {
+    struct Sphere {
+        Sphere() = default;
+
         Sphere(const glm::vec3 &position, cl_float radius, cl_float mass = DEFAULT_MASS);
 
         Sphere(const cl_float3 &position, cl_float radius, cl_float mass = DEFAULT_MASS);
 
-        cl_float mass;
-        cl_float radius;
-
         cl_float3 position;
         cl_float3 velocity;
         cl_float3 impulses;
+
+        cl_float mass;
+        cl_float radius;
     };
 
-    struct __attribute__((packed)) Box {
-        Box(const glm::vec3 &position, const glm::vec3 &halfDimensions, cl_float mass = DEFAULT_MASS);
+    struct Box {
+        Box() = default;
 
-        Box(const cl_float3 &position, const cl_float3 &halfDimensions, cl_float mass = DEFAULT_MASS);
+        Box(const glm::vec3 &position, const glm::vec3 &halfDimensions, cl_float mass = DEFAULT_MASS,
+            const glm::quat &orientation = glm::quat());
 
-        cl_float mass;
-        cl_float3 halfDimensions;
+        Box(const cl_float3 &position, const cl_float3 &halfDimensions, cl_float mass = DEFAULT_MASS);
 
         cl_float3 position;
         cl_float3 velocity;
         cl_float3 impulses;
         cl_float3 torques;
+
+        cl_float3 halfDimensions;
+        cl_float4 orientation;      // Unit quaternion (x, y, z, w)
+        cl_float3 angularVelocity;
+
+        cl_float mass;
     };
 
-    struct __attribute__((packed)) SolidObject {
+    struct SolidObject {
+        SolidObject() = default;
+
+        explicit SolidObject(const Plane &plane);
+
+        explicit SolidObject(const Sphere &sphere);
+
+        explicit SolidObject(const Box &box);
+
         cl_uint type;
 
         union {
@@ -55,8 +76,6 @@ namespace clgl {
             Box box;
         } data;
     };
-
-
 }
 
 #include "SolidObject.inl"
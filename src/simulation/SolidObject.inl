@@ -1,21 +1,47 @@
-namespace clgl {
-    inline Plane::Plane(const glm::vec3 &position, const glm::vec3 &normal)
-            : position(position.x, position.y, position.z, 0.0f), normal(normal.x, normal.y, normal.z, 0.0f) {}
+namespace pbf {
+    inline Plane::Plane(const glm::vec3 &position, const glm::vec3 &normal) {
+        this->normal = {normal.x, normal.y, normal.z, 0.0f};
+        this->position = {position.x, position.y, position.z, 0.0f};
+    }
 
     inline Plane::Plane(const cl_float3 &position, const cl_float3 &normal)
-            : position(position), normal(normal) {}
+            : normal(normal), position(position) {}
 
     inline Sphere::Sphere(const glm::vec3 &position, cl_float radius, cl_float mass)
-            : position(position.x, position.y, position.z, 0.0f), radius(radius), mass(mass) {}
+            : Sphere(cl_float3{{position.x, position.y, position.z, 0.0f}}, radius, mass) {}
 
     inline Sphere::Sphere(const cl_float3 &position, cl_float radius, cl_float mass)
-            : position(position), radius(radius), mass(mass) {}
+            : position(position), mass(mass), radius(radius) {
+        velocity = {0.0f, 0.0f, 0.0f, 0.0f};
+        impulses = {0.0f, 0.0f, 0.0f, 0.0f};
+    }
 
-    inline Box::Box(const glm::vec3 &position, const glm::vec3 &halfDimensions, cl_float mass)
-            : position(position.x, position.y, position.z, 0.0f),
-              halfDimensions(halfDimensions.x, halfDimensions.y, halfDimensions.z, 0.0f),
-              mass(mass) {}
+    inline Box::Box(const glm::vec3 &position, const glm::vec3 &halfDimensions, cl_float mass,
+                    const glm::quat &orientation)
+            : Box(cl_float3{{position.x, position.y, position.z, 0.0f}},
+                  cl_float3{{halfDimensions.x, halfDimensions.y, halfDimensions.z, 0.0f}},
+                  mass) {
+        this->orientation = {orientation.x, orientation.y, orientation.z, orientation.w};
+    }
 
     inline Box::Box(const cl_float3 &position, const cl_float3 &halfDimensions, cl_float mass)
-            : position(position), halfDimensions(halfDimensions), mass(mass) {}
+            : position(position), halfDimensions(halfDimensions), mass(mass) {
+        velocity = {0.0f, 0.0f, 0.0f, 0.0f};
+        impulses = {0.0f, 0.0f, 0.0f, 0.0f};
+        torques = {0.0f, 0.0f, 0.0f, 0.0f};
+        orientation = {0.0f, 0.0f, 0.0f, 1.0f};
+        angularVelocity = {0.0f, 0.0f, 0.0f, 0.0f};
+    }
+
+    inline SolidObject::SolidObject(const Plane &plane) : type(STYPE_PLANE) {
+        data.plane = plane;
+    }
+
+    inline SolidObject::SolidObject(const Sphere &sphere) : type(STYPE_SPHERE) {
+        data.sphere = sphere;
+    }
+
+    inline SolidObject::SolidObject(const Box &box) : type(STYPE_BOX) {
+        data.box = box;
+    }
 }
@@ -0,0 +1,126 @@
+#pragma once
+
+#include <string>
+#include <memory>
+#include <algorithm>
+#include <CL/cl.hpp>
+#include "OCL_CALL.hpp"
+#include "make_unique.hpp"
+
+namespace util {
+    /// @brief Sums, minima and maxima of device buffers of floats, float3s and uints, computed in two passes of
+    /// the kernels in reduce.cl. Only the result is read back, asynchronously: it is valid once the returned
+    /// event has completed. The passes share one set of intermediate buffers, so the reductions of one instance
+    /// must be enqueued on a single in-order queue.
+    class DeviceReduction {
+    public:
+        /// Matches the REDUCE_* defines in reduce.cl
+        enum class Op : cl_uint {
+            Sum = 0,
+            Min = 1,
+            Max = 2
+        };
+
+        /// The work-group size that reduce.cl is built with for a device, the largest power of two up to 256
+        inline static size_t GetGroupSize(const cl::Device &device) {
+            const size_t maxSize = device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>();
+            size_t groupSize = 1;
+            while (groupSize < MAX_GROUP_SIZE && 2 * groupSize <= maxSize) {
+                groupSize *= 2;
+            }
+            return groupSize;
+        }
+
+        inline static std::string GetDefinesCL(const cl::Device &device) {
+            return "#define REDUCE_GROUP_SIZE " + std::to_string(GetGroupSize(device)) + "\n";
+        }
+
+        /// @param program reduce.cl, built with GetDefinesCL(device)
+        inline DeviceReduction(cl::Context &context, const cl::Device &device, const cl::Program &program)
+                : mGroupSize(GetGroupSize(device)) {
+            OCL_ERROR;
+            OCL_CHECK(mReduceFloat = make_unique<cl::Kernel>(program, "reduce_float", CL_ERROR));
+            OCL_CHECK(mReduceFloat3 = make_unique<cl::Kernel>(program, "reduce_float3", CL_ERROR));
+            OCL_CHECK(mReduceUint = make_unique<cl::Kernel>(program, "reduce_uint", CL_ERROR));
+            OCL_CHECK(mPartials = make_unique<cl::Buffer>(context, CL_MEM_READ_WRITE, sizeof(cl_float4) * MAX_GROUPS, (void*)0, CL_ERROR));
+            OCL_CHECK(mResult = make_unique<cl::Buffer>(context, CL_MEM_READ_WRITE, sizeof(cl_float4), (void*)0, CL_ERROR));
+        }
+
+        inline cl::Event reduce(cl::CommandQueue &queue, Op op, const cl::Buffer &input, cl_uint count, cl_float *result) {
+            return reduce(queue, *mReduceFloat, op, input, count, result, sizeof(cl_float));
+        }
+
+        /// float3 elements are 16 bytes apart, like cl_float3
+        inline cl::Event reduce(cl::CommandQueue &queue, Op op, const cl::Buffer &input, cl_uint count, cl_float3 *result) {
+            return reduce(queue, *mReduceFloat3, op, input, count, result, sizeof(cl_float3));
+        }
+
+        inline cl::Event reduce(cl::CommandQueue &queue, Op op, const cl::Buffer &input, cl_uint count, cl_uint *result) {
+            return reduce(queue, *mReduceUint, op, input, count, result, sizeof(cl_uint));
+        }
+
+        /// For first passes implemented by other kernels, like sum_density_errors: these must write one partial
+        /// float per work-group of getGroupSize() work-items to getPartials(), for getNumGroups(count) groups
+        inline cl::Event reducePartials(cl::CommandQueue &queue, Op op, cl_uint count, cl_float *result) {
+            const cl_uint numGroups = getNumGroups(count);
+            return reduceToResult(queue, *mReduceFloat, op, numGroups, result, sizeof(cl_float));
+        }
+
+        inline const cl::Buffer &getPartials() const {
+            return *mPartials;
+        }
+
+        inline size_t getGroupSize() const {
+            return mGroupSize;
+        }
+
+        /// Enough work-groups to keep every compute unit busy, but few enough for a single group to combine
+        inline cl_uint getNumGroups(cl_uint count) const {
+            const size_t numGroups = (count + mGroupSize - 1) / mGroupSize;
+            return static_cast<cl_uint>(std::max(std::min(numGroups, static_cast<size_t>(MAX_GROUPS)), static_cast<size_t>(1)));
+        }
+
+        static const size_t MAX_GROUP_SIZE = 256;
+
+        /// The number of partial results of the first pass at most
+        static const size_t MAX_GROUPS = 256;
+
+    private:
+        inline cl::Event reduce(cl::CommandQueue &queue, cl::Kernel &kernel, Op op, const cl::Buffer &input,
+                                cl_uint count, void *result, size_t resultSize) {
+            const cl_uint numGroups = getNumGroups(count);
+            OCL_CALL(kernel.setArg(0, input));
+            OCL_CALL(kernel.setArg(1, count));
+            OCL_CALL(kernel.setArg(2, static_cast<cl_uint>(op)));
+            OCL_CALL(kernel.setArg(3, *mPartials));
+            OCL_CALL(queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(numGroups * mGroupSize),
+                                                cl::NDRange(mGroupSize)));
+
+            return reduceToResult(queue, kernel, op, numGroups, result, resultSize);
+        }
+
+        /// The second pass over the partial results, followed by the non-blocking read-back of the result
+        inline cl::Event reduceToResult(cl::CommandQueue &queue, cl::Kernel &kernel, Op op, cl_uint numPartials,
+                                        void *result, size_t resultSize) {
+            OCL_CALL(kernel.setArg(0, *mPartials));
+            OCL_CALL(kernel.setArg(1, numPartials));
+            OCL_CALL(kernel.setArg(2, static_cast<cl_uint>(op)));
+            OCL_CALL(kernel.setArg(3, *mResult));
+            OCL_CALL(queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(mGroupSize), cl::NDRange(mGroupSize)));
+
+            cl::Event event;
+            OCL_CALL(queue.enqueueReadBuffer(*mResult, CL_FALSE, 0, resultSize, result, NULL, &event));
+            return event;
+        }
+
+        size_t mGroupSize;
+
+        std::unique_ptr<cl::Kernel> mReduceFloat;
+        std::unique_ptr<cl::Kernel> mReduceFloat3;
+        std::unique_ptr<cl::Kernel> mReduceUint;
+
+        /// The partial results of the first pass, one per work-group
+        std::unique_ptr<cl::Buffer> mPartials;
+        std::unique_ptr<cl::Buffer> mResult;
+    };
+}
@@ -2,6 +2,15 @@
 
 #include <string>
 #include <memory>
+#include <map>
+#include <set>
+#include <algorithm>
+#include <sstream>
+#include <iomanip>
+#include <fstream>
+#include <cctype>
+#include <vector>
+#include <thread>
 #include <CL/cl.hpp>
 #include <bwgl/bwgl.hpp>
 #include "OCL_CALL.hpp"
@@ -18,6 +27,55 @@ namespace util {
         return ss.str();
     }
 
+    /// Formats a float as an OpenCL C single-precision literal without losing precision,
+    /// unlike std::to_string which truncates small values to zero.
+    inline std::string ToCLFloat(const float value) {
+        std::stringstream ss;
+        ss << std::scientific << std::setprecision(9) << value << "f";
+        return ss.str();
+    }
+
+    /// Replaces every `#include "file"` line of an OpenCL source by the contents of KERNELPATH(file), recursively
+    /// and at most once per file. Resolving the includes on the host, rather than passing -I to the compiler, keeps
+    /// the whole source in the program, so edited headers are picked up by a kernel reload and by drivers that
+    /// cache builds by their source.
+    /// @param included The files included so far, which are skipped
+    /// @return False if an included file could not be read
+    inline bool ResolveCLIncludes(std::string &source, std::set<std::string> &included) {
+        std::stringstream in(source);
+        std::stringstream out;
+        bool success = true;
+
+        std::string line;
+        while (std::getline(in, line)) {
+            const size_t directive = line.find_first_not_of(" \t");
+            const size_t open = line.find('"');
+            const size_t close = open == std::string::npos ? open : line.find('"', open + 1);
+            if (directive == std::string::npos || line.compare(directive, 8, "#include") != 0 ||
+                close == std::string::npos) {
+                out << line << std::endl;
+                continue;
+            }
+
+            const std::string file = line.substr(open + 1, close - open - 1);
+            if (!included.insert(file).second) {
+                continue;
+            }
+
+            std::string includedSource;
+            if (!bwgl::TryReadFromFile(KERNELPATH(file), includedSource)) {
+                std::cerr << "Could not include " << file << std::endl;
+                success = false;
+                continue;
+            }
+            success &= ResolveCLIncludes(includedSource, included);
+            out << includedSource << std::endl;
+        }
+
+        source = out.str();
+        return success;
+    }
+
     inline std::unique_ptr<cl::Program> LoadCLProgram(const std::string &kernelName,
                                                       cl::Context &context,
                                                       cl::Device &device,
@@ -25,7 +83,9 @@ namespace util {
 
         std::unique_ptr<cl::Program> program = nullptr;
         std::string kernelSource = "";
-        if (bwgl::TryReadFromFile(KERNELPATH(kernelName), kernelSource)) {
+        std::set<std::string> included = { kernelName };
+        if (bwgl::TryReadFromFile(KERNELPATH(kernelName), kernelSource) &&
+            ResolveCLIncludes(kernelSource, included)) {
             OCL_ERROR;
             OCL_CHECK(program = make_unique<cl::Program>(context,
                                                          prefix + "\n" + kernelSource,
@@ -41,4 +101,185 @@ namespace util {
         }
         return program;
     }
+
+    /// @brief Keeps built programs around, keyed by kernel file and pre-processor defines, so that
+    /// returning to an earlier configuration (e.g. of specialised fluid parameters) does not rebuild.
+    class ProgramCache {
+    public:
+        /// A kernel file and the pre-processor defines that it is built with
+        typedef std::pair<std::string, std::string> Source;
+
+        inline std::shared_ptr<cl::Program> get(const std::string &kernelName,
+                                                cl::Context &context,
+                                                cl::Device &device,
+                                                const std::string &prefix = "") {
+            const std::string key = kernelName + "\n" + prefix;
+
+            auto iter = mPrograms.find(key);
+            if (iter != mPrograms.end()) {
+                iter->second.lastUse = ++mUseCount;
+                return iter->second.program;
+            }
+
+            std::shared_ptr<cl::Program> program = LoadCLProgram(kernelName, context, device, prefix);
+            if (program) {
+                insert(key, program);
+            }
+            return program;
+        }
+
+        /// Builds the sources that aren't cached yet concurrently, on one host thread each, since
+        /// clBuildProgram blocks until the build has finished on most implementations.
+        /// @return False if any of the builds failed
+        inline bool build(const std::vector<Source> &sources,
+                          cl::Context &context,
+                          cl::Device &device) {
+            std::vector<Source> missing;
+            for (const Source &source : sources) {
+                if (mPrograms.find(source.first + "\n" + source.second) == mPrograms.end() &&
+                    std::find(missing.begin(), missing.end(), source) == missing.end()) {
+                    missing.push_back(source);
+                }
+            }
+
+            std::vector<std::shared_ptr<cl::Program>> programs(missing.size());
+            std::vector<std::thread> threads;
+            for (size_t i = 0; i < missing.size(); ++i) {
+                threads.push_back(std::thread([&missing, &programs, &context, &device, i]() {
+                    programs[i] = LoadCLProgram(missing[i].first, context, device, missing[i].second);
+                }));
+            }
+            for (std::thread &thread : threads) {
+                thread.join();
+            }
+
+            bool success = true;
+            for (size_t i = 0; i < missing.size(); ++i) {
+                if (programs[i]) {
+                    insert(missing[i].first + "\n" + missing[i].second, programs[i]);
+                } else {
+                    success = false;
+                }
+            }
+            return success;
+        }
+
+        /// Drops all cached programs, e.g. when the kernel sources have changed on disk
+        inline void clear() {
+            mPrograms.clear();
+        }
+
+        /// The number of programs kept at most. Every edit of a baked parameter (e.g. a specialised fluid
+        /// parameter) adds a program, so the least recently used ones beyond this are dropped
+        static const size_t MAX_PROGRAMS = 64;
+
+    private:
+        struct Entry {
+            std::shared_ptr<cl::Program> program;
+            size_t lastUse;
+        };
+
+        inline void insert(const std::string &key, const std::shared_ptr<cl::Program> &program) {
+            mPrograms[key] = Entry{program, ++mUseCount};
+
+            /// Programs still in use stay alive through their shared pointers
+            while (mPrograms.size() > MAX_PROGRAMS) {
+                auto oldest = std::min_element(mPrograms.begin(), mPrograms.end(),
+                                               [](const std::pair<const std::string, Entry> &a,
+                                                  const std::pair<const std::string, Entry> &b) {
+                                                   return a.second.lastUse < b.second.lastUse;
+                                               });
+                mPrograms.erase(oldest);
+            }
+        }
+
+        std::map<std::string, Entry> mPrograms;
+        size_t mUseCount = 0;
+    };
+
+    /// @brief Values tuned for one device, keyed by name, such as the local work size of each kernel function.
+    /// Persisted as lines of "<device key> <name> <value>", so that one file can hold the results of several
+    /// devices; a missing name reads as 0.
+    class TunedValues {
+    public:
+        /// Identifies a device by its name and driver version, with whitespace replaced so it is one token
+        inline static std::string GetDeviceKey(const cl::Device &device) {
+            std::string key = std::string(device.getInfo<CL_DEVICE_NAME>().c_str()) + "_"
+                              + std::string(device.getInfo<CL_DRIVER_VERSION>().c_str());
+            for (char &c : key) {
+                if (std::isspace(static_cast<unsigned char>(c))) {
+                    c = '_';
+                }
+            }
+            return key;
+        }
+
+        inline void setDevice(const cl::Device &device) {
+            mDeviceKey = GetDeviceKey(device);
+            mValues.clear();
+        }
+
+        inline size_t get(const std::string &name) const {
+            auto iter = mValues.find(name);
+            return iter != mValues.end() ? iter->second : 0;
+        }
+
+        inline bool has(const std::string &name) const {
+            return mValues.find(name) != mValues.end();
+        }
+
+        inline void set(const std::string &name, const size_t value) {
+            mValues[name] = value;
+        }
+
+        inline void clear() {
+            mValues.clear();
+        }
+
+        /// Reads the values stored for the current device, returns false if there were none
+        inline bool load(const std::string &filename) {
+            std::ifstream ifs(filename.c_str());
+
+            bool found = false;
+            std::string device, name;
+            size_t value;
+            while (ifs >> device >> name >> value) {
+                if (device == mDeviceKey) {
+                    mValues[name] = value;
+                    found = true;
+                }
+            }
+
+            ifs.close();
+            return found;
+        }
+
+        /// Rewrites the file with the values of the current device, keeping the entries of other devices
+        inline void save(const std::string &filename) const {
+            std::vector<std::string> otherDevices;
+            std::ifstream ifs(filename.c_str());
+            std::string line;
+            while (std::getline(ifs, line)) {
+                if (!line.empty() && line.compare(0, mDeviceKey.size() + 1, mDeviceKey + " ") != 0) {
+                    otherDevices.push_back(line);
+                }
+            }
+            ifs.close();
+
+            std::ofstream ofs(filename.c_str());
+            if (ofs.is_open()) {
+                for (const std::string &other : otherDevices) {
+                    ofs << other << std::endl;
+                }
+                for (const auto &entry : mValues) {
+                    ofs << mDeviceKey << " " << entry.first << " " << entry.second << std::endl;
+                }
+            }
+            ofs.close();
+        }
+
+    private:
+        std::string mDeviceKey;
+        std::map<std::string, size_t> mValues;
+    };
 }
\ No newline at end of file
@@ -1,6 +1,8 @@
 #include "math_util.hpp"
 #include "make_unique.hpp"
 
+#include <cmath>
+
 namespace util {
     std::random_device random_device;
 
@@ -109,4 +111,46 @@ namespace util {
 
         return linears;
     }
+
+    std::vector<glm::vec3> sample_triangles(const std::vector<glm::vec3> &triangles, float spacing) {
+        std::vector<glm::vec3> samples;
+        for (size_t i = 0; i + 2 < triangles.size(); i += 3) {
+            const glm::vec3 &a = triangles[i];
+            const glm::vec3 ab = triangles[i + 1] - a;
+            const glm::vec3 ac = triangles[i + 2] - a;
+
+            const float longestEdge = std::max(glm::length(ab), std::max(glm::length(ac), glm::length(ac - ab)));
+            const unsigned int n = std::max(1u, static_cast<unsigned int>(std::ceil(longestEdge / spacing)));
+            for (unsigned int u = 0; u <= n; ++u) {
+                for (unsigned int v = 0; u + v <= n; ++v) {
+                    samples.push_back(a + (static_cast<float>(u) / n) * ab + (static_cast<float>(v) / n) * ac);
+                }
+            }
+        }
+        return samples;
+    }
+
+    std::vector<glm::uint16> pack_halfs(const std::vector<float> &values) {
+        std::vector<glm::uint16> halfs(values.size());
+        for (size_t i = 0; i < values.size(); ++i) {
+            halfs[i] = glm::packHalf1x16(values[i]);
+        }
+        return halfs;
+    }
+
+    std::vector<glm::uint64> pack_half4s(const std::vector<glm::vec4> &values) {
+        std::vector<glm::uint64> halfs(values.size());
+        for (size_t i = 0; i < values.size(); ++i) {
+            halfs[i] = glm::packHalf4x16(values[i]);
+        }
+        return halfs;
+    }
+
+    std::vector<float> unpack_halfs(const std::vector<glm::uint16> &halfs) {
+        std::vector<float> values(halfs.size());
+        for (size_t i = 0; i < halfs.size(); ++i) {
+            values[i] = glm::unpackHalf1x16(halfs[i]);
+        }
+        return values;
+    }
 }
\ No newline at end of file
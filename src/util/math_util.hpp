@@ -5,6 +5,7 @@
 #include <random>
 
 #include "glm/glm.hpp"
+#include "glm/gtc/packing.hpp"
 
 
 template<typename T>
@@ -42,4 +43,17 @@ namespace util {
                                                  float y_upper_bound_inclusive = 1.0f,
                                                  float z_lower_bound_inclusive = 0.0f,
                                                  float z_upper_bound_inclusive = 1.0f);
+
+    /// Samples points on each triangle (three consecutive vertices) on a barycentric lattice with at most
+    /// the given spacing along the edges. Points on shared edges and vertices are sampled once per triangle
+    std::vector<glm::vec3> sample_triangles(const std::vector<glm::vec3> &triangles, float spacing);
+
+    /// Converts floats to half-precision bit patterns, e.g. for uploading to OpenCL half buffers
+    std::vector<glm::uint16> pack_halfs(const std::vector<float> &values);
+
+    /// Converts glm::vec4's to four packed half-precision bit patterns each (i.e. OpenCL half4)
+    std::vector<glm::uint64> pack_half4s(const std::vector<glm::vec4> &values);
+
+    /// Converts half-precision bit patterns back to floats
+    std::vector<float> unpack_halfs(const std::vector<glm::uint16> &halfs);
 }